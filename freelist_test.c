@@ -2,6 +2,9 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include "sfs.h"
 
@@ -62,6 +65,226 @@ void test_delete(sfs, test_number, name)
     }
 }
 
+/* With discard on, grows a file over the Free Area and shrinks it, so that
+ * its blocks are queued for punching, then creates files: the Index Area
+ * grows into the queued blocks, which must not be punched */
+SFS *test_discard(sfs, test_number, count)
+    SFS *sfs;
+    int test_number;
+    int count;
+{
+    curr_test = test_number;
+    printf("\n>>>%d. DISCARD<<<\n", test_number);
+    struct sfs_free_stats free_stats;
+    char name[FILE_NAME_LEN];
+    sfs_get_free_stats(sfs, &free_stats);
+    if (sfs_set_discard(sfs, 1) != 0 || sfs_create(sfs, "Big") != 0
+            || sfs_resize(sfs, "Big", (free_stats.largest - 2) * BLOCK_SIZE) != 0
+            || sfs_resize(sfs, "Big", BLOCK_SIZE) != 0) {
+        ERROR
+    }
+    for (int i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "Discard%d", i);
+        if (sfs_create(sfs, name) != 0) {
+            ERROR
+        }
+    }
+    sfs_terminate(sfs);
+    sfs = sfs_init("sfs_f.img");
+    for (int i = 0; i < count; ++i) {
+        snprintf(name, sizeof(name), "Discard%d", i);
+        if (!sfs_is_file(sfs, name)) {
+            fprintf(stderr, "%s is lost\n", name);
+            ERROR
+        }
+    }
+    return sfs;
+}
+
+/* Returns 1 if the bytes from *from* to *to* of the file read as null bytes */
+int is_zero(sfs, name, from, to)
+    SFS *sfs;
+    const char *name;
+    int from;
+    int to;
+{
+    char buf[to];
+    if (sfs_read(sfs, name, buf, to, 0) != to) {
+        return 0;
+    }
+    for (int i = from; i < to; ++i) {
+        if (buf[i] != 0) {
+            fprintf(stderr, "%s: byte %d is 0x%02x\n", name, i, (unsigned char)buf[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Dirties some blocks with a file which is deleted, so that the next files
+ * get blocks which do not read as null bytes */
+void make_junk(sfs, size)
+    SFS *sfs;
+    int size;
+{
+    char buf[size];
+    memset(buf, 0xee, size);
+    if (sfs_create(sfs, "Junk") != 0 || sfs_write_extend(sfs, "Junk", buf, size, 0) != size
+            || sfs_delete(sfs, "Junk") != 0) {
+        ERROR
+    }
+}
+
+/* With lazy zero, a file extended over old data must read as null bytes,
+ * around a write in the middle, and still after a remount */
+SFS *test_lazy_zero(sfs, test_number)
+    SFS *sfs;
+    int test_number;
+{
+    curr_test = test_number;
+    printf("\n>>>%d. LAZY ZERO<<<\n", test_number);
+    const int size = 8 * BLOCK_SIZE;
+    make_junk(sfs, size);
+    sfs_set_lazy_zero(sfs, 1);
+    if (sfs_create(sfs, "Lazy") != 0 || sfs_write_extend(sfs, "Lazy", "abc", 3, 0) != 3
+            || sfs_resize(sfs, "Lazy", size) != 0 || !is_zero(sfs, "Lazy", 3, size)
+            || sfs_write_extend(sfs, "Lazy", "def", 3, 4 * BLOCK_SIZE) != 3) {
+        ERROR
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        char buf[3];
+        if (!is_zero(sfs, "Lazy", 3, 4 * BLOCK_SIZE)
+                || sfs_read(sfs, "Lazy", buf, 3, 4 * BLOCK_SIZE) != 3 || memcmp(buf, "def", 3) != 0) {
+            ERROR
+        }
+        char tail[size - 4 * BLOCK_SIZE - 3];
+        if (sfs_read(sfs, "Lazy", tail, sizeof(tail), 4 * BLOCK_SIZE + 3) != (int)sizeof(tail)) {
+            ERROR
+        }
+        for (size_t i = 0; i < sizeof(tail); ++i) {
+            if (tail[i] != 0) {
+                fprintf(stderr, "Lazy: byte %lu of the tail is not 0\n", i);
+                ERROR
+            }
+        }
+        sfs_terminate(sfs);
+        sfs = sfs_init("sfs_f.img");
+    }
+    return sfs;
+}
+
+/* A write through the image descriptor which copies less than announced:
+ * sfs_write_finish_fh must cut the file back and leave no old data */
+void test_write_undo(sfs, test_number)
+    SFS *sfs;
+    int test_number;
+{
+    curr_test = test_number;
+    printf("\n>>>%d. WRITE UNDO<<<\n", test_number);
+    const int size = 4 * BLOCK_SIZE;
+    make_junk(sfs, 2 * size);
+    if (sfs_create(sfs, "Undo") != 0 || sfs_write_extend(sfs, "Undo", "abc", 3, 0) != 3) {
+        ERROR
+    }
+    SFS_FILE *file = sfs_open(sfs, "Undo");
+    int fd;
+    off_t pos;
+    struct sfs_stat st;
+    if (file == NULL || sfs_write_extend_fh(sfs, file, NULL, size, BLOCK_SIZE) != size
+            || sfs_extent_fh(sfs, file, BLOCK_SIZE, size, &fd, &pos) != size
+            || pwrite(fd, "ghi", 3, pos) != 3
+            || sfs_write_finish_fh(sfs, file, BLOCK_SIZE, size, 3) != 0
+            || sfs_stat_fh(sfs, file, &st) != 0) {
+        ERROR
+    }
+    if (st.size != BLOCK_SIZE + 3 || !is_zero(sfs, "Undo", 3, BLOCK_SIZE)) {
+        fprintf(stderr, "Undo: size %lu instead of %d\n", st.size, BLOCK_SIZE + 3);
+        ERROR
+    }
+    /* nothing copied: the old length comes back */
+    if (sfs_write_extend_fh(sfs, file, NULL, size, 2 * BLOCK_SIZE) != size
+            || sfs_write_finish_fh(sfs, file, 2 * BLOCK_SIZE, size, 0) != 0
+            || sfs_stat_fh(sfs, file, &st) != 0 || st.size != BLOCK_SIZE + 3) {
+        ERROR
+    }
+    sfs_release(sfs, file);
+}
+
+/* A handle follows its file when it is renamed and fails once the file is
+ * deleted */
+void test_handles(sfs, test_number)
+    SFS *sfs;
+    int test_number;
+{
+    curr_test = test_number;
+    printf("\n>>>%d. HANDLES<<<\n", test_number);
+    char buf[3];
+    SFS_FILE *file = sfs_open(sfs, "Undo");
+    if (file == NULL || sfs_rename(sfs, "Undo", "Moved", 0) != 0
+            || sfs_read_fh(sfs, file, buf, 3, 0) != 3 || memcmp(buf, "abc", 3) != 0
+            || sfs_delete(sfs, "Moved") != 0) {
+        ERROR
+    }
+    if (sfs_read_fh(sfs, file, buf, 3, 0) != -1 || sfs_write_fh(sfs, file, "x", 1, 0) != -1) {
+        fprintf(stderr, "the handle of a deleted file still works\n");
+        ERROR
+    }
+    sfs_release(sfs, file);
+}
+
+/* sfs_create_many with the writes of the Index Area failing: nothing is
+ * created, the free blocks are the same and the volume still mounts */
+SFS *test_create_many_undo(sfs, test_number, count)
+    SFS *sfs;
+    int test_number;
+    int count;
+{
+    curr_test = test_number;
+    printf("\n>>>%d. CREATE MANY UNDO<<<\n", test_number);
+    struct sfs_new_entry entries[count];
+    char names[count][FILE_NAME_LEN];
+    for (int i = 0; i < count; ++i) {
+        snprintf(names[i], FILE_NAME_LEN, "Many%d", i);
+        entries[i].path = names[i];
+        entries[i].type = SFS_TYPE_FILE;
+        entries[i].size = make_size(2);
+    }
+    struct sfs_free_stats before;
+    struct sfs_free_stats after;
+    sfs_get_free_stats(sfs, &before);
+    /* the Index Area is at the end of the image: stop the writes before it */
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    rlim_t old_limit = limit.rlim_cur;
+    limit.rlim_cur = sfs_get_block_size(sfs) * (before.blocks / 2);
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    int result = sfs_create_many(sfs, entries, count, 0);
+    limit.rlim_cur = old_limit;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    sfs_get_free_stats(sfs, &after);
+    if (result != -1 || after.blocks != before.blocks || after.largest != before.largest) {
+        fprintf(stderr, "free blocks %lu -> %lu\n", before.blocks, after.blocks);
+        ERROR
+    }
+    sfs_terminate(sfs);
+    sfs = sfs_init("sfs_f.img");
+    if (sfs == NULL) {
+        fprintf(stderr, "the volume does not mount\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (sfs_is_file(sfs, names[i])) {
+            fprintf(stderr, "%s was created\n", names[i]);
+            ERROR
+        }
+    }
+    if (sfs_create_many(sfs, entries, count, 0) != 0) {
+        ERROR
+    }
+    return sfs;
+}
+
 int main(int argc, char **argv)
 {
     srand(time(NULL));
@@ -91,6 +314,11 @@ int main(int argc, char **argv)
     test_resize(sfs, 20, "File5", 5);
     test_delete(sfs, 21, "File5");
     test_delete(sfs, 22, "File4");
+    sfs = test_discard(sfs, 23, 100);
+    sfs = test_lazy_zero(sfs, 24);
+    test_write_undo(sfs, 25);
+    test_handles(sfs, 26);
+    sfs = test_create_many_undo(sfs, 27, 20);
 
     EXIT
 }
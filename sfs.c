@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,8 +6,17 @@
 #include <time.h>
 #include <math.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "sfs.h"
+#include "sfs_trace.h"
+#include "sfs_aio.h"
+#include "sfs_hist.h"
 
 /* Index Data Area Entry Types */
 #define SFS_ENTRY_VOL_ID 0x01
@@ -27,6 +37,15 @@
 #define SFS_DIR_NAME_LEN 53
 #define SFS_FILE_NAME_LEN 29
 
+#define SFS_READAHEAD_MIN (128 * 1024)
+#define SFS_READAHEAD_MAX (2 * 1024 * 1024)
+#define SFS_COPY_CHUNK (1024 * 1024)
+#define SFS_ZERO_CHUNK (64 * 1024)
+#define SFS_DISCARD_BATCH 64                    /* ranges */
+#define SFS_DISCARD_BATCH_BYTES (64 * 1024 * 1024)
+#define SFS_INDEX_THREADS 16
+#define SFS_INDEX_SEGMENT_MIN 16384     /* entries decoded by each thread at least */
+
 /****h* sfs/sfs
  * NAME
  *   sfs -- SFS implementation
@@ -119,6 +138,22 @@ struct block_list {
  *               is stored here (no calls should be made between the first and
  *               the next calls to search a directory), it is reinitialized on
  *               each sfs_first call
+ *   ino_table - hash table of the entries which have an inode number, chained
+ *               through the ino_next field of the entries
+ *   ino_buckets - number of buckets in ino_table (a power of two)
+ *   ino_count - number of entries in ino_table
+ *   next_ino - the next inode number to give out (never reused)
+ *   cache - the block cache for the data read and written, NULL if disabled
+ *   readahead_max - maximum readahead window for sequential reads in bytes
+ *                   (0 disables readahead)
+ *   aio - the asynchronous I/O engine, NULL until sfs_async_init
+ *   next_token - the token of the next asynchronous request
+ *   lazy_zero - if set, files extended with sfs_resize are not filled with
+ *               null bytes on the image (see sfs_set_lazy_zero)
+ *   zero_range - cleared when the image does not support zeroing ranges
+ *                with fallocate
+ *   discard - the queue of ranges to punch holes in, NULL unless enabled
+ *             with sfs_set_discard
  ******
  */
 struct sfs {
@@ -130,6 +165,21 @@ struct sfs {
     struct block_list *free_list;
     struct block_list *free_last;
     struct sfs_entry *iter_curr;
+    struct sfs_entry **ino_table;
+    uint64_t ino_buckets;
+    uint64_t ino_count;
+    uint64_t next_ino;
+    struct block_cache *cache;
+    uint64_t readahead_max;
+    struct sfs_aio *aio;
+    uint64_t next_token;
+    int lazy_zero;
+    int zero_range;
+    struct discard_queue *discard;
+    struct sfs_stats stats;
+    int phase;
+    uint64_t phase_mark;
+    struct sfs_hist phase_hist[SFS_PHASE_COUNT];
 };
 
 
@@ -180,6 +230,11 @@ struct dir_data {
  *   end_block - last block used by the file
  *   file_len - the size of the file in bytes
  *   char - absolute path, with directory names separated by '/'
+ *   ra_next - offset where the next read is expected if reads are sequential
+ *   ra_end - end of the part of the file already announced for readahead
+ *   ra_window - size of the next readahead, 0 if reads are not sequential
+ *   zero_tail - number of bytes at the end of the file which read as null
+ *               bytes but are not written on the image yet (lazy zero-fill)
  ******
  */
 struct file_data {
@@ -189,6 +244,10 @@ struct file_data {
     uint64_t end_block;
     uint64_t file_len;
     char *name;
+    uint64_t ra_next;
+    uint64_t ra_end;
+    uint64_t ra_window;
+    uint64_t zero_tail;
 };
 
 
@@ -211,6 +270,24 @@ struct unusable_data {
 };
 
 
+/****s* sfs/sfs_entry
+ * NAME
+ *   struct sfs_entry -- an entry of the Index Area in memory
+ * DESCRIPTION
+ *   The entries are kept in a list in the order of the Index Area.  Directory
+ *   and file entries can be given an inode number (see sfs_lookup), which
+ *   stays the same when the entry is renamed or moved in the Index Area.
+ * FIELDS
+ *   type - the type of the entry (SFS_ENTRY_*)
+ *   offset - the position of the entry in the image file
+ *   data - the type specific data
+ *   next - the next entry in the Index Area
+ *   ino - the inode number or 0 if the entry has none yet
+ *   nlookup - number of lookups not yet forgotten
+ *   ino_next - next entry in the same bucket of the inode table
+ *   handles - list of the open handles of a file entry
+ ******
+ */
 struct sfs_entry {
     uint8_t type;
     long int offset;
@@ -221,6 +298,51 @@ struct sfs_entry {
         struct unusable_data *unusable_data;
     } data;
     struct sfs_entry *next;
+    uint64_t ino;
+    uint64_t nlookup;
+    struct sfs_entry *ino_next;
+    struct sfs_file *handles;
+};
+
+
+/****s* sfs/write_undo
+ * NAME
+ *   struct write_undo -- a file before a range is allocated for data
+ * DESCRIPTION
+ *   file_write_extend with a NULL buf sets the length of the file and takes
+ *   the range out of the lazy tail before the data is written.  If the data
+ *   is not all written, write_undo uses this to cut the file back and to
+ *   fill with null bytes the part of the old lazy tail left unwritten.
+ * FIELDS
+ *   len - the length of the file
+ *   tail - the start of its lazy tail
+ ******
+ */
+struct write_undo {
+    uint64_t len;
+    uint64_t tail;
+};
+
+
+/****s* sfs/sfs_file
+ * NAME
+ *   struct sfs_file -- an open file handle
+ * DESCRIPTION
+ *   Returned by sfs_open and known to the outside world as SFS_FILE.  The
+ *   handle points to the file entry, so that reading and writing through it
+ *   does not look up the path again.  Renaming keeps the handle valid.  When
+ *   the file is deleted, the entry is set to NULL and every call using the
+ *   handle fails until it is released.
+ * FIELDS
+ *   entry - the file entry or NULL if the file no longer exists
+ *   next - next handle open on the same entry
+ *   undo - the file before the last sfs_write_extend_fh with a NULL buf
+ ******
+ */
+struct sfs_file {
+    struct sfs_entry *entry;
+    struct sfs_file *next;
+    struct write_undo undo;
 };
 
 
@@ -249,7 +371,7 @@ static void fill_timespec(uint64_t time_stamp, struct timespec *timespec)
     uint64_t sec = time_stamp >> 16;
 
     // 1/65536 of sec
-    uint64_t rest = time_stamp & 0x10000;
+    uint64_t rest = time_stamp & 0xffff;
 
     // convert 1/65536 to 1/1000000000
     uint64_t nsec = round((rest * 1953125) / 128.0);
@@ -298,7 +420,8 @@ static struct sfs_super *read_super(struct sfs *sfs)
     char version = *cbuf;
     cbuf += 1;
     if (strncmp(magic, "SFS", 3) != 0 || version != SFS_VERSION) {
-        printf("!!!magic=%c%c%c, version=0x%x\n", magic[0], magic[1], magic[2], version);
+        fprintf(stderr, "bad superblock: magic=%c%c%c, version=0x%x\n",
+                magic[0], magic[1], magic[2], version);
         return NULL;
     }    
 
@@ -317,8 +440,8 @@ static struct sfs_super *read_super(struct sfs *sfs)
 }
 
 
-static void write_super(FILE *file, struct sfs_super *super) {
-    char buf[SFS_SUPER_SIZE];
+/* Fills buf with the SFS_SUPER_SIZE bytes of the superblock */
+static void encode_super(char *buf, struct sfs_super *super) {
     super->time_stamp = make_time_stamp();
     memcpy(&buf[0], &super->time_stamp, 8);
     memcpy(&buf[8], &super->data_size, 8);
@@ -333,8 +456,6 @@ static void write_super(FILE *file, struct sfs_super *super) {
         sum += buf[i];
     }
     buf[41] = 0x100 - (char)(sum % 0x100);
-    fseek(file, SFS_SUPER_START, SEEK_SET);
-    fwrite(buf, SFS_SUPER_SIZE, 1, file);
 }
 
 
@@ -354,9 +475,9 @@ static struct sfs_entry *read_volume_data(uint8_t *buf, struct sfs_entry *entry)
 }
 
 
-static struct sfs_entry *read_dir_data(uint8_t *buf, struct sfs_entry *entry, FILE *file)
+/* buf holds the entry followed by its continuations */
+static struct sfs_entry *read_dir_data(uint8_t *buf, struct sfs_entry *entry)
 {
-    uint8_t *b = buf;
     struct dir_data *dir_data = malloc(sizeof(struct dir_data));
 
     memcpy(&dir_data->num_cont, &buf[2], 1);
@@ -366,26 +487,19 @@ static struct sfs_entry *read_dir_data(uint8_t *buf, struct sfs_entry *entry, FI
     const int name_len = SFS_DIR_NAME_LEN + cont_len;
 
     dir_data->name = malloc(name_len);
-    int bufsz = SFS_ENTRY_SIZE * (1 + dir_data->num_cont);
-    uint8_t buf2[bufsz];
-    if (dir_data->num_cont != 0) {
-        b = buf2;
-        memcpy(buf2, buf, SFS_ENTRY_SIZE);  /* copy from old buffer to new */
-        fread(buf2 + SFS_ENTRY_SIZE, cont_len, 1, file); /* copy into new */
-    }
-    memcpy(dir_data->name, &b[11], name_len);
-    if (!check_crc(b, bufsz)) {
+    memcpy(dir_data->name, &buf[11], name_len);
+    entry->data.dir_data = dir_data;
+    if (!check_crc(buf, SFS_ENTRY_SIZE + cont_len)) {
         return NULL;
     }
-    entry->data.dir_data = dir_data;
     return entry;   
 }
 
 
-static struct sfs_entry *read_file_data(uint8_t *buf, struct sfs_entry *entry, FILE *file)
+/* buf holds the entry followed by its continuations */
+static struct sfs_entry *read_file_data(uint8_t *buf, struct sfs_entry *entry)
 {
-    uint8_t *b = buf;
-    struct file_data *file_data = malloc(sizeof(struct file_data));
+    struct file_data *file_data = calloc(1, sizeof(struct file_data));
 
     memcpy(&file_data->num_cont, &buf[2], 1);
     memcpy(&file_data->time_stamp, &buf[3], 8);
@@ -397,18 +511,11 @@ static struct sfs_entry *read_file_data(uint8_t *buf, struct sfs_entry *entry, F
     const int name_len = SFS_FILE_NAME_LEN + cont_len;
 
     file_data->name = malloc(name_len);
-    int bufsz = SFS_ENTRY_SIZE * (1 + file_data->num_cont);
-    uint8_t buf2[bufsz];
-    if (file_data->num_cont != 0) {
-        b = buf2;
-        memcpy(buf2, buf, SFS_ENTRY_SIZE);  /* copy from old buffer to new */
-        fread(buf2 + SFS_ENTRY_SIZE, cont_len, 1, file); /* copy into new */
-    }
-    memcpy(file_data->name, &b[35], name_len);
-    if (!check_crc(b, bufsz)) {
+    memcpy(file_data->name, &buf[35], name_len);
+    entry->data.file_data = file_data;
+    if (!check_crc(buf, SFS_ENTRY_SIZE + cont_len)) {
         return NULL;
     }
-    entry->data.file_data = file_data;
     return entry;   
 }
 
@@ -441,17 +548,26 @@ static int get_num_cont(struct sfs_entry *entry)
 }
 
 
-/* read entry, at current location */
-static struct sfs_entry *read_entry(SFS *sfs)
+/* Number of bytes of the entry at buf, with its continuations */
+static size_t entry_size(const uint8_t *buf)
 {
-    uint8_t buf[SFS_ENTRY_SIZE];
-
-    struct sfs_entry *entry = malloc(sizeof(struct sfs_entry));
-    entry->offset = ftell(sfs->file);
-    if (entry->offset == -1) {
-        return NULL;
+    switch (buf[0]) {
+    case SFS_ENTRY_DIR:
+    case SFS_ENTRY_DIR_DEL:
+    case SFS_ENTRY_FILE:
+    case SFS_ENTRY_FILE_DEL:
+        return SFS_ENTRY_SIZE * (1 + buf[2]);
+    default:
+        return SFS_ENTRY_SIZE;
     }
-    fread(buf, SFS_ENTRY_SIZE, 1, sfs->file);
+}
+
+
+/* Decodes the entry at buf, which is at offset in the image */
+static struct sfs_entry *read_entry(uint8_t *buf, uint64_t offset)
+{
+    struct sfs_entry *entry = calloc(1, sizeof(struct sfs_entry));
+    entry->offset = offset;
     entry->type = buf[0];
     entry->next = NULL;
     switch (entry->type) {
@@ -459,10 +575,10 @@ static struct sfs_entry *read_entry(SFS *sfs)
         return read_volume_data(buf, entry);
     case SFS_ENTRY_DIR:
     case SFS_ENTRY_DIR_DEL:
-        return read_dir_data(buf, entry, sfs->file);
+        return read_dir_data(buf, entry);
     case SFS_ENTRY_FILE:
     case SFS_ENTRY_FILE_DEL:
-        return read_file_data(buf, entry, sfs->file);
+        return read_file_data(buf, entry);
     case SFS_ENTRY_UNUSABLE:
         return read_unusable_data(buf, entry);
     default:
@@ -473,21 +589,24 @@ static struct sfs_entry *read_entry(SFS *sfs)
 
 static void print_entry(struct sfs *sfs, struct sfs_entry *entry)
 {
-    printf("ENTRY Type: 0x%02x\n", entry->type);
-    printf("\tOffset: 0x%06lx\n", entry->offset);
+    if (!TRACE_ENABLED(SFS_TRACE_DEBUG)) {
+        return;
+    }
+    TRACE_DEBUG("ENTRY Type: 0x%02x", entry->type);
+    TRACE_DEBUG("\tOffset: 0x%06lx", entry->offset);
     int num_cont = get_num_cont(entry);
-    printf("\tContinuations: %d\n", num_cont);
-    printf("\tLength: 0x%06x (bytes)\n", (1 + num_cont) * SFS_ENTRY_SIZE);
+    TRACE_DEBUG("\tContinuations: %d", num_cont);
+    TRACE_DEBUG("\tLength: 0x%06x (bytes)", (1 + num_cont) * SFS_ENTRY_SIZE);
     switch (entry->type) {
     case SFS_ENTRY_DIR:
     case SFS_ENTRY_DIR_DEL:
-        printf("\tDirectory Name: %s\n", entry->data.dir_data->name);
+        TRACE_DEBUG("\tDirectory Name: %s", entry->data.dir_data->name);
         break;
     case SFS_ENTRY_FILE:
     case SFS_ENTRY_FILE_DEL:
-        printf("\tFile Name: %s\n", entry->data.file_data->name);
-        printf("\tFile Start: 0x%06lx\n", entry->data.file_data->start_block * sfs->block_size);
-        printf("\tFile Length: 0x%06lx\n", entry->data.file_data->file_len);
+        TRACE_DEBUG("\tFile Name: %s", entry->data.file_data->name);
+        TRACE_DEBUG("\tFile Start: 0x%06lx", entry->data.file_data->start_block * sfs->block_size);
+        TRACE_DEBUG("\tFile Length: 0x%06lx", entry->data.file_data->file_len);
         break;
     case SFS_ENTRY_UNUSABLE:
         break;
@@ -498,738 +617,1967 @@ static void print_entry(struct sfs *sfs, struct sfs_entry *entry)
 }
 
 
+/****s* sfs/index_segment
+ * NAME
+ *   struct index_segment -- part of the Index Area decoded by one thread
+ * FIELDS
+ *   buf - the Index Area
+ *   offset - offset of the Index Area in the image
+ *   start, end - the bytes of buf to decode, at entry boundaries
+ *   head, tail - the decoded entries, in the order of the Index Area
+ *   error - set when an entry could not be decoded
+ ******
+ */
+struct index_segment {
+    uint8_t *buf;
+    uint64_t offset;
+    size_t start;
+    size_t end;
+    struct sfs_entry *head;
+    struct sfs_entry *tail;
+    int error;
+};
+
+
+static void *read_segment(void *arg)
+{
+    struct index_segment *segment = arg;
+    struct sfs_entry **tail = &segment->head;
+    segment->head = NULL;
+    segment->tail = NULL;
+    for (size_t pos = segment->start; pos < segment->end; pos += entry_size(&segment->buf[pos])) {
+        struct sfs_entry *entry = read_entry(&segment->buf[pos], segment->offset + pos);
+        if (entry == NULL) {
+            segment->error = 1;
+            break;
+        }
+        *tail = entry;
+        tail = &entry->next;
+        segment->tail = entry;
+    }
+    return NULL;
+}
+
+
+/****f* sfs/read_entries
+ * NAME
+ *   read_entries -- read the entries of the Index Area
+ * DESCRIPTION
+ *   The Index Area is read with one pread.  A first pass follows the
+ *   continuation counts of the entries to find the Volume ID entry, which
+ *   ends the Index Area, and cuts it at entry boundaries into one segment
+ *   per thread.  The segments are decoded in parallel and their entries are
+ *   linked in the order of the Index Area.  Small indexes are decoded by
+ *   the calling thread alone.
+ * RESULT
+ *   Returns the entry list, or NULL if an entry is corrupted.
+ ******
+ */
 static struct sfs_entry *read_entries(SFS *sfs)
 {
-    int offset = sfs->block_size * sfs->super->total_blocks - sfs->super->index_size;
-    printf("bs=0x%x, tt=0x%lxH, is=0x%lx, of=0x%x\n",
+    uint64_t offset = sfs->block_size * sfs->super->total_blocks - sfs->super->index_size;
+    size_t size = sfs->super->index_size;
+    TRACE_DEBUG("bs=0x%x, tt=0x%lxH, is=0x%lx, of=0x%lx",
         sfs->block_size, sfs->super->total_blocks, sfs->super->index_size, offset);
-    if (fseek(sfs->file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "fseek error\n");
+    uint8_t *buf = malloc(size);
+    if (buf == NULL || pread(fileno(sfs->file), buf, size, offset) != (ssize_t)size) {
+        fprintf(stderr, "read_entries: couldn't read the Index Area at 0x%06lx\n", offset);
+        free(buf);
+        return NULL;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = size / SFS_ENTRY_SIZE / SFS_INDEX_SEGMENT_MIN;
+    threads = threads > cpus ? cpus : threads;
+    threads = threads > SFS_INDEX_THREADS ? SFS_INDEX_THREADS : threads;
+    threads = threads < 1 ? 1 : threads;
+    struct index_segment segments[SFS_INDEX_THREADS];
+    int count = 0;
+    size_t pos = 0;
+    size_t start = 0;
+    while (pos < size && buf[pos] != SFS_ENTRY_VOL_ID) {
+        if (count < threads - 1 && pos >= size / threads * (count + 1)) {
+            segments[count++] = (struct index_segment){ buf, offset, start, pos, NULL, NULL, 0 };
+            start = pos;
+        }
+        pos += entry_size(&buf[pos]);
+    }
+    if (pos + SFS_ENTRY_SIZE > size) {
+        fprintf(stderr, "read_entries: no Volume ID entry in the Index Area\n");
+        free(buf);
+        return NULL;
+    }
+    segments[count++] = (struct index_segment){ buf, offset, start, pos + SFS_ENTRY_SIZE, NULL, NULL, 0 };
+
+    pthread_t ids[SFS_INDEX_THREADS];
+    int started = 1;
+    while (started < count && pthread_create(&ids[started], NULL, read_segment, &segments[started]) == 0) {
+        started++;
+    }
+    for (int i = started; i < count; ++i) {
+        read_segment(&segments[i]);
+    }
+    read_segment(&segments[0]);
+    for (int i = 1; i < started; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    free(buf);
+
+    struct sfs_entry *head = NULL;
+    struct sfs_entry **tail = &head;
+    int error = 0;
+    sfs->volume = NULL;
+    for (int i = 0; i < count; ++i) {
+        error |= segments[i].error;
+        if (segments[i].head != NULL) {
+            *tail = segments[i].head;
+            tail = &segments[i].tail->next;
+            sfs->volume = segments[i].tail;
+        }
+    }
+    if (error || sfs->volume == NULL || sfs->volume->type != SFS_ENTRY_VOL_ID) {
+        fprintf(stderr, "read_entries: corrupted Index Area\n");
         return NULL;
     }
-    struct sfs_entry *entry = read_entry(sfs);
-    print_entry(sfs, entry);
-    struct sfs_entry *head = entry;
-    while (entry->type != SFS_ENTRY_VOL_ID) {
-        struct sfs_entry *prev = entry;
-        entry = read_entry(sfs);
-        print_entry(sfs, entry);
-        prev->next = entry;
+    if (TRACE_ENABLED(SFS_TRACE_DEBUG)) {
+        for (struct sfs_entry *entry = head; entry != NULL; entry = entry->next) {
+            print_entry(sfs, entry);
+        }
     }
-    sfs->volume = entry;
     return head;
 }
 
 
-struct block_list *block_list_from_entries(struct sfs_entry *entry_list)
+static void print_block_list(struct sfs *sfs, char *info, struct block_list *list)
 {
-    struct block_list *list = NULL;
-    struct sfs_entry *entry = entry_list;
-    while (entry != NULL) {
-        if ((entry->type == SFS_ENTRY_FILE && entry->data.file_data->file_len != 0)
-                || entry->type == SFS_ENTRY_FILE_DEL
-                || entry->type == SFS_ENTRY_UNUSABLE) {
-            struct block_list *item = malloc(sizeof(struct block_list));
-            item->start_block = entry->data.unusable_data->start_block;
-            item->next = list;
-            list = item;
-            switch (entry->type) {
-            case SFS_ENTRY_FILE:
-                item->start_block = entry->data.file_data->start_block;
-                item->length = entry->data.file_data->end_block + 1 - item->start_block;
-                item->delfile = NULL;
-                break;
-            case SFS_ENTRY_UNUSABLE:
-                item->start_block = entry->data.unusable_data->start_block;
-                item->length = entry->data.unusable_data->end_block + 1 - item->start_block;
-                item->delfile = NULL;
-                break;
-            case SFS_ENTRY_FILE_DEL:
-                item->start_block = entry->data.file_data->start_block;
-                item->length = entry->data.file_data->end_block + 1 - item->start_block;
-                item->delfile = entry;
-                break;
-            }
-        }
-        entry = entry->next;
+    if (!TRACE_ENABLED(SFS_TRACE_DEBUG)) {
+        return;
+    }
+    TRACE_DEBUG("%s", info);
+    while (list != NULL) {
+        TRACE_DEBUG("\tstart: 0x%06lx, length: 0x%06lx%s%s",
+            list->start_block * sfs->block_size, list->length * sfs->block_size,
+            list->delfile != NULL ? ", delfile: " : "",
+            list->delfile != NULL ? list->delfile->data.file_data->name : "");
+        list = list->next;
     }
-    return list;
 }
 
 
-struct block_list **conquer(struct block_list **p1, struct block_list **p2, int sz)
+/****s* sfs/extent
+ * NAME
+ *   struct extent -- the blocks of an entry, when building the free list
+ * FIELDS
+ *   start_block - first block
+ *   length - number of blocks
+ *   delfile - the entry of a deleted file, NULL for a file or unusable
+ *             blocks
+ ******
+ */
+struct extent {
+    uint64_t start_block;
+    uint64_t length;
+    struct sfs_entry *delfile;
+};
+
+
+/* Puts the blocks of the files, deleted files and unusable areas into an
+ * array, in the order of the entries.  Returns the array and its length in
+ * *count. */
+static struct extent *extents_from_entries(struct sfs_entry *entry_list, size_t *count)
 {
-    int i1 = 0;
-    int i2 = 0;
-    while (i1 != sz || (i2 != sz && (*p2) != NULL)) {
-        if ((i1 != sz) &&
-                (*p2 == NULL
-                 || i2 == sz
-                 || (*p1)->start_block <= (*p2)->start_block)) {
-            i1++;
-            p1 = &(*p1)->next;
-        } else {
-            i2++;
-            if (i1 != sz) {
-                struct block_list *tmp = *p2;
-                (*p2) = tmp->next;
-                tmp->next = (*p1);
-                *p1 = tmp;
-                p1 = &(*p1)->next;
-            } else {
-                p2 = &(*p2)->next;
+    size_t size = 1024;
+    size_t n = 0;
+    struct extent *extents = malloc(size * sizeof(struct extent));
+    for (struct sfs_entry *entry = entry_list; entry != NULL; entry = entry->next) {
+        struct extent extent;
+        switch (entry->type) {
+        case SFS_ENTRY_FILE:
+            if (entry->data.file_data->file_len == 0) {
+                continue;
             }
+            /* fall through */
+        case SFS_ENTRY_FILE_DEL:
+            extent.start_block = entry->data.file_data->start_block;
+            extent.length = entry->data.file_data->end_block + 1 - extent.start_block;
+            extent.delfile = entry->type == SFS_ENTRY_FILE_DEL ? entry : NULL;
+            break;
+        case SFS_ENTRY_UNUSABLE:
+            extent.start_block = entry->data.unusable_data->start_block;
+            extent.length = entry->data.unusable_data->end_block + 1 - extent.start_block;
+            extent.delfile = NULL;
+            break;
+        default:
+            continue;
         }
+        if (n == size) {
+            size *= 2;
+            extents = realloc(extents, size * sizeof(struct extent));
+        }
+        extents[n++] = extent;
     }
-    return p2;  // return the tail
+    *count = n;
+    return extents;
 }
 
 
-static void print_block_list(struct sfs *sfs, char *info, struct block_list *list)
+/* Sorts the extents by start block with a radix sort on bytes, least
+ * significant first, which keeps the order of the entries for equal starts.
+ * The bytes which are the same in every start are skipped, so volumes of
+ * less than 2^32 blocks take at most four passes. */
+static void sort_extents(struct extent **pextents, size_t count)
 {
-    printf("%s\n", info);
-    while (list != NULL) {
-        printf("\tstart:  0x%06lx", list->start_block * sfs->block_size);
-        printf("\tlength: 0x%06lx\t", list->length * sfs->block_size);
-        if (list->delfile != NULL) {
-            printf("\tdelfile: %s", list->delfile->data.file_data->name);
+    struct extent *from = *pextents;
+    struct extent *to = malloc(count * sizeof(struct extent));
+    uint64_t any = 0;
+    uint64_t all = ~0ull;
+    for (size_t i = 0; i < count; ++i) {
+        any |= from[i].start_block;
+        all &= from[i].start_block;
+    }
+    for (int shift = 0; shift < 64; shift += 8) {
+        if ((((any ^ all) >> shift) & 0xff) == 0) {
+            continue;
         }
-        list = list->next;
-        printf("\n");
+        size_t pos[256];
+        memset(pos, 0, sizeof(pos));
+        for (size_t i = 0; i < count; ++i) {
+            pos[(from[i].start_block >> shift) & 0xff]++;
+        }
+        size_t sum = 0;
+        for (int d = 0; d < 256; ++d) {
+            size_t n = pos[d];
+            pos[d] = sum;
+            sum += n;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            to[pos[(from[i].start_block >> shift) & 0xff]++] = from[i];
+        }
+        struct extent *tmp = from;
+        from = to;
+        to = tmp;
     }
-    printf("\n");
+    free(to);
+    *pextents = from;
 }
 
 
-static void sort_block_list(struct block_list **plist)
+/* Appends an item to the list at *tail and returns it */
+static struct block_list *append_block(struct block_list ***tail, uint64_t start,
+                                       uint64_t length, struct sfs_entry *delfile)
 {
-    int sz = 1;
-    int n;
-    do {
-        n = 0;
-        struct block_list **plist1 = plist;
-        while (*plist1 != NULL) {
-            n = n + 1;
-            struct block_list **plist2 = plist1;
-            int i = 0;
-            plist2 = plist1;
-            while (i < sz && *plist2 != NULL) {
-                i++;
-                plist2 = &(*plist2)->next;
-            }
-            plist1 = conquer(plist1, plist2, sz);
-        }
-        sz = sz * 2;
-    } while (n > 1);
+    struct block_list *item = malloc(sizeof(struct block_list));
+    item->start_block = start;
+    item->length = length;
+    item->delfile = delfile;
+    item->next = NULL;
+    **tail = item;
+    *tail = &item->next;
+    return item;
 }
 
-/****f* sfs/block_list_to_free_list
+
+/****f* sfs/make_free_list
  * NAME
- *   block_list_to_free_list -- convert a block list to a free list
+ *   make_free_list -- build the free list from the entries
  * DESCRIPTION
- *   Converts the block list, representing the files and their lengths to a
- *   free list, representing the gaps between the files and the deleted files.
- *   The items in the block list are ordered by the start_block field of the
- *   files and unusable areas.  A free list item can be either a gap between
- *   files (or unusable areas) or deleted files.  No gap entries can follow
- *   each other, in which case they should be merged.
+ *   Collects the extents of the files, deleted files and unusable areas
+ *   into an array and sorts it by start block.  Then one sweep from the
+ *   first block of the data area makes the free list: a gap item for the
+ *   blocks between two extents, and an item for each deleted file.  The
+ *   gap which ends the data area, before the Index Area, is free_last.
  * PARAMETERS
- *   plist - pointer to pointer to the block list
- *   first_block - number of the first block of the data area
- *   total_blocks - number of blocks in the data area (excluding the index area)
- *   free_last - the pointer to pointer to the last element of the free list
+ *   sfs - the SFS structure variable
+ *   entry_list - the entries of the Index Area
+ *   free_last - receives the last item of the free list, NULL if the data
+ *               area ends with a file
  * RETURN VALUE
- *   Does not return anything.
+ *   Returns the free list.
  ******
- * Pseudocode
- *   if the block list is entry then
- *     use the whole data area as a free list entry
- *     return
- *   end if
- *   if the first entry of the block list is not at first_block then
- *     create a gap entry between first_block and the first entry
- *   end if
- *   the loop: prev, curr, exit:prev=null
- *     prev_end: prev:(start+length)
- *     gap: curr:start - prev_end
- *     if prev is not delfile
- *       if no gap then
- *         delete prev
- *         new prev is its next
- *       else
- *         convert prev to gap entry between prev and curr
- *         new prev is its next
- *       end if
- *     else (if prev is delfile)
- *       if gap > 0 then
- *         create item for the gap
- *         new prev is curr
- *         if curr is null then
- *           set free_last to the new item
- *         end if
- *       else
- *         new prev is its next
- *       end if
- *       if prev is not null and curr is null and prev->delfile is null then
- *         free_last = prev
- *       end if
- *     end if
- *     if curr is not null then
- *       curr = curr->next
- *     end if
- *   continue loop
  */
-static void block_list_to_free_list(plist, first_block, total_blocks, free_last)
-    struct block_list **plist;
-    uint64_t first_block;
-    uint64_t total_blocks;
-    struct block_list **free_last;
-{
-    if (*plist == NULL) {
-        uint64_t gap = total_blocks - first_block;
-        struct block_list *item = malloc(sizeof(struct block_list));
-        item->start_block = first_block;
-        item->length = gap;
-        item->delfile = NULL;
-        item->next = NULL;
-        *plist = item;
-        return;
-    }
-
-    /* if gap before the first block, insert one block structure */
-    struct block_list **pprev;
-    struct block_list *curr;
-    if (first_block < (*plist)->start_block) {
-        struct block_list *b0 = malloc(sizeof(struct block_list));
-        b0->start_block = first_block;
-        b0->length = (*plist)->start_block - first_block;
-        b0->next =  (*plist);
-        b0->delfile = NULL;
-        *plist = b0;
-        pprev = &(*plist)->next;
-    } else {
-        pprev = plist;
-    }
-    curr = (*pprev)->next;
-
-    while ((*pprev) != NULL) {
-        uint64_t prev_end = (*pprev)->start_block + (*pprev)->length;
-        uint64_t gap = (curr != 0 ? curr->start_block : total_blocks) - prev_end;
-        if ((*pprev)->delfile == NULL) {
-            if (gap == 0) {
-                struct block_list *tmp = (*pprev);
-                *pprev = tmp->next;
-                if ((*pprev)->next == NULL) {
-                    *free_last = NULL;
-                }
-                free(tmp);
-            } else {
-                (*pprev)->start_block += (*pprev)->length;
-                (*pprev)->length = gap;
-                if ((*pprev)->next == NULL) {
-                    *free_last = *pprev;
-                }
-                pprev = &(*pprev)->next;
-            }
-        } else {
-            if (gap > 0) {
-                struct block_list *item = malloc(sizeof(struct block_list));
-                item->start_block = (*pprev)->start_block + (*pprev)->length;
-                item->length = gap;
-                item->next = curr;
-                item->delfile = NULL;
-                (*pprev)->next = item;
-                pprev = &item->next;
-                if (curr == NULL) {
-                    *free_last = item;
-                }
-            } else {
-                pprev = &(*pprev)->next;
-            }
-            if (*pprev != NULL && curr == NULL && (*pprev)->delfile == NULL) {
-                *free_last = *pprev;
-            }
-        }
-        if (curr != NULL) {
-            curr = curr->next;
-        }
-    }
-}
-
-
 struct block_list *make_free_list(sfs, entry_list, free_last)
     struct sfs *sfs;
     struct sfs_entry *entry_list;
     struct block_list **free_last;
 {
     struct sfs_super *super = sfs->super;
-    struct block_list *block_list = block_list_from_entries(entry_list);
-    print_block_list(sfs, "not sorted:", block_list);
-
-    sort_block_list(&block_list);
-    print_block_list(sfs, "sorted:", block_list);
+    size_t count;
+    struct extent *extents = extents_from_entries(entry_list, &count);
+    sort_extents(&extents, count);
 
     uint64_t first_block = super->rsvd_blocks;  // !! includes the superblock
     uint64_t iblocks = (sfs->super->index_size + sfs->block_size - 1) / sfs->block_size;
     uint64_t data_blocks = super->total_blocks - iblocks; // without index blocks !!
-    block_list_to_free_list(&block_list, first_block, data_blocks, free_last);
-    print_block_list(sfs, "free:", block_list);
-
-    return block_list;
+    struct block_list *list = NULL;
+    struct block_list **tail = &list;
+    uint64_t pos = first_block;
+    for (size_t i = 0; i < count; ++i) {
+        struct extent *extent = &extents[i];
+        if (extent->start_block > pos) {
+            append_block(&tail, pos, extent->start_block - pos, NULL);
+        }
+        if (extent->delfile != NULL) {
+            append_block(&tail, extent->start_block, extent->length, extent->delfile);
+        }
+        if (extent->start_block + extent->length > pos) {
+            pos = extent->start_block + extent->length;
+        }
+    }
+    *free_last = NULL;
+    if (data_blocks > pos) {
+        *free_last = append_block(&tail, pos, data_blocks - pos, NULL);
+    }
+    free(extents);
+    print_block_list(sfs, "free:", list);
+    return list;
 }
 
 
-SFS *sfs_init(const char *filename)
+/****s* sfs/block_cache
+ * NAME
+ *   struct block_cache -- cache of the blocks of the image
+ * DESCRIPTION
+ *   Blocks read from the image are kept in memory and replaced with the 2Q
+ *   policy: a block read for the first time goes into the a1in queue (FIFO).
+ *   When it leaves a1in, only its number is remembered in the a1out queue.
+ *   A block read again while its number is in a1out is considered hot and
+ *   goes into the am queue (LRU).  This way a scan of a large file only
+ *   replaces the blocks of a1in and not the hot ones of am.  Every write to
+ *   the image goes through image_write, which updates the cached blocks, so
+ *   the cache never has stale data.
+ * FIELDS
+ *   capacity - maximum number of blocks with data
+ *   kin - maximum number of blocks in a1in
+ *   kout - maximum number of block numbers in a1out
+ *   used - number of blocks with data
+ *   hash - hash table of the blocks of all queues, chained by hash_next
+ *   buckets - number of buckets in hash (a power of two)
+ *   queues - the a1in, a1out and am queues, newest block at the head
+ *   hits, misses - statistics of the block lookups
+ ******
+ */
+enum cache_queue { CACHE_A1IN, CACHE_A1OUT, CACHE_AM };
+
+struct cache_block {
+    uint64_t block;
+    enum cache_queue queue;
+    char *data;                 /* NULL in a1out */
+    struct cache_block *prev;
+    struct cache_block *next;
+    struct cache_block *hash_next;
+};
+
+struct cache_list {
+    struct cache_block *head;
+    struct cache_block *tail;
+    size_t count;
+};
+
+struct block_cache {
+    size_t capacity;
+    size_t kin;
+    size_t kout;
+    size_t used;
+    struct cache_block **hash;
+    size_t buckets;
+    struct cache_list queues[3];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+
+static struct cache_block **cache_slot(struct block_cache *cache, uint64_t block)
 {
-    SFS *sfs = malloc(sizeof(SFS));
-    sfs->file = fopen(filename, "r+");
-    if (sfs->file == NULL) {
-        perror("sfs_init error");
-        fprintf(stderr, "sfs_init: file error \"%s\"\n", filename);
-        return NULL;
-    }
-    sfs->super = read_super(sfs);
-    if (sfs->super == NULL) {
-        fprintf(stderr, "sfs_init: error reading the superblock\n");
-        exit(7);
-    }
-    sfs->entry_list = read_entries(sfs);
-    sfs->free_last = NULL;
-    sfs->free_list = make_free_list(sfs, sfs->entry_list, &sfs->free_last);
-    if (sfs->free_last == NULL) {
-        fprintf(stderr, "sfs_init: error: free_last is null\n");
-        exit(7);
+    struct cache_block **p = &cache->hash[block & (cache->buckets - 1)];
+    while (*p != NULL && (*p)->block != block) {
+        p = &(*p)->hash_next;
     }
-    return sfs;
+    return p;
 }
 
 
-static void free_entry(struct sfs_entry *entry)
+static void cache_unlink(struct block_cache *cache, struct cache_block *cb)
 {
-//    printf("freeing: %x\n", entry->type);
-    switch (entry->type) {
-    case SFS_ENTRY_VOL_ID:
-        free(entry->data.volume_data->name);
-        free(entry->data.volume_data);
-        break;
-    case SFS_ENTRY_DIR:
-    case SFS_ENTRY_DIR_DEL:
-        free(entry->data.dir_data->name);
-        free(entry->data.dir_data);
-        break;
-    case SFS_ENTRY_FILE:
-    case SFS_ENTRY_FILE_DEL:
-        free(entry->data.file_data->name);
-        free(entry->data.file_data);
-        break;
-    case SFS_ENTRY_UNUSABLE:
-        free(entry->data.unusable_data);
-        break;
-    default:
-        break;
+    struct cache_list *list = &cache->queues[cb->queue];
+    if (cb->prev != NULL) {
+        cb->prev->next = cb->next;
+    } else {
+        list->head = cb->next;
     }
-    free(entry);
+    if (cb->next != NULL) {
+        cb->next->prev = cb->prev;
+    } else {
+        list->tail = cb->prev;
+    }
+    list->count--;
 }
 
 
-static void free_entry_list(struct sfs_entry *entry_list)
+static void cache_push(struct block_cache *cache, struct cache_block *cb, enum cache_queue queue)
 {
-    struct sfs_entry *prev = entry_list;
-    struct sfs_entry *curr = prev->next;
-    while (curr != NULL) {
-        free_entry(prev);
-        prev = curr;
-        curr = curr->next;
+    struct cache_list *list = &cache->queues[queue];
+    cb->queue = queue;
+    cb->prev = NULL;
+    cb->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = cb;
+    } else {
+        list->tail = cb;
     }
-    free_entry(prev);
+    list->head = cb;
+    list->count++;
 }
 
 
-static void free_free_list(struct block_list *free_list)
+/* Removes the block from its queue and from the hash table and frees it,
+ * returns its data */
+static char *cache_remove(struct block_cache *cache, struct cache_block *cb)
 {
-    struct block_list *prev = free_list;
-    struct block_list *curr = prev->next;
-    while (curr != NULL) {
-        free(prev);
-        prev = curr;
-        curr = curr->next;
-    }
-    free(prev);
+    char *data = cb->data;
+    cache_unlink(cache, cb);
+    *cache_slot(cache, cb->block) = cb->hash_next;
+    free(cb);
+    return data;
 }
 
-int sfs_terminate(SFS *sfs)
+
+/* Returns a buffer for a new block, taking it from the block to be replaced
+ * if the cache is full */
+static char *cache_reclaim(struct block_cache *cache, size_t block_size)
 {
-    free_entry_list(sfs->entry_list);
-    free_free_list(sfs->free_list);
-    free(sfs->super);
-    fclose(sfs->file);
-    free(sfs);
-    return 0;
+    if (cache->used < cache->capacity) {
+        char *data = malloc(block_size);
+        if (data != NULL) {
+            cache->used++;
+        }
+        return data;
+    }
+    char *data;
+    struct cache_list *a1in = &cache->queues[CACHE_A1IN];
+    struct cache_list *a1out = &cache->queues[CACHE_A1OUT];
+    if (a1in->count > cache->kin || cache->queues[CACHE_AM].count == 0) {
+        /* the oldest block of a1in: remember only its number */
+        struct cache_block *cb = a1in->tail;
+        cache_unlink(cache, cb);
+        data = cb->data;
+        cb->data = NULL;
+        cache_push(cache, cb, CACHE_A1OUT);
+        if (a1out->count > cache->kout) {
+            cache_remove(cache, a1out->tail);
+        }
+    } else {
+        data = cache_remove(cache, cache->queues[CACHE_AM].tail);
+    }
+    return data;
 }
 
 
-uint64_t sfs_get_file_size(SFS *sfs, const char *path)
+/* Returns the data of the block, read from the image if not cached */
+static char *cache_get(SFS *sfs, uint64_t block)
 {
-    struct sfs_entry *entry = sfs->entry_list;
-    while (entry != NULL) {
-        if (entry->type == SFS_ENTRY_FILE
-                && strcmp(path, entry->data.file_data->name) == 0) {
-            return entry->data.file_data->file_len;
+    struct block_cache *cache = sfs->cache;
+    struct cache_block *cb = *cache_slot(cache, block);
+    if (cb != NULL && cb->data != NULL) {
+        cache->hits++;
+        if (cb->queue == CACHE_AM) {
+            cache_unlink(cache, cb);
+            cache_push(cache, cb, CACHE_AM);
         }
-        entry = entry->next;
+        return cb->data;
     }
-    return 0;
+    cache->misses++;
+    char *data = cache_reclaim(cache, sfs->block_size);
+    if (data == NULL) {
+        return NULL;
+    }
+    if (pread(fileno(sfs->file), data, sfs->block_size, block * sfs->block_size)
+            != (ssize_t)sfs->block_size) {
+        fprintf(stderr, "cache_get error: couldn't read block 0x%lx\n", block);
+        free(data);
+        cache->used--;
+        return NULL;
+    }
+    cb = *cache_slot(cache, block);     /* reclaim may have removed it */
+    if (cb != NULL) {
+        cache_unlink(cache, cb);
+        cb->data = data;
+        cache_push(cache, cb, CACHE_AM);
+        return data;
+    }
+    cb = malloc(sizeof(struct cache_block));
+    if (cb == NULL) {
+        free(data);
+        cache->used--;
+        return NULL;
+    }
+    cb->block = block;
+    cb->data = data;
+    cb->hash_next = NULL;
+    *cache_slot(cache, block) = cb;
+    cache_push(cache, cb, CACHE_A1IN);
+    return data;
 }
 
 
-// do not return deleted files and directories
-struct sfs_entry *get_entry_by_name(SFS *sfs, const char *path) {
-    struct sfs_entry *entry = sfs->entry_list;
-    while (entry != NULL) {
-        switch (entry->type) {
-        case SFS_ENTRY_DIR:
-            if (strcmp(path, entry->data.dir_data->name) == 0) {
-                return entry;
-            }
-            break;
-        case SFS_ENTRY_FILE:
-            if (strcmp(path, entry->data.file_data->name) == 0) {
-                return entry;
-            }
-            break;
+static void cache_free(struct block_cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    for (int q = CACHE_A1IN; q <= CACHE_AM; ++q) {
+        struct cache_block *cb = cache->queues[q].head;
+        while (cb != NULL) {
+            struct cache_block *next = cb->next;
+            free(cb->data);
+            free(cb);
+            cb = next;
         }
-        entry = entry->next;
     }
-    return NULL;
+    free(cache->hash);
+    free(cache);
 }
 
 
-struct sfs_entry *get_dir_by_name(SFS *sfs, const char *path) {
-    struct sfs_entry *entry = sfs->entry_list;
-    while (entry != NULL) {
-        if (entry->type == SFS_ENTRY_DIR
-                && strcmp(path, entry->data.dir_data->name) == 0) {
-            return entry;
+/* Reads size bytes at offset in the image, through the cache if enabled.
+ * Returns 0 on success and -1 on error. */
+static int image_read(SFS *sfs, char *buf, size_t size, uint64_t offset)
+{
+    if (sfs->cache == NULL) {
+        if (pread(fileno(sfs->file), buf, size, offset) != (ssize_t)size) {
+            fprintf(stderr, "image_read error: couldn't read 0x%lx bytes at 0x%06lx\n", size, offset);
+            return -1;
         }
-        entry = entry->next;
+        return 0;
     }
-    return NULL;
+    const uint64_t bs = sfs->block_size;
+    while (size > 0) {
+        uint64_t in_block = offset % bs;
+        size_t sz = bs - in_block < size ? bs - in_block : size;
+        char *data = cache_get(sfs, offset / bs);
+        if (data == NULL) {
+            return -1;
+        }
+        memcpy(buf, data + in_block, sz);
+        buf += sz;
+        offset += sz;
+        size -= sz;
+    }
+    return 0;
 }
 
 
-struct sfs_entry *get_file_by_name(SFS *sfs, const char *path) {
-    struct sfs_entry *entry = sfs->entry_list;
-    while (entry != NULL) {
-        if (entry->type == SFS_ENTRY_FILE
-                && strcmp(path, entry->data.file_data->name) == 0) {
-            return entry;
+/* Writes size bytes at offset in the image and updates the cached blocks.
+ * Returns 0 on success and -1 on error. */
+static int image_write(SFS *sfs, const char *buf, size_t size, uint64_t offset)
+{
+    if (pwrite(fileno(sfs->file), buf, size, offset) != (ssize_t)size) {
+        fprintf(stderr, "image_write error: couldn't write 0x%lx bytes at 0x%06lx\n", size, offset);
+        return -1;
+    }
+    if (sfs->cache == NULL) {
+        return 0;
+    }
+    const uint64_t bs = sfs->block_size;
+    while (size > 0) {
+        uint64_t in_block = offset % bs;
+        size_t sz = bs - in_block < size ? bs - in_block : size;
+        struct cache_block *cb = *cache_slot(sfs->cache, offset / bs);
+        if (cb != NULL && cb->data != NULL) {
+            memcpy(cb->data + in_block, buf, sz);
         }
-        entry = entry->next;
+        buf += sz;
+        offset += sz;
+        size -= sz;
     }
-    return NULL;
+    return 0;
 }
 
 
-int sfs_is_dir(SFS *sfs, const char *path)
+/* Reads the first size bytes of a sequence of buffers from offset in the
+ * image: with one preadv if the cache is disabled.  Returns 0 on success and
+ * -1 on error. */
+static int image_readv(SFS *sfs, const struct iovec *iov, int iovcnt, size_t size, uint64_t offset)
 {
-//    printf("@@@@\tsfs_is_dir: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_dir_by_name(sfs, path);
-    if (entry != NULL) {
-        return 1;
-    } else {
+    if (sfs->cache == NULL) {
+        if (preadv(fileno(sfs->file), iov, iovcnt, offset) != (ssize_t)size) {
+            fprintf(stderr, "image_readv error: couldn't read 0x%lx bytes at 0x%06lx\n", size, offset);
+            return -1;
+        }
         return 0;
     }
+    for (int i = 0; i < iovcnt && size > 0; ++i) {
+        size_t sz = iov[i].iov_len < size ? iov[i].iov_len : size;
+        if (image_read(sfs, iov[i].iov_base, sz, offset) != 0) {
+            return -1;
+        }
+        offset += sz;
+        size -= sz;
+    }
+    return 0;
 }
 
 
-int sfs_is_file(SFS *sfs, const char *path)
+/* Writes a sequence of buffers of size bytes in total at offset in the
+ * image with one pwritev, and updates the cached blocks */
+static int image_writev(SFS *sfs, const struct iovec *iov, int iovcnt, size_t size, uint64_t offset)
 {
-//    printf("@@@@\tsfs_is_file: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_file_by_name(sfs, path);
-    if (entry != NULL) {
-        return 1;
-    } else {
+    if (pwritev(fileno(sfs->file), iov, iovcnt, offset) != (ssize_t)size) {
+        fprintf(stderr, "image_writev error: couldn't write 0x%lx bytes at 0x%06lx\n", size, offset);
+        return -1;
+    }
+    if (sfs->cache == NULL) {
         return 0;
     }
+    for (int i = 0; i < iovcnt; ++i) {
+        const char *buf = iov[i].iov_base;
+        uint64_t pos = offset;
+        for (size_t done = 0; done < iov[i].iov_len; ) {
+            uint64_t in_block = pos % sfs->block_size;
+            size_t sz = sfs->block_size - in_block;
+            if (sz > iov[i].iov_len - done) {
+                sz = iov[i].iov_len - done;
+            }
+            struct cache_block *cb = *cache_slot(sfs->cache, pos / sfs->block_size);
+            if (cb != NULL && cb->data != NULL) {
+                memcpy(cb->data + in_block, buf + done, sz);
+            }
+            done += sz;
+            pos += sz;
+        }
+        offset += iov[i].iov_len;
+    }
+    return 0;
 }
 
 
-struct sfs_entry *find_entry_from(struct sfs_entry *entry, const char *path)
+/* Writes the superblock of the volume with image_write, like the entries.
+ * Returns 0 on success and -1 on error. */
+static int write_super(SFS *sfs)
 {
-    int len = strlen(path);
-    while (entry != NULL) {
-        if (entry->type == SFS_ENTRY_DIR) {
-            char *name = entry->data.dir_data->name;
-            int name_len = strlen(name);
-            if ((len == 0 || (name_len > len + 1 && name[len] == '/'))
-                    && strncmp(path, name, len) == 0 && strchr(&name[len+1], '/') == NULL) {
-                return entry;
-            }
-        } else if (entry->type == SFS_ENTRY_FILE) {
-            char *name = entry->data.file_data->name;
-            int name_len = strlen(name);
-            if ((len == 0 || (name_len > len + 1 && name[len] == '/'))
-                    && strncmp(path, name, len) == 0 && strchr(&name[len+1], '/') == NULL) {
-                return entry;
+    char buf[SFS_SUPER_SIZE];
+    encode_super(buf, sfs->super);
+    return image_write(sfs, buf, SFS_SUPER_SIZE, SFS_SUPER_START);
+}
+
+
+/* Removes from the cache the blocks of a range of the image that may be
+ * written without image_write */
+static void cache_drop(SFS *sfs, uint64_t offset, uint64_t size)
+{
+    struct block_cache *cache = sfs->cache;
+    if (cache == NULL || size == 0) {
+        return;
+    }
+    const uint64_t bs = sfs->block_size;
+    for (uint64_t block = offset / bs; block <= (offset + size - 1) / bs; ++block) {
+        struct cache_block *cb = *cache_slot(cache, block);
+        if (cb != NULL && cb->data != NULL) {
+            free(cache_remove(cache, cb));
+            cache->used--;
+        }
+    }
+}
+
+
+/****s* sfs/discard_queue
+ * NAME
+ *   struct discard_queue -- ranges of the image to punch holes in
+ * DESCRIPTION
+ *   Blocks which become free, and are not kept for a deleted file, are
+ *   queued.  When SFS_DISCARD_BATCH ranges or SFS_DISCARD_BATCH_BYTES are
+ *   queued, they are given as one batch to a thread which punches holes for
+ *   them in the image with fallocate, so that a sparse image file shrinks.
+ *   Before free blocks are used again, their ranges are taken out of the
+ *   queue, and if the thread is punching a batch with some of them, the
+ *   caller waits until the batch is done.  The queue is only used by the
+ *   calling thread, the batch belongs to the thread while batch_count is
+ *   not 0.
+ * FIELDS
+ *   fd - the image
+ *   block_size - the size of the blocks in bytes
+ *   queued - ranges of blocks waiting for the next batch
+ *   queued_count, queued_size, queued_blocks - ranges in queued, its size
+ *                                              and the blocks of the ranges
+ *   batch - ranges of blocks being punched by the thread
+ *   batch_count, batch_size - ranges in batch (0 if the thread is idle) and
+ *                             its size
+ *   stop - tells the thread to exit
+ *   unsupported - set by the thread when the image cannot punch holes
+ *   lock, wake, idle - the thread waits for wake, the callers for idle
+ *   thread - the thread punching the holes
+ ******
+ */
+struct discard_range {
+    uint64_t start;
+    uint64_t length;
+};
+
+struct discard_queue {
+    int fd;
+    uint64_t block_size;
+    struct discard_range *queued;
+    size_t queued_count;
+    size_t queued_size;
+    uint64_t queued_blocks;
+    struct discard_range *batch;
+    size_t batch_count;
+    size_t batch_size;
+    int stop;
+    atomic_int unsupported;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_t thread;
+};
+
+
+static void *discard_thread(void *arg)
+{
+    struct discard_queue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (queue->batch_count == 0 && !queue->stop) {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        if (queue->batch_count == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        int unsupported = 0;
+        for (size_t i = 0; i < queue->batch_count && !unsupported; ++i) {
+            if (fallocate(queue->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    queue->batch[i].start * queue->block_size,
+                    queue->batch[i].length * queue->block_size) != 0) {
+                unsupported = errno == EOPNOTSUPP || errno == ENOSYS;
             }
         }
-        entry = entry->next;
+        if (unsupported) {
+            atomic_store(&queue->unsupported, 1);
+        }
+        pthread_mutex_lock(&queue->lock);
+        queue->batch_count = 0;
+        pthread_cond_broadcast(&queue->idle);
     }
+    pthread_mutex_unlock(&queue->lock);
     return NULL;
 }
 
 
-static const char *get_basename(const char *full_name)
+/* Gives the queued ranges to the thread if it is idle, or waits for it to
+ * be idle first if *wait* is set */
+static void discard_submit(struct discard_queue *queue, int wait)
 {
-    const char *p = full_name;
-    int i = 0;
-    int last_slash = -1;
-    while (p[i] != 0) {
-        if (p[i] == '/') {
-            last_slash = i;
-        }
-        i = i + 1;
+    pthread_mutex_lock(&queue->lock);
+    while (wait && queue->batch_count > 0) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
     }
-    return &p[last_slash + 1];
+    if (queue->batch_count == 0 && queue->queued_count > 0) {
+        struct discard_range *batch = queue->batch;
+        size_t batch_size = queue->batch_size;
+        queue->batch = queue->queued;
+        queue->batch_size = queue->queued_size;
+        queue->batch_count = queue->queued_count;
+        queue->queued = batch;
+        queue->queued_size = batch_size;
+        queue->queued_count = 0;
+        queue->queued_blocks = 0;
+        pthread_cond_signal(&queue->wake);
+    }
+    pthread_mutex_unlock(&queue->lock);
 }
 
 
-static const char *get_entry_basename(struct sfs_entry *entry)
+/* Punches the queued ranges, stops the thread and frees the queue */
+static void discard_free(struct discard_queue *queue)
 {
-    switch (entry->type) {
-    case SFS_ENTRY_DIR:
-    case SFS_ENTRY_DIR_DEL:
-        return get_basename((char*)entry->data.dir_data->name);
-    case SFS_ENTRY_FILE:
-    case SFS_ENTRY_FILE_DEL:
-        return get_basename((char*)entry->data.file_data->name);
-    default:
-        return NULL;
+    if (queue == NULL) {
+        return;
     }
+    discard_submit(queue, 1);
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = 1;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->wake);
+    pthread_cond_destroy(&queue->idle);
+    free(queue->queued);
+    free(queue->batch);
+    free(queue);
 }
 
 
-const char *sfs_first(SFS *sfs, const char *path)
+/* Adds a range to the queued ones.  Returns 0 on success and -1 on error. */
+static int discard_append(struct discard_queue *queue, uint64_t start, uint64_t length)
 {
-    struct sfs_entry *entry = find_entry_from(sfs->entry_list, path);
-    if (entry != NULL) {
-        sfs->iter_curr = entry->next;
-        return get_entry_basename(entry);
+    if (queue->queued_count == queue->queued_size) {
+        size_t size = queue->queued_size == 0 ? SFS_DISCARD_BATCH : queue->queued_size * 2;
+        struct discard_range *queued = realloc(queue->queued, size * sizeof(struct discard_range));
+        if (queued == NULL) {
+            return -1;
+        }
+        queue->queued = queued;
+        queue->queued_size = size;
     }
-    sfs->iter_curr = NULL;
-    return NULL;
+    queue->queued[queue->queued_count].start = start;
+    queue->queued[queue->queued_count].length = length;
+    queue->queued_count++;
+    queue->queued_blocks += length;
+    return 0;
 }
 
 
-const char *sfs_next(SFS *sfs, const char *path)
+/* Queues *length* free blocks from *start* for punching a hole, if discard
+ * is enabled.  The blocks are removed from the cache. */
+static void discard_blocks(SFS *sfs, uint64_t start, uint64_t length)
 {
-    struct sfs_entry *entry = find_entry_from(sfs->iter_curr, path);
-    if (entry != NULL) {
-        sfs->iter_curr = entry->next;
-        return get_entry_basename(entry);
+    struct discard_queue *queue = sfs->discard;
+    if (queue == NULL || length == 0 || atomic_load(&queue->unsupported)) {
+        return;
+    }
+    cache_drop(sfs, start * sfs->block_size, length * sfs->block_size);
+    struct discard_range *last = queue->queued_count > 0 ? &queue->queued[queue->queued_count - 1] : NULL;
+    if (last != NULL && last->start + last->length == start) {
+        last->length += length;
+        queue->queued_blocks += length;
+    } else if (discard_append(queue, start, length) != 0) {
+        return;
+    }
+    sfs->stats.discards++;
+    sfs->stats.blocks_discarded += length;
+    if (queue->queued_count >= SFS_DISCARD_BATCH
+            || queue->queued_blocks * sfs->block_size >= SFS_DISCARD_BATCH_BYTES) {
+        discard_submit(queue, 0);
     }
-    sfs->iter_curr = NULL;
-    return NULL;
 }
 
 
-int sfs_read(SFS *sfs, const char *path, char *buf, size_t size, off_t offset)
+/* Before *length* free blocks from *start* are used: takes them out of the
+ * queued ranges and waits for the batch being punched if it has some of
+ * them */
+static void discard_claim(SFS *sfs, uint64_t start, uint64_t length)
 {
-//    printf("@@@@\tsfs_read: path=\"%s\", size:0x%lx, offset:0x%lx\n", path, size, offset);
-    struct sfs_entry *entry = get_file_by_name(sfs, path);
-    if (entry != NULL) {
-        uint64_t sz;		// number of bytes to be read
-        uint64_t len = entry->data.file_data->file_len;
-        if ((uint64_t)offset > len) {
-            return 0;
+    struct discard_queue *queue = sfs->discard;
+    if (queue == NULL || length == 0) {
+        return;
+    }
+    const uint64_t end = start + length;
+    size_t i = 0;
+    while (i < queue->queued_count) {
+        struct discard_range range = queue->queued[i];
+        uint64_t range_end = range.start + range.length;
+        if (range_end <= start || range.start >= end) {
+            i++;
+            continue;
         }
-        if (offset + size > len) {
-            sz = len - offset;
+        queue->queued_blocks -= range.length;
+        /* the blocks after the claimed ones become a new range, if the
+         * queue cannot grow they are just not punched */
+        if (range_end > end) {
+            discard_append(queue, end, range_end - end);
+        }
+        if (range.start < start) {
+            queue->queued[i].length = start - range.start;
+            queue->queued_blocks += start - range.start;
+            i++;
         } else {
-            sz = size;
+            queue->queued[i] = queue->queued[--queue->queued_count];
         }
-        uint64_t data_offset = sfs->block_size * entry->data.file_data->start_block;
-        uint64_t read_from = data_offset + offset;
-        fseek(sfs->file, read_from, SEEK_SET);
-        fread(buf, sz, 1, sfs->file);
-        return sz;
-    } else {
-        return -1;
     }
-}
-
 
-static int get_entry_usable_space(struct sfs_entry *entry)
-{
-    switch (entry->type) {
-    case SFS_ENTRY_DIR_DEL:
-        return 1 + entry->data.dir_data->num_cont;
-    case SFS_ENTRY_FILE_DEL:
-        return 1 + entry->data.file_data->num_cont;
-    case SFS_ENTRY_UNUSED:
-        return 1;
-    default:
-        return 0;
+    pthread_mutex_lock(&queue->lock);
+    int overlaps = 0;
+    for (size_t i = 0; i < queue->batch_count && !overlaps; ++i) {
+        overlaps = queue->batch[i].start < end
+            && queue->batch[i].start + queue->batch[i].length > start;
+    }
+    while (overlaps && queue->batch_count > 0) {
+        pthread_cond_wait(&queue->idle, &queue->lock);
     }
+    pthread_mutex_unlock(&queue->lock);
 }
 
 
-static void write_volume_data(char *buf, struct volume_data *vol_data)
+/* Writes *len* null bytes at *offset* in the image.  The whole blocks of
+ * the range are zeroed with fallocate when the image supports it, the rest
+ * is written in chunks of SFS_ZERO_CHUNK bytes. */
+static int zero_fill(SFS *sfs, uint64_t offset, uint64_t len)
 {
-    memcpy(&buf[4], &vol_data->time_stamp, 8);
-    strncpy(&buf[12], vol_data->name, SFS_VOL_NAME_LEN);
+    static const char zeros[SFS_ZERO_CHUNK];
+    const uint64_t bs = sfs->block_size;
+    uint64_t first = (offset + bs - 1) / bs * bs;
+    uint64_t last = (offset + len) / bs * bs;
+    if (sfs->zero_range && last > first) {
+        if (fallocate(fileno(sfs->file), FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                first, last - first) == 0) {
+            cache_drop(sfs, first, last - first);
+            return zero_fill(sfs, offset, first - offset) || zero_fill(sfs, last, offset + len - last)
+                ? -1 : 0;
+        }
+        TRACE_INFO("zero_fill: no FALLOC_FL_ZERO_RANGE on the image (%s)", strerror(errno));
+        sfs->zero_range = 0;
+    }
+    while (len > 0) {
+        size_t sz = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (image_write(sfs, zeros, sz, offset) != 0) {
+            return -1;
+        }
+        offset += sz;
+        len -= sz;
+    }
+    return 0;
 }
 
 
-static void write_dir_data(char *buf, struct dir_data *dir_data)
+/* Writes the null bytes of the lazy tail of the file which are before *end*
+ * on the image */
+static int zero_tail_flush(SFS *sfs, struct file_data *file_data, uint64_t end)
 {
-    memcpy(&buf[2], &dir_data->num_cont, 1);
-    memcpy(&buf[3], &dir_data->time_stamp, 8);
-    uint64_t max_len = SFS_DIR_NAME_LEN + SFS_ENTRY_SIZE * dir_data->num_cont;
-    strncpy(&buf[11], dir_data->name, max_len);
+    uint64_t from = file_data->file_len - file_data->zero_tail;
+    if (end > file_data->file_len) {
+        end = file_data->file_len;
+    }
+    if (end <= from) {
+        return 0;
+    }
+    if (zero_fill(sfs, sfs->block_size * file_data->start_block + from, end - from) != 0) {
+        return -1;
+    }
+    file_data->zero_tail = file_data->file_len - end;
+    return 0;
 }
 
 
-static void write_file_data(char *buf, struct file_data *file_data)
+/* Before data is written at [offset, end) of the file: the lazy tail must
+ * stay at the end of the file, so its null bytes before offset are written
+ * and the range is taken out of it */
+static int zero_tail_write(SFS *sfs, struct file_data *file_data, uint64_t offset, uint64_t end)
 {
-    memcpy(&buf[2], &file_data->num_cont, 1);
-    memcpy(&buf[3], &file_data->time_stamp, 8);
-    memcpy(&buf[11], &file_data->start_block, 8);
-    memcpy(&buf[19], &file_data->end_block, 8);
-    memcpy(&buf[27], &file_data->file_len, 8);
-    uint64_t max_len = SFS_FILE_NAME_LEN + SFS_ENTRY_SIZE * file_data->num_cont;
-    strncpy(&buf[35], file_data->name, max_len);
+    if (zero_tail_flush(sfs, file_data, offset) != 0) {
+        return -1;
+    }
+    if (end > file_data->file_len - file_data->zero_tail) {
+        file_data->zero_tail = end < file_data->file_len ? file_data->file_len - end : 0;
+    }
+    return 0;
 }
 
 
-static void write_unusable_data(char *buf, struct unusable_data *unusable_data)
+SFS *sfs_init(const char *filename)
 {
-    memcpy(&buf[10], &unusable_data->start_block, 8);
-    memcpy(&buf[18], &unusable_data->end_block, 8);
+    SFS *sfs = malloc(sizeof(SFS));
+    sfs->file = fopen(filename, "r+");
+    if (sfs->file == NULL) {
+        perror("sfs_init error");
+        fprintf(stderr, "sfs_init: file error \"%s\"\n", filename);
+        return NULL;
+    }
+    sfs->super = read_super(sfs);
+    if (sfs->super == NULL) {
+        fprintf(stderr, "sfs_init: error reading the superblock\n");
+        exit(7);
+    }
+    sfs->entry_list = read_entries(sfs);
+    if (sfs->entry_list == NULL) {
+        fprintf(stderr, "sfs_init: error reading the Index Area\n");
+        exit(7);
+    }
+    sfs->ino_buckets = 64;
+    sfs->ino_table = calloc(sfs->ino_buckets, sizeof(struct sfs_entry *));
+    sfs->ino_count = 0;
+    sfs->next_ino = SFS_ROOT_INO + 1;
+    sfs->cache = NULL;
+    sfs->readahead_max = SFS_READAHEAD_MAX;
+    sfs->aio = NULL;
+    sfs->next_token = 1;
+    sfs->lazy_zero = 0;
+    sfs->zero_range = 1;
+    sfs->discard = NULL;
+    memset(&sfs->stats, 0, sizeof(struct sfs_stats));
+    sfs->phase = -1;
+    memset(sfs->phase_hist, 0, sizeof(sfs->phase_hist));
+    sfs->free_last = NULL;
+    sfs->free_list = make_free_list(sfs, sfs->entry_list, &sfs->free_last);
+    if (sfs->free_last == NULL) {
+        fprintf(stderr, "sfs_init: error: free_last is null\n");
+        exit(7);
+    }
+    return sfs;
 }
 
 
-/* Writes the entry (with its continuations) to the Index Area.
- * Returns 0 on success and -1 on error.
- */
-static int write_entry(SFS *sfs, struct sfs_entry *entry)
+static void free_entry(struct sfs_entry *entry)
 {
-    printf("=== WRITING ENTRY ===\n");
-    int num_cont = get_num_cont(entry);
-    int size = (1 + num_cont) * SFS_ENTRY_SIZE;
-    char buf[size];
-    memset(buf, 0, size);
-    buf[0] = entry->type;
-    buf[1] = 0;
+//    printf("freeing: %x\n", entry->type);
     switch (entry->type) {
     case SFS_ENTRY_VOL_ID:
-        write_volume_data(buf, entry->data.volume_data);
+        free(entry->data.volume_data->name);
+        free(entry->data.volume_data);
         break;
     case SFS_ENTRY_DIR:
     case SFS_ENTRY_DIR_DEL:
-        write_dir_data(buf, entry->data.dir_data);
+        free(entry->data.dir_data->name);
+        free(entry->data.dir_data);
         break;
     case SFS_ENTRY_FILE:
     case SFS_ENTRY_FILE_DEL:
-        write_file_data(buf, entry->data.file_data);
+        free(entry->data.file_data->name);
+        free(entry->data.file_data);
         break;
     case SFS_ENTRY_UNUSABLE:
-        write_unusable_data(buf, entry->data.unusable_data);
-        break;
-    case SFS_ENTRY_START:
-    case SFS_ENTRY_UNUSED:
+        free(entry->data.unusable_data);
         break;
     default:
-        fprintf(stderr, "write_entry error: unknown entry type: 0x%02x\n", entry->type);
-        printf("=== WRITING ENTRY: ERROR ===\n");
-        return -1;
+        break;
     }
-    int sum = 0;
-    for (int i = 0; i < size; ++i) {
-        sum += buf[i];
+    free(entry);
+}
+
+
+static void free_entry_list(struct sfs_entry *entry_list)
+{
+    struct sfs_entry *prev = entry_list;
+    struct sfs_entry *curr = prev->next;
+    while (curr != NULL) {
+        free_entry(prev);
+        prev = curr;
+        curr = curr->next;
     }
-    buf[1] = 0x100 - sum % 0x100;
+    free_entry(prev);
+}
 
-    printf("writing %d bytes at 0x%06lx\n", size, entry->offset);
-    if (fseek(sfs->file, entry->offset, SEEK_SET) == -1) {
-        fprintf(stderr, "write_entry error: couldn't fseek to %06lx\n", entry->offset);
-        printf("=== WRITING ENTRY: ERROR ===\n");
-        return -1;
+
+static void free_free_list(struct block_list *free_list)
+{
+    struct block_list *prev = free_list;
+    struct block_list *curr = prev->next;
+    while (curr != NULL) {
+        free(prev);
+        prev = curr;
+        curr = curr->next;
     }
-    int tmp;
-    if ((tmp=fwrite(buf, size, 1, sfs->file)) != 1) {
-        fprintf(stderr, "write_entry error: written %d bytes instead of %d bytes\n", tmp, size);
-        printf("=== WRITING ENTRY: ERROR ===\n");
-        return -1;
+    free(prev);
+}
+
+int sfs_terminate(SFS *sfs)
+{
+    for (struct sfs_entry *entry = sfs->entry_list; entry != NULL; entry = entry->next) {
+        if (entry->type == SFS_ENTRY_FILE && entry->data.file_data->zero_tail > 0) {
+            zero_tail_flush(sfs, entry->data.file_data, entry->data.file_data->file_len);
+        }
+    }
+    discard_free(sfs->discard);
+    free_entry_list(sfs->entry_list);
+    free_free_list(sfs->free_list);
+    free(sfs->ino_table);
+    if (sfs->aio != NULL) {
+        sfs_aio_free(sfs->aio);
     }
-    printf("=== WRITING ENTRY: OK ===\n");
+    cache_free(sfs->cache);
+    free(sfs->super);
+    fclose(sfs->file);
+    free(sfs);
     return 0;
 }
 
 
-/****f* sfs/delfile_to_normal
+/* An occurrence of a phase of the work of the library (enum sfs_phase).
+ * Phases can be nested: the histogram of a phase gets the whole duration of
+ * each occurrence, but the time of the inner phase is only counted for it in
+ * stats.phase_ns, so that the times of the phases add up. */
+struct phase {
+    int prev;
+    uint64_t start;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+/* Counts the time since the last change of phase for the current phase */
+static void phase_charge(SFS *sfs, uint64_t now)
+{
+    if (sfs->phase >= 0) {
+        sfs->stats.phase_ns[sfs->phase] += now - sfs->phase_mark;
+    }
+    sfs->phase_mark = now;
+}
+
+static void phase_enter(SFS *sfs, struct phase *phase, int id)
+{
+    uint64_t now = now_ns();
+    phase_charge(sfs, now);
+    phase->prev = sfs->phase;
+    phase->start = now;
+    sfs->phase = id;
+}
+
+static void phase_leave(SFS *sfs, struct phase *phase)
+{
+    uint64_t now = now_ns();
+    sfs_hist_add(&sfs->phase_hist[sfs->phase], now - phase->start);
+    phase_charge(sfs, now);
+    sfs->phase = phase->prev;
+}
+
+
+/* Finds the directory (if dirs) or file (if files) with the path, going
+ * through the entry list */
+static struct sfs_entry *find_by_name(SFS *sfs, const char *path, int dirs, int files)
+{
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_LOOKUP);
+    struct sfs_entry *entry = sfs->entry_list;
+    sfs->stats.lookups++;
+    while (entry != NULL) {
+        sfs->stats.lookup_entries++;
+        if (dirs && entry->type == SFS_ENTRY_DIR
+                && strcmp(path, entry->data.dir_data->name) == 0) {
+            break;
+        }
+        if (files && entry->type == SFS_ENTRY_FILE
+                && strcmp(path, entry->data.file_data->name) == 0) {
+            break;
+        }
+        entry = entry->next;
+    }
+    phase_leave(sfs, &phase);
+    return entry;
+}
+
+
+// do not return deleted files and directories
+struct sfs_entry *get_entry_by_name(SFS *sfs, const char *path) {
+    return find_by_name(sfs, path, 1, 1);
+}
+
+
+struct sfs_entry *get_dir_by_name(SFS *sfs, const char *path) {
+    return find_by_name(sfs, path, 1, 0);
+}
+
+
+struct sfs_entry *get_file_by_name(SFS *sfs, const char *path) {
+    return find_by_name(sfs, path, 0, 1);
+}
+
+
+uint64_t sfs_get_file_size(SFS *sfs, const char *path)
+{
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry != NULL) {
+        return entry->data.file_data->file_len;
+    }
+    return 0;
+}
+
+
+int sfs_is_dir(SFS *sfs, const char *path)
+{
+//    printf("@@@@\tsfs_is_dir: name=\"%s\"\n", path);
+    struct sfs_entry *entry = get_dir_by_name(sfs, path);
+    if (entry != NULL) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+
+int sfs_is_file(SFS *sfs, const char *path)
+{
+//    printf("@@@@\tsfs_is_file: name=\"%s\"\n", path);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry != NULL) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+
+static char *get_entry_name(struct sfs_entry *entry)
+{
+    switch (entry->type) {
+    case SFS_ENTRY_DIR:
+    case SFS_ENTRY_DIR_DEL:
+        return entry->data.dir_data->name;
+    case SFS_ENTRY_FILE:
+    case SFS_ENTRY_FILE_DEL:
+        return entry->data.file_data->name;
+    default:
+        return NULL;
+    }
+}
+
+
+static void ino_table_grow(struct sfs *sfs)
+{
+    uint64_t n = sfs->ino_buckets * 2;
+    struct sfs_entry **table = calloc(n, sizeof(struct sfs_entry *));
+    for (uint64_t i = 0; i < sfs->ino_buckets; ++i) {
+        struct sfs_entry *entry = sfs->ino_table[i];
+        while (entry != NULL) {
+            struct sfs_entry *next = entry->ino_next;
+            entry->ino_next = table[entry->ino & (n - 1)];
+            table[entry->ino & (n - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(sfs->ino_table);
+    sfs->ino_table = table;
+    sfs->ino_buckets = n;
+}
+
+
+/* Returns the inode number of the entry, giving it a new one if needed */
+static uint64_t entry_ino(struct sfs *sfs, struct sfs_entry *entry)
+{
+    if (entry->ino != 0) {
+        return entry->ino;
+    }
+    if (sfs->ino_count >= sfs->ino_buckets) {
+        ino_table_grow(sfs);
+    }
+    entry->ino = sfs->next_ino++;
+    struct sfs_entry **bucket = &sfs->ino_table[entry->ino & (sfs->ino_buckets - 1)];
+    entry->ino_next = *bucket;
+    *bucket = entry;
+    sfs->ino_count++;
+    return entry->ino;
+}
+
+
+/* Removes the entry from the inode table, its inode number becomes invalid */
+static void ino_release(struct sfs *sfs, struct sfs_entry *entry)
+{
+    if (entry->ino == 0) {
+        return;
+    }
+    struct sfs_entry **p = &sfs->ino_table[entry->ino & (sfs->ino_buckets - 1)];
+    while (*p != NULL) {
+        if (*p == entry) {
+            *p = entry->ino_next;
+            sfs->ino_count--;
+            break;
+        }
+        p = &(*p)->ino_next;
+    }
+    entry->ino = 0;
+    entry->nlookup = 0;
+    entry->ino_next = NULL;
+}
+
+
+/* Called when the entry stops being a file or directory: its inode number
+ * and its open handles become invalid */
+static void drop_entry(struct sfs *sfs, struct sfs_entry *entry)
+{
+    ino_release(sfs, entry);
+    struct sfs_file *file = entry->handles;
+    while (file != NULL) {
+        struct sfs_file *next = file->next;
+        file->entry = NULL;
+        file->next = NULL;
+        file = next;
+    }
+    entry->handles = NULL;
+}
+
+
+/* The root directory has no entry: NULL is returned for SFS_ROOT_INO */
+static struct sfs_entry *get_entry_by_ino(SFS *sfs, uint64_t ino)
+{
+    struct sfs_entry *entry = sfs->ino_table[ino & (sfs->ino_buckets - 1)];
+    while (entry != NULL && entry->ino != ino) {
+        entry = entry->ino_next;
+    }
+    return entry;
+}
+
+
+/* Fills st for a directory or file entry, except the inode number.
+ * Directories have no blocks: their start and end blocks are 0. */
+static void fill_attr(struct sfs_entry *entry, struct sfs_stat *st)
+{
+    st->start_block = 0;
+    st->end_block = 0;
+    if (entry->type == SFS_ENTRY_DIR) {
+        st->type = SFS_TYPE_DIR;
+        st->size = 0;
+        fill_timespec(entry->data.dir_data->time_stamp, &st->time);
+    } else {
+        st->type = SFS_TYPE_FILE;
+        st->size = entry->data.file_data->file_len;
+        st->start_block = entry->data.file_data->start_block;
+        st->end_block = entry->data.file_data->end_block;
+        fill_timespec(entry->data.file_data->time_stamp, &st->time);
+    }
+}
+
+
+/* Fills st for a directory or file entry, or for the root if entry is NULL.
+ * No inode number is given out: st->ino is 0 if the entry has none. */
+static void fill_stat(SFS *sfs, struct sfs_entry *entry, struct sfs_stat *st)
+{
+    if (entry == NULL) {
+        st->ino = SFS_ROOT_INO;
+        st->type = SFS_TYPE_DIR;
+        st->size = 0;
+        st->start_block = 0;
+        st->end_block = 0;
+        fill_timespec(sfs->super->time_stamp, &st->time);
+        return;
+    }
+    st->ino = entry->ino;
+    fill_attr(entry, st);
+}
+
+
+/****f* sfs/sfs_get_path
  * NAME
- *   delfile_to_normal -- find item in free list by entry and make it normal
+ *   sfs_get_path -- get the path of a file or directory from its inode number
  * DESCRIPTION
- *   Find a delfile item in the free list and make it normal free space.  The
- *   item can be merged with previous or next item if they are before/after
- *   without a gap.
+ *   The path of the root directory is the empty string.  The returned string
+ *   belongs to the entry and is valid until the entry is renamed or deleted.
  * PARAMETERS
  *   SFS - the SFS structure variable
- *   entry - the delfile entry to convert to normal
+ *   ino - the inode number
  * RETURN VALUE
- *   No return value (void funcion)
+ *   Returns the path or NULL if the inode number is not valid.
  ******
- * Pseudocode
- *   find delfile
- *     curr: item contiaining delfile
- *     prev: previous item or null (if curr is first)
- *     next: next item or null (if curr is last)
- *   if prev <> null and prev:delfile = null
- *                   and prev:(start+length) = curr:start then
- *     prev:length += curr:length
- *     prev:next := curr:next
- *     tmp := curr
- *     curr := prev
- *     free(tmp)
- *   else
- *     curr:delfile = null
- *   end if
- *   if next <> null and next:delfile = null
- *                   and curr:(start+length) = next:start then
- *     curr:length += next:length
- *     curr:next := next:next
- *     free(next)
- *   end if
  */
-void delfile_to_normal(struct sfs *sfs, struct sfs_entry *delfile)
+const char *sfs_get_path(SFS *sfs, uint64_t ino)
 {
-    // find delfile
-    struct block_list *curr = sfs->free_list;
-    struct block_list *prev = NULL;
-    struct block_list *next;
-    while (curr != NULL && curr->delfile != delfile) {
-        prev = curr;
-        curr = curr->next;
+    if (ino == SFS_ROOT_INO) {
+        return "";
     }
-    if (curr == NULL) {
-        return;
+    struct sfs_entry *entry = get_entry_by_ino(sfs, ino);
+    if (entry == NULL) {
+        return NULL;
     }
-    next = curr->next;
+    return get_entry_name(entry);
+}
 
-    // check before
-    if (prev != NULL && prev->delfile == NULL
-            && prev->start_block + prev->length == curr->start_block) {
-        prev->length += curr->length;
-        prev->next = curr->next;
-        struct block_list *tmp = curr;
-        curr = prev;
-        free(tmp);
+
+/****f* sfs/sfs_lookup
+ * NAME
+ *   sfs_lookup -- find a file or directory in a directory by its name
+ * DESCRIPTION
+ *   Finds the entry *name* in the directory *parent* and returns its inode
+ *   number.  The inode number is given to the entry on its first lookup and
+ *   stays valid until the entry is deleted or all its lookups are forgotten
+ *   (see sfs_forget).  Each successful call counts as one lookup.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   parent - the inode number of the directory
+ *   name - the name of the file or directory in the directory
+ * RETURN VALUE
+ *   Returns the inode number or 0 if not found.
+ ******
+ */
+uint64_t sfs_lookup(SFS *sfs, uint64_t parent, const char *name)
+{
+    const char *parent_path = sfs_get_path(sfs, parent);
+    if (parent_path == NULL) {
+        return 0;
+    }
+    int parent_len = strlen(parent_path);
+    int name_len = strlen(name);
+    char path[parent_len + name_len + 2];
+    if (parent_len == 0) {
+        memcpy(path, name, name_len + 1);
     } else {
-        curr->delfile = NULL;
+        memcpy(path, parent_path, parent_len);
+        path[parent_len] = '/';
+        memcpy(&path[parent_len + 1], name, name_len + 1);
+    }
+    struct sfs_entry *entry = get_entry_by_name(sfs, path);
+    if (entry == NULL) {
+        return 0;
     }
+    entry->nlookup++;
+    return entry_ino(sfs, entry);
+}
 
-    // check after
+
+/****f* sfs/sfs_forget
+ * NAME
+ *   sfs_forget -- forget lookups of an inode number
+ * DESCRIPTION
+ *   Decreases the lookup count of the inode by *nlookup*.  When it reaches
+ *   zero the inode number is released and the entry gets a new one on its
+ *   next lookup.  Unknown inode numbers are ignored.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   ino - the inode number
+ *   nlookup - the number of lookups to forget
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_forget(SFS *sfs, uint64_t ino, uint64_t nlookup)
+{
+    struct sfs_entry *entry = get_entry_by_ino(sfs, ino);
+    if (entry == NULL) {
+        return;
+    }
+    if (entry->nlookup > nlookup) {
+        entry->nlookup -= nlookup;
+    } else {
+        ino_release(sfs, entry);
+    }
+}
+
+
+/****f* sfs/sfs_stat
+ * NAME
+ *   sfs_stat -- get the type, size, time and blocks of a file or directory
+ * DESCRIPTION
+ *   Fills *st* from a single search of the entry list, instead of calling
+ *   sfs_is_dir, sfs_is_file, sfs_get_file_size and the time functions one
+ *   after the other.  The empty path is the root directory.  Inode numbers
+ *   are only given out by sfs_lookup: st->ino is 0 for an entry which has
+ *   not been looked up.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - the absolute path of the file or directory
+ *   st - the structure to fill
+ * RETURN VALUE
+ *   Returns 0 on success and -1 if there is no such file or directory.
+ ******
+ */
+int sfs_stat(SFS *sfs, const char *path, struct sfs_stat *st)
+{
+    struct sfs_entry *entry = NULL;
+    if (path[0] != '\0') {
+        entry = get_entry_by_name(sfs, path);
+        if (entry == NULL) {
+            return -1;
+        }
+    }
+    fill_stat(sfs, entry, st);
+    return 0;
+}
+
+
+/****f* sfs/sfs_stat_ino
+ * NAME
+ *   sfs_stat_ino -- get the type, size, time and blocks of a file or directory
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   ino - the inode number
+ *   st - the structure to fill
+ * RETURN VALUE
+ *   Returns 0 on success and -1 if the inode number is not valid.
+ ******
+ */
+int sfs_stat_ino(SFS *sfs, uint64_t ino, struct sfs_stat *st)
+{
+    struct sfs_entry *entry = NULL;
+    if (ino != SFS_ROOT_INO) {
+        entry = get_entry_by_ino(sfs, ino);
+        if (entry == NULL) {
+            return -1;
+        }
+    }
+    fill_stat(sfs, entry, st);
+    return 0;
+}
+
+
+struct sfs_entry *find_entry_from(struct sfs_entry *entry, const char *path)
+{
+    int len = strlen(path);
+    while (entry != NULL) {
+        if (entry->type == SFS_ENTRY_DIR) {
+            char *name = entry->data.dir_data->name;
+            int name_len = strlen(name);
+            if ((len == 0 || (name_len > len + 1 && name[len] == '/'))
+                    && strncmp(path, name, len) == 0 && strchr(&name[len+1], '/') == NULL) {
+                return entry;
+            }
+        } else if (entry->type == SFS_ENTRY_FILE) {
+            char *name = entry->data.file_data->name;
+            int name_len = strlen(name);
+            if ((len == 0 || (name_len > len + 1 && name[len] == '/'))
+                    && strncmp(path, name, len) == 0 && strchr(&name[len+1], '/') == NULL) {
+                return entry;
+            }
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+
+static const char *get_basename(const char *full_name)
+{
+    const char *p = full_name;
+    int i = 0;
+    int last_slash = -1;
+    while (p[i] != 0) {
+        if (p[i] == '/') {
+            last_slash = i;
+        }
+        i = i + 1;
+    }
+    return &p[last_slash + 1];
+}
+
+
+static const char *get_entry_basename(struct sfs_entry *entry)
+{
+    switch (entry->type) {
+    case SFS_ENTRY_DIR:
+    case SFS_ENTRY_DIR_DEL:
+        return get_basename((char*)entry->data.dir_data->name);
+    case SFS_ENTRY_FILE:
+    case SFS_ENTRY_FILE_DEL:
+        return get_basename((char*)entry->data.file_data->name);
+    default:
+        return NULL;
+    }
+}
+
+
+/* Finds the next entry of the directory path starting from the entry from,
+ * fills st if not NULL and returns the name */
+static const char *iter_from(SFS *sfs, struct sfs_entry *from, const char *path, struct sfs_stat *st)
+{
+    struct sfs_entry *entry = find_entry_from(from, path);
+    if (entry != NULL) {
+        sfs->iter_curr = entry->next;
+        if (st != NULL) {
+            fill_stat(sfs, entry, st);
+        }
+        return get_entry_basename(entry);
+    }
+    sfs->iter_curr = NULL;
+    return NULL;
+}
+
+
+const char *sfs_first(SFS *sfs, const char *path)
+{
+    return iter_from(sfs, sfs->entry_list, path, NULL);
+}
+
+
+const char *sfs_next(SFS *sfs, const char *path)
+{
+    return iter_from(sfs, sfs->iter_curr, path, NULL);
+}
+
+
+/****f* sfs/sfs_first_stat
+ * NAME
+ *   sfs_first_stat -- start listing a directory with the attributes
+ * DESCRIPTION
+ *   Works like sfs_first, but also fills *st* with the attributes of the
+ *   entry found, so that listing a directory with its attributes needs only
+ *   one walk of the entry list.  The listing is continued with
+ *   sfs_next_stat.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - the absolute path of the directory
+ *   st - the structure to fill
+ * RETURN VALUE
+ *   Returns the name of the first entry or NULL if there is none.
+ ******
+ */
+const char *sfs_first_stat(SFS *sfs, const char *path, struct sfs_stat *st)
+{
+    return iter_from(sfs, sfs->entry_list, path, st);
+}
+
+
+const char *sfs_next_stat(SFS *sfs, const char *path, struct sfs_stat *st)
+{
+    return iter_from(sfs, sfs->iter_curr, path, st);
+}
+
+
+/****f* sfs/sfs_first_ino
+ * NAME
+ *   sfs_first_ino -- start listing a directory given by its inode number
+ * DESCRIPTION
+ *   Works like sfs_first, but also fills *st* with the attributes of the
+ *   entry found.  The listing is continued with sfs_next_ino.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   dir - the inode number of the directory
+ *   st - the structure to fill
+ * RETURN VALUE
+ *   Returns the name of the first entry or NULL if there is none.
+ ******
+ */
+const char *sfs_first_ino(SFS *sfs, uint64_t dir, struct sfs_stat *st)
+{
+    const char *path = sfs_get_path(sfs, dir);
+    if (path == NULL) {
+        sfs->iter_curr = NULL;
+        return NULL;
+    }
+    return iter_from(sfs, sfs->entry_list, path, st);
+}
+
+
+const char *sfs_next_ino(SFS *sfs, uint64_t dir, struct sfs_stat *st)
+{
+    const char *path = sfs_get_path(sfs, dir);
+    if (path == NULL) {
+        sfs->iter_curr = NULL;
+        return NULL;
+    }
+    return iter_from(sfs, sfs->iter_curr, path, st);
+}
+
+
+/* Finds the next directory or file starting from the entry from, fills st
+ * and returns the path */
+static const char *iter_all_from(SFS *sfs, struct sfs_entry *from, struct sfs_stat *st)
+{
+    struct sfs_entry *entry = from;
+    while (entry != NULL && entry->type != SFS_ENTRY_DIR && entry->type != SFS_ENTRY_FILE) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        sfs->iter_curr = NULL;
+        return NULL;
+    }
+    sfs->iter_curr = entry->next;
+    fill_attr(entry, st);
+    st->ino = entry->ino;
+    return get_entry_name(entry);
+}
+
+
+/****f* sfs/sfs_first_entry
+ * NAME
+ *   sfs_first_entry -- start listing all the directories and files
+ * DESCRIPTION
+ *   Lists every directory and file of the filesystem in the order of the
+ *   Index Area, with one walk of the entry list for the whole listing.  *st*
+ *   is filled like by sfs_stat.  The listing is continued with
+ *   sfs_next_entry.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   st - the structure to fill
+ * RETURN VALUE
+ *   Returns the path of the first entry or NULL if there is none.
+ ******
+ */
+const char *sfs_first_entry(SFS *sfs, struct sfs_stat *st)
+{
+    return iter_all_from(sfs, sfs->entry_list, st);
+}
+
+
+const char *sfs_next_entry(SFS *sfs, struct sfs_stat *st)
+{
+    return iter_all_from(sfs, sfs->iter_curr, st);
+}
+
+
+int sfs_get_block_size(SFS *sfs)
+{
+    return sfs->block_size;
+}
+
+
+/* Files are contiguous, so sequential reads of a file read the image
+ * sequentially: when a read continues the previous one, the kernel is asked
+ * to read the next window of the file in the background.  The window
+ * doubles at each readahead, up to readahead_max, and is started again from
+ * SFS_READAHEAD_MIN after a read elsewhere in the file. */
+static void file_readahead(SFS *sfs, struct file_data *file_data, uint64_t offset, uint64_t size)
+{
+    const uint64_t end = offset + size;
+    if (sfs->readahead_max == 0) {
+        return;
+    }
+    if (offset != file_data->ra_next) {
+        file_data->ra_next = end;
+        file_data->ra_end = end;
+        file_data->ra_window = 0;
+        return;
+    }
+    file_data->ra_next = end;
+    if (file_data->ra_window == 0) {
+        file_data->ra_window = SFS_READAHEAD_MIN < sfs->readahead_max
+            ? SFS_READAHEAD_MIN : sfs->readahead_max;
+    }
+    /* wait until the reader is in the last half window of the readahead */
+    if (end + file_data->ra_window / 2 < file_data->ra_end) {
+        return;
+    }
+    uint64_t start = file_data->ra_end > end ? file_data->ra_end : end;
+    if (start >= file_data->file_len) {
+        return;
+    }
+    uint64_t len = file_data->file_len - start;
+    if (len > file_data->ra_window) {
+        len = file_data->ra_window;
+    }
+    posix_fadvise(fileno(sfs->file), sfs->block_size * file_data->start_block + start,
+        len, POSIX_FADV_WILLNEED);
+    file_data->ra_end = start + len;
+    if (file_data->ra_window * 2 <= sfs->readahead_max) {
+        file_data->ra_window *= 2;
+    } else {
+        file_data->ra_window = sfs->readahead_max;
+    }
+}
+
+
+static int file_read(SFS *sfs, struct sfs_entry *entry, char *buf, size_t size, off_t offset)
+{
+    uint64_t sz;		// number of bytes to be read
+    uint64_t len = entry->data.file_data->file_len;
+    if ((uint64_t)offset > len) {
+        return 0;
+    }
+    if (offset + size > len) {
+        sz = len - offset;
+    } else {
+        sz = size;
+    }
+    /* the lazy tail is not read from the image */
+    uint64_t from = len - entry->data.file_data->zero_tail;
+    uint64_t disk = offset + sz <= from ? sz : (uint64_t)offset < from ? from - offset : 0;
+    uint64_t data_offset = sfs->block_size * entry->data.file_data->start_block;
+    uint64_t read_from = data_offset + offset;
+    if (disk > 0 && image_read(sfs, buf, disk, read_from) != 0) {
+        return -1;
+    }
+    memset(buf + disk, 0, sz - disk);
+    sfs->stats.bytes_read += sz;
+    file_readahead(sfs, entry->data.file_data, offset, sz);
+    return sz;
+}
+
+
+int sfs_read(SFS *sfs, const char *path, char *buf, size_t size, off_t offset)
+{
+//    printf("@@@@\tsfs_read: path=\"%s\", size:0x%lx, offset:0x%lx\n", path, size, offset);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry != NULL) {
+        return file_read(sfs, entry, buf, size, offset);
+    } else {
+        return -1;
+    }
+}
+
+
+/* Returns the file entry with the inode number ino or NULL */
+static struct sfs_entry *get_file_by_ino(SFS *sfs, uint64_t ino)
+{
+    struct sfs_entry *entry = get_entry_by_ino(sfs, ino);
+    if (entry == NULL || entry->type != SFS_ENTRY_FILE) {
+        return NULL;
+    }
+    return entry;
+}
+
+
+int sfs_read_ino(SFS *sfs, uint64_t ino, char *buf, size_t size, off_t offset)
+{
+    struct sfs_entry *entry = get_file_by_ino(sfs, ino);
+    if (entry == NULL) {
+        return -1;
+    }
+    return file_read(sfs, entry, buf, size, offset);
+}
+
+
+static int get_entry_usable_space(struct sfs_entry *entry)
+{
+    switch (entry->type) {
+    case SFS_ENTRY_DIR_DEL:
+        return 1 + entry->data.dir_data->num_cont;
+    case SFS_ENTRY_FILE_DEL:
+        return 1 + entry->data.file_data->num_cont;
+    case SFS_ENTRY_UNUSED:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+static void write_volume_data(char *buf, struct volume_data *vol_data)
+{
+    memcpy(&buf[4], &vol_data->time_stamp, 8);
+    strncpy(&buf[12], vol_data->name, SFS_VOL_NAME_LEN);
+}
+
+
+static void write_dir_data(char *buf, struct dir_data *dir_data)
+{
+    memcpy(&buf[2], &dir_data->num_cont, 1);
+    memcpy(&buf[3], &dir_data->time_stamp, 8);
+    uint64_t max_len = SFS_DIR_NAME_LEN + SFS_ENTRY_SIZE * dir_data->num_cont;
+    strncpy(&buf[11], dir_data->name, max_len);
+}
+
+
+static void write_file_data(char *buf, struct file_data *file_data)
+{
+    memcpy(&buf[2], &file_data->num_cont, 1);
+    memcpy(&buf[3], &file_data->time_stamp, 8);
+    memcpy(&buf[11], &file_data->start_block, 8);
+    memcpy(&buf[19], &file_data->end_block, 8);
+    memcpy(&buf[27], &file_data->file_len, 8);
+    uint64_t max_len = SFS_FILE_NAME_LEN + SFS_ENTRY_SIZE * file_data->num_cont;
+    strncpy(&buf[35], file_data->name, max_len);
+}
+
+
+static void write_unusable_data(char *buf, struct unusable_data *unusable_data)
+{
+    memcpy(&buf[10], &unusable_data->start_block, 8);
+    memcpy(&buf[18], &unusable_data->end_block, 8);
+}
+
+
+/* Puts the entry with its continuations into buf, which must have space for
+ * them.  Returns the size of the entry in bytes or -1 on error. */
+static int encode_entry(char *buf, struct sfs_entry *entry)
+{
+    int num_cont = get_num_cont(entry);
+    int size = (1 + num_cont) * SFS_ENTRY_SIZE;
+    memset(buf, 0, size);
+    buf[0] = entry->type;
+    buf[1] = 0;
+    switch (entry->type) {
+    case SFS_ENTRY_VOL_ID:
+        write_volume_data(buf, entry->data.volume_data);
+        break;
+    case SFS_ENTRY_DIR:
+    case SFS_ENTRY_DIR_DEL:
+        write_dir_data(buf, entry->data.dir_data);
+        break;
+    case SFS_ENTRY_FILE:
+    case SFS_ENTRY_FILE_DEL:
+        write_file_data(buf, entry->data.file_data);
+        break;
+    case SFS_ENTRY_UNUSABLE:
+        write_unusable_data(buf, entry->data.unusable_data);
+        break;
+    case SFS_ENTRY_START:
+    case SFS_ENTRY_UNUSED:
+        break;
+    default:
+        fprintf(stderr, "write_entry error: unknown entry type: 0x%02x\n", entry->type);
+        return -1;
+    }
+    int sum = 0;
+    for (int i = 0; i < size; ++i) {
+        sum += buf[i];
+    }
+    buf[1] = 0x100 - sum % 0x100;
+    return size;
+}
+
+
+/* Writes the entry (with its continuations) to the Index Area.
+ * Returns 0 on success and -1 on error.
+ */
+static int write_entry(SFS *sfs, struct sfs_entry *entry)
+{
+    TRACE_DEBUG("=== WRITING ENTRY ===");
+    char buf[(1 + get_num_cont(entry)) * SFS_ENTRY_SIZE];
+    int size = encode_entry(buf, entry);
+    if (size == -1) {
+        TRACE_DEBUG("=== WRITING ENTRY: ERROR ===");
+        return -1;
+    }
+
+    TRACE_DEBUG("writing %d bytes at 0x%06lx", size, entry->offset);
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_INDEX);
+    int written = image_write(sfs, buf, size, entry->offset);
+    phase_leave(sfs, &phase);
+    if (written != 0) {
+        fprintf(stderr, "write_entry error: couldn't write the entry at %06lx\n", entry->offset);
+        TRACE_DEBUG("=== WRITING ENTRY: ERROR ===");
+        return -1;
+    }
+    sfs->stats.entries_written += size / SFS_ENTRY_SIZE;
+    TRACE_DEBUG("=== WRITING ENTRY: OK ===");
+    return 0;
+}
+
+
+/****f* sfs/delfile_to_normal
+ * NAME
+ *   delfile_to_normal -- find item in free list by entry and make it normal
+ * DESCRIPTION
+ *   Find a delfile item in the free list and make it normal free space.  The
+ *   item can be merged with previous or next item if they are before/after
+ *   without a gap.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   entry - the delfile entry to convert to normal
+ * RETURN VALUE
+ *   No return value (void funcion)
+ ******
+ * Pseudocode
+ *   find delfile
+ *     curr: item contiaining delfile
+ *     prev: previous item or null (if curr is first)
+ *     next: next item or null (if curr is last)
+ *   if prev <> null and prev:delfile = null
+ *                   and prev:(start+length) = curr:start then
+ *     prev:length += curr:length
+ *     prev:next := curr:next
+ *     tmp := curr
+ *     curr := prev
+ *     free(tmp)
+ *   else
+ *     curr:delfile = null
+ *   end if
+ *   if next <> null and next:delfile = null
+ *                   and curr:(start+length) = next:start then
+ *     curr:length += next:length
+ *     curr:next := next:next
+ *     free(next)
+ *   end if
+ */
+void delfile_to_normal(struct sfs *sfs, struct sfs_entry *delfile)
+{
+    // find delfile
+    struct block_list *curr = sfs->free_list;
+    struct block_list *prev = NULL;
+    struct block_list *next;
+    while (curr != NULL && curr->delfile != delfile) {
+        prev = curr;
+        curr = curr->next;
+    }
+    if (curr == NULL) {
+        return;
+    }
+    next = curr->next;
+    discard_blocks(sfs, curr->start_block, curr->length);
+
+    // check before
+    if (prev != NULL && prev->delfile == NULL
+            && prev->start_block + prev->length == curr->start_block) {
+        prev->length += curr->length;
+        prev->next = curr->next;
+        struct block_list *tmp = curr;
+        curr = prev;
+        free(tmp);
+    } else {
+        curr->delfile = NULL;
+    }
+
+    // check after
     if (next != NULL && next->delfile != NULL
             && curr->start_block + curr->length == next->start_block) {
         curr->length += next->length;
@@ -1239,1048 +2587,2777 @@ void delfile_to_normal(struct sfs *sfs, struct sfs_entry *delfile)
 }
 
 
-static void delete_entries(sfs, from, to)
-    struct sfs *sfs;
-    struct sfs_entry *from;
-    struct sfs_entry *to;
+static void delete_entries(sfs, from, to)
+    struct sfs *sfs;
+    struct sfs_entry *from;
+    struct sfs_entry *to;
+{
+    struct sfs_entry *entry = from;
+    while (entry != to) {
+        if (entry->type == SFS_ENTRY_FILE_DEL) {
+            delfile_to_normal(sfs, entry);
+        }
+        struct sfs_entry *tmp = entry;
+        entry = entry->next;
+        free_entry(tmp);
+    }
+}
+
+
+/* Insert n unused entries before tail and returns the head */
+struct sfs_entry *insert_unused(sfs, offset, n, tail)
+    struct sfs *sfs;
+    uint64_t offset;
+    int n;
+    struct sfs_entry *tail;
+{
+    struct sfs_entry *entry;
+    struct sfs_entry *next = tail;
+    for (int i = 0; i < n; ++i) {
+        entry = calloc(1, sizeof(struct sfs_entry));
+        entry->offset = offset + SFS_ENTRY_SIZE * (n - i - 1);
+        entry->type = SFS_ENTRY_UNUSED;
+        entry->next = next;
+        if (write_entry(sfs, entry) != 0) {
+            return NULL;
+        }
+        next = entry;
+    }
+    return next;
+}
+
+
+/* Finds space for the entry and inserts it.
+ * Writes changes to the Index Area.
+ * Return 0 on success, -1 on error
+ *
+ * k: amount of space needed
+ * l: amount of consecutive space found so that (l >= k)
+ * The entries taking l space are deleted.
+ * The new entry is inserted.
+ * The remaining (l - k) is filled with unused entries.
+ * If the space could not be found, -1 is returned, otherwise 0 is returned.
+ */
+static int insert_entry(struct sfs *sfs, struct sfs_entry *new_entry)
+{
+    TRACE_DEBUG("=== INSERT ENTRY ===");
+    int space_needed = 1 + get_num_cont(new_entry); // in number of simple entries
+    TRACE_DEBUG("\tneeded: %d", space_needed);
+    int space_found = 0;
+    struct sfs_entry **p_entry = &sfs->entry_list;
+    struct sfs_entry **pfirst_usable = NULL;
+    while (*p_entry != NULL) {
+//        printf("\ttype=0x%02x\n", curr_entry->type);
+        int usable_space = get_entry_usable_space(*p_entry);
+//        printf("\tusable: %d\n", usable_space);
+        if (usable_space > 0) {
+            if (pfirst_usable == NULL) {
+                pfirst_usable = p_entry;
+                TRACE_DEBUG("\tfound: %d", space_found);
+            }
+            space_found += usable_space;
+            if (space_found >= space_needed) {
+                long start = (*pfirst_usable)->offset;
+                long end = start + SFS_ENTRY_SIZE * space_needed;
+                struct sfs_entry *next = (*p_entry)->next;
+                delete_entries(sfs, *pfirst_usable, next);
+                new_entry->offset = start;
+                int l = space_found - space_needed;
+                new_entry->next = insert_unused(sfs, end, l, next);
+                *pfirst_usable = new_entry;
+                TRACE_DEBUG("=== INSERT ENTRY: OK ===");
+                if (write_entry(sfs, new_entry) != 0) {
+                    return -1;
+                } else {
+                    return 0;
+                }
+            }
+        } else if (pfirst_usable != NULL) {
+            pfirst_usable = NULL;
+            space_found = 0;
+        }
+        p_entry = &(*p_entry)->next;
+    }
+    TRACE_DEBUG("insert_entry: couldn't find (%d * 64) bytes", space_needed);
+    TRACE_DEBUG("=== INSERT ENTRY: ERROR ===");
+    return -1;
+}
+
+
+/* Prepends the entry to the list of entries.
+ * The entry is inserted after the start marker.
+ * In the Index Area, the start marker is moved in the direction of the superblock.
+ * The entry is written to the Index Area after the start marker.
+ * On success 0 is returned, -1 on error.
+ */
+static int prepend_entry(struct sfs *sfs, struct sfs_entry *entry)
+{
+    TRACE_DEBUG("=== PREPEND ENTRY ===");
+    struct sfs_entry *start = sfs->entry_list;
+    uint64_t entry_size = SFS_ENTRY_SIZE * (1 + get_num_cont(entry));
+    uint64_t start_size = SFS_ENTRY_SIZE * (1 + get_num_cont(start));
+
+    /* check available space in the free area and update free list */
+    if (sfs->free_last == NULL) {
+        fprintf(stderr, "free_last is NULL\n");
+        return -1;
+    }
+
+    TRACE_DEBUG("\tfree_last length: 0x%06lx (bytes)", sfs->free_last->length * sfs->block_size);
+    TRACE_DEBUG("\tentry size: 0x%06lx", entry_size);
+    if (sfs->free_last != NULL  && sfs->free_last->length * sfs->block_size >= entry_size) {
+        uint64_t new_isz = sfs->super->index_size + entry_size;
+        uint64_t iblocks = (sfs->super->index_size + sfs->block_size - 1) / sfs->block_size;
+        uint64_t ibt = iblocks * sfs->block_size;                // index with rest in bytes
+        uint64_t fbt = sfs->free_last->length * sfs->block_size; // free blocks in bytes
+        uint64_t index_start = sfs->super->total_blocks * sfs->block_size - sfs->super->index_size;
+        TRACE_DEBUG("\tblock size: 0x%06x", sfs->block_size);
+        TRACE_DEBUG("\toriginal index size: 0x%06lx", sfs->super->index_size);
+        TRACE_DEBUG("\toriginal index start: 0x%06lx", index_start);
+        TRACE_DEBUG("\toriginal free blocks: 0x%06lx", sfs->free_last->length);
+        TRACE_DEBUG("\toriginal index blocks (bytes): 0x%06lx", ibt);
+        TRACE_DEBUG("\toriginal free blocks (bytes): 0x%06lx", fbt);
+        TRACE_DEBUG("\tnew entry size: 0x%06lx", entry_size);
+        TRACE_DEBUG("\tnew index size: 0x%06lx", new_isz);
+        TRACE_DEBUG("\tnew index start: 0x%06lx", index_start - entry_size);
+        if (new_isz > ibt) {
+            // update free list
+            if (new_isz - ibt > fbt) {
+                fprintf(stderr, "Error: could not prepend entry: no more free space\n");
+                sfs->stats.alloc_failures++;
+                return -1;
+            }
+            sfs->free_last->length -= (new_isz - ibt + sfs->block_size - 1) / sfs->block_size;
+            /* the end of free_last becomes part of the Index Area */
+            discard_claim(sfs, sfs->free_last->start_block + sfs->free_last->length,
+                          (new_isz - ibt + sfs->block_size - 1) / sfs->block_size);
+            TRACE_DEBUG("\tupdate free_last: 0x%06lx", sfs->free_last->length);
+            TRACE_DEBUG("\tnew free blocks (bytes): 0x%06lx", sfs->free_last->length * sfs->block_size);
+        }
+        sfs->super->index_size = new_isz;
+        TRACE_DEBUG("\tupdate index size: 0x%06lx", new_isz);
+        struct phase phase;
+        phase_enter(sfs, &phase, SFS_PHASE_INDEX);
+        int result = write_super(sfs);
+        phase_leave(sfs, &phase);
+        if (result != 0) {
+            return -1;
+        }
+        sfs->stats.super_writes++;
+    } else {
+        fprintf(stderr, "prepend_entry: free list error\n");
+        return -1;
+    }
+
+    start->type = SFS_ENTRY_START;
+    start->offset -= entry_size;
+    entry->offset = start->offset + start_size;
+    if (write_entry(sfs, entry) == -1) {
+        fprintf(stderr, "prepend_entry: write new entry error\n");
+        return -1;
+    }
+    if (write_entry(sfs, start) == -1) {
+        fprintf(stderr, "prepend_entry: write start marker entry error\n");
+        return -1;
+    }
+    // update pointers only if write successful
+    entry->next = start->next;
+    start->next = entry;
+    TRACE_DEBUG("=== PREPEND: OK! ===");
+    return 0;
+}
+
+
+/* Puts a new entry into the entry list, updating the index area:
+ * -> finds a place in the list with needed number of continuations
+ * -> writes changes to the index area
+ * -> updates free list if deleted files overwritten
+ * -> on success returns 0
+ *    otherwise returns -1
+ */
+static int put_new_entry(struct sfs *sfs, struct sfs_entry *new_entry)
+{
+    if (insert_entry(sfs, new_entry) != 0) {
+        return prepend_entry(sfs, new_entry);
+    }
+    return 0;
+}
+
+
+// check if path valid and does not exist
+static int check_valid_new(struct sfs *sfs, const char *path)
+{
+    // if path exists, not valid as a new name
+    struct sfs_entry *entry = get_dir_by_name(sfs, path);
+    if (entry != NULL) {
+        TRACE_DEBUG("check valid as new \"%s\": no (already exists)", path);
+        return 0;
+    }
+
+    int path_len = strlen(path);
+    const char *basename = get_basename(path);
+    int basename_len = strlen(basename);
+    if (basename_len == 0) {
+        TRACE_DEBUG("check valid as new \"%s\": empty basename", path);
+        return 0;
+    }
+
+    /* check if prent dir exists */
+    if (path_len > basename_len) {
+        char parent[path_len];
+        memcpy(parent, path, path_len);
+        parent[path_len - basename_len - 1] = '\0';
+        struct sfs_entry *parent_entry = get_dir_by_name(sfs, parent);
+        if (parent_entry == NULL) {
+            TRACE_DEBUG("check valid as new \"%s\": no (parent \"%s\" does not exist)",
+                path, parent);
+            return 0;
+        }
+    }
+    TRACE_DEBUG("check valid as new \"%s\": yes (basename=\"%s\")", path, basename);
+
+    return 1;
+}
+
+
+static int num_cont_from_name(int entry_type, int name_len)
+{
+    int first_len;
+    switch (entry_type) {
+    case SFS_ENTRY_DIR:
+        first_len = SFS_DIR_NAME_LEN;
+        break;
+    case SFS_ENTRY_FILE:
+        first_len = SFS_FILE_NAME_LEN;
+        break;
+    default:
+        break;
+    }
+    int num_cont;
+    if (name_len < first_len) {
+        num_cont = 0;
+    } else {
+        int cont_str_len = name_len - first_len + 1;
+        num_cont = (cont_str_len + SFS_ENTRY_SIZE - 1) / SFS_ENTRY_SIZE;
+    }
+    return num_cont;
+}
+
+
+int sfs_mkdir(struct sfs *sfs, const char *path)
+{
+    int path_len = strlen(path);
+    TRACE_INFO("@@@\tsfs_mkdir: create new directory \"%s\"", path);
+    if (!check_valid_new(sfs, path)) {
+        return -1;
+    }
+
+    struct sfs_entry *dir_entry = calloc(1, sizeof(struct sfs_entry));
+    dir_entry->type = SFS_ENTRY_DIR;
+    int num_cont = num_cont_from_name(SFS_ENTRY_DIR, path_len);
+    dir_entry->data.dir_data = malloc(sizeof(struct dir_data));
+    dir_entry->data.dir_data->num_cont = num_cont;
+    dir_entry->data.dir_data->time_stamp = make_time_stamp();
+    dir_entry->data.dir_data->name = strdup(path);
+
+    if (put_new_entry(sfs, dir_entry) == -1) {
+        TRACE_DEBUG("\tsfs_mkdir put new entry error");
+        free_entry(dir_entry);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int sfs_create(struct sfs *sfs, const char *path)
+{
+    int path_len = strlen(path);
+    TRACE_INFO("@@@\tsfs_create: create new empty file \"%s\"", path);
+    if (!check_valid_new(sfs, path)) {
+        return -1;
+    }
+
+    struct sfs_entry *file_entry = calloc(1, sizeof(struct sfs_entry));
+    file_entry->type = SFS_ENTRY_FILE;
+    int num_cont = num_cont_from_name(SFS_ENTRY_FILE, path_len);
+    TRACE_DEBUG("\tpath_len=%d=>num_cont=%d", path_len, num_cont);
+    file_entry->data.file_data = calloc(1, sizeof(struct file_data));
+    file_entry->data.file_data->num_cont = num_cont;
+    file_entry->data.file_data->time_stamp = make_time_stamp();
+    file_entry->data.file_data->start_block = sfs->super->rsvd_blocks;
+    file_entry->data.file_data->end_block = sfs->super->rsvd_blocks - 1;
+    file_entry->data.file_data->file_len = 0;
+    file_entry->data.file_data->name = strdup(path);
+
+    if (put_new_entry(sfs, file_entry) == -1) {
+        TRACE_DEBUG("\tsfs_file put new entry error");
+        free_entry(file_entry);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int is_dir_empty(struct sfs *sfs, const char *path) {
+    struct sfs_entry *entry = sfs->entry_list;
+    int path_len = strlen(path);
+    while (entry != NULL) {
+        if ((entry->type == SFS_ENTRY_DIR
+                && strncmp(path, entry->data.dir_data->name, path_len) == 0
+                && entry->data.dir_data->name[path_len] == '/')
+        || (entry->type == SFS_ENTRY_FILE
+                && strncmp(path, entry->data.file_data->name, path_len) == 0
+                && entry->data.file_data->name[path_len] == '/')) {
+            return 0;
+        }
+        entry = entry->next;
+    }
+    return 1;
+}
+
+
+/****f* sfs/sfs_rmdir
+ * NAME
+ *   sfs_rmdir -- delete an empty directory
+ * DESCRIPTION
+ *   Delete an empty directory located at the specified path.  If it is not
+ *   a directory or if it's not empty, nothing happens and -1 is returned.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - absolute path of the directory to delete
+ * RETURN VALUE
+ *   On success returns 0.  On error returns -1.
+ ******
+ */
+int sfs_rmdir(struct sfs *sfs, const char *path)
+{
+    TRACE_INFO("@@@@\tsfs_rmdir: name=\"%s\"", path);
+    struct sfs_entry *entry = get_dir_by_name(sfs, path);
+    if (entry == NULL) {
+        fprintf(stderr, "no directory \"%s\" exists\n", path);
+        return -1;
+    }
+    if (!is_dir_empty(sfs, path)) {
+        fprintf(stderr, "directory \"%s\" is not empty\n", path);
+        return -1;
+    }
+    /* Deleted children: do not remove, unreachable
+     * If the parent is deleted, the children cannot be restored
+     * => on restore: check that the parent exists
+     */
+    entry->type = SFS_ENTRY_DIR_DEL;
+    drop_entry(sfs, entry);
+    if (write_entry(sfs, entry) == 0) {
+        TRACE_DEBUG("\trmdir(%s): ok", path);
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+
+/* Insert a deleted file into the free list */
+static void free_list_insert(struct sfs *sfs, struct sfs_entry *delfile)
+{
+    struct block_list **p = &sfs->free_list;
+    while ((*p) != NULL) {
+        if ((*p)->start_block > delfile->data.file_data->start_block) {
+            // insert before *p
+            struct block_list *item = malloc(sizeof(struct block_list));
+            item->start_block = delfile->data.file_data->start_block;
+            item->length = (delfile->data.file_data->file_len + sfs->block_size - 1) / sfs->block_size;
+            item->delfile = delfile;
+            item->next = (*p);
+            *p = item;
+            break;
+        }
+        p = &(*p)->next;
+    }
+}
+
+
+/* Replaces the entry by unused entries in the entry list and in the Index
+ * Area.  The entry itself is not freed and keeps its inode number.
+ */
+static void unlink_entry(struct sfs *sfs, struct sfs_entry *entry)
+{
+    struct sfs_entry **p_entry = &sfs->entry_list;
+    int entry_length = 1 + get_num_cont(entry);
+    struct sfs_entry *tail = entry->next;
+    while (*p_entry != NULL) {
+        if (*p_entry == entry) {
+            *p_entry = insert_unused(sfs, entry->offset, entry_length, tail);
+            entry->next = NULL;
+            break;
+        }
+        p_entry = &(*p_entry)->next;
+    }
+}
+
+
+/****f* sfs/delete_entry
+ * NAME
+ *   delete_entry -- delete entry from the entry list and free it
+ * DESCRIPTION
+ *   The function delete_entry deletes the entry given as parameter and frees
+ *   the entry.  It is assmued that the entry is in the entry list and can be
+ *   freed (for example if it's a file entry, its name field contains a valid
+ *   null-terminated string.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   entry - the entry to be deleted
+ * RETURN VALUE
+ *   This is a void function and does not return anything.
+ ******
+ * Pseudocode:
+ *   entry_length - the number of SFS_ENTRY_SIZE-byte segments to be deleted
+ *
+ *   for each entry do:
+ *     if entry found (pointers are equal) then
+ *       insert unused before entry->next entry_length times
+ *       point the pointer to the entry to its next
+ *       free entry
+ *     end if
+ * end pseudocode
+ */
+static void delete_entry(struct sfs *sfs, struct sfs_entry *entry)
+{
+    unlink_entry(sfs, entry);
+    drop_entry(sfs, entry);
+    free_entry(entry);
+}
+
+
+/****f* sfs/sfs_delete
+ * NAME
+ *   sfs_delete -- delete a file form the file system
+ * DESCRIPTION
+ *   Delete a file from the file system.  Can be used only for files, for
+ *   directories sfs_rmdir can be used.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - the absolute path of the file that should be deleted
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ */
+// deleted empty files: do not allow in the free list (are never deleted)
+int sfs_delete(struct sfs *sfs, const char *path)
+{
+    TRACE_INFO("@@@@\tsfs_delete: name=\"%s\"", path);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry == NULL) {
+        fprintf(stderr, "file \"%s\" does not exists\n", path);
+        return -1;
+    }
+
+    // do not insert empty files into the free list
+    if (entry->data.file_data->file_len == 0) {
+        delete_entry(sfs, entry);
+        return 0;
+    }
+
+    entry->type = SFS_ENTRY_FILE_DEL;
+    drop_entry(sfs, entry);
+    free_list_insert(sfs, entry);
+    if (write_entry(sfs, entry) == 0) {
+        TRACE_DEBUG("\tdelete(%s): ok", path);
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+
+int sfs_get_sfs_time(SFS *sfs, struct timespec *timespec)
+{
+    fill_timespec(sfs->super->time_stamp, timespec);
+    return 0;
+}
+
+
+int sfs_get_dir_time(SFS *sfs, const char *path, struct timespec *timespec)
+{
+    TRACE_DEBUG("@@@@\tsfs_get_dir_time: name=\"%s\"", path);
+    struct sfs_entry *entry = get_dir_by_name(sfs, path);
+    if (entry == NULL) {
+        fprintf(stderr, "directory \"%s\" does not exists\n", path);
+        return -1;
+    }
+    fill_timespec(entry->data.dir_data->time_stamp, timespec);
+    return 0;
+}
+
+
+int sfs_get_file_time(SFS *sfs, const char *path, struct timespec *timespec)
+{
+    TRACE_DEBUG("@@@@\tsfs_get_file_time: name=\"%s\"", path);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry == NULL) {
+        fprintf(stderr, "file \"%s\" does not exists\n", path);
+        return -1;
+    }
+    fill_timespec(entry->data.file_data->time_stamp, timespec);
+    return 0;
+}
+
+
+static int entry_set_time(SFS *sfs, struct sfs_entry *entry, struct timespec *timespec)
+{
+    uint64_t time_stamp = timespec_to_time_stamp(timespec);
+    switch (entry->type) {
+    case SFS_ENTRY_DIR:
+        entry->data.dir_data->time_stamp = time_stamp;
+        break;
+    case SFS_ENTRY_FILE:
+        entry->data.file_data->time_stamp = time_stamp;
+        break;
+    }
+    return write_entry(sfs, entry);
+}
+
+
+int sfs_set_time(SFS *sfs, const char *path, struct timespec *timespec)
+{
+    TRACE_INFO("@@@@\tsfs_set_time: name=\"%s\"", path);
+    struct sfs_entry *entry = get_entry_by_name(sfs, path);
+    if (entry == NULL) {
+        fprintf(stderr, "File or directory\"%s\" does not exists\n", path);
+        return -1;
+    }
+    return entry_set_time(sfs, entry, timespec);
+}
+
+
+int sfs_set_time_ino(SFS *sfs, uint64_t ino, struct timespec *timespec)
+{
+    struct sfs_entry *entry = get_entry_by_ino(sfs, ino);
+    if (entry == NULL) {
+        return -1;
+    }
+    return entry_set_time(sfs, entry, timespec);
+}
+
+
+/****f* sfs/rename_entry
+ * NAME
+ *   rename_entry -- rename the entry by moving it to a new place
+ * DESCRIPTION
+ *   Gives the entry a new name.  The entry is removed from its place in the
+ *   entry list and inserted again where there is enough space for the new
+ *   name.  The entry structure stays the same, so that its inode number does
+ *   not change.  The changes made to the entry list are also written to the
+ *   Index Area.
+ * RETURN VALUE
+ *   On success returns 0, on error returns -1 (the entry is then deleted).
+ ******
+ */
+static int rename_entry(SFS *sfs, struct sfs_entry *entry, const char *name)
+{
+    int path_len = strlen(name);
+    int num_cont = num_cont_from_name(entry->type, path_len);
+    TRACE_DEBUG("\tpath_len=%d=>num_cont=%d", path_len, num_cont);
+    char *buf = calloc(SFS_ENTRY_SIZE * (1 + num_cont), 1);
+    strcpy(buf, name);
+    unlink_entry(sfs, entry);
+    switch (entry->type) {
+    case SFS_ENTRY_DIR:
+        free(entry->data.dir_data->name);
+        entry->data.dir_data->num_cont = num_cont;
+        entry->data.dir_data->name = buf;
+        break;
+    case SFS_ENTRY_FILE:
+        free(entry->data.file_data->name);
+        entry->data.file_data->num_cont = num_cont;
+        entry->data.file_data->name = buf;
+        break;
+    default:
+        break;
+    }
+    if (put_new_entry(sfs, entry) != 0) {
+        drop_entry(sfs, entry);
+        free_entry(entry);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Assume: there is no entry with name dest_path.
+ * Rename entry <source_path> to <dest_path>.
+ * Replace in every file and directory entry that starts with <source_path>/
+ * <source_path> with <dest_path>.  Write everything to index area.
+ * Return 0 on success and -1 on error.
+ */
+static int move_dir(sfs, source_path, dest_path)
+    struct sfs *sfs;
+    const char *source_path;
+    const char *dest_path;
+{
+    int src_len = strlen(source_path);
+    int dest_len = strlen(dest_path);
+
+    /* collect the entries first: renamed entries move in the entry list */
+    uint64_t n = 0;
+    uint64_t max = 16;
+    struct sfs_entry **moved = malloc(max * sizeof(struct sfs_entry *));
+    struct sfs_entry *entry = sfs->entry_list;
+    while (entry != NULL) {
+        char *name = NULL;
+        if (entry->type == SFS_ENTRY_DIR || entry->type == SFS_ENTRY_FILE) {
+            name = get_entry_name(entry);
+        }
+        if (name != NULL) {
+            int name_len = strlen(name);
+            if (name_len >= src_len && (name_len == src_len || name[src_len] == '/')
+                    && strncmp(source_path, name, src_len) == 0) {
+                if (n == max) {
+                    max *= 2;
+                    moved = realloc(moved, max * sizeof(struct sfs_entry *));
+                }
+                moved[n++] = entry;
+            }
+        }
+        entry = entry->next;
+    }
+
+    for (uint64_t i = 0; i < n; ++i) {
+        char *name = get_entry_name(moved[i]);
+        int name_len = strlen(name);
+        char new_name[dest_len + name_len - src_len + 1];
+        strncpy(new_name, dest_path, dest_len);
+        strncpy(&new_name[dest_len], &name[src_len], name_len - src_len + 1);
+        if (rename_entry(sfs, moved[i], new_name) == -1) {
+            free(moved);
+            return -1;
+        }
+    }
+    free(moved);
+    return 0;
+}
+
+
+/****f* sfs/sfs_rename
+ * NAME
+ *   sfs_rename -- rename the file or directory (or move)
+ * DESCRIPTION
+ *   Move a file or directory from one path to another.  It can replace
+ *   existing files if the replace parameter is *true*.
+ * PARAMETER
+ *   SFS - the SFS structure variable
+ *   source_path - the name of the file or directory to rename or move
+ *   dest_path - the new name for the file or directory
+ *   replace - boolean parameter indicating whether the file or directory
+ *             should be replaced
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ */
+int sfs_rename(sfs, source_path, dest_path, replace)
+    SFS *sfs;
+    const char *source_path;
+    const char *dest_path;
+    int replace;
+{
+    TRACE_INFO("@@@@\tsfs_rename: \"%s\"->\"%s\"", source_path, dest_path);
+    if (strcmp(source_path, dest_path) == 0) {
+        return 0;
+    }
+    struct sfs_entry *entry = get_entry_by_name(sfs, source_path);
+    if (entry == NULL) {
+        fprintf(stderr, "Source \"%s\" does not exist\n", source_path);
+        return -1;
+    }
+    if (!check_valid_new(sfs, dest_path)) {
+        fprintf(stderr, "Destination name not valid\n");
+        return -1;
+    }
+    struct sfs_entry *dest_entry = get_entry_by_name(sfs, dest_path);
+    if (dest_entry != NULL) {
+        if (replace == 0) {
+            fprintf(stderr, "Cannot replace existing file \"%s\"\n", dest_path);
+            return -1;
+        } else {
+            if (entry->type != dest_entry->type) {
+                fprintf(stderr, "Source and destination of different types\n");
+                return -1;
+            }
+            if (dest_entry->type == SFS_ENTRY_DIR) {
+                // check if directory is empty
+                if (!is_dir_empty(sfs, dest_path)) {
+                    fprintf(stderr, "directory \"%s\" is not empty\n", dest_path);
+                    return -1;
+                }
+            } 
+            // delete entry from entry list
+            delete_entry(sfs, dest_entry);
+        }
+    }
+    if (entry->type == SFS_ENTRY_DIR) {
+        if (move_dir(sfs, source_path, dest_path) != 0) {
+            return -1;
+        }
+    } else if (entry->type == SFS_ENTRY_FILE) {
+        if (rename_entry(sfs, entry, dest_path) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/****f* sfs/sfs_write
+ * NAME
+ *   sfs_write -- write to file from buffer at an offset
+ * DESCRIPTION
+ *   Write a specified amount of bytes from buffer to file at a specified offset.
+ *   If there is not enough space, the file size is not increased (sfs_resize
+ *   must be called in such case).  The offset must not be further than the end
+ *   of the file.  If the sum of size and the offset is greater than the tota
+ *   size of the file, bytes are written only until the end of the file.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - path of the file in the file system
+ *   buf - buffer containing bytes to write
+ *   size - number of bytes to read from buffer and to write to file
+ *   offset - offset in the file where the bytes should be written
+ * RETURN VALUE
+ *   On error -1 is returned, on success returns the number of bytes written.
+ *****
+ */
+static int file_write(SFS *sfs, struct sfs_entry *entry, const char *buf, size_t size, off_t offset)
+{
+    uint64_t sz;		// number of bytes to write
+    uint64_t len = entry->data.file_data->file_len;
+    TRACE_DEBUG("\toffset=0x%06lx", offset);
+    TRACE_DEBUG("\tlen=0x%06lx", len);
+    if ((uint64_t)offset > len) {
+        return 0;
+    }
+    if (offset + size > len) {
+        sz = len - offset;
+    } else {
+        sz = size;
+    }
+    if (sz == 0) {
+        return 0;
+    }
+    if (zero_tail_write(sfs, entry->data.file_data, offset, offset + sz) != 0) {
+        return -1;
+    }
+    uint64_t data_offset = sfs->block_size * entry->data.file_data->start_block;
+    uint64_t write_start = data_offset + offset;
+    TRACE_DEBUG("\tdata_offset=0x%06lx", data_offset);
+    TRACE_DEBUG("\twrite_start=0x%06lx", write_start);
+    if (image_write(sfs, buf, sz, write_start) != 0) {
+        return -1;
+    }
+    sfs->stats.bytes_written += sz;
+    return sz;
+}
+
+
+int sfs_write(SFS *sfs, const char *path, const char *buf, size_t size, off_t offset)
+{
+    TRACE_INFO("@@@@\tsfs_write: path=\"%s\", size:0x%lx, offset:0x%lx", path, size, offset);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry != NULL) {
+        return file_write(sfs, entry, buf, size, offset);
+    } else {
+        fprintf(stderr, "!! no file error\n");
+        return -1;
+    }
+}
+
+
+int sfs_write_ino(SFS *sfs, uint64_t ino, const char *buf, size_t size, off_t offset)
+{
+    struct sfs_entry *entry = get_file_by_ino(sfs, ino);
+    if (entry == NULL) {
+        return -1;
+    }
+    return file_write(sfs, entry, buf, size, offset);
+}
+
+
+/* The calls of the free list are only timed when built with
+ * SFS_FREE_LIST_TIMING, as sfs_alloc_sim is: most of them take less time
+ * than the two clock_gettime calls */
+#ifdef SFS_FREE_LIST_TIMING
+#define free_list_clock() now_ns()
+#else
+#define free_list_clock() 0
+#endif
+
+/* Counts a call of the free list which started at *start* */
+static void free_list_charge(SFS *sfs, int op, uint64_t start)
+{
+    sfs->stats.free_list_calls[op]++;
+    sfs->stats.free_list_ns[op] += free_list_clock() - start;
+}
+
+
+/****f* sfs/free_list_find
+ *  NAME
+ *    free_list_find -- find consecutive free block in the free list
+ *  DESCRIPTION
+ *    Finds consecutive block entries starting from *start_block*.
+ *  PARAMETERS
+ *    SFS - the SFS structure variable
+ *    start_block - the minimum block number for the consecutive blocks
+ *    length - minimum length of the consecutive blocks
+ *  RETURN VALUE
+ *    Returns a pointer to pointer to the found block or NULL if could not find.
+ ******
+ * Pseudocode:
+ *   p: pointer to pointer to the current item, initialized to the free list
+ *   pfirst: pointer to pointer to the first item of the consecutive blocks
+ *           initialized to the free list
+ *   tot: the number of blocks found so far
+ *   next: the expected start of the next entry if there are no gaps
+ *
+ *   do while not at end and not enough blocks in tot:
+ *      if next <> current start block then	// means there is a gap
+ *        *pfirst = p	// set the first block found to current
+ *        tot = 0       // what was found was not enough, starting again
+ *      end if
+ *      if start block not yet reached then
+ *        tot += (*p)->length
+ *        next = (*p)->start_block + (*p)->length
+ *       end if
+ *      set p to next
+ *   continue
+ *   if tot >= length then return pfirst        // found => return
+ *   return NULL      // not found
+ * end pseudocode
+ */
+struct block_list **free_list_find(sfs, start_block, length)
+    SFS *sfs;
+    uint64_t start_block;
+    uint64_t length;
+{
+    uint64_t t0 = free_list_clock();
+    struct block_list **p = &sfs->free_list;
+    struct block_list **pfirst = p;
+    uint64_t tot = 0;
+    uint64_t next = 0;
+    while (*p != NULL && tot < length) {
+        sfs->stats.free_extents++;
+        if (next != (*p)->start_block) {
+            pfirst = p;
+            tot = 0;
+        }
+        if (start_block <= (*p)->start_block) {
+            tot += (*p)->length;
+            next = (*p)->start_block + (*p)->length;
+        }
+        p = &(*p)->next;
+    }
+    free_list_charge(sfs, SFS_FREE_FIND, t0);
+    if (tot >= length) {
+        return pfirst;
+    }
+    return NULL;
+}
+
+
+/****f* sfs/free_list_merge
+ *  NAME
+ *    free_list_merge -- add free block to the free list
+ *  DESCRIPTION
+ *    Adds new blocks into the free list.  If the blocks are before and/or
+ *    after existing free list entries, the entries are merged.
+ *    Blocks can only be merged with blocks which have delfile NULL.
+ *  PARAMETERS
+ *    SFS - the SFS structure variable
+ *    start - the block where the new free area starts
+ *    length - the number of blocks in the new free area
+ *  RETURN VALUE
+ *    Returns 0 on success and -1 on error.
+ ******
+ * Pseudocode:
+ *   item: current block list item
+ *   prev: previous item
+ *
+ *   while item != NULL    // return 0 when found
+ *     if cannot merge with current then
+ *       if start + length = item->start and item is not a deleted file then
+ *         item->start -= length
+ *         item->length += length
+ *         return 0
+ *       else if start + length < item->start
+ *         insert new item bewteen prev and item
+ *         return 0
+ *       end if
+ *     else if prev->start + prev->next = start then
+ *       if start + length < item->start
+ *       || (start + length = item->start && item->delfile != NULL)
+ *         prev->length += length
+ *         return 0
+ *       else if start + length = item->start
+ *         prev->length += length + item->length
+ *         prev->next = item->next
+ *         free prev
+ *         return 0
+ *       end if
+ *       prev = item
+ *       item = item->next
+ *   end while
+ *   return -1
+ *
+ */
+static int free_list_merge(SFS *sfs, uint64_t start, uint64_t length)
+{
+    struct block_list *prev = NULL;
+    struct block_list *item = sfs->free_list;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    TRACE_DEBUG("[[free_list_add: start=0x%06lx length=0x%06lx]]", start, length);
+    while (item != NULL) {
+        sfs->stats.free_extents++;
+        if (prev == NULL || prev->start_block + prev->length < start
+                || (prev->start_block + prev->length == start
+                    && prev->delfile != NULL)) {
+            if (start + length == item->start_block && item->delfile == NULL) {
+                item->start_block -= length;
+                item->length += length;
+                return 0;
+            } else if (start + length <= item->start_block) {
+                struct block_list *new_item = malloc(sizeof(struct block_list));
+                new_item->start_block = start;
+                new_item->length = length;
+                new_item->delfile = NULL;
+                new_item->next = item;
+                if (prev != NULL) {
+                    prev->next = new_item;
+                } else {
+                    sfs->free_list = new_item;
+                }
+              return 0;
+            }
+        } else if (prev->start_block + prev->length == start) {
+            if (start + length < item->start_block
+                    || (start + length == item->start_block
+                        && item->delfile != NULL)) {
+                prev->length += length;
+                return 0;
+            } else if (start + length == item->start_block) {
+                prev->length += length + item->length;
+                prev->next = item->next;
+                if (item == sfs->free_last) {
+                    sfs->free_last = prev;
+                }
+                free(item);
+                return 0;
+            }
+        }
+        prev = item;
+        item = item->next;
+    }
+    return -1;
+}
+
+
+/* free_list_merge, timed */
+static int free_list_add(SFS *sfs, uint64_t start, uint64_t length)
+{
+    uint64_t t0 = free_list_clock();
+    int result = free_list_merge(sfs, start, length);
+    free_list_charge(sfs, SFS_FREE_ADD, t0);
+    return result;
+}
+
+
+/****f* sfs/free_list_del
+ *  NAME
+ *    free_list_del -- delete free blocks from free list
+ *  DESCRIPTION
+ *    Deletes free blocks from the free list, so that they can be used.
+ *    Several free list entries can be deleted and at most one can be resized,
+ *    so that the beginning is moved forward and the length becomes smaller.
+ *    Deleted block entries are freed and if they reference a deleted file, it's
+ *    deleted from the entry list.
+ *  PARAMETERS
+ *    SFS - the SFS structure variable
+ *    p_from - pointer to pointer to the block list entry where the search begins
+ *    length - the number of blocks needed
+ *  RETURN VALUE
+ *    Returns 0 on success and -1 on error.
+ ******
+ * Pseudocode:
+ *   rest: remaining blocks to delete, initialized to length
+ *   p: pointer to pointer to current block, initialized to p_from
+ *
+ *   do while (not at end) and (rest <= length):
+ *     rest := rest - current length
+ *     if delfile in *p then delete it
+ *     free current item
+ *   continue
+ *   // here = at-end or rest < length
+ *   if at-end then error (no more space left) and return
+ *   last element:
+ *     length -= rest
+ *     start block: advance rest times
+ * end pseidocode
+ */
+static int free_list_del(SFS *sfs, struct block_list **p_from, uint64_t length)
+{
+    uint64_t t0 = free_list_clock();
+    uint64_t rest = length;
+    struct block_list **p = p_from;
+    if (*p != NULL) {
+        discard_claim(sfs, (*p)->start_block, length);
+    }
+    while (*p != NULL && (*p)->length <= rest) {
+        struct block_list *tmp = (*p);
+        rest -= (*p)->length;
+        *p = (*p)->next;
+        if (tmp->delfile != NULL) {
+            delete_entry(sfs, tmp->delfile);
+        }
+        free(tmp);
+    }
+    if (*p == NULL) {
+        free_list_charge(sfs, SFS_FREE_DEL, t0);
+        return -1;
+    }
+    if (rest > 0) {
+        (*p)->length -= rest;
+        (*p)->start_block += rest;
+        if ((*p)->delfile != NULL) {
+            /* the rest of the deleted file is lost, its blocks are free */
+            delete_entry(sfs, (*p)->delfile);
+            discard_blocks(sfs, (*p)->start_block, (*p)->length);
+        }
+        (*p)->delfile = NULL;
+    }
+    free_list_charge(sfs, SFS_FREE_DEL, t0);
+    return 0;
+}
+
+
+/* Takes the blocks *start* to *start* + *length* - 1 out of the free list.
+ * They must be in one gap, not in a deleted file, and cannot be the end of
+ * free_last.  The gap keeps the blocks after them and a new item is made
+ * for the blocks before them, so free_last stays valid.  Returns 0 on
+ * success and -1 if the blocks are not free. */
+static int free_list_take(SFS *sfs, uint64_t start, uint64_t length)
+{
+    if (length == 0) {
+        return 0;
+    }
+    struct block_list **p = &sfs->free_list;
+    while (*p != NULL && ((*p)->delfile != NULL || start < (*p)->start_block
+                || start + length > (*p)->start_block + (*p)->length)) {
+        sfs->stats.free_extents++;
+        p = &(*p)->next;
+    }
+    if (*p == NULL || (*p == sfs->free_last
+                       && start + length == (*p)->start_block + (*p)->length)) {
+        return -1;
+    }
+    discard_claim(sfs, start, length);
+    struct block_list *item = *p;
+    uint64_t item_end = item->start_block + item->length;
+    if (start > item->start_block) {
+        struct block_list *before = malloc(sizeof(struct block_list));
+        before->start_block = item->start_block;
+        before->length = start - item->start_block;
+        before->delfile = NULL;
+        before->next = item;
+        *p = before;
+        p = &before->next;
+    }
+    item->start_block = start + length;
+    item->length = item_end - item->start_block;
+    if (item->length == 0) {
+        *p = item->next;
+        free(item);
+    }
+    return 0;
+}
+
+
+/****f* sfs/sfs_resize
+ * NAME
+ *   sfs_resize -- resize a file
+ * DESCRIPTION
+ *   Resize a file *path* to size *len*.  Truncate the file if its size
+ *   is less than *len*.  Otherwise, fills with null characters.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - the absolute path of the file
+ *   len - the new size for the file
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ * Pseudocode:
+ *   l0 - initial file size
+ *   l1 - final file size
+ *   b0 - initial number of blocks used by the file
+ *   b1 - number of block needed for its new size
+ *   s0 - the first block of the file
+ *   file_entry - file entry in the Index Area
+ *
+ *   if b1 > b0 then    // file is to small
+ *     p_next = free_list_find(sfs, s0 + l0, b1 - b0)
+ *     if next <> null then     // enough space right after the file
+ *       free_list_del(sfs, p_next, b1 - b0)
+ *     else                     // not enough space: find some blocks
+ *       delete the file (add it to free list)
+ *       p_blocks = free_list_find(sfs, 0, b1)
+ *       delete from free list
+ *       copy the file contents: b0*bs bytes from s0 to start of p_blocks
+ *     end if
+ *     set file_entry start: s0
+ *   else if b0 > b1    // file is to big => free b0-b1 blocks after the file
+ *     free_list_add(sfs, s0 + b0, b0 - b1)
+ *   end if
+ *   if l1 > l0 then
+ *     fill l1 - l0 bytes after the file contents with '\0'
+ *   end if
+ *   write_entry(sfs, file_entry)
+ */
+/* Copies *count* blocks from *from* to *to*, in chunks of up to
+ * SFS_COPY_CHUNK bytes.  The new place of a moved file can only overlap the
+ * old one if it starts before it, so copying forwards is safe. */
+static int move_blocks(SFS *sfs, uint64_t from, uint64_t to, uint64_t count)
+{
+    const uint64_t bs = sfs->block_size;
+    uint64_t chunk = SFS_COPY_CHUNK / bs;
+    if (chunk > count) {
+        chunk = count;
+    }
+    if (chunk == 0) {
+        return 0;
+    }
+    char *buf = malloc(chunk * bs);
+    if (buf == NULL) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i += chunk) {
+        uint64_t n = count - i < chunk ? count - i : chunk;
+        if (image_read(sfs, buf, n * bs, (from + i) * bs) != 0
+                || image_write(sfs, buf, n * bs, (to + i) * bs) != 0) {
+            fprintf(stderr, "move_blocks error: couldn't move block 0x%lx\n", from + i);
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+
+/* Tells if blocks up to *end* would use all of free_last, which must keep at
+ * least one block for the Index Area to grow into */
+static int reaches_free_end(SFS *sfs, uint64_t end)
+{
+    return end >= sfs->free_last->start_block + sfs->free_last->length;
+}
+
+
+/* Gives the file entry the blocks needed for *len* bytes, moving the file if
+ * the blocks after it are not free.  The file length in the entry is not
+ * changed.  The blocks the file gives up are returned in *freed*, to be
+ * discarded by file_set_len once the entry no longer uses them.  Returns the
+ * start block of the file or -1 on error. */
+static int64_t file_alloc(sfs, file_entry, len, freed)
+    SFS *sfs;
+    struct sfs_entry *file_entry;
+    uint64_t len;
+    struct discard_range *freed;
+{
+    const uint64_t bs = sfs->block_size;
+    const uint64_t l0 = file_entry->data.file_data->file_len;
+    const uint64_t b0 = (l0 + bs - 1) / bs;
+    const uint64_t b1 = (len + bs - 1) / bs;
+    const uint64_t s0 = file_entry->data.file_data->start_block;
+    uint64_t s1 = s0;
+    freed->start = 0;
+    freed->length = 0;
+    if (b1 > b0) {
+        struct block_list **p_next = free_list_find(sfs, s0 + b0, b1 - b0);
+        if (p_next != NULL && (*p_next)->start_block == s0 + b0
+                && !reaches_free_end(sfs, s0 + b1)) {
+            if (l0 == 0) {
+                s1 = (*p_next)->start_block;
+                file_entry->data.file_data->start_block = s1;
+            }
+            free_list_del(sfs, p_next, b1 - b0);
+        } else {
+            if (free_list_add(sfs, s0, b0) != 0) {
+                return -1;
+            }
+            struct block_list **p_blocks = free_list_find(sfs, 0, b1);
+            if (p_blocks == NULL || reaches_free_end(sfs, (*p_blocks)->start_block + b1)) {
+                /* the file keeps its blocks */
+                free_list_take(sfs, s0, b0);
+                sfs->stats.alloc_failures++;
+                return -1;
+            }
+            s1 = (*p_blocks)->start_block;
+            if (free_list_del(sfs, p_blocks, b1) != 0) {
+                return -1;
+            }
+            struct phase phase;
+            phase_enter(sfs, &phase, SFS_PHASE_RELOCATE);
+            int moved = move_blocks(sfs, s0, s1, b0);
+            phase_leave(sfs, &phase);
+            if (moved != 0) {
+                return -1;
+            }
+            if (b0 > 0) {
+                sfs->stats.relocations++;
+                sfs->stats.blocks_relocated += b0;
+            }
+            /* the new place can only overlap the start of the old one */
+            uint64_t old_free = s1 + b1 > s0 ? s1 + b1 : s0;
+            if (s0 + b0 > old_free) {
+                freed->start = old_free;
+                freed->length = s0 + b0 - old_free;
+            }
+            file_entry->data.file_data->start_block = s1;
+        }
+    } else if (b0 > b1) {
+        if (free_list_add(sfs, s0 + b1, b0 - b1)) {
+            return -1;
+        }
+        freed->start = s0 + b1;
+        freed->length = b0 - b1;
+    }
+    return s1;
+}
+
+
+/* Sets the length of the file in the entry and writes the entry.  Then the
+ * blocks given up by file_alloc are discarded: before, the entry on the
+ * image may still point at them. */
+static int file_set_len(sfs, file_entry, start, len, freed)
+    SFS *sfs;
+    struct sfs_entry *file_entry;
+    uint64_t start;
+    uint64_t len;
+    const struct discard_range *freed;
+{
+    file_entry->data.file_data->file_len = len;
+    file_entry->data.file_data->end_block = start + (len + sfs->block_size - 1) / sfs->block_size - 1;
+    if (write_entry(sfs, file_entry) != 0) {
+        return -1;
+    }
+    discard_blocks(sfs, freed->start, freed->length);
+    return 0;
+}
+
+
+static int file_resize(SFS *sfs, struct sfs_entry *file_entry, off_t len)
+{
+    const uint64_t l0 = file_entry->data.file_data->file_len;
+    const uint64_t l1 = (uint64_t)len;
+    struct discard_range freed;
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_ALLOC);
+    int64_t s1 = file_alloc(sfs, file_entry, l1, &freed);
+    phase_leave(sfs, &phase);
+    if (s1 == -1) {
+        return -1;
+    }
+    /* in lazy mode the new bytes join the lazy tail, otherwise the lazy
+     * tail is written with them */
+    struct file_data *file_data = file_entry->data.file_data;
+    uint64_t from = l0 - file_data->zero_tail;
+    if (from > l1) {
+        from = l1;
+    }
+    if (!sfs->lazy_zero && l1 > from) {
+        if (zero_fill(sfs, s1 * sfs->block_size + from, l1 - from) != 0) {
+            return -1;
+        }
+        from = l1;
+    }
+    file_data->zero_tail = l1 - from;
+    return file_set_len(sfs, file_entry, s1, l1, &freed);
+}
+
+
+/* Writes beyond the end of the file: the blocks are allocated once, only the
+ * gap between the end of the file and *offset* is filled with null bytes,
+ * and the entry is written once.  If buf is NULL, the range is only
+ * allocated.  Returns the number of bytes written or -1 on error. */
+static int file_write_extend(sfs, file_entry, buf, size, offset)
+    SFS *sfs;
+    struct sfs_entry *file_entry;
+    const char *buf;
+    size_t size;
+    off_t offset;
+{
+    const uint64_t l0 = file_entry->data.file_data->file_len;
+    const uint64_t end = offset + size;
+    if (size == 0 || end <= l0) {
+        if (buf != NULL) {
+            return file_write(sfs, file_entry, buf, size, offset);
+        }
+        return zero_tail_write(sfs, file_entry->data.file_data, offset, end) == 0 ? (int)size : -1;
+    }
+    struct discard_range freed;
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_ALLOC);
+    int64_t s1 = file_alloc(sfs, file_entry, end, &freed);
+    phase_leave(sfs, &phase);
+    if (s1 == -1) {
+        return -1;
+    }
+    const uint64_t data_offset = s1 * sfs->block_size;
+    if (zero_tail_write(sfs, file_entry->data.file_data, offset, end) != 0) {
+        return -1;
+    }
+    if ((uint64_t)offset > l0 && zero_fill(sfs, data_offset + l0, offset - l0) != 0) {
+        return -1;
+    }
+    if (buf != NULL) {
+        if (image_write(sfs, buf, size, data_offset + offset) != 0) {
+            return -1;
+        }
+        sfs->stats.bytes_written += size;
+    }
+    if (file_set_len(sfs, file_entry, s1, end, &freed) != 0) {
+        return -1;
+    }
+    return size;
+}
+
+
+static void write_undo_save(struct file_data *file_data, struct write_undo *undo)
+{
+    undo->len = file_data->file_len;
+    undo->tail = file_data->file_len - file_data->zero_tail;
+}
+
+
+/* After file_write_extend with a NULL buf, when only *written* bytes of
+ * [offset, offset + size) were written: the file is cut back to the end of
+ * the written data or to its old length, and the rest of the old lazy tail
+ * is filled with null bytes.  Returns 0 on success and -1 on error. */
+static int write_undo(sfs, file_entry, undo, offset, size, written)
+    SFS *sfs;
+    struct sfs_entry *file_entry;
+    struct write_undo *undo;
+    uint64_t offset;
+    size_t size;
+    size_t written;
+{
+    if (written >= size) {
+        return 0;
+    }
+    const uint64_t lo = offset + written;
+    const uint64_t hi = offset + size;
+    const uint64_t from = lo > undo->tail ? lo : undo->tail;
+    const uint64_t to = hi < undo->len ? hi : undo->len;
+    const uint64_t data_offset = sfs->block_size * file_entry->data.file_data->start_block;
+    if (from < to && zero_fill(sfs, data_offset + from, to - from) != 0) {
+        return -1;
+    }
+    if (hi > undo->len) {
+        /* the null bytes before offset stay only if some data follows them */
+        return file_resize(sfs, file_entry, written > 0 && lo > undo->len ? lo : undo->len);
+    }
+    return 0;
+}
+
+
+int sfs_resize(SFS *sfs, const char *path, off_t len)
+{
+    TRACE_INFO("@@@@\tsfs_resize: name=\"%s\" length=%ld", path, len);
+    struct sfs_entry *file_entry = get_file_by_name(sfs, path);
+    if (file_entry == NULL) {
+        fprintf(stderr, "file \"%s\" does not exists\n", path);
+        return -1;
+    }
+    if (file_entry->type != SFS_ENTRY_FILE) {
+        fprintf(stderr, "\"%s\" is not a file\n", path);
+        return -1;
+    }
+    return file_resize(sfs, file_entry, len);
+}
+
+
+int sfs_resize_ino(SFS *sfs, uint64_t ino, off_t len)
+{
+    struct sfs_entry *file_entry = get_file_by_ino(sfs, ino);
+    if (file_entry == NULL) {
+        return -1;
+    }
+    return file_resize(sfs, file_entry, len);
+}
+
+
+static SFS_FILE *open_entry(struct sfs_entry *entry)
+{
+    if (entry == NULL || entry->type != SFS_ENTRY_FILE) {
+        return NULL;
+    }
+    SFS_FILE *file = malloc(sizeof(SFS_FILE));
+    file->entry = entry;
+    file->next = entry->handles;
+    entry->handles = file;
+    return file;
+}
+
+
+/****f* sfs/sfs_open
+ * NAME
+ *   sfs_open -- open a file handle
+ * DESCRIPTION
+ *   Looks up the file once and returns a handle for sfs_read_fh,
+ *   sfs_write_fh, sfs_resize_fh and sfs_stat_fh.  The handle must be freed
+ *   with sfs_release.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   path - the absolute path of the file
+ * RETURN VALUE
+ *   Returns the handle or NULL if there is no such file.
+ ******
+ */
+SFS_FILE *sfs_open(SFS *sfs, const char *path)
 {
-    struct sfs_entry *entry = from;
-    while (entry != to) {
-        if (entry->type == SFS_ENTRY_FILE_DEL) {
-            delfile_to_normal(sfs, entry);
-        }
-        struct sfs_entry *tmp = entry;
-        entry = entry->next;
-        free_entry(tmp);
-    }
+    return open_entry(get_file_by_name(sfs, path));
 }
 
 
-/* Insert n unused entries before tail and returns the head */
-struct sfs_entry *insert_unused(sfs, offset, n, tail)
-    struct sfs *sfs;
-    uint64_t offset;
-    int n;
-    struct sfs_entry *tail;
+SFS_FILE *sfs_open_ino(SFS *sfs, uint64_t ino)
 {
-    struct sfs_entry *entry;
-    struct sfs_entry *next = tail;
-    for (int i = 0; i < n; ++i) {
-        entry = malloc(sizeof(struct sfs_entry));
-        entry->offset = offset + SFS_ENTRY_SIZE * (n - i - 1);
-        entry->type = SFS_ENTRY_UNUSED;
-        entry->next = next;
-        if (write_entry(sfs, entry) != 0) {
-            return NULL;
+    return open_entry(get_file_by_ino(sfs, ino));
+}
+
+
+int sfs_release(SFS *sfs, SFS_FILE *file)
+{
+    if (file->entry != NULL) {
+        struct sfs_file **p = &file->entry->handles;
+        while (*p != file) {
+            p = &(*p)->next;
         }
-        next = entry;
+        *p = file->next;
     }
-    return next;
+    free(file);
+    return 0;
 }
 
 
-/* Finds space for the entry and inserts it.
- * Writes changes to the Index Area.
- * Return 0 on success, -1 on error
- *
- * k: amount of space needed
- * l: amount of consecutive space found so that (l >= k)
- * The entries taking l space are deleted.
- * The new entry is inserted.
- * The remaining (l - k) is filled with unused entries.
- * If the space could not be found, -1 is returned, otherwise 0 is returned.
- */
-static int insert_entry(struct sfs *sfs, struct sfs_entry *new_entry)
+int sfs_stat_fh(SFS *sfs, SFS_FILE *file, struct sfs_stat *st)
 {
-    printf("=== INSERT ENTRY ===\n");
-    int space_needed = 1 + get_num_cont(new_entry); // in number of simple entries
-    printf("\tneeded: %d\n", space_needed);
-    int space_found = 0;
-    struct sfs_entry **p_entry = &sfs->entry_list;
-    struct sfs_entry **pfirst_usable = NULL;
-    while (*p_entry != NULL) {
-//        printf("\ttype=0x%02x\n", curr_entry->type);
-        int usable_space = get_entry_usable_space(*p_entry);
-//        printf("\tusable: %d\n", usable_space);
-        if (usable_space > 0) {
-            if (pfirst_usable == NULL) {
-                pfirst_usable = p_entry;
-                printf("\tfound: %d\n", space_found);
-            }
-            space_found += usable_space;
-            if (space_found >= space_needed) {
-                int start = (*pfirst_usable)->offset;
-                int end = start + SFS_ENTRY_SIZE * space_needed;
-                struct sfs_entry *next = (*p_entry)->next;
-                delete_entries(sfs, *pfirst_usable, next);
-                new_entry->offset = start;
-                int l = space_found - space_needed;
-                new_entry->next = insert_unused(sfs, end, l, next);
-                *pfirst_usable = new_entry;
-                printf("=== INSERT ENTRY: OK ===\n");
-                if (write_entry(sfs, new_entry) != 0) {
-                    return -1;
-                } else {
-                    return 0;
-                }
-            }
-        } else if (pfirst_usable != NULL) {
-            pfirst_usable = NULL;
-            space_found = 0;
-        }
-        p_entry = &(*p_entry)->next;
+    if (file->entry == NULL) {
+        return -1;
     }
-    printf("insert_entry: couldn't find (%d * 64) bytes\n", space_needed);
-    printf("=== INSERT ENTRY: ERROR ===\n");
-    return -1;
+    fill_stat(sfs, file->entry, st);
+    return 0;
 }
 
 
-/* Prepends the entry to the list of entries.
- * The entry is inserted after the start marker.
- * In the Index Area, the start marker is moved in the direction of the superblock.
- * The entry is written to the Index Area after the start marker.
- * On success 0 is returned, -1 on error.
- */
-static int prepend_entry(struct sfs *sfs, struct sfs_entry *entry)
+int sfs_read_fh(SFS *sfs, SFS_FILE *file, char *buf, size_t size, off_t offset)
 {
-    printf("=== PREPEND ENTRY ===\n");
-    struct sfs_entry *start = sfs->entry_list;
-    uint64_t entry_size = SFS_ENTRY_SIZE * (1 + get_num_cont(entry));
-    uint64_t start_size = SFS_ENTRY_SIZE * (1 + get_num_cont(start));
+    if (file->entry == NULL) {
+        return -1;
+    }
+    return file_read(sfs, file->entry, buf, size, offset);
+}
 
-    /* check available space in the free area and update free list */
-    if (sfs->free_last == NULL) {
-        printf("free_last is NULL!!!\n");
+
+int sfs_write_fh(SFS *sfs, SFS_FILE *file, const char *buf, size_t size, off_t offset)
+{
+    if (file->entry == NULL) {
         return -1;
     }
+    return file_write(sfs, file->entry, buf, size, offset);
+}
 
-    printf("\tfree_last length: 0x%06lx (bytes)\n", sfs->free_last->length * sfs->block_size);
-    printf("\tentry size: 0x%06lx\n", entry_size);
-    if (sfs->free_last != NULL  && sfs->free_last->length * sfs->block_size >= entry_size) {
-        uint64_t new_isz = sfs->super->index_size + entry_size;
-        uint64_t iblocks = (sfs->super->index_size + sfs->block_size - 1) / sfs->block_size;
-        uint64_t ibt = iblocks * sfs->block_size;                // index with rest in bytes
-        uint64_t fbt = sfs->free_last->length * sfs->block_size; // free blocks in bytes
-        uint64_t index_start = sfs->super->total_blocks * sfs->block_size - sfs->super->index_size;
-        printf("\tblock size: 0x%06x\n", sfs->block_size);
-        printf("\toriginal index size: 0x%06lx\n", sfs->super->index_size);
-        printf("\toriginal index start: 0x%06lx\n", index_start);
-        printf("\toriginal free blocks: 0x%06lx\n", sfs->free_last->length);
-        printf("\toriginal index blocks (bytes): 0x%06lx\n", ibt);
-        printf("\toriginal free blocks (bytes): 0x%06lx\n", fbt);
-        printf("\tnew entry size: 0x%06lx\n", entry_size);
-        printf("\tnew index size: 0x%06lx\n", new_isz);
-        printf("\tnew index start: 0x%06lx\n", index_start - entry_size);
-        if (new_isz > ibt) {
-            // update free list
-            if (new_isz - ibt > fbt) {
-                fprintf(stderr, "Error: could not prepend entry: no more free space\n");
-                return -1;
-            }
-            sfs->free_last->length -= (new_isz - ibt + sfs->block_size - 1) / sfs->block_size;
-            printf("\tupdate free_last: 0x%06lx\n", sfs->free_last->length);
-            printf("\tnew free blocks (bytes): 0x%06lx\n", sfs->free_last->length * sfs->block_size);
-        }
-        sfs->super->index_size = new_isz;
-        printf("\tupdate index size: 0x%06lx\n", new_isz);
-        write_super(sfs->file, sfs->super);
-    } else {
-        fprintf(stderr, "prepend_entry: free list error\n");
+
+int sfs_resize_fh(SFS *sfs, SFS_FILE *file, off_t len)
+{
+    if (file->entry == NULL) {
         return -1;
     }
+    return file_resize(sfs, file->entry, len);
+}
 
-    start->type = SFS_ENTRY_START;
-    start->offset -= entry_size;
-    entry->offset = start->offset + start_size;
-    if (write_entry(sfs, entry) == -1) {
-        fprintf(stderr, "prepend_entry: write new entry error\n");
+
+/****f* sfs/sfs_write_extend
+ * NAME
+ *   sfs_write_extend -- write to a file, extending it if needed
+ * DESCRIPTION
+ *   Like sfs_write, but if the data goes beyond the end of the file, the
+ *   file is first extended.  This is done in one pass: the bytes between
+ *   the old end of the file and *offset* are filled with null characters,
+ *   the ones about to be written are not.  With sfs_write_extend_fh, *buf*
+ *   can be NULL: then the range is only allocated, for data written through
+ *   the descriptor given by sfs_extent_fh, and sfs_write_finish_fh must be
+ *   called after it.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   path - the absolute path of the file
+ *   buf - the data to write
+ *   size - the number of bytes to write
+ *   offset - the position in the file
+ * RETURN VALUE
+ *   Returns the number of bytes written or -1 on error.
+ ******
+ */
+int sfs_write_extend(sfs, path, buf, size, offset)
+    SFS *sfs;
+    const char *path;
+    const char *buf;
+    size_t size;
+    off_t offset;
+{
+    TRACE_INFO("@@@@\tsfs_write_extend: path=\"%s\", size:0x%lx, offset:0x%lx", path, size, offset);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry == NULL || entry->type != SFS_ENTRY_FILE) {
         return -1;
     }
-    if (write_entry(sfs, start) == -1) {
-        fprintf(stderr, "prepend_entry: write start marker entry error\n");
+    return file_write_extend(sfs, entry, buf, size, offset);
+}
+
+
+int sfs_write_extend_fh(SFS *sfs, SFS_FILE *file, const char *buf, size_t size, off_t offset)
+{
+    if (file->entry == NULL) {
         return -1;
     }
-    // update pointers only if write successful
-    entry->next = start->next;
-    start->next = entry;
-    printf("=== PREPEND: OK! ===\n");
-    return 0;
+    if (buf == NULL) {
+        write_undo_save(file->entry->data.file_data, &file->undo);
+    }
+    return file_write_extend(sfs, file->entry, buf, size, offset);
 }
 
 
-/* Puts a new entry into the entry list, updating the index area:
- * -> finds a place in the list with needed number of continuations
- * -> writes changes to the index area
- * -> updates free list if deleted files overwritten
- * -> on success returns 0
- *    otherwise returns -1
+/****f* sfs/sfs_write_finish_fh
+ * NAME
+ *   sfs_write_finish_fh -- end a write through the image descriptor
+ * DESCRIPTION
+ *   To be called after sfs_write_extend_fh with a NULL *buf*, once the data
+ *   has been written through the descriptor given by sfs_extent_fh.  If
+ *   fewer than *size* bytes were written, the file is cut back to its old
+ *   length or to the end of the written data, and the part of the range
+ *   that should read as null bytes is filled with them, so that the file
+ *   never shows stale data of the image.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   file - the open file
+ *   offset - the position given to sfs_write_extend_fh
+ *   size - the size given to sfs_write_extend_fh
+ *   written - the number of bytes written from *offset*
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
  */
-static int put_new_entry(struct sfs *sfs, struct sfs_entry *new_entry)
+int sfs_write_finish_fh(sfs, file, offset, size, written)
+    SFS *sfs;
+    SFS_FILE *file;
+    off_t offset;
+    size_t size;
+    size_t written;
 {
-    if (insert_entry(sfs, new_entry) != 0) {
-        return prepend_entry(sfs, new_entry);
+    if (file->entry == NULL) {
+        return -1;
     }
-    return 0;
+    return write_undo(sfs, file->entry, &file->undo, offset, size, written);
 }
 
 
-// check if path valid and does not exist
-static int check_valid_new(struct sfs *sfs, const char *path)
+/****f* sfs/sfs_extent_fh
+ * NAME
+ *   sfs_extent_fh -- locate file data in the image file
+ * DESCRIPTION
+ *   Finds where the data at *offset* of an open file is stored in the image,
+ *   so that it can be read or written directly through the file descriptor
+ *   of the image (for example with splice), without copying it through sfs.
+ *   The files are contiguous, so the data of the whole range is at *pos*.
+ *   The location is valid until the file is resized, renamed or deleted.
+ *   Writing through the descriptor does not change the size of the file:
+ *   extend it first with sfs_resize_fh.  The blocks of the range are removed
+ *   from the block cache, since they may be written.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   file - the open file
+ *   offset - the position in the file
+ *   size - the number of bytes to locate
+ *   fd - receives the file descriptor of the image
+ *   pos - receives the position of the data in the image
+ * RETURN VALUE
+ *   Returns the number of bytes of the range inside the file (less than
+ *   *size* near the end of the file, 0 after it), -1 on error.
+ ******
+ */
+int sfs_extent_fh(sfs, file, offset, size, fd, pos)
+    SFS *sfs;
+    SFS_FILE *file;
+    off_t offset;
+    size_t size;
+    int *fd;
+    off_t *pos;
 {
-    printf("check valid as new \"%s\"s:", path);
-    // if path exists, not valid as a new name
-    struct sfs_entry *entry = get_dir_by_name(sfs, path);
-    if (entry != NULL) {
-        printf(" no (already exists)\n");
+    if (file->entry == NULL) {
+        return -1;
+    }
+    struct file_data *file_data = file->entry->data.file_data;
+    uint64_t len = file_data->file_len;
+    if ((uint64_t)offset >= len) {
         return 0;
     }
+    if (offset + size > len) {
+        size = len - offset;
+    }
+    if (zero_tail_flush(sfs, file_data, offset + size) != 0) {
+        return -1;
+    }
+    *fd = fileno(sfs->file);
+    *pos = sfs->block_size * file_data->start_block + offset;
+    cache_drop(sfs, *pos, size);
+    sfs->stats.bytes_extent += size;
+    return size;
+}
 
-    int path_len = strlen(path);
-    const char *basename = get_basename(path);
-    int basename_len = strlen(basename);
-    if (basename_len == 0) {
-        printf(" empty basename\n");
+
+/****f* sfs/sfs_set_cache
+ * NAME
+ *   sfs_set_cache -- enable the block cache
+ * DESCRIPTION
+ *   Blocks of the image read by the library are kept in a cache of *blocks*
+ *   blocks, using the 2Q replacement policy, so that repeated reads of the
+ *   same blocks do not reach the disk.  All writes, including the ones of
+ *   the index entries and of files being moved, go through the cache to the
+ *   image.  Setting the size drops the cached
+ *   blocks and resets the statistics.  The cache is disabled by default.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   blocks - the number of blocks to cache, 0 to disable the cache
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ */
+int sfs_set_cache(SFS *sfs, size_t blocks)
+{
+    cache_free(sfs->cache);
+    sfs->cache = NULL;
+    if (blocks == 0) {
         return 0;
     }
+    struct block_cache *cache = calloc(1, sizeof(struct block_cache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->capacity = blocks;
+    cache->kin = blocks / 4 > 0 ? blocks / 4 : 1;
+    cache->kout = blocks / 2 > 0 ? blocks / 2 : 1;
+    cache->buckets = 1;
+    while (cache->buckets < blocks + cache->kout) {
+        cache->buckets *= 2;
+    }
+    cache->hash = calloc(cache->buckets, sizeof(struct cache_block *));
+    if (cache->hash == NULL) {
+        free(cache);
+        return -1;
+    }
+    sfs->cache = cache;
+    return 0;
+}
 
-    /* check if prent dir exists */
-    if (path_len > basename_len) {
-        char parent[path_len];
-        memcpy(parent, path, path_len);
-        parent[path_len - basename_len - 1] = '\0';
-        struct sfs_entry *parent_entry = get_dir_by_name(sfs, parent);
-        if (parent_entry == NULL) {
-            printf(" no (parent \"%s\" does exists)\n", parent);
-            return 0;
-        }
-        printf(" parent=\"%s\"", parent);
+
+void sfs_get_cache_stats(SFS *sfs, struct sfs_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(struct sfs_cache_stats));
+    if (sfs->cache != NULL) {
+        stats->hits = sfs->cache->hits;
+        stats->misses = sfs->cache->misses;
+        stats->blocks = sfs->cache->used;
+        stats->capacity = sfs->cache->capacity;
     }
-    printf(" basename=\"%s\"\n", basename);
+}
 
-    return 1;
+
+/****f* sfs/sfs_get_stats
+ * NAME
+ *   sfs_get_stats -- get the counters of the library
+ * DESCRIPTION
+ *   Copies the counters of the work done since sfs_init (see struct
+ *   sfs_stats in sfs.h).  They are only updated by the calls on sfs, so
+ *   they must not be read during another call from another thread.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   stats - the structure receiving the counters
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_get_stats(SFS *sfs, struct sfs_stats *stats)
+{
+    *stats = sfs->stats;
 }
 
 
-static int num_cont_from_name(int entry_type, int name_len)
+/****f* sfs/sfs_get_free_stats
+ * NAME
+ *   sfs_get_free_stats -- measure the free space
+ * DESCRIPTION
+ *   Walks the free list and counts the runs of free blocks, gaps and
+ *   deleted files which follow each other making one run.  With the
+ *   largest run, this gives the external fragmentation of the Data Area:
+ *   1 - largest / blocks.  The Free Area, between the files and the Index
+ *   Area, is the last run.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   stats - the structure receiving the measures
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_get_free_stats(SFS *sfs, struct sfs_free_stats *stats)
 {
-    int first_len;
-    switch (entry_type) {
-    case SFS_ENTRY_DIR:
-        first_len = SFS_DIR_NAME_LEN;
-        break;
-    case SFS_ENTRY_FILE:
-        first_len = SFS_FILE_NAME_LEN;
-        break;
-    default:
-        break;
-    }
-    int num_cont;
-    if (name_len < first_len) {
-        num_cont = 0;
-    } else {
-        int cont_str_len = name_len - first_len + 1;
-        num_cont = (cont_str_len + SFS_ENTRY_SIZE - 1) / SFS_ENTRY_SIZE;
+    memset(stats, 0, sizeof(struct sfs_free_stats));
+    uint64_t run = 0;
+    uint64_t run_end = 0;
+    for (struct block_list *item = sfs->free_list; item != NULL; item = item->next) {
+        if (run == 0 || item->start_block != run_end) {
+            stats->extents++;
+            run = 0;
+        }
+        run += item->length;
+        run_end = item->start_block + item->length;
+        stats->blocks += item->length;
+        if (run > stats->largest) {
+            stats->largest = run;
+        }
+    }
+    if (sfs->free_last != NULL) {
+        stats->free_area = sfs->free_last->length;
     }
-    return num_cont;
 }
 
 
-int sfs_mkdir(struct sfs *sfs, const char *path)
+/****f* sfs/sfs_get_phase_hist
+ * NAME
+ *   sfs_get_phase_hist -- get the latency histogram of a phase
+ * DESCRIPTION
+ *   Gives the histogram of the durations in ns of the occurrences of a
+ *   phase of the work of the library (see enum sfs_phase in sfs.h), since
+ *   sfs_init.  The histogram is updated in place and can be read from a
+ *   signal handler.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   phase - the phase
+ * RETURN VALUE
+ *   Returns the histogram or NULL if the phase is not valid.
+ ******
+ */
+const struct sfs_hist *sfs_get_phase_hist(SFS *sfs, int phase)
 {
-    int path_len = strlen(path);
-    printf("@@@\tsfs_mkdir: create new directory \"%s\"\n", path);
-    if (!check_valid_new(sfs, path)) {
-        return -1;
+    if (phase < 0 || phase >= SFS_PHASE_COUNT) {
+        return NULL;
     }
+    return &sfs->phase_hist[phase];
+}
 
-    struct sfs_entry *dir_entry = malloc(sizeof(struct sfs_entry));
-    dir_entry->type = SFS_ENTRY_DIR;
-    int num_cont = num_cont_from_name(SFS_ENTRY_DIR, path_len);
-    dir_entry->data.dir_data = malloc(sizeof(struct dir_data));
-    dir_entry->data.dir_data->num_cont = num_cont;
-    dir_entry->data.dir_data->time_stamp = make_time_stamp();
-    dir_entry->data.dir_data->name = strdup(path);
 
-    if (put_new_entry(sfs, dir_entry) == -1) {
-        printf("\tsfs_mkdir put new entry error\n");
-        free_entry(dir_entry);
+const char *sfs_phase_name(int phase)
+{
+    static const char *names[SFS_PHASE_COUNT] = { "lookup", "alloc", "relocate", "index" };
+    if (phase < 0 || phase >= SFS_PHASE_COUNT) {
+        return "unknown";
     }
-
-    return 0;
+    return names[phase];
 }
 
 
-int sfs_create(struct sfs *sfs, const char *path)
+/****f* sfs/sfs_set_readahead
+ * NAME
+ *   sfs_set_readahead -- set the maximum readahead window
+ * DESCRIPTION
+ *   When the reads of a file are sequential, the next part of the file is
+ *   read in the background, in windows growing up to *max* bytes (default
+ *   SFS_READAHEAD_MAX).
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   max - the maximum window in bytes, 0 to disable readahead
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_set_readahead(SFS *sfs, size_t max)
 {
-    int path_len = strlen(path);
-    printf("@@@\tsfs_create: create new empty file \"%s\"\n", path);
-    if (!check_valid_new(sfs, path)) {
-        return -1;
-    }
-
-    struct sfs_entry *file_entry = malloc(sizeof(struct sfs_entry));
-    file_entry->type = SFS_ENTRY_FILE;
-    int num_cont = num_cont_from_name(SFS_ENTRY_FILE, path_len);
-    printf("\tpath_len=%d=>num_cont=%d\n", path_len, num_cont);
-    file_entry->data.file_data = malloc(sizeof(struct file_data));
-    file_entry->data.file_data->num_cont = num_cont;
-    file_entry->data.file_data->time_stamp = make_time_stamp();
-    file_entry->data.file_data->start_block = sfs->super->rsvd_blocks;
-    file_entry->data.file_data->end_block = sfs->super->rsvd_blocks - 1;
-    file_entry->data.file_data->file_len = 0;
-    file_entry->data.file_data->name = strdup(path);
+    sfs->readahead_max = max;
+}
 
-    if (put_new_entry(sfs, file_entry) == -1) {
-        printf("\tsfs_file put new entry error\n");
-        free_entry(file_entry);
-    }
 
-    return 0;
+/****f* sfs/sfs_set_lazy_zero
+ * NAME
+ *   sfs_set_lazy_zero -- extend files without writing null bytes
+ * DESCRIPTION
+ *   By default, a file extended with sfs_resize is filled with null bytes
+ *   on the image right away.  In lazy mode, only the start of the null bytes
+ *   at the end of the file is remembered in memory: reads of that part
+ *   return null bytes without reaching the image, and the null bytes are
+ *   written when data is written after them, when the range is given out by
+ *   sfs_extent_fh or sfs_read_async, and by sfs_terminate.  After a crash
+ *   that part of the file holds the old data of its blocks.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   lazy - 1 for the lazy mode, 0 for the default
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_set_lazy_zero(SFS *sfs, int lazy)
+{
+    sfs->lazy_zero = lazy;
 }
 
 
-static int is_dir_empty(struct sfs *sfs, const char *path) {
-    struct sfs_entry *entry = sfs->entry_list;
-    int path_len = strlen(path);
-    while (entry != NULL) {
-        if ((entry->type == SFS_ENTRY_DIR
-                && strncmp(path, entry->data.dir_data->name, path_len) == 0
-                && entry->data.dir_data->name[path_len] == '/')
-        || (entry->type == SFS_ENTRY_FILE
-                && strncmp(path, entry->data.file_data->name, path_len) == 0
-                && entry->data.file_data->name[path_len] == '/')) {
-            return 0;
-        }
-        entry = entry->next;
+/****f* sfs/sfs_set_discard
+ * NAME
+ *   sfs_set_discard -- punch holes in the image for the freed blocks
+ * DESCRIPTION
+ *   When enabled, the blocks which become free are given back to the
+ *   filesystem holding the image with fallocate(FALLOC_FL_PUNCH_HOLE), so
+ *   that a sparse image file shrinks: the blocks given up by files which
+ *   shrink or move, and the blocks of deleted files when they stop being
+ *   kept for recovery.  The blocks of deleted files still kept are not
+ *   touched.  The holes are punched in batches by a background thread (see
+ *   struct discard_queue).  Disabling punches the queued blocks first.
+ *   If the image does not support punching holes, nothing more is queued.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   enable - 1 to enable, 0 to disable
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ */
+int sfs_set_discard(SFS *sfs, int enable)
+{
+    if (!enable) {
+        discard_free(sfs->discard);
+        sfs->discard = NULL;
+        return 0;
     }
-    return 1;
+    if (sfs->discard != NULL) {
+        return 0;
+    }
+    struct discard_queue *queue = calloc(1, sizeof(struct discard_queue));
+    if (queue == NULL) {
+        return -1;
+    }
+    queue->fd = fileno(sfs->file);
+    queue->block_size = sfs->block_size;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+    if (pthread_create(&queue->thread, NULL, discard_thread, queue) != 0) {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->wake);
+        pthread_cond_destroy(&queue->idle);
+        free(queue);
+        return -1;
+    }
+    sfs->discard = queue;
+    return 0;
 }
 
 
-/****f* sfs/sfs_rmdir
+/****f* sfs/sfs_async_init
  * NAME
- *   sfs_rmdir -- delete an empty directory
+ *   sfs_async_init -- enable asynchronous reads and writes
  * DESCRIPTION
- *   Delete an empty directory located at the specified path.  If it is not
- *   a directory or if it's not empty, nothing happens and -1 is returned.
+ *   Sets up io_uring on the image file for sfs_read_async and
+ *   sfs_write_async.  If io_uring is not available, or with the flag
+ *   SFS_ASYNC_THREADS, a small pool of threads does the I/O instead.
  * PARAMETERS
- *   SFS - the SFS structure variable
- *   path - absolute path of the directory to delete
+ *   sfs - the SFS structure variable
+ *   depth - the maximum number of requests in flight
+ *   flags - 0 or SFS_ASYNC_THREADS
  * RETURN VALUE
- *   On success returns 0.  On error returns -1.
+ *   Returns 0 on success and -1 on error.
  ******
  */
-int sfs_rmdir(struct sfs *sfs, const char *path)
+int sfs_async_init(SFS *sfs, unsigned depth, int flags)
 {
-    printf("@@@@\tsfs_rmdir: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_dir_by_name(sfs, path);
-    if (entry == NULL) {
-        fprintf(stderr, "no directory \"%s\" exists\n", path);
-        return -1;
-    }
-    if (!is_dir_empty(sfs, path)) {
-        fprintf(stderr, "directory \"%s\" is not empty\n", path);
+    if (sfs->aio != NULL || depth == 0) {
         return -1;
     }
-    /* Deleted children: do not remove, unreachable
-     * If the parent is deleted, the children cannot be restored
-     * => on restore: check that the parent exists
-     */
-    entry->type = SFS_ENTRY_DIR_DEL;
-    if (write_entry(sfs, entry) == 0) {
-        printf("\trmdir(%s): ok\n", path);
-        return 0;
-    } else {
+    sfs->aio = sfs_aio_new(fileno(sfs->file), depth, flags);
+    if (sfs->aio == NULL) {
         return -1;
     }
+    TRACE_INFO("sfs_async_init: depth=%u, %s", depth,
+        sfs_aio_uses_uring(sfs->aio) ? "io_uring" : "threads");
+    return 0;
 }
 
 
-/* Insert a deleted file into the free list */
-static void free_list_insert(struct sfs *sfs, struct sfs_entry *delfile)
+/****f* sfs/sfs_read_async
+ * NAME
+ *   sfs_read_async -- start reading from an open file
+ * DESCRIPTION
+ *   Like sfs_read_fh, but returns as soon as the read is submitted.  The
+ *   place of the data in the image is found when the read is submitted, so
+ *   the file must not be resized, moved or deleted before the read is
+ *   completed.  The completion, with the number of bytes read, is returned
+ *   by sfs_poll.  Reads do not go through the block cache.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   file - the open file
+ *   buf - the buffer, must be valid until the read is completed
+ *   size - the number of bytes to read
+ *   offset - the position in the file
+ *   data - a pointer returned with the completion
+ * RETURN VALUE
+ *   Returns the token of the request or 0 on error.
+ ******
+ */
+uint64_t sfs_read_async(sfs, file, buf, size, offset, data)
+    SFS *sfs;
+    SFS_FILE *file;
+    char *buf;
+    size_t size;
+    off_t offset;
+    void *data;
 {
-    struct block_list **p = &sfs->free_list;
-    while ((*p) != NULL) {
-        if ((*p)->start_block > delfile->data.file_data->start_block) {
-            // insert before *p
-            struct block_list *item = malloc(sizeof(struct block_list));
-            item->start_block = delfile->data.file_data->start_block;
-            item->length = (delfile->data.file_data->file_len + sfs->block_size - 1) / sfs->block_size;
-            item->delfile = delfile;
-            item->next = (*p);
-            *p = item;
-            break;
-        }
-        p = &(*p)->next;
+    if (sfs->aio == NULL || file->entry == NULL) {
+        return 0;
+    }
+    struct file_data *file_data = file->entry->data.file_data;
+    uint64_t len = file_data->file_len;
+    if ((uint64_t)offset >= len) {
+        size = 0;
+    } else if (offset + size > len) {
+        size = len - offset;
     }
+    if (zero_tail_flush(sfs, file_data, offset + size) != 0) {
+        return 0;
+    }
+    uint64_t pos = sfs->block_size * file_data->start_block + offset;
+    uint64_t token = sfs->next_token;
+    if (sfs_aio_submit(sfs->aio, 0, buf, size, pos, token, data) != 0) {
+        return 0;
+    }
+    sfs->stats.bytes_read += size;
+    sfs->next_token++;
+    return token;
 }
 
 
-/****f* sfs/delete_entry
+/****f* sfs/sfs_write_async
  * NAME
- *   delete_entry -- delete entry from the entry list and free it
+ *   sfs_write_async -- start writing to an open file
  * DESCRIPTION
- *   The function delete_entry deletes the entry given as parameter and frees
- *   the entry.  It is assmued that the entry is in the entry list and can be
- *   freed (for example if it's a file entry, its name field contains a valid
- *   null-terminated string.
+ *   Like sfs_write_extend_fh, but returns as soon as the write is
+ *   submitted.  The file is extended when the write is submitted, the data
+ *   is in the image when the write is completed (see sfs_poll).  Reading
+ *   the range before that gives undefined data.
  * PARAMETERS
- *   SFS - the SFS structure variable
- *   entry - the entry to be deleted
+ *   sfs - the SFS structure variable
+ *   file - the open file
+ *   buf - the data, must be valid until the write is completed
+ *   size - the number of bytes to write
+ *   offset - the position in the file
+ *   data - a pointer returned with the completion
  * RETURN VALUE
- *   This is a void function and does not return anything.
+ *   Returns the token of the request or 0 on error.
  ******
- * Pseudocode:
- *   entry_length - the number of SFS_ENTRY_SIZE-byte segments to be deleted
- *
- *   for each entry do:
- *     if entry found (pointers are equal) then
- *       insert unused before entry->next entry_length times
- *       point the pointer to the entry to its next
- *       free entry
- *     end if
- * end pseudocode
  */
-static void delete_entry(struct sfs *sfs, struct sfs_entry *entry)
+uint64_t sfs_write_async(sfs, file, buf, size, offset, data)
+    SFS *sfs;
+    SFS_FILE *file;
+    const char *buf;
+    size_t size;
+    off_t offset;
+    void *data;
 {
-    struct sfs_entry **p_entry = &sfs->entry_list;
-    int entry_length = 1 + get_num_cont(entry);
-    struct sfs_entry *tail = entry->next;
-    while (*p_entry != NULL) {
-        if (*p_entry == entry) {
-            *p_entry = insert_unused(sfs, entry->offset, entry_length, tail);
-            free_entry(entry);
-            break;
-        }
-        p_entry = &(*p_entry)->next;
+    if (sfs->aio == NULL || file->entry == NULL) {
+        return 0;
+    }
+    struct write_undo undo;
+    write_undo_save(file->entry->data.file_data, &undo);
+    if (file_write_extend(sfs, file->entry, NULL, size, offset) < 0) {
+        return 0;
+    }
+    struct file_data *file_data = file->entry->data.file_data;
+    uint64_t pos = sfs->block_size * file_data->start_block + offset;
+    cache_drop(sfs, pos, size);
+    uint64_t token = sfs->next_token;
+    if (sfs_aio_submit(sfs->aio, 1, (void *)buf, size, pos, token, data) != 0) {
+        write_undo(sfs, file->entry, &undo, offset, size, 0);
+        return 0;
     }
+    sfs->stats.bytes_written += size;
+    sfs->next_token++;
+    return token;
 }
 
 
-/****f* sfs/sfs_delete
+/****f* sfs/sfs_poll
  * NAME
- *   sfs_delete -- delete a file form the file system
+ *   sfs_poll -- get the completed asynchronous requests
  * DESCRIPTION
- *   Delete a file from the file system.  Can be used only for files, for
- *   directories sfs_rmdir can be used.
+ *   Stores up to *max* completions in *completions*.  The result of a
+ *   completion is the number of bytes read or written, or -errno; it is
+ *   only shorter than the request at the end of the image.  With io_uring,
+ *   the requests submitted since the last call are given to the kernel
+ *   here, all together, so sfs_poll should be called after a batch of
+ *   sfs_read_async and sfs_write_async.
  * PARAMETERS
- *   SFS - the SFS structure variable
- *   path - the absolute path of the file that should be deleted
+ *   sfs - the SFS structure variable
+ *   completions - array receiving the completions
+ *   max - the size of the array
+ *   wait - if not 0, wait for at least one completion when requests are in
+ *          flight
  * RETURN VALUE
- *   Returns 0 on success and -1 on error.
+ *   Returns the number of completions or -1 on error.
  ******
  */
-// deleted empty files: do not allow in the free list (are never deleted)
-int sfs_delete(struct sfs *sfs, const char *path)
+int sfs_poll(SFS *sfs, struct sfs_completion *completions, int max, int wait)
 {
-    printf("@@@@\tsfs_delete: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_file_by_name(sfs, path);
-    if (entry == NULL) {
-        fprintf(stderr, "file \"%s\" does not exists\n", path);
+    if (sfs->aio == NULL) {
         return -1;
     }
+    return sfs_aio_reap(sfs->aio, completions, max, wait);
+}
 
-    // do not insert empty files into the free list
-    if (entry->data.file_data->file_len == 0) {
-        delete_entry(sfs, entry);
-        return 0;
+
+static size_t iov_size(const struct iovec *iov, int iovcnt)
+{
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size += iov[i].iov_len;
     }
+    return size;
+}
 
-    entry->type = SFS_ENTRY_FILE_DEL;
-    free_list_insert(sfs, entry);
-    if (write_entry(sfs, entry) == 0) {
-        printf("\tdelete(%s): ok\n", path);
+
+/* Fills *size* bytes of the buffers with null bytes, after the first *skip*
+ * bytes */
+static void iov_zero(const struct iovec *iov, size_t skip, size_t size)
+{
+    for (int i = 0; size > 0; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t sz = iov[i].iov_len - skip;
+        if (sz > size) {
+            sz = size;
+        }
+        memset((char *)iov[i].iov_base + skip, 0, sz);
+        skip = 0;
+        size -= sz;
+    }
+}
+
+
+static int file_readv(sfs, entry, iov, iovcnt, offset)
+    SFS *sfs;
+    struct sfs_entry *entry;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+{
+    struct file_data *file_data = entry->data.file_data;
+    uint64_t len = file_data->file_len;
+    if ((uint64_t)offset >= len) {
         return 0;
-    } else {
+    }
+    uint64_t sz = iov_size(iov, iovcnt);
+    if (offset + sz > len) {
+        sz = len - offset;
+    }
+    if (sz == 0) {
+        return 0;
+    }
+    /* the lazy tail is not read from the image */
+    uint64_t from = len - file_data->zero_tail;
+    uint64_t disk = offset + sz <= from ? sz : (uint64_t)offset < from ? from - offset : 0;
+    /* preadv reads as much as the buffers hold: leave out the part after
+     * the end of the file and the lazy tail */
+    int count = 0;
+    size_t total = 0;
+    while (total < disk) {
+        total += iov[count++].iov_len;
+    }
+    struct iovec *v = (struct iovec *)iov;
+    if (total > disk) {
+        v = malloc(count * sizeof(struct iovec));
+        if (v == NULL) {
+            return -1;
+        }
+        memcpy(v, iov, count * sizeof(struct iovec));
+        v[count - 1].iov_len -= total - disk;
+    }
+    int res = disk > 0 ? image_readv(sfs, v, count, disk, sfs->block_size * file_data->start_block + offset) : 0;
+    if (v != iov) {
+        free(v);
+    }
+    if (res != 0) {
         return -1;
     }
+    iov_zero(iov, disk, sz - disk);
+    sfs->stats.bytes_read += sz;
+    file_readahead(sfs, file_data, offset, sz);
+    return sz;
 }
 
 
-int sfs_get_sfs_time(SFS *sfs, struct timespec *timespec)
+static int file_writev(sfs, entry, iov, iovcnt, offset)
+    SFS *sfs;
+    struct sfs_entry *entry;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
 {
-    fill_timespec(sfs->super->time_stamp, timespec);
-    return 0;
+    size_t sz = iov_size(iov, iovcnt);
+    if (sz == 0) {
+        return 0;
+    }
+    struct write_undo undo;
+    write_undo_save(entry->data.file_data, &undo);
+    if (file_write_extend(sfs, entry, NULL, sz, offset) < 0) {
+        return -1;
+    }
+    uint64_t pos = sfs->block_size * entry->data.file_data->start_block + offset;
+    if (image_writev(sfs, iov, iovcnt, sz, pos) != 0) {
+        write_undo(sfs, entry, &undo, offset, sz, 0);
+        return -1;
+    }
+    sfs->stats.bytes_written += sz;
+    return sz;
 }
 
 
-int sfs_get_dir_time(SFS *sfs, const char *path, struct timespec *timespec)
+/****f* sfs/sfs_readv
+ * NAME
+ *   sfs_readv -- read from a file into several buffers
+ * DESCRIPTION
+ *   Like sfs_read, but the data is scattered into the *iovcnt* buffers of
+ *   *iov*, filled in order.  The file is looked up once and the data is
+ *   read with one preadv on the image.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   path - the absolute path of the file
+ *   iov - the buffers
+ *   iovcnt - the number of buffers
+ *   offset - the position in the file
+ * RETURN VALUE
+ *   Returns the number of bytes read or -1 on error.
+ ******
+ */
+int sfs_readv(sfs, path, iov, iovcnt, offset)
+    SFS *sfs;
+    const char *path;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
 {
-    printf("@@@@\tsfs_get_dir_time: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_dir_by_name(sfs, path);
-    if (entry == NULL) {
-        fprintf(stderr, "directory \"%s\" does not exists\n", path);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry == NULL || entry->type != SFS_ENTRY_FILE) {
+        return -1;
+    }
+    return file_readv(sfs, entry, iov, iovcnt, offset);
+}
+
+
+/****f* sfs/sfs_writev
+ * NAME
+ *   sfs_writev -- write to a file from several buffers
+ * DESCRIPTION
+ *   Writes the *iovcnt* buffers of *iov* one after the other at *offset*,
+ *   with one pwritev on the image.  Like sfs_write_extend, the file is
+ *   extended if the data goes beyond its end.
+ * PARAMETERS
+ *   sfs - the SFS structure variable
+ *   path - the absolute path of the file
+ *   iov - the buffers
+ *   iovcnt - the number of buffers
+ *   offset - the position in the file
+ * RETURN VALUE
+ *   Returns the number of bytes written or -1 on error.
+ ******
+ */
+int sfs_writev(sfs, path, iov, iovcnt, offset)
+    SFS *sfs;
+    const char *path;
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+{
+    TRACE_INFO("@@@@\tsfs_writev: path=\"%s\", iovcnt:%d, offset:0x%lx", path, iovcnt, offset);
+    struct sfs_entry *entry = get_file_by_name(sfs, path);
+    if (entry == NULL || entry->type != SFS_ENTRY_FILE) {
         return -1;
     }
-    fill_timespec(entry->data.dir_data->time_stamp, timespec);
-    return 0;
+    return file_writev(sfs, entry, iov, iovcnt, offset);
 }
 
 
-int sfs_get_file_time(SFS *sfs, const char *path, struct timespec *timespec)
+int sfs_readv_fh(SFS *sfs, SFS_FILE *file, const struct iovec *iov, int iovcnt, off_t offset)
 {
-    printf("@@@@\tsfs_get_file_time: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_file_by_name(sfs, path);
-    if (entry == NULL) {
-        fprintf(stderr, "file \"%s\" does not exists\n", path);
+    if (file->entry == NULL) {
         return -1;
     }
-    fill_timespec(entry->data.file_data->time_stamp, timespec);
-    return 0;
+    return file_readv(sfs, file->entry, iov, iovcnt, offset);
 }
 
 
-int sfs_set_time(SFS *sfs, const char *path, struct timespec *timespec)
+int sfs_writev_fh(SFS *sfs, SFS_FILE *file, const struct iovec *iov, int iovcnt, off_t offset)
 {
-    printf("@@@@\tsfs_set_time: name=\"%s\"\n", path);
-    struct sfs_entry *entry = get_entry_by_name(sfs, path);
-    if (entry == NULL) {
-        fprintf(stderr, "File or directory\"%s\" does not exists\n", path);
+    if (file->entry == NULL) {
         return -1;
     }
-    uint64_t time_stamp = timespec_to_time_stamp(timespec);
-    switch (entry->type) {
-    case SFS_ENTRY_DIR:
-        entry->data.dir_data->time_stamp = time_stamp;
-        break;
-    case SFS_ENTRY_FILE:
-        entry->data.file_data->time_stamp = time_stamp;
-        break;
-    }
-    return write_entry(sfs, entry);
+    return file_writev(sfs, file->entry, iov, iovcnt, offset);
 }
 
 
-/****f* sfs/rename_entry
+/****s* sfs/name_set
  * NAME
- *   rename_entry -- rename the entry by deleting the old and inserting the new
+ *   struct name_set -- directory and file entries by name
  * DESCRIPTION
- *   Creates a new entry with all data the same as the entry given, but with a
- *   new name.  The old entry is deleted from the entry list and the new is
- *   inserted.  The changes made to the entry list are also written to the
- *   Index Area.
- * RETURN VALUE
- *   On success returns 0, on error returns -1.
+ *   Open addressing hash table used by sfs_create_many to check many new
+ *   paths without searching the entry list for each of them.
+ * FIELDS
+ *   slots - the entries, NULL for an empty slot
+ *   mask - number of slots - 1 (the number of slots is a power of two)
  ******
  */
-static int rename_entry(SFS *sfs, struct sfs_entry *entry, const char *name)
+struct name_set {
+    struct sfs_entry **slots;
+    uint64_t mask;
+};
+
+
+static uint64_t name_hash(const char *name)
 {
-    struct sfs_entry *new_entry = malloc(sizeof(struct sfs_entry));
-    int path_len = strlen(name);
-    int num_cont = num_cont_from_name(entry->type, path_len);
-    new_entry->type = entry->type;
-    printf("\tpath_len=%d=>num_cont=%d\n", path_len, num_cont);
-    char *buf = calloc(SFS_ENTRY_SIZE * (1 + num_cont), 1);
-    strcpy(buf, name);
-    switch (entry->type) {
-    case SFS_ENTRY_DIR:
-        new_entry->data.dir_data = malloc(sizeof(struct dir_data));
-        new_entry->data.dir_data->num_cont = num_cont;
-        new_entry->data.dir_data->time_stamp = entry->data.dir_data->time_stamp;
-        new_entry->data.dir_data->name = buf;
-        break;
-    case SFS_ENTRY_FILE:
-        new_entry->data.file_data = malloc(sizeof(struct file_data));
-        new_entry->data.file_data->num_cont = num_cont;
-        new_entry->data.file_data->time_stamp = entry->data.file_data->time_stamp;
-        new_entry->data.file_data->start_block = entry->data.file_data->start_block;
-        new_entry->data.file_data->end_block = entry->data.file_data->end_block;
-        new_entry->data.file_data->file_len = entry->data.file_data->file_len;
-        new_entry->data.file_data->name = buf;
-        break;
-    default:
-        break;
+    uint64_t hash = 0xcbf29ce484222325;
+    while (*name != '\0') {
+        hash = (hash ^ (uint8_t)*name++) * 0x100000001b3;
     }
-    delete_entry(sfs, entry);
-    return put_new_entry(sfs, new_entry);
+    return hash;
 }
 
 
-/* Assume: there is no entry with name dest_path.
- * Rename entry <source_path> to <dest_path>.
- * Replace in every file and directory entry that starts with <source_path>/
- * <source_path> with <dest_path>.  Write everything to index area.
- * Return 0 on success and -1 on error.
- */
-static int move_dir(sfs, source_path, dest_path)
-    struct sfs *sfs;
-    const char *source_path;
-    const char *dest_path;
+/* Returns the slot of the entry named name or the empty slot where it would
+ * be put */
+static struct sfs_entry **name_set_slot(struct name_set *set, const char *name)
 {
-    struct sfs_entry *entry = sfs->entry_list;
-    int src_len = strlen(source_path);
-    int dest_len = strlen(dest_path);
-    while (entry != NULL) {
-        char *name = NULL;
-        switch (entry->type) {
-        case SFS_ENTRY_DIR:
-            name = entry->data.dir_data->name;
-            break;
-        case SFS_ENTRY_FILE:
-            name = entry->data.file_data->name;
-            break;
+    uint64_t i = name_hash(name) & set->mask;
+    while (set->slots[i] != NULL && strcmp(get_entry_name(set->slots[i]), name) != 0) {
+        i = (i + 1) & set->mask;
+    }
+    return &set->slots[i];
+}
+
+
+/* Makes a set of the directories and files with space for *extra* more
+ * entries.  Returns 0 on success and -1 on error. */
+static int name_set_init(SFS *sfs, struct name_set *set, size_t extra)
+{
+    uint64_t count = extra;
+    for (struct sfs_entry *entry = sfs->entry_list; entry != NULL; entry = entry->next) {
+        if (entry->type == SFS_ENTRY_DIR || entry->type == SFS_ENTRY_FILE) {
+            ++count;
         }
-        if (name != NULL) {
-            int name_len = strlen(name);
-            if (name_len >= src_len && (name_len == src_len || name[src_len] == '/')
-                    && strncmp(source_path, name, src_len) == 0) {
-                char new_name[dest_len + name_len - src_len + 1];
-                strncpy(new_name, dest_path, dest_len);
-                strncpy(&new_name[dest_len], &name[src_len], name_len - src_len + 1);
-                if (rename_entry(sfs, entry, new_name) == -1) {
-                    return -1;
-                }
-                // TODO: !!! move several entries => !!!
-            }
+    }
+    uint64_t size = 16;
+    while (size < 2 * count) {
+        size *= 2;
+    }
+    set->slots = calloc(size, sizeof(struct sfs_entry *));
+    if (set->slots == NULL) {
+        return -1;
+    }
+    set->mask = size - 1;
+    for (struct sfs_entry *entry = sfs->entry_list; entry != NULL; entry = entry->next) {
+        if (entry->type == SFS_ENTRY_DIR || entry->type == SFS_ENTRY_FILE) {
+            *name_set_slot(set, get_entry_name(entry)) = entry;
         }
-        entry = entry->next;
     }
     return 0;
 }
 
 
-/****f* sfs/sfs_rename
- * NAME
- *   sfs_rename -- rename the file or directory (or move)
- * DESCRIPTION
- *   Move a file or directory from one path to another.  It can replace
- *   existing files if the replace parameter is *true*.
- * PARAMETER
- *   SFS - the SFS structure variable
- *   source_path - the name of the file or directory to rename or move
- *   dest_path - the new name for the file or directory
- *   replace - boolean parameter indicating whether the file or directory
- *             should be replaced
- * RETURN VALUE
- *   Returns 0 on success and -1 on error.
- ******
- */
-int sfs_rename(sfs, source_path, dest_path, replace)
-    SFS *sfs;
-    const char *source_path;
-    const char *dest_path;
-    int replace;
+/* Like check_valid_new, but looks up the path and its parent in the set */
+static int check_valid_new_in(struct name_set *set, const char *path)
 {
-    printf("@@@@\tsfs_rename: \"%s\"->\"%s\"\n", source_path, dest_path);
-    if (strcmp(source_path, dest_path) == 0) {
+    if (*name_set_slot(set, path) != NULL) {
+        TRACE_DEBUG("check valid as new \"%s\": no (already exists)", path);
         return 0;
     }
-    struct sfs_entry *entry = get_entry_by_name(sfs, source_path);
-    if (entry == NULL) {
-        fprintf(stderr, "Source \"%s\" does not exist\n", source_path);
+
+    int path_len = strlen(path);
+    const char *basename = get_basename(path);
+    int basename_len = strlen(basename);
+    if (basename_len == 0) {
+        TRACE_DEBUG("check valid as new \"%s\": empty basename", path);
+        return 0;
+    }
+
+    if (path_len > basename_len) {
+        char parent[path_len];
+        memcpy(parent, path, path_len);
+        parent[path_len - basename_len - 1] = '\0';
+        struct sfs_entry *parent_entry = *name_set_slot(set, parent);
+        if (parent_entry == NULL || parent_entry->type != SFS_ENTRY_DIR) {
+            TRACE_DEBUG("check valid as new \"%s\": no (parent \"%s\" does not exist)",
+                path, parent);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* Makes the entry of a new directory or empty file */
+static struct sfs_entry *new_entry(SFS *sfs, int type, const char *path, int64_t time_stamp)
+{
+    struct sfs_entry *entry = calloc(1, sizeof(struct sfs_entry));
+    int num_cont = num_cont_from_name(type, strlen(path));
+    entry->type = type;
+    if (type == SFS_ENTRY_DIR) {
+        entry->data.dir_data = calloc(1, sizeof(struct dir_data));
+        entry->data.dir_data->num_cont = num_cont;
+        entry->data.dir_data->time_stamp = time_stamp;
+        entry->data.dir_data->name = strdup(path);
+    } else {
+        entry->data.file_data = calloc(1, sizeof(struct file_data));
+        entry->data.file_data->num_cont = num_cont;
+        entry->data.file_data->time_stamp = time_stamp;
+        entry->data.file_data->start_block = sfs->super->rsvd_blocks;
+        entry->data.file_data->end_block = sfs->super->rsvd_blocks - 1;
+        entry->data.file_data->name = strdup(path);
+    }
+    return entry;
+}
+
+
+/* Takes n consecutive blocks from the free list, but never all the blocks
+ * of free_last.  Returns the first block or -1 if not found. */
+static int64_t alloc_blocks(SFS *sfs, uint64_t n)
+{
+    struct block_list **p = free_list_find(sfs, 0, n);
+    if (p == NULL || reaches_free_end(sfs, (*p)->start_block + n)) {
+        sfs->stats.alloc_failures++;
         return -1;
     }
-    if (!check_valid_new(sfs, dest_path)) {
-        fprintf(stderr, "Destination name not valid\n");
+    int64_t start = (*p)->start_block;
+    if (free_list_del(sfs, p, n) != 0) {
         return -1;
     }
-    struct sfs_entry *dest_entry = get_entry_by_name(sfs, dest_path);
-    if (dest_entry != NULL) {
-        if (replace == 0) {
-            fprintf(stderr, "Cannot replace existing file \"%s\"\n", dest_path);
-            return -1;
-        } else {
-            if (entry->type != dest_entry->type) {
-                fprintf(stderr, "Source and destination of different types\n");
-                return -1;
+    return start;
+}
+
+
+/* Gives the blocks of the files among the first count entries back to the
+ * free list, when they cannot be created */
+static void free_files(SFS *sfs, struct sfs_entry **entries, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        struct file_data *file_data = entries[i]->data.file_data;
+        if (entries[i]->type == SFS_ENTRY_FILE && file_data->file_len > 0) {
+            uint64_t length = file_data->end_block - file_data->start_block + 1;
+            free_list_add(sfs, file_data->start_block, length);
+            discard_blocks(sfs, file_data->start_block, length);
+        }
+    }
+    /* free_list_add can merge free_last into the item before it */
+    sfs->free_last = sfs->free_list;
+    while (sfs->free_last->next != NULL) {
+        sfs->free_last = sfs->free_last->next;
+    }
+}
+
+
+/* Gives blocks to the count files of entries, in one area if possible and
+ * else file by file.  On error, the blocks already given are freed again.
+ * Returns 0 on success and -1 on error. */
+static int alloc_files(SFS *sfs, struct sfs_entry **entries, size_t count, uint64_t total)
+{
+    const uint64_t bs = sfs->block_size;
+    int64_t start = alloc_blocks(sfs, total);
+    if (start != -1) {
+        for (size_t i = 0; i < count; ++i) {
+            struct file_data *file_data = entries[i]->data.file_data;
+            if (entries[i]->type == SFS_ENTRY_FILE && file_data->file_len > 0) {
+                file_data->start_block = start;
+                file_data->end_block = start + (file_data->file_len + bs - 1) / bs - 1;
+                start = file_data->end_block + 1;
             }
-            if (dest_entry->type == SFS_ENTRY_DIR) {
-                // check if directory is empty
-                if (!is_dir_empty(sfs, dest_path)) {
-                    fprintf(stderr, "directory \"%s\" is not empty\n", dest_path);
-                    return -1;
-                }
-            } 
-            // delete entry from entry list
-            delete_entry(sfs, dest_entry);
         }
+        return 0;
     }
-    if (entry->type == SFS_ENTRY_DIR) {
-        if (move_dir(sfs, source_path, dest_path) != 0) {
-            return -1;
+
+    for (size_t i = 0; i < count; ++i) {
+        struct file_data *file_data = entries[i]->data.file_data;
+        if (entries[i]->type != SFS_ENTRY_FILE || file_data->file_len == 0) {
+            continue;
         }
-    } else if (entry->type == SFS_ENTRY_FILE) {
-        if (rename_entry(sfs, entry, dest_path) == -1) {
+        start = alloc_blocks(sfs, (file_data->file_len + bs - 1) / bs);
+        if (start == -1) {
+            free_files(sfs, entries, i);
             return -1;
         }
+        file_data->start_block = start;
+        file_data->end_block = start + (file_data->file_len + bs - 1) / bs - 1;
     }
     return 0;
 }
 
 
-/****f* sfs/sfs_write
- * NAME
- *   sfs_write -- write to file from buffer at an offset
- * DESCRIPTION
- *   Write a specified amount of bytes from buffer to file at a specified offset.
- *   If there is not enough space, the file size is not increased (sfs_resize
- *   must be called in such case).  The offset must not be further than the end
- *   of the file.  If the sum of size and the offset is greater than the tota
- *   size of the file, bytes are written only until the end of the file.
- * PARAMETERS
- *   SFS - the SFS structure variable
- *   path - path of the file in the file system
- *   buf - buffer containing bytes to write
- *   size - number of bytes to read from buffer and to write to file
- *   offset - offset in the file where the bytes should be written
- * RETURN VALUE
- *   On error -1 is returned, on success returns the number of bytes written.
- *****
- */
-int sfs_write(SFS *sfs, const char *path, const char *buf, size_t size, off_t offset)
+/* Fills the data of the new files with null bytes, one write for blocks
+ * which follow each other */
+static int zero_files(SFS *sfs, struct sfs_entry **entries, size_t count)
 {
-    printf("@@@@\tsfs_write: path=\"%s\", size:0x%lx, offset:0x%lx\n", path, size, offset);
-    struct sfs_entry *entry = get_file_by_name(sfs, path);
-    if (entry != NULL) {
-        uint64_t sz;		// number of bytes to write
-        uint64_t len = entry->data.file_data->file_len;
-        printf("\toffset=0x%06lx\n", offset);
-        printf("\tlen=0x%06lx\n", len);
-        if ((uint64_t)offset > len) {
-            return 0;
+    const uint64_t bs = sfs->block_size;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (size_t i = 0; i <= count; ++i) {
+        struct file_data *file_data = i < count ? entries[i]->data.file_data : NULL;
+        if (i < count && (entries[i]->type != SFS_ENTRY_FILE || file_data->file_len == 0)) {
+            continue;
         }
-        if (offset + size > len) {
-            sz = len - offset;
-        } else {
-            sz = size;
+        if (file_data != NULL && file_data->start_block == end) {
+            end = file_data->end_block + 1;
+            continue;
         }
-        uint64_t data_offset = sfs->block_size * entry->data.file_data->start_block;
-        uint64_t write_start = data_offset + offset;
-        printf("\tdata_offset=0x%06lx\n", data_offset);
-        printf("\twrite_start=0x%06lx\n", write_start);
-        if (fseek(sfs->file, write_start, SEEK_SET) != 0) {
-            fprintf(stderr, "f!! seek error\n");
+        if (end > start && zero_fill(sfs, start * bs, (end - start) * bs) != 0) {
             return -1;
         }
-        if (fwrite(buf, sz, 1, sfs->file) != 1) {
-            fprintf(stderr, "!! fwrite error\n");
-            return -1;
+        if (file_data != NULL) {
+            start = file_data->start_block;
+            end = file_data->end_block + 1;
         }
-        return sz;
-    } else {
-        fprintf(stderr, "!! no file error\n");
-        return -1;
     }
+    return 0;
 }
 
-
-/****f* sfs/free_list_find
- *  NAME
- *    free_list_find -- find consecutive free block in the free list
- *  DESCRIPTION
- *    Finds consecutive block entries starting from *start_block*.
- *  PARAMETERS
- *    SFS - the SFS structure variable
- *    start_block - the minimum block number for the consecutive blocks
- *    length - minimum length of the consecutive blocks
- *  RETURN VALUE
- *    Returns a pointer to pointer to the found block or NULL if could not find.
- ******
- * Pseudocode:
- *   p: pointer to pointer to the current item, initialized to the free list
- *   pfirst: pointer to pointer to the first item of the consecutive blocks
- *           initialized to the free list
- *   tot: the number of blocks found so far
- *   next: the expected start of the next entry if there are no gaps
- *
- *   do while not at end and not enough blocks in tot:
- *      if next <> current start block then	// means there is a gap
- *        *pfirst = p	// set the first block found to current
- *        tot = 0       // what was found was not enough, starting again
- *      end if
- *      if start block not yet reached then
- *        tot += (*p)->length
- *        next = (*p)->start_block + (*p)->length
- *       end if
- *      set p to next
- *   continue
- *   if tot >= length then return pfirst        // found => return
- *   return NULL      // not found
- * end pseudocode
- */
-struct block_list **free_list_find(sfs, start_block, length)
-    SFS *sfs;
-    uint64_t start_block;
-    uint64_t length;
-{
-    struct block_list **p = &sfs->free_list;
-    struct block_list **pfirst = p;
-    uint64_t tot = 0;
-    uint64_t next = 0;
-    while (*p != NULL && tot < length) {
-        if (next != (*p)->start_block) {
-            pfirst = p;
-            tot = 0;
-        }
-        if (start_block <= (*p)->start_block) {
-            tot += (*p)->length;
-            next = (*p)->start_block + (*p)->length;
+
+/* Puts the count entries after the start marker, moving the start marker by
+ * size bytes in the direction of the superblock, and writes the start marker
+ * and the entries at once.  The superblock is written last: if a write
+ * fails, the old index size and start marker are written back.  The blocks
+ * for the larger Index Area must have been taken from free_last.  Returns 0
+ * on success and -1 on error. */
+static int prepend_entries(SFS *sfs, struct sfs_entry **entries, size_t count, uint64_t size)
+{
+    struct sfs_entry *start = sfs->entry_list;
+    uint64_t start_size = SFS_ENTRY_SIZE * (1 + get_num_cont(start));
+    char *buf = malloc(start_size + size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_INDEX);
+    const uint64_t old_offset = start->offset;
+    start->offset -= size;
+    uint64_t offset = start_size;
+    encode_entry(buf, start);
+    for (size_t i = 0; i < count; ++i) {
+        entries[i]->offset = start->offset + offset;
+        offset += encode_entry(&buf[offset], entries[i]);
+    }
+    int result = image_write(sfs, buf, offset, start->offset);
+    if (result == 0) {
+        sfs->stats.entries_written += offset / SFS_ENTRY_SIZE;
+        sfs->super->index_size += size;
+        result = write_super(sfs);
+        if (result == 0) {
+            sfs->stats.super_writes++;
+        } else {
+            sfs->super->index_size -= size;
+            write_super(sfs);
         }
-        p = &(*p)->next;
     }
-    if (tot >= length) {
-        return pfirst;
+    if (result != 0) {
+        /* the entries may have been written over the old start marker */
+        fprintf(stderr, "prepend_entries: couldn't write %lu entries\n", count);
+        start->offset = old_offset;
+        image_write(sfs, buf, start_size, start->offset);
     }
-    return NULL;
+    phase_leave(sfs, &phase);
+    free(buf);
+    if (result != 0) {
+        return -1;
+    }
+    entries[count - 1]->next = start->next;
+    for (size_t i = count - 1; i > 0; --i) {
+        entries[i - 1]->next = entries[i];
+    }
+    start->next = entries[0];
+    return 0;
 }
 
 
-/****f* sfs/free_list_add
- *  NAME
- *    free_list_add -- add free block to the free list
- *  DESCRIPTION
- *    Adds new blocks into the free list.  If the blocks are before and/or
- *    after existing free list entries, the entries are merged.
- *    Blocks can only be merged with blocks which have delfile NULL.
- *  PARAMETERS
- *    SFS - the SFS structure variable
- *    start - the block where the new free area starts
- *    length - the number of blocks in the new free area
- *  RETURN VALUE
- *    Returns 0 on success and -1 on error.
+static void free_entries(struct sfs_entry **entries, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        free_entry(entries[i]);
+    }
+    free(entries);
+}
+
+
+/****f* sfs/sfs_create_many
+ * NAME
+ *   sfs_create_many -- create many directories and files at once
+ * DESCRIPTION
+ *   Creates the directories and files described by the count items of
+ *   *entries*, in order, so that a directory must come before its contents.
+ *   A file is given *size* null bytes, or *size* bytes left as they are in
+ *   the image with the flag SFS_CREATE_NOFILL, when the caller writes them
+ *   itself.  The first block of each file is stored in the start_block field
+ *   of its item.  The paths are checked against a hash
+ *   table of the existing entries before anything is changed.  The blocks of
+ *   the files are allocated together, in one area if possible, and the new
+ *   entries are put after the start marker and written with it in one write.
+ *   Unused entries of the Index Area are not reused.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   entries - the path, type (SFS_TYPE_DIR or SFS_TYPE_FILE) and size of the
+ *             new entries
+ *   count - the number of new entries
+ *   flags - 0 or SFS_CREATE_NOFILL
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.  If a path is not valid or there
+ *   is not enough space, nothing is created.
  ******
- * Pseudocode:
- *   item: current block list item
- *   prev: previous item
- *
- *   while item != NULL    // return 0 when found
- *     if cannot merge with current then
- *       if start + length = item->start then
- *         item->start -= length
- *         return 0
- *       else if start + length < item->start
- *         insert new item bewteen prev and item
- *         return 0
- *       end if
- *     else if prev->start + prev->next = start then
- *       if start + length < item->start
- *       || (start + length = item->start && item->delfile != NULL)
- *         prev->length += length
- *         return 0
- *       else if start + length = item->start
- *         prev->length += length + item->length
- *         prev->next = item->next
- *         free prev
- *         return 0
- *       end if
- *       prev = item
- *       item = item->next
- *   end while
- *   return -1
- *
  */
-static int free_list_add(SFS *sfs, uint64_t start, uint64_t length)
+int sfs_create_many(SFS *sfs, struct sfs_new_entry *entries, size_t count, int flags)
 {
-    struct block_list *prev = NULL;
-    struct block_list *item = sfs->free_list;
-
-    if (length == 0) {
+    TRACE_INFO("@@@\tsfs_create_many: %lu entries", count);
+    const uint64_t bs = sfs->block_size;
+    if (count == 0) {
         return 0;
     }
+    struct name_set set;
+    if (name_set_init(sfs, &set, count) != 0) {
+        return -1;
+    }
 
-    printf("[[free_list_add: start=0x%06lx length=0x%06lx]]\n", start, length);
-    while (item != NULL) {
-        if (prev == NULL || prev->start_block + prev->length < start
-                || (prev->start_block + prev->length == start
-                    && prev->delfile != NULL)) {
-            if (start + length == item->start_block) {
-                item->start_block -= length;
-                return 0;
-            } else if (start + length < item->start_block) {
-                struct block_list *new_item = malloc(sizeof(struct block_list));
-                new_item->start_block = start;
-                new_item->length = length;
-                new_item->delfile = NULL;
-                new_item->next = item;
-                if (prev != NULL) {
-                    prev->next = new_item;
-                } else {
-                    sfs->free_list = new_item;
-                }
-              return 0;
-            }
-        } else if (prev->start_block + prev->length == start) {
-            if (start + length < item->start_block
-                    || (start + length == item->start_block
-                        && item->delfile != NULL)) {
-                prev->length += length;
-                return 0;
-            } else if (start + length == item->start_block) {
-                prev->length += length + item->length;
-                prev->next = item->next;
-                free(item);
-                return 0;
-            }
+    /* make the entries and compute the space needed */
+    struct sfs_entry **new_entries = calloc(count, sizeof(struct sfs_entry *));
+    int64_t time_stamp = make_time_stamp();
+    uint64_t index_size = 0;
+    uint64_t data_blocks = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const char *path = entries[i].path;
+        int type = entries[i].type == SFS_TYPE_DIR ? SFS_ENTRY_DIR : SFS_ENTRY_FILE;
+        if (!check_valid_new_in(&set, path)) {
+            fprintf(stderr, "sfs_create_many: cannot create \"%s\"\n", path);
+            free(set.slots);
+            free_entries(new_entries, i);
+            return -1;
+        }
+        new_entries[i] = new_entry(sfs, type, path, time_stamp);
+        *name_set_slot(&set, path) = new_entries[i];
+        index_size += SFS_ENTRY_SIZE * (1 + get_num_cont(new_entries[i]));
+        if (type == SFS_ENTRY_FILE) {
+            new_entries[i]->data.file_data->file_len = entries[i].size;
+            data_blocks += (entries[i].size + bs - 1) / bs;
         }
-        prev = item;
-        item = item->next;
     }
-    return -1;
+    free(set.slots);
+
+    /* take the blocks of the Index Area first, so that the files cannot use
+     * them, but leave at least one block in free_last */
+    uint64_t isz = sfs->super->index_size;
+    uint64_t ibt = (isz + bs - 1) / bs * bs;
+    uint64_t index_blocks = isz + index_size > ibt ? (isz + index_size - ibt + bs - 1) / bs : 0;
+    if (sfs->free_last == NULL || sfs->free_last->length <= index_blocks) {
+        fprintf(stderr, "sfs_create_many: no space left for %lu entries\n", count);
+        free_entries(new_entries, count);
+        return -1;
+    }
+    sfs->free_last->length -= index_blocks;
+    discard_claim(sfs, sfs->free_last->start_block + sfs->free_last->length, index_blocks);
+    struct phase phase;
+    phase_enter(sfs, &phase, SFS_PHASE_ALLOC);
+    int allocated = data_blocks == 0 || alloc_files(sfs, new_entries, count, data_blocks) == 0;
+    phase_leave(sfs, &phase);
+    if (!allocated) {
+        fprintf(stderr, "sfs_create_many: no space left for 0x%lx blocks\n", data_blocks);
+        discard_blocks(sfs, sfs->free_last->start_block + sfs->free_last->length, index_blocks);
+        sfs->free_last->length += index_blocks;
+        free_entries(new_entries, count);
+        return -1;
+    }
+
+    if ((!(flags & SFS_CREATE_NOFILL) && zero_files(sfs, new_entries, count) != 0)
+            || prepend_entries(sfs, new_entries, count, index_size) != 0) {
+        /* give back the blocks of the files and of the Index Area */
+        free_files(sfs, new_entries, count);
+        discard_blocks(sfs, sfs->free_last->start_block + sfs->free_last->length, index_blocks);
+        sfs->free_last->length += index_blocks;
+        free_entries(new_entries, count);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (new_entries[i]->type == SFS_ENTRY_FILE) {
+            entries[i].start_block = new_entries[i]->data.file_data->start_block;
+        }
+    }
+    free(new_entries);
+    return 0;
 }
 
 
-/****f* sfs/free_list_del
- *  NAME
- *    free_list_del -- delete free blocks from free list
- *  DESCRIPTION
- *    Deletes free blocks from the free list, so that they can be used.
- *    Several free list entries can be deleted and at most one can be resized,
- *    so that the beginning is moved forward and the length becomes smaller.
- *    Deleted block entries are freed and if they reference a deleted file, it's
- *    deleted from the entry list.
- *  PARAMETERS
- *    SFS - the SFS structure variable
- *    p_from - pointer to pointer to the block list entry where the search begins
- *    length - the number of blocks needed
- *  RETURN VALUE
- *    Returns 0 on success and -1 on error.
+/****f* sfs/sfs_mark_unusable
+ * NAME
+ *   sfs_mark_unusable -- mark free blocks as unusable
+ * DESCRIPTION
+ *   Adds an unusable entry for the blocks *start_block* to *end_block*, so
+ *   that they are never given to a file, as for bad sectors.  The blocks
+ *   must be in one free gap, not in a deleted file, and cannot be the end
+ *   of the Free Area, which the Index Area grows into.
+ * PARAMETERS
+ *   SFS - the SFS structure variable
+ *   start_block - first unusable block
+ *   end_block - last unusable block
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
  ******
- * Pseudocode:
- *   rest: remaining blocks to delete, initialized to length
- *   p: pointer to pointer to current block, initialized to p_from
- *
- *   do while (not at end) and (rest <= length):
- *     rest := rest - current length
- *     if delfile in *p then delete it
- *     free current item
- *   continue
- *   // here = at-end or rest < length
- *   if at-end then error (no more space left) and return
- *   last element:
- *     length -= rest
- *     start block: advance rest times
- * end pseidocode
  */
-static int free_list_del(SFS *sfs, struct block_list **p_from, uint64_t length)
+int sfs_mark_unusable(SFS *sfs, uint64_t start_block, uint64_t end_block)
 {
-    uint64_t rest = length;
-    struct block_list **p = p_from;
-    while (*p != NULL && (*p)->length <= rest) {
-        struct block_list *tmp = (*p);
-        rest -= (*p)->length;
-        *p = (*p)->next;
-        if (tmp->delfile != NULL) {
-            delete_entries(&sfs->free_list, tmp->delfile, tmp->delfile->next);
-        }
-        free(tmp);
+    TRACE_INFO("@@@\tsfs_mark_unusable: 0x%lx-0x%lx", start_block, end_block);
+    if (end_block < start_block
+            || free_list_take(sfs, start_block, end_block + 1 - start_block) != 0) {
+        fprintf(stderr, "sfs_mark_unusable error: blocks 0x%lx-0x%lx are not free\n",
+                start_block, end_block);
+        return -1;
     }
-    if (*p == NULL) {
+
+    struct sfs_entry *entry = calloc(1, sizeof(struct sfs_entry));
+    entry->type = SFS_ENTRY_UNUSABLE;
+    entry->data.unusable_data = malloc(sizeof(struct unusable_data));
+    entry->data.unusable_data->start_block = start_block;
+    entry->data.unusable_data->end_block = end_block;
+    if (put_new_entry(sfs, entry) != 0) {
+        free_entry(entry);
+        free_list_add(sfs, start_block, end_block + 1 - start_block);
         return -1;
     }
-    (*p)->length -= rest;
-    (*p)->delfile = NULL;
-    (*p)->start_block += rest;
     return 0;
 }
 
 
-/****f* sfs/sfs_resize
+/****f* sfs/sfs_mkfs
  * NAME
- *   sfs_resize -- resize a file
+ *   sfs_mkfs -- create an empty filesystem
  * DESCRIPTION
- *   Resize a file *path* to size *len*.  Truncate the file if its size
- *   is less than *len*.  Otherwise, fills with null characters.
+ *   Writes an empty SFS filesystem into the file *filename*, which is
+ *   created if it does not exist.  A regular file is given the size of the
+ *   filesystem, without writing the Data Area, which reads as null bytes.
+ *   The reserved blocks hold the superblock.  The Index Area has the start
+ *   marker, unused entries and the volume entry.
  * PARAMETERS
- *   SFS - the SFS structure variable
- *   path - the absolute path of the file
- *   len - the new size for the file
+ *   filename - the image file or device
+ *   total_blocks - the size of the filesystem in blocks
+ *   block_size - the size of a block in bytes, a power of two from 128
+ *   index_size - the initial size of the Index Area in bytes (rounded up to
+ *                whole entries), so that entries can be created without
+ *                growing it
+ *   volume_name - the name of the volume
  * RETURN VALUE
  *   Returns 0 on success and -1 on error.
  ******
- * Pseudocode:
- *   l0 - initial file size
- *   l1 - final file size
- *   b0 - initial number of blocks used by the file
- *   b1 - number of block needed for its new size
- *   s0 - the first block of the file
- *   file_entry - file entry in the Index Area
- *
- *   if b1 > b0 then    // file is to small
- *     p_next = free_list_find(sfs, s0 + l0, b1 - b0)
- *     if next <> null then     // enough space right after the file
- *       free_list_del(sfs, p_next, b1 - b0)
- *     else                     // not enough space: find some blocks
- *       delete the file (add it to free list)
- *       p_blocks = free_list_find(sfs, 0, b1)
- *       delete from free list
- *       copy the file contents: b0*bs bytes from s0 to start of p_blocks
- *     end if
- *     set file_entry start: s0
- *   else if b0 > b1    // file is to big => free b0-b1 blocks after the file
- *     free_list_add(sfs, s0 + b0, b0 - b1)
- *   end if
- *   if l1 > l0 then
- *     fill l1 - l0 bytes after the file contents with '\0'
- *   end if
- *   write_entry(sfs, file_entry)
  */
-int sfs_resize(SFS *sfs, const char *path, off_t len)
+int sfs_mkfs(filename, total_blocks, block_size, index_size, volume_name)
+    const char *filename;
+    uint64_t total_blocks;
+    int block_size;
+    uint64_t index_size;
+    const char *volume_name;
 {
-    const uint64_t bs = sfs->block_size;
-    printf("@@@@\tsfs_resize: name=\"%s\" length=%ld\n", path, len);
-    struct sfs_entry *file_entry = get_file_by_name(sfs, path);
-    if (file_entry == NULL) {
-        fprintf(stderr, "file \"%s\" does not exists\n", path);
+    TRACE_INFO("@@@\tsfs_mkfs: \"%s\" blocks=0x%lx block_size=%d", filename, total_blocks, block_size);
+    if (block_size < 128 || (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "sfs_mkfs error: bad block size %d\n", block_size);
         return -1;
     }
-    if (file_entry->type != SFS_ENTRY_FILE) {
-        fprintf(stderr, "\"%s\" is not a file\n", path);
+    int shift = 7;
+    while ((1 << shift) < block_size) {
+        ++shift;
+    }
+    uint64_t entries = (index_size + SFS_ENTRY_SIZE - 1) / SFS_ENTRY_SIZE;
+    if (entries < 2) {
+        entries = 2;
+    }
+    index_size = entries * SFS_ENTRY_SIZE;
+    const uint32_t rsvd_blocks = (SFS_SUPER_START + SFS_SUPER_SIZE + block_size - 1) / block_size;
+    const uint64_t index_blocks = (index_size + block_size - 1) / block_size;
+    if (total_blocks < rsvd_blocks + index_blocks + 1) {
+        fprintf(stderr, "sfs_mkfs error: %lu blocks are not enough\n", total_blocks);
         return -1;
     }
-    const uint64_t l0 = file_entry->data.file_data->file_len;
-    const uint64_t l1 = (uint64_t)len;
-    const uint64_t b0 = (l0 + bs - 1) / bs;
-    const uint64_t b1 = (len + bs - 1) / bs;
-    const uint64_t s0 = file_entry->data.file_data->start_block;
-    uint64_t s1;
-    if (b1 > b0) {
-        struct block_list **p_next = free_list_find(sfs, s0 + b0, b1 - b0);
-        if (*p_next != NULL && (*p_next)->start_block == s0 + b0) {
-            if (l0 == 0) {
-                s1 = (*p_next)->start_block;
-                file_entry->data.file_data->start_block = s0;
-            } else {
-                s1 = s0;
-            }
-            free_list_del(sfs, p_next, b1 - b0);
-        } else {
-            if (free_list_add(sfs, s0, b0) != 0) {
-                return -1;
-            }
-            struct block_list **p_blocks = free_list_find(sfs, 0, b1);
-            if (*p_blocks == NULL) {
-                return -1;
-            }
-            s1 = (*p_blocks)->start_block;
-            if (free_list_del(sfs, p_blocks, b1) != 0) {
-                return -1;
-            }
-            for (uint64_t i = 0; i < b0; ++i) {
-                char buf[bs];
-                fseek(sfs->file, (s0 + i) * bs, SEEK_SET);
-                fread(buf, bs, 1, sfs->file);
-                fseek(sfs->file, (s1 + i) * bs, SEEK_SET);
-                fwrite(buf, bs, 1, sfs->file);
-            }
-            file_entry->data.file_data->start_block = s1;
-        }
-    } else if (b0 > b1) {
-        if (free_list_add(sfs, s0 + b1, b0 - b1)) {
-            return -1;
-        }
-        s1 = s0;
+
+    FILE *file = fopen(filename, "w+");
+    if (file == NULL) {
+        perror("sfs_mkfs error");
+        return -1;
     }
-    if (l1 > l0) {
-        char c[l1-l0];
-        memset(c, 0, l1-l0);
-        fseek(sfs->file, s1 * bs + l0, SEEK_SET);
-        fwrite(&c, l1 - l0, 1, sfs->file);
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)
+            && ftruncate(fileno(file), total_blocks * block_size) != 0) {
+        perror("sfs_mkfs error");
+        fclose(file);
+        return -1;
     }
-    file_entry->data.file_data->file_len = l1;
-    file_entry->data.file_data->end_block = s1 + (l1 + sfs->block_size - 1) / sfs->block_size - 1;
-    if (write_entry(sfs, file_entry) != 0) {
+
+    struct sfs_super super;
+    super.data_size = 0;
+    super.index_size = index_size;
+    super.total_blocks = total_blocks;
+    super.rsvd_blocks = rsvd_blocks;
+    super.block_size = shift - 7;
+    char super_buf[SFS_SUPER_SIZE];
+    encode_super(super_buf, &super);
+    if (pwrite(fileno(file), super_buf, SFS_SUPER_SIZE, SFS_SUPER_START) != SFS_SUPER_SIZE) {
+        fprintf(stderr, "sfs_mkfs error: couldn't write the superblock\n");
+        fclose(file);
         return -1;
     }
-    return 0;
+
+    /* the start marker, unused entries and the volume entry */
+    char *buf = malloc(index_size);
+    if (buf == NULL) {
+        fprintf(stderr, "sfs_mkfs error: couldn't allocate the Index Area\n");
+        fclose(file);
+        return -1;
+    }
+    struct sfs_entry entry;
+    memset(&entry, 0, sizeof(struct sfs_entry));
+    entry.type = SFS_ENTRY_START;
+    encode_entry(buf, &entry);
+    entry.type = SFS_ENTRY_UNUSED;
+    for (uint64_t i = 1; i < entries - 1; ++i) {
+        encode_entry(&buf[i * SFS_ENTRY_SIZE], &entry);
+    }
+    struct volume_data volume_data;
+    volume_data.time_stamp = super.time_stamp;
+    volume_data.name = (char *)volume_name;
+    entry.type = SFS_ENTRY_VOL_ID;
+    entry.data.volume_data = &volume_data;
+    encode_entry(&buf[index_size - SFS_ENTRY_SIZE], &entry);
+
+    int result = 0;
+    if (pwrite(fileno(file), buf, index_size, total_blocks * block_size - index_size)
+            != (ssize_t)index_size) {
+        fprintf(stderr, "sfs_mkfs error: couldn't write the Index Area\n");
+        result = -1;
+    }
+    free(buf);
+    if (fclose(file) != 0) {
+        perror("sfs_mkfs error");
+        result = -1;
+    }
+    return result;
 }
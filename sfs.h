@@ -1,10 +1,99 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
+#include <sys/uio.h>
 
 struct sfs;
 typedef struct sfs SFS;
 
+struct sfs_file;
+typedef struct sfs_file SFS_FILE;
+
+#define SFS_ROOT_INO 1
+
+#define SFS_TYPE_DIR 1
+#define SFS_TYPE_FILE 2
+
+struct sfs_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t blocks;
+    uint64_t capacity;
+};
+
+/* Phases of the work of the library, timed for sfs_get_phase_hist */
+enum sfs_phase {
+    SFS_PHASE_LOOKUP,           /* finding a path in the entry list */
+    SFS_PHASE_ALLOC,            /* finding and taking free blocks */
+    SFS_PHASE_RELOCATE,         /* copying a file being moved */
+    SFS_PHASE_INDEX,            /* writing index entries and the superblock */
+    SFS_PHASE_COUNT
+};
+
+/* Operations on the free list, timed in struct sfs_stats */
+enum sfs_free_op {
+    SFS_FREE_FIND,              /* finding free blocks */
+    SFS_FREE_ADD,               /* giving blocks back */
+    SFS_FREE_DEL,               /* taking found blocks */
+    SFS_FREE_OP_COUNT
+};
+
+struct sfs_hist;
+
+/* Counters of the work done by the library since sfs_init */
+struct sfs_stats {
+    uint64_t lookups;           /* paths looked up in the entry list */
+    uint64_t lookup_entries;    /* entries compared by these lookups */
+    uint64_t entries_written;   /* index entries written, with continuations */
+    uint64_t super_writes;      /* superblock writes */
+    uint64_t relocations;       /* files moved to grow them */
+    uint64_t blocks_relocated;  /* blocks copied by these moves */
+    uint64_t free_extents;      /* free list extents walked */
+    uint64_t bytes_read;        /* file data read */
+    uint64_t bytes_written;     /* file data written */
+    uint64_t bytes_extent;      /* file data given by sfs_extent_fh */
+    uint64_t alloc_failures;    /* allocations without enough free blocks */
+    uint64_t discards;          /* free ranges queued for punching holes */
+    uint64_t blocks_discarded;  /* blocks of these ranges */
+    uint64_t phase_ns[SFS_PHASE_COUNT]; /* time in each phase, nested excluded */
+    uint64_t free_list_calls[SFS_FREE_OP_COUNT]; /* calls of the free list */
+    uint64_t free_list_ns[SFS_FREE_OP_COUNT];    /* time in these calls, if timed */
+};
+
+/* The free space of the Data Area, for measuring fragmentation */
+struct sfs_free_stats {
+    uint64_t extents;           /* runs of free blocks, the Free Area included */
+    uint64_t blocks;            /* free blocks, the Free Area included */
+    uint64_t largest;           /* blocks of the largest run */
+    uint64_t free_area;         /* blocks of the Free Area before the index */
+};
+
+#define SFS_ASYNC_THREADS 1
+
+struct sfs_completion {
+    uint64_t token;
+    void *data;
+    int64_t result;
+};
+
+#define SFS_CREATE_NOFILL 1
+
+struct sfs_new_entry {
+    const char *path;
+    int type;
+    uint64_t size;
+    uint64_t start_block;
+};
+
+struct sfs_stat {
+    uint64_t ino;
+    int type;
+    uint64_t size;
+    struct timespec time;
+    uint64_t start_block;
+    uint64_t end_block;
+};
+
 SFS *sfs_init(const char *filename);
 
 int sfs_terminate(SFS *sfs);
@@ -19,6 +108,10 @@ const char *sfs_first(SFS *sfs, const char *path);
 
 const char *sfs_next(SFS *sfs, const char *path);
 
+const char *sfs_first_stat(SFS *sfs, const char *path, struct sfs_stat *st);
+
+const char *sfs_next_stat(SFS *sfs, const char *path, struct sfs_stat *st);
+
 int sfs_read(SFS *sfs, const char *path, char *buf, size_t size, off_t offset);
 
 int sfs_mkdir(SFS *sfs, const char *path);
@@ -42,3 +135,94 @@ int sfs_rename(SFS *sfs, const char *path, const char *path_to, int replace);
 int sfs_write(SFS *sfs, const char *path, const char *buf, size_t size, off_t offset);
 
 int sfs_resize(SFS *sfs, const char *path, off_t length);
+
+uint64_t sfs_lookup(SFS *sfs, uint64_t parent, const char *name);
+
+void sfs_forget(SFS *sfs, uint64_t ino, uint64_t nlookup);
+
+const char *sfs_get_path(SFS *sfs, uint64_t ino);
+
+int sfs_stat(SFS *sfs, const char *path, struct sfs_stat *st);
+
+int sfs_stat_ino(SFS *sfs, uint64_t ino, struct sfs_stat *st);
+
+const char *sfs_first_ino(SFS *sfs, uint64_t dir, struct sfs_stat *st);
+
+const char *sfs_next_ino(SFS *sfs, uint64_t dir, struct sfs_stat *st);
+
+const char *sfs_first_entry(SFS *sfs, struct sfs_stat *st);
+
+const char *sfs_next_entry(SFS *sfs, struct sfs_stat *st);
+
+int sfs_get_block_size(SFS *sfs);
+
+int sfs_read_ino(SFS *sfs, uint64_t ino, char *buf, size_t size, off_t offset);
+
+int sfs_write_ino(SFS *sfs, uint64_t ino, const char *buf, size_t size, off_t offset);
+
+int sfs_resize_ino(SFS *sfs, uint64_t ino, off_t length);
+
+int sfs_set_time_ino(SFS *sfs, uint64_t ino, struct timespec *timespec);
+
+SFS_FILE *sfs_open(SFS *sfs, const char *path);
+
+SFS_FILE *sfs_open_ino(SFS *sfs, uint64_t ino);
+
+int sfs_release(SFS *sfs, SFS_FILE *file);
+
+int sfs_stat_fh(SFS *sfs, SFS_FILE *file, struct sfs_stat *st);
+
+int sfs_read_fh(SFS *sfs, SFS_FILE *file, char *buf, size_t size, off_t offset);
+
+int sfs_write_fh(SFS *sfs, SFS_FILE *file, const char *buf, size_t size, off_t offset);
+
+int sfs_write_extend(SFS *sfs, const char *path, const char *buf, size_t size, off_t offset);
+
+int sfs_write_extend_fh(SFS *sfs, SFS_FILE *file, const char *buf, size_t size, off_t offset);
+
+int sfs_write_finish_fh(SFS *sfs, SFS_FILE *file, off_t offset, size_t size, size_t written);
+
+int sfs_resize_fh(SFS *sfs, SFS_FILE *file, off_t length);
+
+int sfs_extent_fh(SFS *sfs, SFS_FILE *file, off_t offset, size_t size, int *fd, off_t *pos);
+
+int sfs_set_cache(SFS *sfs, size_t blocks);
+
+void sfs_get_cache_stats(SFS *sfs, struct sfs_cache_stats *stats);
+
+void sfs_get_stats(SFS *sfs, struct sfs_stats *stats);
+
+void sfs_get_free_stats(SFS *sfs, struct sfs_free_stats *stats);
+
+const struct sfs_hist *sfs_get_phase_hist(SFS *sfs, int phase);
+
+const char *sfs_phase_name(int phase);
+
+void sfs_set_readahead(SFS *sfs, size_t max);
+
+void sfs_set_lazy_zero(SFS *sfs, int lazy);
+
+int sfs_set_discard(SFS *sfs, int enable);
+
+int sfs_async_init(SFS *sfs, unsigned depth, int flags);
+
+uint64_t sfs_read_async(SFS *sfs, SFS_FILE *file, char *buf, size_t size, off_t offset, void *data);
+
+uint64_t sfs_write_async(SFS *sfs, SFS_FILE *file, const char *buf, size_t size, off_t offset, void *data);
+
+int sfs_poll(SFS *sfs, struct sfs_completion *completions, int max, int wait);
+
+int sfs_readv(SFS *sfs, const char *path, const struct iovec *iov, int iovcnt, off_t offset);
+
+int sfs_writev(SFS *sfs, const char *path, const struct iovec *iov, int iovcnt, off_t offset);
+
+int sfs_readv_fh(SFS *sfs, SFS_FILE *file, const struct iovec *iov, int iovcnt, off_t offset);
+
+int sfs_writev_fh(SFS *sfs, SFS_FILE *file, const struct iovec *iov, int iovcnt, off_t offset);
+
+int sfs_create_many(SFS *sfs, struct sfs_new_entry *entries, size_t count, int flags);
+
+int sfs_mark_unusable(SFS *sfs, uint64_t start_block, uint64_t end_block);
+
+int sfs_mkfs(const char *filename, uint64_t total_blocks, int block_size,
+             uint64_t index_size, const char *volume_name);
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "sfs.h"
+#include "sfs_aio.h"
+
+/****h* sfs/sfs_aio
+ * NAME
+ *   sfs_aio -- asynchronous I/O on the image file
+ * DESCRIPTION
+ *   Requests are kept in a fixed array of slots (the queue depth).  With
+ *   io_uring, each request is one readv/writev submission entry whose
+ *   user_data is the slot number.  The entries are only queued by
+ *   sfs_aio_submit and given to the kernel together, with one
+ *   io_uring_enter, by the next sfs_aio_reap.  A short read or write is
+ *   submitted again for the rest, so that a completion covers the whole
+ *   range as with the threads.  When io_uring cannot be set up (old
+ *   kernel, seccomp) or SFS_ASYNC_THREADS is given, the requests are queued
+ *   to a few threads doing pread/pwrite.  In both cases submitting and
+ *   reaping are done by the thread using the SFS structure.
+ ******
+ */
+
+#define SFS_AIO_THREADS 4
+
+struct aio_req {
+    struct iovec iov;
+    int write;
+    uint64_t pos;
+    uint64_t token;
+    void *data;
+    int64_t result;
+    size_t done;                /* bytes already transferred with io_uring */
+    int next_free;
+    struct aio_req *next;       /* in the queue or done list */
+};
+
+struct sfs_aio {
+    int fd;
+    unsigned depth;
+    struct aio_req *reqs;
+    int free_slot;
+    unsigned in_flight;
+
+    int ring_fd;                /* -1 when the threads are used */
+    unsigned sq_queued;         /* entries not yet given to the kernel */
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    size_t sqes_size;
+
+    pthread_t threads[SFS_AIO_THREADS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    struct aio_req *queue_head;
+    struct aio_req *queue_tail;
+    struct aio_req *done_head;  /* with io_uring: refused by the kernel */
+    struct aio_req *done_tail;
+    int stop;
+};
+
+
+static int uring_setup(struct sfs_aio *aio)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (aio->ring_fd < 0) {
+        aio->ring_fd = -1;
+        return -1;
+    }
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_size > aio->sq_ring_size) {
+            aio->sq_ring_size = aio->cq_ring_size;
+        }
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+    if (aio->sq_ring == MAP_FAILED) {
+        goto err_close;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+        if (aio->cq_ring == MAP_FAILED) {
+            goto err_sq;
+        }
+    }
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+    if (aio->sqes == MAP_FAILED) {
+        goto err_cq;
+    }
+    aio->sq_tail = (unsigned *)((char *)aio->sq_ring + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)((char *)aio->sq_ring + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)((char *)aio->sq_ring + params.sq_off.array);
+    aio->cq_head = (unsigned *)((char *)aio->cq_ring + params.cq_off.head);
+    aio->cq_tail = (unsigned *)((char *)aio->cq_ring + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)((char *)aio->cq_ring + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ring + params.cq_off.cqes);
+    return 0;
+
+err_cq:
+    if (aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+err_sq:
+    munmap(aio->sq_ring, aio->sq_ring_size);
+err_close:
+    close(aio->ring_fd);
+    aio->ring_fd = -1;
+    return -1;
+}
+
+
+static void uring_free(struct sfs_aio *aio)
+{
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring != aio->sq_ring) {
+        munmap(aio->cq_ring, aio->cq_ring_size);
+    }
+    munmap(aio->sq_ring, aio->sq_ring_size);
+    close(aio->ring_fd);
+}
+
+
+static void uring_queue(struct sfs_aio *aio, int slot)
+{
+    struct aio_req *req = &aio->reqs[slot];
+    unsigned tail = *aio->sq_tail;
+    unsigned index = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = aio->fd;
+    sqe->off = req->pos;
+    sqe->addr = (uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    aio->sq_array[index] = index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    aio->sq_queued++;
+}
+
+
+static void done_add(struct sfs_aio *aio, struct aio_req *req)
+{
+    req->next = NULL;
+    if (aio->done_tail != NULL) {
+        aio->done_tail->next = req;
+    } else {
+        aio->done_head = req;
+    }
+    aio->done_tail = req;
+}
+
+
+/* Gives the queued entries to the kernel with one system call, waiting for
+ * a completion if wait is set.  The entries refused by the kernel are
+ * taken back and completed with the error.  Returns -1 on error. */
+static int uring_enter(struct sfs_aio *aio, int wait)
+{
+    unsigned queued = aio->sq_queued;
+    if (queued == 0 && !wait) {
+        return 0;
+    }
+    int ret = syscall(__NR_io_uring_enter, aio->ring_fd, queued, wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) {
+        aio->sq_queued -= ret;
+        return 0;
+    }
+    if (errno == EINTR) {
+        return 0;
+    }
+    if (queued == 0) {
+        return -1;
+    }
+    int error = errno;
+    unsigned tail = *aio->sq_tail - queued;
+    for (unsigned i = 0; i < queued; ++i) {
+        struct io_uring_sqe *sqe = &aio->sqes[(tail + i) & *aio->sq_mask];
+        struct aio_req *req = &aio->reqs[sqe->user_data];
+        req->result = -error;
+        done_add(aio, req);
+    }
+    __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+    aio->sq_queued = 0;
+    return 0;
+}
+
+
+/* Returns 1 if the request is finished with res, or queues the rest of a
+ * short transfer and returns 0 */
+static int uring_result(struct sfs_aio *aio, int slot, int res)
+{
+    struct aio_req *req = &aio->reqs[slot];
+    if (res == -EINTR || res == -EAGAIN) {
+        uring_queue(aio, slot);
+        return 0;
+    }
+    if (res < 0) {
+        req->result = res;
+        return 1;
+    }
+    req->done += res;
+    req->result = req->done;
+    if (res == 0 || (size_t)res == req->iov.iov_len) {
+        return 1;
+    }
+    req->iov.iov_base = (char *)req->iov.iov_base + res;
+    req->iov.iov_len -= res;
+    req->pos += res;
+    uring_queue(aio, slot);
+    return 0;
+}
+
+
+/* Reads or writes the whole request, returns the number of bytes or -errno */
+static int64_t transfer(int fd, struct aio_req *req)
+{
+    size_t done = 0;
+    while (done < req->iov.iov_len) {
+        char *p = (char *)req->iov.iov_base + done;
+        size_t size = req->iov.iov_len - done;
+        ssize_t n = req->write ? pwrite(fd, p, size, req->pos + done)
+                               : pread(fd, p, size, req->pos + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -errno;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+
+static void *worker(void *arg)
+{
+    struct sfs_aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;) {
+        while (aio->queue_head == NULL && !aio->stop) {
+            pthread_cond_wait(&aio->queued, &aio->lock);
+        }
+        struct aio_req *req = aio->queue_head;
+        if (req == NULL) {
+            break;
+        }
+        aio->queue_head = req->next;
+        pthread_mutex_unlock(&aio->lock);
+
+        req->result = transfer(aio->fd, req);
+
+        pthread_mutex_lock(&aio->lock);
+        done_add(aio, req);
+        pthread_cond_signal(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+
+static int threads_setup(struct sfs_aio *aio)
+{
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->queued, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    for (aio->num_threads = 0; aio->num_threads < SFS_AIO_THREADS; ++aio->num_threads) {
+        if (pthread_create(&aio->threads[aio->num_threads], NULL, worker, aio) != 0) {
+            break;
+        }
+    }
+    return aio->num_threads > 0 ? 0 : -1;
+}
+
+
+static void threads_free(struct sfs_aio *aio)
+{
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->queued);
+    pthread_mutex_unlock(&aio->lock);
+    for (int i = 0; i < aio->num_threads; ++i) {
+        pthread_join(aio->threads[i], NULL);
+    }
+    pthread_cond_destroy(&aio->done);
+    pthread_cond_destroy(&aio->queued);
+    pthread_mutex_destroy(&aio->lock);
+}
+
+
+static void threads_submit(struct sfs_aio *aio, int slot)
+{
+    struct aio_req *req = &aio->reqs[slot];
+    req->next = NULL;
+    pthread_mutex_lock(&aio->lock);
+    if (aio->queue_head != NULL) {
+        aio->queue_tail->next = req;
+    } else {
+        aio->queue_head = req;
+    }
+    aio->queue_tail = req;
+    pthread_cond_signal(&aio->queued);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+
+/****f* sfs_aio/sfs_aio_new
+ * NAME
+ *   sfs_aio_new -- start asynchronous I/O on a file descriptor
+ * PARAMETERS
+ *   fd - the file descriptor
+ *   depth - the maximum number of requests in flight
+ *   flags - SFS_ASYNC_THREADS to use the threads even if io_uring works
+ * RETURN VALUE
+ *   Returns the new structure or NULL on error.
+ ******
+ */
+struct sfs_aio *sfs_aio_new(int fd, unsigned depth, int flags)
+{
+    struct sfs_aio *aio = calloc(1, sizeof(struct sfs_aio));
+    if (aio == NULL) {
+        return NULL;
+    }
+    aio->fd = fd;
+    aio->depth = depth;
+    aio->reqs = calloc(depth, sizeof(struct aio_req));
+    if (aio->reqs == NULL) {
+        free(aio);
+        return NULL;
+    }
+    for (unsigned i = 0; i < depth; ++i) {
+        aio->reqs[i].next_free = i + 1 < depth ? (int)i + 1 : -1;
+    }
+    aio->free_slot = 0;
+    aio->ring_fd = -1;
+    if ((flags & SFS_ASYNC_THREADS) || uring_setup(aio) != 0) {
+        if (threads_setup(aio) != 0) {
+            fprintf(stderr, "sfs_aio_new error: couldn't start the I/O threads\n");
+            threads_free(aio);
+            free(aio->reqs);
+            free(aio);
+            return NULL;
+        }
+    }
+    return aio;
+}
+
+
+int sfs_aio_uses_uring(struct sfs_aio *aio)
+{
+    return aio->ring_fd != -1;
+}
+
+
+/* Waits for the requests in flight and frees the structure */
+void sfs_aio_free(struct sfs_aio *aio)
+{
+    struct sfs_completion completion;
+    while (aio->in_flight > 0) {
+        if (sfs_aio_reap(aio, &completion, 1, 1) < 0) {
+            break;
+        }
+    }
+    if (aio->ring_fd != -1) {
+        uring_free(aio);
+    } else {
+        threads_free(aio);
+    }
+    free(aio->reqs);
+    free(aio);
+}
+
+
+/* Starts reading or writing size bytes at pos; with io_uring the request is
+ * only queued until the next sfs_aio_reap.  Returns 0 on success and -1 on
+ * error (including when depth requests are already in flight). */
+int sfs_aio_submit(aio, write, buf, size, pos, token, data)
+    struct sfs_aio *aio;
+    int write;
+    void *buf;
+    size_t size;
+    uint64_t pos;
+    uint64_t token;
+    void *data;
+{
+    int slot = aio->free_slot;
+    if (slot == -1) {
+        return -1;
+    }
+    struct aio_req *req = &aio->reqs[slot];
+    req->iov.iov_base = buf;
+    req->iov.iov_len = size;
+    req->write = write;
+    req->pos = pos;
+    req->token = token;
+    req->data = data;
+    req->done = 0;
+    if (aio->ring_fd != -1) {
+        uring_queue(aio, slot);
+    } else {
+        threads_submit(aio, slot);
+    }
+    aio->free_slot = req->next_free;
+    aio->in_flight++;
+    return 0;
+}
+
+
+static void complete(struct sfs_aio *aio, int slot, int64_t result, struct sfs_completion *c)
+{
+    struct aio_req *req = &aio->reqs[slot];
+    c->token = req->token;
+    c->data = req->data;
+    c->result = result;
+    req->next_free = aio->free_slot;
+    aio->free_slot = slot;
+    aio->in_flight--;
+}
+
+
+/* Completes the requests of the done list after the n first completions */
+static int done_reap(aio, completions, n, max)
+    struct sfs_aio *aio;
+    struct sfs_completion *completions;
+    int n;
+    int max;
+{
+    while (n < max && aio->done_head != NULL) {
+        struct aio_req *req = aio->done_head;
+        aio->done_head = req->next;
+        if (aio->done_head == NULL) {
+            aio->done_tail = NULL;
+        }
+        complete(aio, req - aio->reqs, req->result, &completions[n++]);
+    }
+    return n;
+}
+
+
+/* Stores up to max completed requests in completions, waiting for one if
+ * wait is set and requests are in flight.  Returns the number of completed
+ * requests or -1 on error. */
+int sfs_aio_reap(aio, completions, max, wait)
+    struct sfs_aio *aio;
+    struct sfs_completion *completions;
+    int max;
+    int wait;
+{
+    int n = 0;
+    if (aio->ring_fd != -1) {
+        if (uring_enter(aio, 0) != 0) {
+            return -1;
+        }
+        n = done_reap(aio, completions, n, max);
+        unsigned head = *aio->cq_head;
+        while (n < max) {
+            unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                if (n > 0 || !wait || aio->in_flight == 0) {
+                    break;
+                }
+                __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+                if (uring_enter(aio, 1) != 0) {
+                    return -1;
+                }
+                n = done_reap(aio, completions, n, max);
+                continue;
+            }
+            struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+            int slot = cqe->user_data;
+            if (uring_result(aio, slot, cqe->res)) {
+                complete(aio, slot, aio->reqs[slot].result, &completions[n++]);
+            }
+            head++;
+        }
+        __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+        /* the rest of the short transfers */
+        if (uring_enter(aio, 0) != 0) {
+            return -1;
+        }
+        return n;
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    while (wait && aio->done_head == NULL && aio->in_flight > 0) {
+        pthread_cond_wait(&aio->done, &aio->lock);
+    }
+    n = done_reap(aio, completions, n, max);
+    pthread_mutex_unlock(&aio->lock);
+    return n;
+}
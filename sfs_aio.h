@@ -0,0 +1,20 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/* Asynchronous reads and writes on a file descriptor, with io_uring or, if
+ * it is not available, with a pool of threads.  Used by sfs.c for the
+ * sfs_*_async functions. */
+struct sfs_aio;
+struct sfs_completion;
+
+struct sfs_aio *sfs_aio_new(int fd, unsigned depth, int flags);
+
+void sfs_aio_free(struct sfs_aio *aio);
+
+int sfs_aio_submit(struct sfs_aio *aio, int write, void *buf, size_t size,
+                   uint64_t pos, uint64_t token, void *data);
+
+int sfs_aio_reap(struct sfs_aio *aio, struct sfs_completion *completions,
+                 int max, int wait);
+
+int sfs_aio_uses_uring(struct sfs_aio *aio);
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sfs.h"
+#include "sfs_util.h"
+
+/****h* sfs/sfs_alloc_sim
+ * NAME
+ *   sfs_alloc_sim -- aging simulator of the block allocator
+ * DESCRIPTION
+ *   sfs_alloc_sim [-n ops] [-f files] [-z min,max] [-m c,g,s,d] [-s size]
+ *                 [-b size] [-i ops] [-r seed] [-o image]
+ *
+ *   Creates -f files (default 2000) of -z min,max bytes (default 0,64K,
+ *   uniform on a log scale), then runs -n operations (default 1000000)
+ *   through the library on a volume kept in memory (a memfd, or the file
+ *   -o), so that the real free list code allocates the blocks.  The
+ *   operations are chosen at random with the percentages -m (default
+ *   30,30,10,30):
+ *     c  creates a file, unless there are twice -f files
+ *     g  grows a file by a size drawn like the first sizes, which moves it
+ *        when the blocks after it are not free
+ *     s  shrinks a file to half its size
+ *     d  deletes a file
+ *   With as many creations as deletions, the number of files stays around
+ *   -f.  The volume has blocks of -b bytes (default 512) and -s bytes
+ *   (default: three times the expected size of the files).
+ *
+ *   Every -i operations (default a tenth of them), a line gives the use of
+ *   the volume and the quality of the free space: the runs of free blocks,
+ *   the largest one, the external fragmentation (1 - largest / free), the
+ *   relocations and the bytes they copied, and the operations which failed
+ *   for lack of a large enough run.  At the end, the calls of
+ *   free_list_find, free_list_add and free_list_del are given with the
+ *   time spent in them.  The random choices come from the seed -r, so
+ *   that allocation policies can be compared on the same operations.
+ ******
+ */
+
+#define DEFAULT_OPS 1000000
+#define DEFAULT_FILES 2000
+#define DEFAULT_SIZE_MAX (64 << 10)
+#define DEFAULT_BLOCK_SIZE 512
+#define NAME_LEN 24
+
+/* a live file, kept open so that resizing does not look up its path */
+struct sim_file {
+    char name[NAME_LEN];
+    SFS_FILE *fh;
+    uint64_t size;
+};
+
+struct sim {
+    SFS *sfs;
+    uint64_t rng;
+    uint64_t size_min;
+    uint64_t size_max;
+    int mix[4];
+    uint64_t max_files;
+    struct sim_file *files;
+    uint64_t count;
+    uint64_t next_id;
+    uint64_t used_blocks;
+    uint64_t failures;
+    int block_size;
+};
+
+
+static uint64_t sim_rand(struct sim *sim)
+{
+    return sfs_util_rand(&sim->rng);
+}
+
+
+static uint64_t sim_range(struct sim *sim, uint64_t n)
+{
+    return n == 0 ? 0 : sim_rand(sim) % n;
+}
+
+
+/* A size between size_min and size_max, uniform on a log scale */
+static uint64_t sim_size(struct sim *sim)
+{
+    double u = (sim_rand(sim) >> 11) / 9007199254740992.0;
+    double lo = log(sim->size_min + 1.0);
+    double hi = log(sim->size_max + 1.0);
+    uint64_t size = exp(lo + u * (hi - lo)) - 1.0;
+    return size > sim->size_max ? sim->size_max : size;
+}
+
+
+static uint64_t blocks_of(struct sim *sim, uint64_t size)
+{
+    return (size + sim->block_size - 1) / sim->block_size;
+}
+
+
+static void sim_create(struct sim *sim)
+{
+    struct sim_file *file = &sim->files[sim->count];
+    snprintf(file->name, NAME_LEN, "f%lu", sim->next_id++);
+    file->size = sim_size(sim);
+    if (sfs_create(sim->sfs, file->name) != 0
+            || (file->fh = sfs_open(sim->sfs, file->name)) == NULL) {
+        sim->failures++;
+        return;
+    }
+    sim->count++;
+    if (sfs_resize_fh(sim->sfs, file->fh, file->size) != 0) {
+        sim->failures++;
+        file->size = 0;
+    }
+    sim->used_blocks += blocks_of(sim, file->size);
+}
+
+
+static void sim_resize(struct sim *sim, struct sim_file *file, uint64_t size)
+{
+    if (sfs_resize_fh(sim->sfs, file->fh, size) != 0) {
+        sim->failures++;
+        return;
+    }
+    sim->used_blocks += blocks_of(sim, size);
+    sim->used_blocks -= blocks_of(sim, file->size);
+    file->size = size;
+}
+
+
+static void sim_delete(struct sim *sim, uint64_t i)
+{
+    struct sim_file *file = &sim->files[i];
+    if (sfs_delete(sim->sfs, file->name) != 0) {
+        sim->failures++;
+        return;
+    }
+    sfs_release(sim->sfs, file->fh);
+    sim->used_blocks -= blocks_of(sim, file->size);
+    sim->files[i] = sim->files[--sim->count];
+}
+
+
+static void sim_op(struct sim *sim)
+{
+    int choice = sim_range(sim, 100);
+    if (sim->count == 0 || (choice < sim->mix[0] && sim->count < 2 * sim->max_files)) {
+        sim_create(sim);
+        return;
+    }
+    uint64_t i = sim_range(sim, sim->count);
+    if (choice < sim->mix[0] + sim->mix[1]) {
+        sim_resize(sim, &sim->files[i], sim->files[i].size + sim_size(sim));
+    } else if (choice < sim->mix[0] + sim->mix[1] + sim->mix[2]) {
+        sim_resize(sim, &sim->files[i], sim->files[i].size / 2);
+    } else {
+        sim_delete(sim, i);
+    }
+}
+
+
+static void report_header(void)
+{
+    printf("%10s %8s %6s %8s %12s %7s %10s %12s %9s\n", "ops", "files", "used",
+           "runs", "largest", "frag", "relocs", "copied", "failures");
+}
+
+
+static void report(struct sim *sim, uint64_t ops)
+{
+    struct sfs_free_stats free_stats;
+    struct sfs_stats stats;
+    sfs_get_free_stats(sim->sfs, &free_stats);
+    sfs_get_stats(sim->sfs, &stats);
+    uint64_t total = sim->used_blocks + free_stats.blocks;
+    printf("%10lu %8lu %5.1f%% %8lu %12lu %6.1f%% %10lu %8.1f MiB %9lu\n",
+           ops, sim->count, total > 0 ? 100.0 * sim->used_blocks / total : 0,
+           free_stats.extents, free_stats.largest,
+           free_stats.blocks > 0 ? 100.0 * (1 - (double)free_stats.largest / free_stats.blocks) : 0,
+           stats.relocations, (double)stats.blocks_relocated * sim->block_size / (1 << 20),
+           sim->failures);
+}
+
+
+static void report_free_list(struct sim *sim, uint64_t ops, double time)
+{
+    static const char *names[SFS_FREE_OP_COUNT] = {
+        "free_list_find", "free_list_add", "free_list_del"
+    };
+    struct sfs_stats stats;
+    sfs_get_stats(sim->sfs, &stats);
+    printf("%lu operations in %.2f s, %.0f ops/s, %lu free list items walked\n",
+           ops, time, time > 0 ? ops / time : 0, stats.free_extents);
+    printf("  %-16s %12s %12s %12s\n", "function", "calls", "time (ms)", "ns/call");
+    for (int op = 0; op < SFS_FREE_OP_COUNT; ++op) {
+        uint64_t calls = stats.free_list_calls[op];
+        printf("  %-16s %12lu %12.1f %12.1f\n", names[op], calls,
+               stats.free_list_ns[op] / 1e6,
+               calls > 0 ? (double)stats.free_list_ns[op] / calls : 0);
+    }
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n ops] [-f files] [-z min,max] [-m c,g,s,d] [-s size] [-b size] [-i ops] [-r seed] [-o image]\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct sim sim;
+    memset(&sim, 0, sizeof(struct sim));
+    uint64_t ops = DEFAULT_OPS;
+    uint64_t interval = 0;
+    uint64_t volume_size = 0;
+    uint64_t seed = 1;
+    const char *image = NULL;
+    char *comma;
+    int bad = 0;
+    int opt;
+    sim.max_files = DEFAULT_FILES;
+    sim.size_max = DEFAULT_SIZE_MAX;
+    sim.block_size = DEFAULT_BLOCK_SIZE;
+    sim.mix[0] = 30;
+    sim.mix[1] = 30;
+    sim.mix[2] = 10;
+    sim.mix[3] = 30;
+    while ((opt = getopt(argc, argv, "n:f:z:m:s:b:i:r:o:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            sim.max_files = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            comma = strchr(optarg, ',');
+            if (comma == NULL) {
+                bad = 1;
+                break;
+            }
+            *comma = '\0';
+            sim.size_min = strcmp(optarg, "0") == 0 ? 0 : sfs_util_parse_size(optarg);
+            sim.size_max = sfs_util_parse_size(comma + 1);
+            bad |= sim.size_max == 0;
+            break;
+        case 'm':
+            bad |= sscanf(optarg, "%d,%d,%d,%d", &sim.mix[0], &sim.mix[1],
+                          &sim.mix[2], &sim.mix[3]) != 4;
+            break;
+        case 's':
+            volume_size = sfs_util_parse_size(optarg);
+            bad |= volume_size == 0;
+            break;
+        case 'b':
+            sim.block_size = atoi(optarg);
+            break;
+        case 'i':
+            interval = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        default:
+            bad = 1;
+        }
+    }
+    if (bad || argc != optind || ops == 0 || sim.max_files == 0 || sim.size_max < sim.size_min
+            || sim.mix[0] < 0 || sim.mix[1] < 0 || sim.mix[2] < 0 || sim.mix[3] < 0
+            || sim.mix[0] + sim.mix[1] + sim.mix[2] + sim.mix[3] != 100 || sim.block_size < 128
+            || (sim.block_size & (sim.block_size - 1)) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (interval == 0) {
+        interval = ops >= 10 ? ops / 10 : 1;
+    }
+    sim.rng = seed * 0x9e3779b97f4a7c15ull + 1;
+    if (volume_size == 0) {
+        double lo = sim.size_min + 1.0;
+        double hi = sim.size_max + 1.0;
+        double mean_size = hi > lo ? (hi - lo) / log(hi / lo) - 1.0 : lo - 1.0;
+        volume_size = 3 * sim.max_files * ((uint64_t)mean_size + sim.block_size)
+                      + 2 * sim.max_files * 64 + (1 << 20);
+    }
+
+    /* the image lives in memory, reached through /proc for sfs_init */
+    char path[64];
+    int fd = -1;
+    if (image == NULL) {
+        fd = memfd_create("sfs_alloc_sim", 0);
+        if (fd == -1) {
+            perror("memfd_create");
+            return 1;
+        }
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        image = path;
+    }
+    if (sfs_mkfs(image, volume_size / sim.block_size, sim.block_size, 4096, "sim") != 0
+            || (sim.sfs = sfs_init(image)) == NULL) {
+        fprintf(stderr, "couldn't make the volume\n");
+        return 1;
+    }
+    sim.files = malloc(2 * sim.max_files * sizeof(struct sim_file));
+
+    printf("%lu blocks of %d bytes, up to %lu files of %lu to %lu bytes, mix %d,%d,%d,%d, seed %lu\n",
+           volume_size / sim.block_size, sim.block_size, sim.max_files, sim.size_min,
+           sim.size_max, sim.mix[0], sim.mix[1], sim.mix[2], sim.mix[3], seed);
+    report_header();
+    while (sim.count < sim.max_files && sim.failures == 0) {
+        sim_create(&sim);
+    }
+    report(&sim, 0);
+    double t0 = sfs_util_now();
+    for (uint64_t i = 1; i <= ops; ++i) {
+        sim_op(&sim);
+        if (i % interval == 0 || i == ops) {
+            report(&sim, i);
+        }
+    }
+    double time = sfs_util_now() - t0;
+    report_free_list(&sim, ops, time);
+
+    for (uint64_t i = 0; i < sim.count; ++i) {
+        sfs_release(sim.sfs, sim.files[i].fh);
+    }
+    sfs_terminate(sim.sfs);
+    free(sim.files);
+    if (fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include "sfs.h"
+#include "sfs_util.h"
+
+/****h* sfs/sfs_bench
+ * NAME
+ *   sfs_bench -- microbenchmarks of the library operations
+ * DESCRIPTION
+ *   sfs_bench [-e entries,...] [-f percent] [-n ops] [-d files] [-b size]
+ *             [-r seed] [-o image]
+ *
+ *   For each number of entries, a volume is generated with that many files
+ *   in directories of -d files (default 100), with sizes of 0 to 8 blocks.
+ *   Then -f percent of the files (default 10) are deleted to fragment the
+ *   free space.  Each operation is run -n times (default 1000, fewer for
+ *   the mount) and its throughput and latency percentiles are printed, with
+ *   the memory used by the mounted volume per entry.
+ *
+ *   The volumes are written to -o (default sfs_bench.img), with blocks of
+ *   -b bytes (default 512).  The random choices are made from the seed -r,
+ *   so that runs can be compared.
+ ******
+ */
+
+#define DEFAULT_ENTRIES "1000,10000,100000"
+#define DEFAULT_FRAGMENTATION 10
+#define DEFAULT_OPS 1000
+#define DEFAULT_FILES_PER_DIR 100
+#define MOUNT_OPS 10
+#define MAX_FILE_BLOCKS 8
+#define NAME_LEN 48
+
+struct bench {
+    const char *image;
+    int block_size;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t files_per_dir;
+    int ops;
+    char (*names)[NAME_LEN];
+    char *deleted;
+    double *times;
+};
+
+
+static void report(struct bench *bench, const char *op, int count, int errors)
+{
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += bench->times[i];
+    }
+    qsort(bench->times, count, sizeof(double), sfs_util_compare_double);
+    printf("  %-16s %8d %12.0f %12.1f %12.1f%s\n", op, count,
+           total > 0 ? count / total : 0,
+           bench->times[count / 2] * 1e6,
+           bench->times[(count * 99) / 100] * 1e6,
+           errors > 0 ? "  (errors)" : "");
+}
+
+
+/* A random live file, NULL if there is none */
+static const char *random_file(struct bench *bench)
+{
+    for (int tries = 0; tries < 1000; ++tries) {
+        uint64_t i = rand() % bench->files;
+        if (!bench->deleted[i]) {
+            return bench->names[bench->dirs + i];
+        }
+    }
+    return NULL;
+}
+
+
+/* Makes a volume with the files and directories, then deletes
+ * fragmentation percent of the files */
+static int generate(struct bench *bench, int fragmentation)
+{
+    const uint64_t count = bench->dirs + bench->files;
+    const uint64_t bs = bench->block_size;
+    struct sfs_new_entry *entries = malloc(count * sizeof(struct sfs_new_entry));
+    uint64_t data_blocks = 0;
+    for (uint64_t i = 0; i < bench->dirs; ++i) {
+        snprintf(bench->names[i], NAME_LEN, "d%lu", i);
+        entries[i].path = bench->names[i];
+        entries[i].type = SFS_TYPE_DIR;
+        entries[i].size = 0;
+    }
+    for (uint64_t i = 0; i < bench->files; ++i) {
+        struct sfs_new_entry *entry = &entries[bench->dirs + i];
+        snprintf(bench->names[bench->dirs + i], NAME_LEN, "d%lu/f%lu", i / bench->files_per_dir, i);
+        entry->path = bench->names[bench->dirs + i];
+        entry->type = SFS_TYPE_FILE;
+        entry->size = rand() % (MAX_FILE_BLOCKS * bs + 1);
+        data_blocks += (entry->size + bs - 1) / bs;
+    }
+
+    /* room for the entries and data of the operations */
+    uint64_t index_blocks = (count + 4 * bench->ops) * 2 * 64 / bs;
+    uint64_t total_blocks = 16 + data_blocks + index_blocks + 4 * bench->ops * 4 * MAX_FILE_BLOCKS;
+    if (sfs_mkfs(bench->image, total_blocks, bs, 4096, "bench") != 0) {
+        free(entries);
+        return -1;
+    }
+    SFS *sfs = sfs_init(bench->image);
+    if (sfs == NULL) {
+        free(entries);
+        return -1;
+    }
+    int result = sfs_create_many(sfs, entries, count, SFS_CREATE_NOFILL);
+    free(entries);
+
+    memset(bench->deleted, 0, bench->files);
+    uint64_t to_delete = bench->files * fragmentation / 100;
+    for (uint64_t n = 0; result == 0 && n < to_delete; ++n) {
+        uint64_t i = rand() % bench->files;
+        if (!bench->deleted[i]) {
+            result = sfs_delete(sfs, bench->names[bench->dirs + i]);
+            bench->deleted[i] = 1;
+        }
+    }
+    sfs_terminate(sfs);
+    return result;
+}
+
+
+static void bench_mount(struct bench *bench)
+{
+    int count = bench->ops < MOUNT_OPS ? bench->ops : MOUNT_OPS;
+    size_t used = 0;
+    for (int i = 0; i < count; ++i) {
+        struct mallinfo2 before = mallinfo2();
+        double t0 = sfs_util_now();
+        SFS *sfs = sfs_init(bench->image);
+        bench->times[i] = sfs_util_now() - t0;
+        struct mallinfo2 after = mallinfo2();
+        used = after.uordblks - before.uordblks;
+        sfs_terminate(sfs);
+    }
+    report(bench, "mount", count, 0);
+    printf("  %-16s %8.1f bytes/entry\n", "memory", (double)used / (bench->dirs + bench->files));
+}
+
+
+/* Runs the operations which do not change the volume much, on one mount */
+static void bench_ops(struct bench *bench)
+{
+    SFS *sfs = sfs_init(bench->image);
+    const int ops = bench->ops;
+    struct sfs_stat st;
+    char name[NAME_LEN + 8];
+    int errors;
+
+    errors = 0;
+    for (int i = 0; i < ops; ++i) {
+        const char *path = random_file(bench);
+        double t0 = sfs_util_now();
+        errors += sfs_stat(sfs, path, &st) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "lookup", ops, errors);
+
+    errors = 0;
+    for (int i = 0; i < ops; ++i) {
+        const char *dir = bench->names[rand() % bench->dirs];
+        double t0 = sfs_util_now();
+        for (const char *s = sfs_first(sfs, dir); s != NULL; s = sfs_next(sfs, dir)) {
+        }
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "list dir", ops, errors);
+
+    /* new empty files, then grown by one block */
+    errors = 0;
+    srand(ops);
+    for (int i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), "%s/new%d", bench->names[rand() % bench->dirs], i);
+        double t0 = sfs_util_now();
+        errors += sfs_create(sfs, name) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "create", ops, errors);
+
+    errors = 0;
+    srand(ops);
+    for (int i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), "%s/new%d", bench->names[rand() % bench->dirs], i);
+        double t0 = sfs_util_now();
+        errors += sfs_resize(sfs, name, bench->block_size) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "resize grow", ops, errors);
+
+    /* files followed by other files: they have to be moved */
+    errors = 0;
+    for (int i = 0; i < ops; ++i) {
+        const char *path = random_file(bench);
+        uint64_t size = sfs_get_file_size(sfs, path);
+        double t0 = sfs_util_now();
+        errors += sfs_resize(sfs, path, size + 4 * MAX_FILE_BLOCKS * bench->block_size) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "resize relocate", ops, errors);
+
+    errors = 0;
+    srand(ops);
+    for (int i = 0; i < ops; ++i) {
+        snprintf(name, sizeof(name), "%s/new%d", bench->names[rand() % bench->dirs], i);
+        double t0 = sfs_util_now();
+        errors += sfs_delete(sfs, name) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+    }
+    report(bench, "delete", ops, errors);
+
+    /* renamed and renamed back, only the first rename is counted */
+    errors = 0;
+    for (int i = 0; i < ops; ++i) {
+        const char *path = random_file(bench);
+        snprintf(name, sizeof(name), "%s.r", path);
+        double t0 = sfs_util_now();
+        errors += sfs_rename(sfs, path, name, 0) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+        sfs_rename(sfs, name, path, 0);
+    }
+    report(bench, "rename file", ops, errors);
+
+    errors = 0;
+    for (int i = 0; i < ops; ++i) {
+        const char *dir = bench->names[rand() % bench->dirs];
+        snprintf(name, sizeof(name), "%s.r", dir);
+        double t0 = sfs_util_now();
+        errors += sfs_rename(sfs, dir, name, 0) != 0;
+        bench->times[i] = sfs_util_now() - t0;
+        sfs_rename(sfs, name, dir, 0);
+    }
+    report(bench, "rename dir", ops, errors);
+
+    sfs_terminate(sfs);
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-e entries,...] [-f percent] [-n ops] [-d files] [-b size] [-r seed] [-o image]\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct bench bench;
+    const char *entries = DEFAULT_ENTRIES;
+    int fragmentation = DEFAULT_FRAGMENTATION;
+    unsigned seed = 1;
+    int opt;
+    bench.image = "sfs_bench.img";
+    bench.block_size = 512;
+    bench.files_per_dir = DEFAULT_FILES_PER_DIR;
+    bench.ops = DEFAULT_OPS;
+    while ((opt = getopt(argc, argv, "e:f:n:d:b:r:o:")) != -1) {
+        switch (opt) {
+        case 'e':
+            entries = optarg;
+            break;
+        case 'f':
+            fragmentation = atoi(optarg);
+            break;
+        case 'n':
+            bench.ops = atoi(optarg);
+            break;
+        case 'd':
+            bench.files_per_dir = atoi(optarg);
+            break;
+        case 'b':
+            bench.block_size = atoi(optarg);
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        case 'o':
+            bench.image = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (bench.ops < 1 || bench.files_per_dir < 1 || fragmentation < 0 || fragmentation > 90
+            || bench.block_size < 128 || (bench.block_size & (bench.block_size - 1)) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (const char *p = entries; *p != '\0'; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        bench.files = strtoull(p, NULL, 10);
+        if (bench.files == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        bench.dirs = (bench.files + bench.files_per_dir - 1) / bench.files_per_dir;
+        bench.names = malloc((bench.dirs + bench.files) * NAME_LEN);
+        bench.deleted = malloc(bench.files);
+        bench.times = malloc(bench.ops * sizeof(double));
+
+        srand(seed);
+        double t0 = sfs_util_now();
+        if (generate(&bench, fragmentation) != 0) {
+            fprintf(stderr, "couldn't generate the volume\n");
+            return 1;
+        }
+        printf("%lu files in %lu directories, %d%% deleted (generated in %.1f s)\n",
+               bench.files, bench.dirs, fragmentation, sfs_util_now() - t0);
+        printf("  %-16s %8s %12s %12s %12s\n", "operation", "ops", "ops/s", "p50 (us)", "p99 (us)");
+        bench_mount(&bench);
+        bench_ops(&bench);
+
+        free(bench.names);
+        free(bench.deleted);
+        free(bench.times);
+    }
+    unlink(bench.image);
+    return 0;
+}
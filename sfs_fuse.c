@@ -7,9 +7,16 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include "sfs.h"
+#include "sfs_trace.h"
+#include "sfs_record.h"
+#include "sfs_hist.h"
+#include "sfs_util.h"
 
 #ifndef RENAME_NOREPLACE
 #define RENAME_NOREPLACE (1 << 0)
@@ -23,7 +30,9 @@
  *  NAME
  *    sfs_fuse -- FUSE interface for the sfs implementation
  *  DESCRIPTION
- *    FUSE interface implementing severatl FUSE functions.
+ *    FUSE interface implementing severatl FUSE functions.  The counters of
+ *    the library can be read in the file .sfs_stats at the root, which is
+ *    not listed.
  ******
  */
 
@@ -33,6 +42,14 @@ static struct options {
     const char *filename;
     char *absolute_filename;
     int show_help;
+    int trace_level;
+    int trace_echo;
+    const char *trace_dump;
+    const char *record;
+    int slow_ms;
+    const char *slow_log;
+    int lazy_zero;
+    int discard;
 } options;
 
 #define OPTION(t, p)                           \
@@ -42,80 +59,245 @@ static const struct fuse_opt option_spec[] = {
     OPTION("--name=%s", filename),
     OPTION("-h", show_help),
     OPTION("--help", show_help),
+    OPTION("--trace=%d", trace_level),
+    OPTION("--trace-echo", trace_echo),
+    OPTION("--trace-dump=%s", trace_dump),
+    OPTION("--record=%s", record),
+    OPTION("--slow-ms=%d", slow_ms),
+    OPTION("--slow-log=%s", slow_log),
+    OPTION("--lazy-zero", lazy_zero),
+    OPTION("--discard", discard),
     FUSE_OPT_END
 };
 
 static void *sfs_fuse_init(struct fuse_conn_info *conn,
                         struct fuse_config *cfg)
 {
-    printf("### sfs_fuse_init: fn=\"%s\"\n", options.absolute_filename);
+    TRACE_DEBUG("### sfs_fuse_init: fn=\"%s\"", options.absolute_filename);
     sfs = sfs_init(options.absolute_filename);
+    if (sfs == NULL) {
+        /* init cannot fail: end the session before any request */
+        fprintf(stderr, "couldn't mount the volume %s\n", options.absolute_filename);
+        struct fuse_context *context = fuse_get_context();
+        if (context != NULL && context->fuse != NULL) {
+            fuse_exit(context->fuse);
+        }
+        return NULL;
+    }
+    sfs_set_lazy_zero(sfs, options.lazy_zero);
+    if (options.discard && sfs_set_discard(sfs, 1) != 0) {
+        fprintf(stderr, "cannot enable discard\n");
+    }
     cfg->kernel_cache = 1;
+    /* readdir fills the attributes anyway: always use readdirplus */
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+    /* read_buf and write_buf use the image fd: let the data be spliced */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE | (conn->capable & FUSE_CAP_SPLICE_MOVE);
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
     return NULL;
 }
 
 static void sfs_fuse_destroy(void *private_data)
 {
-    printf("### sfs_fuse_destroy\n");
+    TRACE_DEBUG("### sfs_fuse_destroy");
+    if (sfs == NULL) {
+        return;
+    }
     sfs_terminate(sfs);
     sfs = NULL;
 }
 
-static const char *fix_path(const char *path)
+/* latency of each operation, in ns */
+static struct sfs_hist op_hist[SFS_OP_COUNT];
+
+#define HISTS_SIZE ((SFS_OP_COUNT + SFS_PHASE_COUNT + 1) * SFS_HIST_LINE)
+
+/* Writes the latency histograms of the operations and of the phases of the
+ * library into buf, of HISTS_SIZE bytes, one per line.  Only
+ * async-signal-safe functions are used.  Returns the length. */
+static int format_hists(char *buf)
 {
-    char *result = (char *)path;
-    while (*result == '/')
-        result++;
-    return result;
+    static const char header[] = "# latency (ns): count avg p50 p90 p99 p99.9 max\n";
+    char name[SFS_HIST_LINE];
+    int len = strlen(header);
+    memcpy(buf, header, len);
+    for (int op = 0; op < SFS_OP_COUNT; ++op) {
+        strcpy(name, "op_");
+        strcat(name, sfs_record_op_name(op));
+        len += sfs_hist_format(&buf[len], name, &op_hist[op]);
+    }
+    for (int phase = 0; sfs != NULL && phase < SFS_PHASE_COUNT; ++phase) {
+        strcpy(name, "phase_");
+        strcat(name, sfs_phase_name(phase));
+        len += sfs_hist_format(&buf[len], name, sfs_get_phase_hist(sfs, phase));
+    }
+    return len;
 }
 
-static int sfs_fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info* fi)
+/* Read-only file, not listed, giving the counters of the library and the
+ * latency histograms */
+#define STATS_PATH "/.sfs_stats"
+#define STATS_SIZE (2048 + HISTS_SIZE)
+
+static int is_stats(const char *path)
 {
-    printf("### sfs_fuse_getattr: '%s'\n", path);
+    return strcmp(path, STATS_PATH) == 0;
+}
 
-    stbuf->st_uid = getuid();
-    stbuf->st_gid = getgid();
+/* Writes the counters as "name value" lines, then the histograms, into buf,
+ * returns the length */
+static int format_stats(char *buf)
+{
+    struct sfs_stats stats;
+    struct sfs_cache_stats cache;
+    struct sfs_free_stats free_stats;
+    sfs_get_stats(sfs, &stats);
+    sfs_get_cache_stats(sfs, &cache);
+    sfs_get_free_stats(sfs, &free_stats);
+    int len = snprintf(buf, STATS_SIZE,
+        "lookups %lu\n"
+        "lookup_entries %lu\n"
+        "entries_written %lu\n"
+        "super_writes %lu\n"
+        "relocations %lu\n"
+        "blocks_relocated %lu\n"
+        "free_extents %lu\n"
+        "bytes_read %lu\n"
+        "bytes_written %lu\n"
+        "bytes_extent %lu\n"
+        "alloc_failures %lu\n"
+        "discards %lu\n"
+        "blocks_discarded %lu\n"
+        "cache_hits %lu\n"
+        "cache_misses %lu\n"
+        "cache_blocks %lu\n"
+        "cache_capacity %lu\n"
+        "phase_lookup_ns %lu\n"
+        "phase_alloc_ns %lu\n"
+        "phase_relocate_ns %lu\n"
+        "phase_index_ns %lu\n"
+        "free_find_calls %lu\n"
+        "free_find_ns %lu\n"
+        "free_add_calls %lu\n"
+        "free_add_ns %lu\n"
+        "free_del_calls %lu\n"
+        "free_del_ns %lu\n"
+        "free_runs %lu\n"
+        "free_blocks %lu\n"
+        "free_largest %lu\n"
+        "free_area %lu\n",
+        stats.lookups, stats.lookup_entries, stats.entries_written,
+        stats.super_writes, stats.relocations, stats.blocks_relocated,
+        stats.free_extents, stats.bytes_read, stats.bytes_written,
+        stats.bytes_extent, stats.alloc_failures, stats.discards,
+        stats.blocks_discarded, cache.hits, cache.misses,
+        cache.blocks, cache.capacity, stats.phase_ns[SFS_PHASE_LOOKUP],
+        stats.phase_ns[SFS_PHASE_ALLOC], stats.phase_ns[SFS_PHASE_RELOCATE],
+        stats.phase_ns[SFS_PHASE_INDEX], stats.free_list_calls[SFS_FREE_FIND],
+        stats.free_list_ns[SFS_FREE_FIND], stats.free_list_calls[SFS_FREE_ADD],
+        stats.free_list_ns[SFS_FREE_ADD], stats.free_list_calls[SFS_FREE_DEL],
+        stats.free_list_ns[SFS_FREE_DEL], free_stats.extents, free_stats.blocks,
+        free_stats.largest, free_stats.free_area);
+    return len + format_hists(&buf[len]);
+}
 
-    struct timespec timespec;
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        if (sfs_get_sfs_time(sfs, &timespec) == 0) {
-            stbuf->st_mtim = timespec;
-            return 0;
-        } else {
-            fprintf(stderr, "sfs_get_sfs_mtime error\n");
-            return -1;
-        }
+/* Copies the part of the counters at offset into buf */
+static int read_stats(char *buf, size_t size, off_t offset)
+{
+    char text[STATS_SIZE];
+    int len = format_stats(text);
+    if (offset >= len) {
+        return 0;
+    }
+    if (size > (size_t)(len - offset)) {
+        size = len - offset;
     }
+    memcpy(buf, text + offset, size);
+    return size;
+}
 
-    const char *fxpath = fix_path(path);
-    if (sfs_is_dir(sfs, fxpath)) {
+static void fill_stat(struct sfs_stat *st, struct stat *stbuf)
+{
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    if (st->type == SFS_TYPE_DIR) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-        if (sfs_get_dir_time(sfs, fxpath, &timespec) == 0) {
-            stbuf->st_mtim = timespec;
-            return 0;
-        } else {
-            fprintf(stderr, "sfs_get_sfs_mtime error\n");
-            return -1;
-        }
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = st->size;
     }
+    stbuf->st_mtim = st->time;
+}
 
-    if (sfs_is_file(sfs, fxpath)) {
-        stbuf->st_mode = S_IFREG | 0644;
+static int sfs_fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info* fi)
+{
+    TRACE_DEBUG("### sfs_fuse_getattr: '%s'", path);
+
+    if (is_stats(path)) {
+        char text[STATS_SIZE];
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_mode = S_IFREG | 0444;
         stbuf->st_nlink = 1;
-        stbuf->st_size = sfs_get_file_size(sfs, fxpath);
-        if (sfs_get_file_time(sfs, fxpath, &timespec) == 0) {
-            stbuf->st_mtim = timespec;
-            return 0;
-        } else {
-            fprintf(stderr, "sfs_get_sfs_mtime error\n");
-            return -1;
+        stbuf->st_size = format_stats(text);
+        clock_gettime(CLOCK_REALTIME, &stbuf->st_mtim);
+        return 0;
+    }
+    struct sfs_stat st;
+    if (sfs_stat(sfs, sfs_util_fix_path(path), &st) != 0) {
+        return -ENOENT;
+    }
+    fill_stat(&st, stbuf);
+    return 0;
+}
+
+/* the handle opened by sfs_fuse_open or sfs_fuse_create */
+static SFS_FILE *get_handle(struct fuse_file_info *fi)
+{
+    if (fi == NULL) {
+        return NULL;
+    }
+    return (SFS_FILE *)(uintptr_t)fi->fh;
+}
+
+static int sfs_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    TRACE_DEBUG("### sfs_fuse_open: '%s'", path);
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
         }
+        /* read each time: the size changes */
+        fi->fh = 0;
+        fi->direct_io = 1;
+        return 0;
+    }
+    SFS_FILE *file = sfs_open(sfs, sfs_util_fix_path(path));
+    if (file == NULL) {
+        return -ENOENT;
     }
+    fi->fh = (uintptr_t)file;
+    return 0;
+}
 
-    return -ENOENT;
+static int sfs_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    TRACE_DEBUG("### sfs_fuse_release: '%s'", path);
+    SFS_FILE *file = get_handle(fi);
+    if (file != NULL) {
+        sfs_release(sfs, file);
+        fi->fh = 0;
+    }
+    return 0;
 }
 
 static int sfs_fuse_read(path, buf, size, offset, fi)
@@ -125,9 +307,18 @@ static int sfs_fuse_read(path, buf, size, offset, fi)
     off_t offset;
     struct fuse_file_info *fi;
 {
-    printf("### sfs_fuse_read: '%s', size: 0x%lx, offset: 0x%lx\n", path, size, offset);
+    TRACE_DEBUG("### sfs_fuse_read: '%s', size: 0x%lx, offset: 0x%lx", path, size, offset);
 
-    int sz = sfs_read(sfs, fix_path(path), buf, size, offset);
+    if (is_stats(path)) {
+        return read_stats(buf, size, offset);
+    }
+    SFS_FILE *file = get_handle(fi);
+    int sz;
+    if (file != NULL) {
+        sz = sfs_read_fh(sfs, file, buf, size, offset);
+    } else {
+        sz = sfs_read(sfs, sfs_util_fix_path(path), buf, size, offset);
+    }
     if (sz >= 0) {
         return sz;
     } else {
@@ -135,33 +326,105 @@ static int sfs_fuse_read(path, buf, size, offset, fi)
     }
 }
 
-static int sfs_fuse_readdir(path, buf, filler, offset, fi)
+/* Returns the location of the data in the image instead of copying it, so
+ * that libfuse can splice it from the image to the kernel */
+static int sfs_fuse_read_buf(path, bufp, size, offset, fi)
+    const char *path;
+    struct fuse_bufvec **bufp;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_fuse_read_buf: '%s', size: 0x%lx, offset: 0x%lx", path, size, offset);
+
+    if (is_stats(path)) {
+        /* libfuse frees the text, as a memory buffer, and then the bufvec */
+        struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+        char *text = malloc(STATS_SIZE);
+        if (bufv == NULL || text == NULL) {
+            free(bufv);
+            free(text);
+            return -ENOMEM;
+        }
+        *bufv = FUSE_BUFVEC_INIT(read_stats(text, size, offset));
+        bufv->buf[0].mem = text;
+        *bufp = bufv;
+        return 0;
+    }
+    SFS_FILE *file = get_handle(fi);
+    if (file == NULL) {
+        file = sfs_open(sfs, sfs_util_fix_path(path));
+        if (file == NULL) {
+            return -ENOENT;
+        }
+    }
+    int fd;
+    off_t pos;
+    int sz = sfs_extent_fh(sfs, file, offset, size, &fd, &pos);
+    if (file != get_handle(fi)) {
+        sfs_release(sfs, file);
+    }
+    if (sz < 0) {
+        return -ENOENT;
+    }
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL) {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(sz);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = fd;
+    bufv->buf[0].pos = pos;
+    *bufp = bufv;
+    return 0;
+}
+
+static int sfs_fuse_readdir(path, buf, filler, offset, fi, flags)
     const char *path;
     void *buf;
     fuse_fill_dir_t filler;
     off_t offset;
     struct fuse_file_info *fi;
+    enum fuse_readdir_flags flags;
 {
-    printf("### sfs_fuse_readdir: '%s', offset:%lx\n", path, offset);
-    filler(buf, ".", NULL, 0, 0);
+    TRACE_DEBUG("### sfs_fuse_readdir: '%s', offset:%lx", path, offset);
+    const char *fxpath = sfs_util_fix_path(path);
+    enum fuse_fill_dir_flags fill_flags = 0;
+    struct sfs_stat st;
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(struct stat));
+
+    /* the attributes come with the names: no getattr needed for each child */
+    if (flags & FUSE_READDIR_PLUS) {
+        fill_flags = FUSE_FILL_DIR_PLUS;
+    }
+    if (sfs_stat(sfs, fxpath, &st) != 0) {
+        return -ENOENT;
+    }
+    fill_stat(&st, &stbuf);
+    filler(buf, ".", &stbuf, 0, fill_flags);
     filler(buf, "..", NULL, 0, 0);
 
-    const char *fxpath = fix_path(path);
-    char *name = (char*)sfs_first(sfs, fxpath);
+    char *name = (char*)sfs_first_stat(sfs, fxpath, &st);
     while (name != NULL) {
-        printf("\tadding: '%s'\n", name);
-        if (filler(buf, name, NULL, 0, 0) == 1) {
-            printf("buffer full\n");
+        TRACE_DEBUG("\tadding: '%s'", name);
+        memset(&stbuf, 0, sizeof(struct stat));
+        fill_stat(&st, &stbuf);
+        if (filler(buf, name, &stbuf, 0, fill_flags) == 1) {
+            TRACE_DEBUG("buffer full");
         }
-        name = (char*)sfs_next(sfs, fxpath);
+        name = (char*)sfs_next_stat(sfs, fxpath, &st);
     }
     return 0;
 }
 
 static int sfs_fuse_mkdir(const char *path, mode_t mode)
 {
-    printf("### sfs_fuse_mkdir \"%s\"\n", path);
-    int result = sfs_mkdir(sfs, fix_path(path));
+    TRACE_DEBUG("### sfs_fuse_mkdir \"%s\"", path);
+    if (is_stats(path)) {
+        return -EEXIST;
+    }
+    int result = sfs_mkdir(sfs, sfs_util_fix_path(path));
     if (result == 0) {
         return 0;
     } else {
@@ -171,10 +434,13 @@ static int sfs_fuse_mkdir(const char *path, mode_t mode)
 
 static int sfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    printf("### sfs_fuse_create \"%s\"\n", path);
-    int result = sfs_create(sfs, fix_path(path));
+    TRACE_DEBUG("### sfs_fuse_create \"%s\"", path);
+    if (is_stats(path)) {
+        return -EEXIST;
+    }
+    int result = sfs_create(sfs, sfs_util_fix_path(path));
     if (result == 0) {
-        return 0;
+        return sfs_fuse_open(path, fi);
     } else {
         return -EACCES;
     }
@@ -182,8 +448,8 @@ static int sfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info
 
 static int sfs_fuse_rmdir(const char *path)
 {
-    printf("### sfs_fuse_rmdir \"%s\"\n", path);
-    int result = sfs_rmdir(sfs, fix_path(path));
+    TRACE_DEBUG("### sfs_fuse_rmdir \"%s\"", path);
+    int result = sfs_rmdir(sfs, sfs_util_fix_path(path));
     if (result == 0) {
         return 0;
     } else {
@@ -193,8 +459,8 @@ static int sfs_fuse_rmdir(const char *path)
 
 static int sfs_fuse_unlink(const char *path)
 {
-    printf("### sfs_fuse_unlink \"%s\"\n", path);
-    int result = sfs_delete(sfs, fix_path(path));
+    TRACE_DEBUG("### sfs_fuse_unlink \"%s\"", path);
+    int result = sfs_delete(sfs, sfs_util_fix_path(path));
     if (result == 0) {
         return 0;
     } else {
@@ -207,18 +473,18 @@ static int sfs_fuse_utimens(path, tv, fi)
     const struct timespec tv[2];
     struct fuse_file_info *fi;
 {
-    printf("### sfs_fuse_utimens \"%s\"\n", path);
+    TRACE_DEBUG("### sfs_fuse_utimens \"%s\"", path);
     struct timespec timespec = tv[1];
     if (timespec.tv_nsec == UTIME_NOW) {    // current time
-        printf("\tset now\n");
+        TRACE_DEBUG("\tset now");
         clock_gettime(CLOCK_REALTIME, &timespec);
     } else if (timespec.tv_nsec == UTIME_OMIT) {  // no change
-        printf("\tomit\n");
+        TRACE_DEBUG("\tomit");
         return 0;
     }
-    printf("\ttv_sec=0x%08lx\n", timespec.tv_sec);
-    printf("\ttv_nsec=0x%08lx\n", timespec.tv_nsec);
-    int result = sfs_set_time(sfs, fix_path(path), &timespec);
+    TRACE_DEBUG("\ttv_sec=0x%08lx", timespec.tv_sec);
+    TRACE_DEBUG("\ttv_nsec=0x%08lx", timespec.tv_nsec);
+    int result = sfs_set_time(sfs, sfs_util_fix_path(path), &timespec);
     if (result == 0) {
         return 0;
     } else {
@@ -231,14 +497,17 @@ static int sfs_fuse_rename(oldpath, newpath, flags)
     const char *newpath;
     unsigned int flags;
 {
-    printf("### sfs_fuse_rename \"%s\"->\"%s\"\n", oldpath, newpath);
+    TRACE_DEBUG("### sfs_fuse_rename \"%s\"->\"%s\"", oldpath, newpath);
+    if (is_stats(oldpath) || is_stats(newpath)) {
+        return -EPERM;
+    }
     if (flags & RENAME_EXCHANGE) {
         fprintf(stderr, "rename exchange not implemented\n");
         return -EACCES;
     } else { 
         int replace = ((flags & RENAME_NOREPLACE) == 0);
-        printf("\treplace=%d\n", replace);
-        int result = sfs_rename(sfs, fix_path(oldpath), fix_path(newpath), replace);
+        TRACE_DEBUG("\treplace=%d", replace);
+        int result = sfs_rename(sfs, sfs_util_fix_path(oldpath), sfs_util_fix_path(newpath), replace);
         if (result == 0) {
             return 0;
         } else {
@@ -256,23 +525,69 @@ static int sfs_fuse_write(path, buf, size, offset, fi)
     off_t offset;
     struct fuse_file_info *fi;
 {
-    printf("### sfs_fuse_write: '%s', size: 0x%lx, offset: 0x%lx\n", path, size, offset);
+    TRACE_DEBUG("### sfs_fuse_write: '%s', size: 0x%lx, offset: 0x%lx", path, size, offset);
 
-    const char *fxpath = fix_path(path);
-    uint64_t file_size = sfs_get_file_size(sfs, fxpath);
-    uint64_t min_size = offset + size;
-    if (min_size > file_size) {    // if writing beyond the end of file, resize first
-        if (sfs_resize(sfs, fxpath, min_size) != 0) {
-            return -1;
+    SFS_FILE *file = get_handle(fi);
+    if (file == NULL) {
+        file = sfs_open(sfs, sfs_util_fix_path(path));
+        if (file == NULL) {
+            return -ENOENT;
         }
     }
-
-    int res = sfs_write(sfs, fxpath, buf, size, offset);
+    int res = sfs_write_extend_fh(sfs, file, buf, size, offset);
+    if (file != get_handle(fi)) {
+        sfs_release(sfs, file);
+    }
     if (res >= 0) {
         return res;
     } else {
-        return -ENOENT;
+        return -ENOSPC;
+    }
+}
+
+/* Copies the data directly into the image, with splice if libfuse received
+ * it in a pipe */
+static int sfs_fuse_write_buf(path, buf, offset, fi)
+    const char *path;
+    struct fuse_bufvec *buf;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    size_t size = fuse_buf_size(buf);
+    TRACE_DEBUG("### sfs_fuse_write_buf: '%s', size: 0x%lx, offset: 0x%lx", path, size, offset);
+
+    SFS_FILE *file = get_handle(fi);
+    if (file == NULL) {
+        file = sfs_open(sfs, sfs_util_fix_path(path));
+        if (file == NULL) {
+            return -ENOENT;
+        }
+    }
+    int res;
+    int fd;
+    off_t pos;
+    int sz;
+    /* allocate without filling the range with zeros, then copy into it */
+    if (sfs_write_extend_fh(sfs, file, NULL, size, offset) < 0) {
+        res = -ENOSPC;
+    } else if ((sz = sfs_extent_fh(sfs, file, offset, size, &fd, &pos)) < 0) {
+        res = -EIO;
+        sfs_write_finish_fh(sfs, file, offset, size, 0);
+    } else {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sz);
+        dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        dst.buf[0].fd = fd;
+        dst.buf[0].pos = pos;
+        res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+        /* a failed or short copy must not leave stale data in the file */
+        if (sfs_write_finish_fh(sfs, file, offset, size, res > 0 ? res : 0) != 0) {
+            res = -EIO;
+        }
+    }
+    if (file != get_handle(fi)) {
+        sfs_release(sfs, file);
     }
+    return res;
 }
 
 static int sfs_fuse_truncate(path, length, fi)
@@ -280,9 +595,15 @@ static int sfs_fuse_truncate(path, length, fi)
     off_t length;
     struct fuse_file_info *fi;
 {
-    printf("### sfs_fuse_truncate: '%s', offset: 0x%lx\n", path, length);
+    TRACE_DEBUG("### sfs_fuse_truncate: '%s', offset: 0x%lx", path, length);
 
-    int res = sfs_resize(sfs, fix_path(path), length);
+    SFS_FILE *file = get_handle(fi);
+    int res;
+    if (file != NULL) {
+        res = sfs_resize_fh(sfs, file, length);
+    } else {
+        res = sfs_resize(sfs, sfs_util_fix_path(path), length);
+    }
     if (res == 0) {
         return length;
     } else {
@@ -294,7 +615,10 @@ static struct fuse_operations fuse_operations = {
     .init = sfs_fuse_init,
     .destroy = sfs_fuse_destroy,
     .getattr = sfs_fuse_getattr,
+    .open = sfs_fuse_open,
+    .release = sfs_fuse_release,
     .read = sfs_fuse_read,
+    .read_buf = sfs_fuse_read_buf,
     .readdir = sfs_fuse_readdir,
     .mkdir = sfs_fuse_mkdir,
     .create = sfs_fuse_create,
@@ -303,18 +627,358 @@ static struct fuse_operations fuse_operations = {
     .utimens = sfs_fuse_utimens,
     .rename = sfs_fuse_rename,
     .write = sfs_fuse_write,
+    .write_buf = sfs_fuse_write_buf,
     .truncate = sfs_fuse_truncate
 };
 
+/* The operations measured around the ones above: each one is added to the
+ * latency histogram of the operation, logged if slower than --slow-ms and
+ * recorded with --record.  The file handle recorded is the one of
+ * sfs_fuse_open, so that replays can tell the open files apart. */
+
+static FILE *slow_log;
+
+struct op_start {
+    uint64_t time;
+    struct sfs_stats stats;
+};
+
+static uint64_t op_fh(struct fuse_file_info *fi)
+{
+    return fi == NULL ? 0 : fi->fh;
+}
+
+static void op_begin(struct op_start *start)
+{
+    start->time = sfs_record_time();
+    if (options.slow_ms > 0 && sfs != NULL) {
+        sfs_get_stats(sfs, &start->stats);
+    }
+}
+
+/* Writes the operation to the slow log with the time spent in each phase
+ * of the library, which also has the work done for other operations in the
+ * meantime if several threads are used */
+static void log_slow(int op, struct op_start *start, uint64_t duration,
+                     const char *path, const char *path2, int32_t result)
+{
+    struct sfs_stats stats;
+    struct timespec now;
+    char phases[SFS_PHASE_COUNT * 32];
+    int len = 0;
+    sfs_get_stats(sfs, &stats);
+    for (int phase = 0; phase < SFS_PHASE_COUNT; ++phase) {
+        len += snprintf(&phases[len], sizeof(phases) - len, " %s %lu",
+                        sfs_phase_name(phase),
+                        (stats.phase_ns[phase] - start->stats.phase_ns[phase]) / 1000);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(slow_log, "%ld.%06ld %s '%s'%s%s%s %lu us, result %d, phases (us):%s\n",
+            now.tv_sec, now.tv_nsec / 1000, sfs_record_op_name(op), path,
+            path2 != NULL ? " -> '" : "", path2 != NULL ? path2 : "",
+            path2 != NULL ? "'" : "", duration / 1000, result, phases);
+    fflush(slow_log);
+}
+
+static void op_end(op, start, path, path2, fh, offset, size, result)
+    int op;
+    struct op_start *start;
+    const char *path;
+    const char *path2;
+    uint64_t fh;
+    uint64_t offset;
+    uint32_t size;
+    int32_t result;
+{
+    uint64_t duration = sfs_record_time() - start->time;
+    sfs_hist_add(&op_hist[op], duration);
+    sfs_record(op, start->time, path, path2, fh, offset, size, result);
+    if (options.slow_ms > 0 && duration >= options.slow_ms * 1000000ull && sfs != NULL) {
+        log_slow(op, start, duration, path, path2, result);
+    }
+}
+
+static void timed_destroy(void *private_data)
+{
+    sfs_fuse_destroy(private_data);
+    sfs_record_stop();
+}
+
+static int timed_getattr(const char *path, struct stat *stbuf, struct fuse_file_info* fi)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_getattr(path, stbuf, fi);
+    op_end(SFS_OP_GETATTR, &start, path, NULL, op_fh(fi), 0, 0, result);
+    return result;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_open(path, fi);
+    op_end(SFS_OP_OPEN, &start, path, NULL, op_fh(fi), 0, 0, result);
+    return result;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+    struct op_start start;
+    op_begin(&start);
+    uint64_t fh = op_fh(fi);
+    int result = sfs_fuse_release(path, fi);
+    op_end(SFS_OP_RELEASE, &start, path, NULL, fh, 0, 0, result);
+    return result;
+}
+
+static int timed_read(path, buf, size, offset, fi)
+    const char *path;
+    char *buf;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_read(path, buf, size, offset, fi);
+    op_end(SFS_OP_READ, &start, path, NULL, op_fh(fi), offset, size, result);
+    return result;
+}
+
+static int timed_read_buf(path, bufp, size, offset, fi)
+    const char *path;
+    struct fuse_bufvec **bufp;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_read_buf(path, bufp, size, offset, fi);
+    op_end(SFS_OP_READ, &start, path, NULL, op_fh(fi), offset, size, result);
+    return result;
+}
+
+static int timed_readdir(path, buf, filler, offset, fi, flags)
+    const char *path;
+    void *buf;
+    fuse_fill_dir_t filler;
+    off_t offset;
+    struct fuse_file_info *fi;
+    enum fuse_readdir_flags flags;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_readdir(path, buf, filler, offset, fi, flags);
+    op_end(SFS_OP_READDIR, &start, path, NULL, op_fh(fi), offset, 0, result);
+    return result;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_mkdir(path, mode);
+    op_end(SFS_OP_MKDIR, &start, path, NULL, 0, 0, 0, result);
+    return result;
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_create(path, mode, fi);
+    op_end(SFS_OP_CREATE, &start, path, NULL, op_fh(fi), 0, 0, result);
+    return result;
+}
+
+static int timed_rmdir(const char *path)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_rmdir(path);
+    op_end(SFS_OP_RMDIR, &start, path, NULL, 0, 0, 0, result);
+    return result;
+}
+
+static int timed_unlink(const char *path)
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_unlink(path);
+    op_end(SFS_OP_UNLINK, &start, path, NULL, 0, 0, 0, result);
+    return result;
+}
+
+static int timed_utimens(path, tv, fi)
+    const char *path;
+    const struct timespec tv[2];
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_utimens(path, tv, fi);
+    op_end(SFS_OP_UTIMENS, &start, path, NULL, op_fh(fi),
+           tv[1].tv_sec, tv[1].tv_nsec, result);
+    return result;
+}
+
+static int timed_rename(oldpath, newpath, flags)
+    const char *oldpath;
+    const char *newpath;
+    unsigned int flags;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_rename(oldpath, newpath, flags);
+    op_end(SFS_OP_RENAME, &start, oldpath, newpath, 0, 0, flags, result);
+    return result;
+}
+
+static int timed_write(path, buf, size, offset, fi)
+    const char *path;
+    const char *buf;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_write(path, buf, size, offset, fi);
+    op_end(SFS_OP_WRITE, &start, path, NULL, op_fh(fi), offset, size, result);
+    return result;
+}
+
+static int timed_write_buf(path, buf, offset, fi)
+    const char *path;
+    struct fuse_bufvec *buf;
+    off_t offset;
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    size_t size = fuse_buf_size(buf);
+    int result = sfs_fuse_write_buf(path, buf, offset, fi);
+    op_end(SFS_OP_WRITE, &start, path, NULL, op_fh(fi), offset, size, result);
+    return result;
+}
+
+static int timed_truncate(path, length, fi)
+    const char *path;
+    off_t length;
+    struct fuse_file_info *fi;
+{
+    struct op_start start;
+    op_begin(&start);
+    int result = sfs_fuse_truncate(path, length, fi);
+    op_end(SFS_OP_TRUNCATE, &start, path, NULL, op_fh(fi), length, 0, result);
+    return result;
+}
+
+static struct fuse_operations timed_operations = {
+    .init = sfs_fuse_init,
+    .destroy = timed_destroy,
+    .getattr = timed_getattr,
+    .open = timed_open,
+    .release = timed_release,
+    .read = timed_read,
+    .read_buf = timed_read_buf,
+    .readdir = timed_readdir,
+    .mkdir = timed_mkdir,
+    .create = timed_create,
+    .rmdir = timed_rmdir,
+    .unlink = timed_unlink,
+    .utimens = timed_utimens,
+    .rename = timed_rename,
+    .write = timed_write,
+    .write_buf = timed_write_buf,
+    .truncate = timed_truncate
+};
+
+/* sfs_fuse_bench includes this file to call the operations directly */
+#ifndef SFS_FUSE_NO_MAIN
+
 static void show_help(const char *progname)
 {
     printf("usage: %s [options] <mountpoint>\n\n", progname);
     printf("File-system specific options:\n"
         "    --name=<s>          Name of the \"hello\" file\n"
         "                        (default: \"hello\")\n"
+        "    --trace=<n>         Trace level: 0 none, 1 error, 2 warn, 3 info,\n"
+        "                        4 debug (default: 0)\n"
+        "    --trace-echo        Also write trace messages to stderr\n"
+        "    --trace-dump=<s>    File where the trace buffer is dumped on\n"
+        "                        SIGUSR1 (default: stderr)\n"
+        "    --record=<s>        Record the operations into a file, for\n"
+        "                        sfs_replay\n"
+        "    --slow-ms=<n>       Log the operations taking at least n ms\n"
+        "                        (default: 0, no log)\n"
+        "    --slow-log=<s>      File of the slow operations log\n"
+        "                        (default: stderr)\n"
+        "    --lazy-zero         Do not write the null bytes of the files\n"
+        "                        extended by truncate until needed\n"
+        "    --discard           Punch holes in the image for the freed\n"
+        "                        blocks\n"
+        "\n"
+        "The latency histograms are dumped with the trace on SIGUSR2.\n"
         "\n");
 }
 
+static atomic_int hists_fd = -1;
+
+static void dump_hists(int signum)
+{
+    char buf[HISTS_SIZE];
+    int len = format_hists(buf);
+    ssize_t written = write(atomic_load(&hists_fd), buf, len);
+    (void)written;
+}
+
+/* Sets the trace level and installs the SIGUSR1 handler dumping the trace
+ * buffer and the SIGUSR2 handler dumping the latency histograms.  Returns 0
+ * on success and -1 on error. */
+static int setup_trace(void)
+{
+    int fd = STDERR_FILENO;
+    sfs_trace_set_level(options.trace_level);
+    if (options.trace_echo) {
+        sfs_trace_set_echo(STDERR_FILENO);
+    }
+    if (options.trace_dump != NULL) {
+        fd = open(options.trace_dump, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "cannot open trace dump file %s\n", options.trace_dump);
+            return -1;
+        }
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = dump_hists;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    atomic_store(&hists_fd, fd);
+    if (sigaction(SIGUSR2, &action, NULL) != 0) {
+        return -1;
+    }
+    return sfs_trace_dump_on_signal(SIGUSR1, fd);
+}
+
+/* Opens the log of the slow operations.  Returns 0 on success and -1 on
+ * error. */
+static int setup_slow_log(void)
+{
+    slow_log = stderr;
+    if (options.slow_log != NULL) {
+        slow_log = fopen(options.slow_log, "a");
+        if (slow_log == NULL) {
+            fprintf(stderr, "cannot open slow log file %s\n", options.slow_log);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -332,9 +996,15 @@ int main(int argc, char **argv)
     if (options.show_help || options.filename == NULL) {
         show_help(argv[0]);
         ret = 0;
+    } else if (setup_trace() != 0 || setup_slow_log() != 0) {
+        ret = 2;
+    } else if (options.record != NULL && sfs_record_start(options.record) != 0) {
+        ret = 2;
     } else {
-        ret = fuse_main(args.argc, args.argv, &fuse_operations, NULL);
+        ret = fuse_main(args.argc, args.argv, &timed_operations, NULL);
     }
     fuse_opt_free_args(&args);
     return ret;
 }
+
+#endif /* SFS_FUSE_NO_MAIN */
@@ -0,0 +1,516 @@
+#define SFS_FUSE_NO_MAIN
+#include "sfs_fuse.c"
+
+#include <time.h>
+
+#include "sfs_util.h"
+
+/****h* sfs/sfs_fuse_bench
+ * NAME
+ *   sfs_fuse_bench -- workloads on the FUSE operations without a mount
+ * DESCRIPTION
+ *   sfs_fuse_bench [-p profile,...] [-s size] [-f size] [-b size] [-B size]
+ *                  [-n ops] [-r seed] [-o image] [-R recording]
+ *
+ *   Calls the fuse_operations of sfs_fuse directly, the way libfuse does for
+ *   the requests of the kernel, so that the handlers can be measured where
+ *   FUSE cannot be mounted.  The profiles are run in this order on one
+ *   volume of -s bytes (default 256M) written to -o (default
+ *   sfs_fuse_bench.img):
+ *     seqwrite   writes a file of -f bytes (default 64M) in -b byte
+ *                requests (default 128k)
+ *     seqread    reads it back in -b byte requests
+ *     randwrite  -n writes (default 10000) of -B bytes (default 4k) at
+ *                random offsets of the file
+ *     randread   -n reads of -B bytes at random offsets
+ *     create     creates -n files of -B bytes in directories of 100 files
+ *     walk       lists all the directories and gets the attributes of each
+ *                entry, like ls -lR with a cold cache
+ *     append     -n appends of -B bytes to a log, each after a getattr for
+ *                the size, like O_APPEND
+ *   For each profile, the throughput is printed, then the latency of each
+ *   operation called.  The sizes can have a K, M or G suffix.  With -R,
+ *   the operations are recorded into a file as with sfs_fuse --record, to
+ *   measure the cost of the recording.
+ ******
+ */
+
+#define DEFAULT_PROFILES "seqwrite,seqread,randwrite,randread,create,walk,append"
+#define DEFAULT_VOLUME_SIZE (256 << 20)
+#define DEFAULT_FILE_SIZE (64 << 20)
+#define DEFAULT_SEQ_SIZE (128 << 10)
+#define DEFAULT_RAND_SIZE 4096
+#define DEFAULT_OPS 10000
+#define FILES_PER_DIR 100
+#define PATH_LEN 64
+
+enum bench_op {
+    OP_GETATTR,
+    OP_OPEN,
+    OP_CREATE,
+    OP_RELEASE,
+    OP_READ,
+    OP_WRITE,
+    OP_READDIR,
+    OP_MKDIR,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "getattr", "open", "create", "release", "read", "write", "readdir", "mkdir"
+};
+
+/* latencies of one operation during a profile */
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    double total;
+    double *times;
+    size_t times_size;
+};
+
+static struct bench {
+    uint64_t file_size;
+    size_t seq_size;
+    size_t rand_size;
+    int ops;
+    char *buf;
+    struct op_stats stats[OP_COUNT];
+} bench;
+
+static const struct fuse_operations *ops = &fuse_operations;
+
+
+static void record(enum bench_op op, double t0, int result)
+{
+    struct op_stats *stats = &bench.stats[op];
+    double time = sfs_util_now() - t0;
+    if (stats->count == stats->times_size) {
+        stats->times_size = stats->times_size == 0 ? 1024 : stats->times_size * 2;
+        stats->times = realloc(stats->times, stats->times_size * sizeof(double));
+    }
+    stats->times[stats->count++] = time;
+    stats->total += time;
+    if (result < 0) {
+        stats->errors++;
+    }
+}
+
+
+/* The operations as libfuse calls them: read_buf and write_buf if the file
+ * system has them, the data being copied from or to memory */
+
+static int do_getattr(const char *path, struct stat *stbuf)
+{
+    double t0 = sfs_util_now();
+    memset(stbuf, 0, sizeof(struct stat));
+    int result = ops->getattr(path, stbuf, NULL);
+    record(OP_GETATTR, t0, result);
+    return result;
+}
+
+static int do_open(const char *path, struct fuse_file_info *fi)
+{
+    double t0 = sfs_util_now();
+    memset(fi, 0, sizeof(struct fuse_file_info));
+    int result = ops->open(path, fi);
+    record(OP_OPEN, t0, result);
+    return result;
+}
+
+static int do_create(const char *path, struct fuse_file_info *fi)
+{
+    double t0 = sfs_util_now();
+    memset(fi, 0, sizeof(struct fuse_file_info));
+    int result = ops->create(path, 0644, fi);
+    record(OP_CREATE, t0, result);
+    return result;
+}
+
+static void do_release(const char *path, struct fuse_file_info *fi)
+{
+    double t0 = sfs_util_now();
+    int result = ops->release(path, fi);
+    record(OP_RELEASE, t0, result);
+}
+
+/* Frees the result of read_buf as libfuse does: the memory of each buffer
+ * which is not a descriptor, then the bufvec */
+static void free_bufvec(struct fuse_bufvec *bufv)
+{
+    if (bufv == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < bufv->count; ++i) {
+        if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) {
+            free(bufv->buf[i].mem);
+        }
+    }
+    free(bufv);
+}
+
+static int do_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    double t0 = sfs_util_now();
+    int result;
+    if (ops->read_buf != NULL) {
+        struct fuse_bufvec *bufv = NULL;
+        result = ops->read_buf(path, &bufv, size, offset, fi);
+        if (result == 0) {
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].mem = buf;
+            result = fuse_buf_copy(&dst, bufv, 0);
+        }
+        free_bufvec(bufv);
+    } else {
+        result = ops->read(path, buf, size, offset, fi);
+    }
+    record(OP_READ, t0, result);
+    return result;
+}
+
+static int do_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    double t0 = sfs_util_now();
+    int result;
+    if (ops->write_buf != NULL) {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+        src.buf[0].mem = (void *)buf;
+        result = ops->write_buf(path, &src, offset, fi);
+    } else {
+        result = ops->write(path, buf, size, offset, fi);
+    }
+    record(OP_WRITE, t0, result);
+    return result;
+}
+
+/* names given by readdir */
+struct dir_list {
+    char **names;
+    size_t count;
+    size_t size;
+};
+
+static int fill_dir(void *buf, const char *name, const struct stat *stbuf,
+                    off_t off, enum fuse_fill_dir_flags flags)
+{
+    struct dir_list *list = buf;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    if (list->count == list->size) {
+        list->size = list->size == 0 ? 64 : list->size * 2;
+        list->names = realloc(list->names, list->size * sizeof(char *));
+    }
+    list->names[list->count++] = strdup(name);
+    return 0;
+}
+
+static int do_readdir(const char *path, struct dir_list *list)
+{
+    double t0 = sfs_util_now();
+    list->count = 0;
+    int result = ops->readdir(path, list, fill_dir, 0, NULL, 0);
+    record(OP_READDIR, t0, result);
+    return result;
+}
+
+static int do_mkdir(const char *path)
+{
+    double t0 = sfs_util_now();
+    int result = ops->mkdir(path, 0755);
+    record(OP_MKDIR, t0, result);
+    return result;
+}
+
+
+/* Prints the throughput of the profile and the latencies of the operations,
+ * and resets them */
+static void report(const char *profile, double time, uint64_t count, uint64_t bytes)
+{
+    if (bytes > 0) {
+        printf("%s: %lu ops in %.2f s, %.0f ops/s, %.1f MiB/s\n", profile, count,
+               time, count / time, bytes / time / (1 << 20));
+    } else {
+        printf("%s: %lu ops in %.2f s, %.0f ops/s\n", profile, count, time, count / time);
+    }
+    printf("  %-10s %10s %10s %12s %12s %12s\n", "operation", "ops", "errors",
+           "avg (us)", "p50 (us)", "p99 (us)");
+    for (int op = 0; op < OP_COUNT; ++op) {
+        struct op_stats *stats = &bench.stats[op];
+        if (stats->count == 0) {
+            continue;
+        }
+        qsort(stats->times, stats->count, sizeof(double), sfs_util_compare_double);
+        printf("  %-10s %10lu %10lu %12.1f %12.1f %12.1f\n", op_names[op],
+               stats->count, stats->errors, stats->total / stats->count * 1e6,
+               stats->times[stats->count / 2] * 1e6,
+               stats->times[(stats->count * 99) / 100] * 1e6);
+        stats->count = 0;
+        stats->errors = 0;
+        stats->total = 0;
+    }
+}
+
+
+static void profile_seqwrite()
+{
+    struct fuse_file_info fi;
+    uint64_t count = 0;
+    double t0 = sfs_util_now();
+    if (do_create("/seq", &fi) == 0) {
+        for (uint64_t pos = 0; pos < bench.file_size; pos += bench.seq_size) {
+            do_write("/seq", bench.buf, bench.seq_size, pos, &fi);
+            count++;
+        }
+        do_release("/seq", &fi);
+    }
+    report("seqwrite", sfs_util_now() - t0, count, count * bench.seq_size);
+}
+
+static void profile_seqread()
+{
+    struct fuse_file_info fi;
+    uint64_t count = 0;
+    double t0 = sfs_util_now();
+    if (do_open("/seq", &fi) == 0) {
+        for (uint64_t pos = 0; pos < bench.file_size; pos += bench.seq_size) {
+            do_read("/seq", bench.buf, bench.seq_size, pos, &fi);
+            count++;
+        }
+        do_release("/seq", &fi);
+    }
+    report("seqread", sfs_util_now() - t0, count, count * bench.seq_size);
+}
+
+static void profile_random(int write)
+{
+    struct fuse_file_info fi;
+    uint64_t blocks = bench.file_size / bench.rand_size;
+    int count = 0;
+    double t0 = sfs_util_now();
+    if (blocks > 0 && do_open("/seq", &fi) == 0) {
+        for (; count < bench.ops; ++count) {
+            off_t pos = (off_t)(rand() % blocks) * bench.rand_size;
+            if (write) {
+                do_write("/seq", bench.buf, bench.rand_size, pos, &fi);
+            } else {
+                do_read("/seq", bench.buf, bench.rand_size, pos, &fi);
+            }
+        }
+        do_release("/seq", &fi);
+    }
+    report(write ? "randwrite" : "randread", sfs_util_now() - t0, count, count * bench.rand_size);
+}
+
+static void profile_randwrite()
+{
+    profile_random(1);
+}
+
+static void profile_randread()
+{
+    profile_random(0);
+}
+
+static void profile_create()
+{
+    struct fuse_file_info fi;
+    char path[PATH_LEN];
+    double t0 = sfs_util_now();
+    do_mkdir("/storm");
+    for (int i = 0; i < bench.ops; ++i) {
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "/storm/d%d", i / FILES_PER_DIR);
+            do_mkdir(path);
+        }
+        snprintf(path, sizeof(path), "/storm/d%d/f%d", i / FILES_PER_DIR, i);
+        if (do_create(path, &fi) == 0) {
+            do_write(path, bench.buf, bench.rand_size, 0, &fi);
+            do_release(path, &fi);
+        }
+    }
+    report("create", sfs_util_now() - t0, bench.ops, 0);
+}
+
+/* Lists the directory, gets the attributes of each entry and enters the
+ * subdirectories.  Returns the number of entries. */
+static uint64_t walk(const char *path)
+{
+    struct dir_list list = { NULL, 0, 0 };
+    struct stat stbuf;
+    char child[PATH_LEN * 4];
+    uint64_t count = 0;
+    do_readdir(path, &list);
+    for (size_t i = 0; i < list.count; ++i) {
+        snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path,
+                 list.names[i]);
+        count++;
+        if (do_getattr(child, &stbuf) == 0 && S_ISDIR(stbuf.st_mode)) {
+            count += walk(child);
+        }
+        free(list.names[i]);
+    }
+    free(list.names);
+    return count;
+}
+
+static void profile_walk()
+{
+    double t0 = sfs_util_now();
+    uint64_t count = walk("/");
+    report("walk", sfs_util_now() - t0, count, 0);
+}
+
+static void profile_append()
+{
+    struct fuse_file_info fi;
+    struct stat stbuf;
+    double t0 = sfs_util_now();
+    if (do_create("/log", &fi) == 0) {
+        for (int i = 0; i < bench.ops; ++i) {
+            if (do_getattr("/log", &stbuf) == 0) {
+                do_write("/log", bench.buf, bench.rand_size, stbuf.st_size, &fi);
+            }
+        }
+        do_release("/log", &fi);
+    }
+    report("append", sfs_util_now() - t0, bench.ops, (uint64_t)bench.ops * bench.rand_size);
+}
+
+static const struct profile {
+    const char *name;
+    void (*run)();
+} profiles[] = {
+    { "seqwrite", profile_seqwrite },
+    { "seqread", profile_seqread },
+    { "randwrite", profile_randwrite },
+    { "randread", profile_randread },
+    { "create", profile_create },
+    { "walk", profile_walk },
+    { "append", profile_append },
+    { NULL, NULL }
+};
+
+
+/* Size with an optional K, M or G suffix, 0 if not valid */
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p profile,...] [-s size] [-f size] [-b size] [-B size] [-n ops] [-r seed] [-o image] [-R recording]\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *image = "sfs_fuse_bench.img";
+    const char *recording = NULL;
+    const char *selected = DEFAULT_PROFILES;
+    uint64_t volume_size = DEFAULT_VOLUME_SIZE;
+    unsigned seed = 1;
+    int opt;
+    bench.file_size = DEFAULT_FILE_SIZE;
+    bench.seq_size = DEFAULT_SEQ_SIZE;
+    bench.rand_size = DEFAULT_RAND_SIZE;
+    bench.ops = DEFAULT_OPS;
+    while ((opt = getopt(argc, argv, "p:s:f:b:B:n:r:o:R:")) != -1) {
+        switch (opt) {
+        case 'p':
+            selected = optarg;
+            break;
+        case 's':
+            volume_size = sfs_util_parse_size(optarg);
+            break;
+        case 'f':
+            bench.file_size = sfs_util_parse_size(optarg);
+            break;
+        case 'b':
+            bench.seq_size = sfs_util_parse_size(optarg);
+            break;
+        case 'B':
+            bench.rand_size = sfs_util_parse_size(optarg);
+            break;
+        case 'n':
+            bench.ops = atoi(optarg);
+            break;
+        case 'r':
+            seed = atoi(optarg);
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        case 'R':
+            recording = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (volume_size == 0 || bench.file_size == 0 || bench.seq_size == 0
+            || bench.rand_size == 0 || bench.ops < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (sfs_mkfs(image, volume_size / 512, 512, 1 << 20, "bench") != 0) {
+        fprintf(stderr, "couldn't create the volume %s\n", image);
+        return 1;
+    }
+    bench.buf = malloc(bench.seq_size > bench.rand_size ? bench.seq_size : bench.rand_size);
+    memset(bench.buf, 'x', bench.seq_size > bench.rand_size ? bench.seq_size : bench.rand_size);
+    srand(seed);
+
+    if (recording != NULL) {
+        if (sfs_record_start(recording) != 0) {
+            return 1;
+        }
+        ops = &timed_operations;
+    }
+
+    /* the capabilities of a recent kernel */
+    struct fuse_conn_info conn;
+    struct fuse_config cfg;
+    memset(&conn, 0, sizeof(struct fuse_conn_info));
+    memset(&cfg, 0, sizeof(struct fuse_config));
+    conn.capable = FUSE_CAP_READDIRPLUS | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
+    options.absolute_filename = realpath(image, NULL);
+    ops->init(&conn, &cfg);
+    if (sfs == NULL) {
+        fprintf(stderr, "couldn't mount the volume %s\n", image);
+        return 1;
+    }
+
+    int result = 0;
+    for (const char *p = selected; *p != '\0'; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        size_t len = strcspn(p, ",");
+        const struct profile *profile = profiles;
+        while (profile->name != NULL
+                && (strlen(profile->name) != len || strncmp(profile->name, p, len) != 0)) {
+            profile++;
+        }
+        if (profile->name == NULL) {
+            fprintf(stderr, "unknown profile %.*s\n", (int)len, p);
+            result = 1;
+            break;
+        }
+        profile->run();
+    }
+
+    /* the statistics file is read through read_buf like the files */
+    static char stats_text[STATS_SIZE];
+    if (do_read(STATS_PATH, stats_text, STATS_SIZE, 0, NULL) < 0) {
+        fprintf(stderr, "couldn't read %s\n", STATS_PATH);
+        result = 1;
+    }
+
+    ops->destroy(NULL);
+    for (int op = 0; op < OP_COUNT; ++op) {
+        free(bench.stats[op].times);
+    }
+    free(bench.buf);
+    free(options.absolute_filename);
+    unlink(image);
+    return result;
+}
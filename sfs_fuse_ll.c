@@ -0,0 +1,675 @@
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "sfs.h"
+#include "sfs_trace.h"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/****h* sfs/sfs_fuse_ll
+ *  NAME
+ *    sfs_fuse_ll -- low-level FUSE interface for the sfs implementation
+ *  DESCRIPTION
+ *    FUSE interface using inode numbers instead of paths.  The inode numbers
+ *    are the ones given by sfs_lookup and are forgotten with sfs_forget, so
+ *    that reading, writing and getting attributes do not resolve any path.
+ *    Paths are only built for the operations changing the directory tree.
+ ******
+ */
+
+static SFS *sfs;
+
+static const double timeout = 1.0;
+
+static struct options {
+    const char *filename;
+    char *absolute_filename;
+    int show_help;
+    int trace_level;
+    int trace_echo;
+    const char *trace_dump;
+    int lazy_zero;
+    int discard;
+} options;
+
+#define OPTION(t, p)                           \
+    { t, offsetof(struct options, p), 1 }
+
+static const struct fuse_opt option_spec[] = {
+    OPTION("--name=%s", filename),
+    OPTION("-h", show_help),
+    OPTION("--help", show_help),
+    OPTION("--trace=%d", trace_level),
+    OPTION("--trace-echo", trace_echo),
+    OPTION("--trace-dump=%s", trace_dump),
+    OPTION("--lazy-zero", lazy_zero),
+    OPTION("--discard", discard),
+    FUSE_OPT_END
+};
+
+/* the inode number of the readdir items which have not been looked up, as
+ * in libfuse */
+#define UNKNOWN_INO 0xffffffff
+
+/* directory listing built on opendir, kept in fi->fh until releasedir,
+ * the offset of an item is its index + 1 */
+struct dirlist {
+    size_t count;
+    size_t max;
+    char **names;
+    struct sfs_stat *st;
+};
+
+static void fill_stat(struct sfs_stat *st, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = st->ino;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    if (st->type == SFS_TYPE_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = st->size;
+    }
+    stbuf->st_mtim = st->time;
+}
+
+static int fill_entry_param(uint64_t ino, struct fuse_entry_param *e)
+{
+    struct sfs_stat st;
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (sfs_stat_ino(sfs, ino, &st) != 0) {
+        return -1;
+    }
+    e->ino = ino;
+    e->attr_timeout = timeout;
+    e->entry_timeout = timeout;
+    fill_stat(&st, &e->attr);
+    return 0;
+}
+
+/* Returns the path of name in the directory parent (to be freed) */
+static char *child_path(fuse_ino_t parent, const char *name)
+{
+    const char *parent_path = sfs_get_path(sfs, parent);
+    if (parent_path == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(parent_path) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (parent_path[0] == '\0') {
+        snprintf(path, len, "%s", name);
+    } else {
+        snprintf(path, len, "%s/%s", parent_path, name);
+    }
+    return path;
+}
+
+/* Looks up name after it has been created and replies with its entry */
+static void reply_new_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    uint64_t ino = sfs_lookup(sfs, parent, name);
+    if (ino == 0 || fill_entry_param(ino, &e) != 0) {
+        fuse_reply_err(req, ENOENT);
+    } else if (fi != NULL) {
+        fi->fh = (uintptr_t)sfs_open_ino(sfs, ino);
+        fuse_reply_create(req, &e, fi);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void sfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    /* the listing has the attributes anyway: always use readdirplus */
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+    /* read and write_buf use the image fd: let the data be spliced */
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE | (conn->capable & FUSE_CAP_SPLICE_MOVE);
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
+}
+
+static void sfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    TRACE_DEBUG("### sfs_ll_lookup: %lu '%s'", parent, name);
+    struct fuse_entry_param e;
+    uint64_t ino = sfs_lookup(sfs, parent, name);
+    if (ino == 0 || fill_entry_param(ino, &e) != 0) {
+        fuse_reply_err(req, ENOENT);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void sfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    sfs_forget(sfs, ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void sfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                struct fuse_forget_data *forgets)
+{
+    for (size_t i = 0; i < count; ++i) {
+        sfs_forget(sfs, forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void sfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    TRACE_DEBUG("### sfs_ll_getattr: %lu", ino);
+    struct sfs_stat st;
+    struct stat stbuf;
+    if (sfs_stat_ino(sfs, ino, &st) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fill_stat(&st, &stbuf);
+    fuse_reply_attr(req, &stbuf, timeout);
+}
+
+static void sfs_ll_setattr(req, ino, attr, to_set, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    struct stat *attr;
+    int to_set;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_setattr: %lu, to_set: 0x%x", ino, to_set);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int res;
+        if (fi != NULL) {
+            res = sfs_resize_fh(sfs, (SFS_FILE *)(uintptr_t)fi->fh, attr->st_size);
+        } else {
+            res = sfs_resize_ino(sfs, ino, attr->st_size);
+        }
+        if (res != 0) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+    }
+    if (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+        struct timespec timespec = attr->st_mtim;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            clock_gettime(CLOCK_REALTIME, &timespec);
+        }
+        if (sfs_set_time_ino(sfs, ino, &timespec) != 0) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+    }
+    sfs_ll_getattr(req, ino, fi);
+}
+
+static void dirlist_add(struct dirlist *d, const char *name, struct sfs_stat *st)
+{
+    if (d->count == d->max) {
+        d->max = d->max == 0 ? 16 : d->max * 2;
+        d->names = realloc(d->names, d->max * sizeof(char *));
+        d->st = realloc(d->st, d->max * sizeof(struct sfs_stat));
+    }
+    d->names[d->count] = strdup(name);
+    d->st[d->count] = *st;
+    d->count++;
+}
+
+static void sfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    TRACE_DEBUG("### sfs_ll_opendir: %lu", ino);
+    struct sfs_stat st;
+    if (sfs_stat_ino(sfs, ino, &st) != 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (st.type != SFS_TYPE_DIR) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct dirlist *d = calloc(1, sizeof(struct dirlist));
+    dirlist_add(d, ".", &st);
+    dirlist_add(d, "..", &st);
+    const char *name = sfs_first_ino(sfs, ino, &st);
+    while (name != NULL) {
+        dirlist_add(d, name, &st);
+        name = sfs_next_ino(sfs, ino, &st);
+    }
+    fi->fh = (uintptr_t)d;
+    fuse_reply_open(req, fi);
+}
+
+/* Replies with the items of the listing from off that fit into size bytes.
+ * With plus, each item other than "." and ".." is looked up again, which
+ * counts as a lookup and gives its current attributes; the items deleted
+ * since opendir are skipped. */
+static void reply_dirlist(req, ino, size, off, fi, plus)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    size_t size;
+    off_t off;
+    struct fuse_file_info *fi;
+    int plus;
+{
+    struct dirlist *d = (struct dirlist *)(uintptr_t)fi->fh;
+    char *buf = malloc(size);
+    size_t pos = 0;
+    for (size_t i = off; i < d->count; ++i) {
+        size_t len;
+        uint64_t child = 0;
+        if (plus) {
+            struct fuse_entry_param e;
+            if (i < 2) {
+                memset(&e, 0, sizeof(struct fuse_entry_param));
+                fill_stat(&d->st[i], &e.attr);
+            } else {
+                child = sfs_lookup(sfs, ino, d->names[i]);
+                if (child == 0) {
+                    continue;
+                }
+                if (fill_entry_param(child, &e) != 0) {
+                    sfs_forget(sfs, child, 1);
+                    continue;
+                }
+            }
+            len = fuse_add_direntry_plus(req, buf + pos, size - pos, d->names[i], &e, i + 1);
+        } else {
+            struct stat stbuf;
+            fill_stat(&d->st[i], &stbuf);
+            if (stbuf.st_ino == 0) {
+                stbuf.st_ino = UNKNOWN_INO;
+            }
+            len = fuse_add_direntry(req, buf + pos, size - pos, d->names[i], &stbuf, i + 1);
+        }
+        if (len > size - pos) {
+            if (child != 0) {
+                sfs_forget(sfs, child, 1);
+            }
+            break;
+        }
+        pos += len;
+    }
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+static void sfs_ll_readdir(req, ino, size, off, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    size_t size;
+    off_t off;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_readdir: %lu, offset:%lx", ino, off);
+    reply_dirlist(req, ino, size, off, fi, 0);
+}
+
+static void sfs_ll_readdirplus(req, ino, size, off, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    size_t size;
+    off_t off;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_readdirplus: %lu, offset:%lx", ino, off);
+    reply_dirlist(req, ino, size, off, fi, 1);
+}
+
+static void sfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct dirlist *d = (struct dirlist *)(uintptr_t)fi->fh;
+    for (size_t i = 0; i < d->count; ++i) {
+        free(d->names[i]);
+    }
+    free(d->names);
+    free(d->st);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+static void sfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    TRACE_DEBUG("### sfs_ll_open: %lu", ino);
+    struct sfs_stat st;
+    if (sfs_stat_ino(sfs, ino, &st) != 0) {
+        fuse_reply_err(req, ENOENT);
+    } else if (st.type != SFS_TYPE_FILE) {
+        fuse_reply_err(req, EISDIR);
+    } else {
+        fi->fh = (uintptr_t)sfs_open_ino(sfs, ino);
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void sfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    sfs_release(sfs, (SFS_FILE *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+/* Replies with the location of the data in the image instead of a copy, so
+ * that libfuse can splice it from the image to the kernel */
+static void sfs_ll_read(req, ino, size, off, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    size_t size;
+    off_t off;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_read: %lu, size: 0x%lx, offset: 0x%lx", ino, size, off);
+    int fd;
+    off_t pos;
+    int sz = sfs_extent_fh(sfs, (SFS_FILE *)(uintptr_t)fi->fh, off, size, &fd, &pos);
+    if (sz < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(sz);
+    bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv.buf[0].fd = fd;
+    bufv.buf[0].pos = pos;
+    fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void sfs_ll_write(req, ino, buf, size, off, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    const char *buf;
+    size_t size;
+    off_t off;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_write: %lu, size: 0x%lx, offset: 0x%lx", ino, size, off);
+    int res = sfs_write_extend_fh(sfs, (SFS_FILE *)(uintptr_t)fi->fh, buf, size, off);
+    if (res >= 0) {
+        fuse_reply_write(req, res);
+    } else {
+        fuse_reply_err(req, ENOSPC);
+    }
+}
+
+/* Copies the data directly into the image, with splice if libfuse received
+ * it in a pipe */
+static void sfs_ll_write_buf(req, ino, bufv, off, fi)
+    fuse_req_t req;
+    fuse_ino_t ino;
+    struct fuse_bufvec *bufv;
+    off_t off;
+    struct fuse_file_info *fi;
+{
+    size_t size = fuse_buf_size(bufv);
+    TRACE_DEBUG("### sfs_ll_write_buf: %lu, size: 0x%lx, offset: 0x%lx", ino, size, off);
+    SFS_FILE *file = (SFS_FILE *)(uintptr_t)fi->fh;
+    /* allocate without filling the range with zeros, then copy into it */
+    if (sfs_write_extend_fh(sfs, file, NULL, size, off) < 0) {
+        fuse_reply_err(req, ENOSPC);
+        return;
+    }
+    int fd;
+    off_t pos;
+    int sz = sfs_extent_fh(sfs, file, off, size, &fd, &pos);
+    if (sz < 0) {
+        sfs_write_finish_fh(sfs, file, off, size, 0);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sz);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = fd;
+    dst.buf[0].pos = pos;
+    ssize_t res = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+    /* a failed or short copy must not leave stale data in the file */
+    if (sfs_write_finish_fh(sfs, file, off, size, res > 0 ? res : 0) != 0) {
+        res = -EIO;
+    }
+    if (res >= 0) {
+        fuse_reply_write(req, res);
+    } else {
+        fuse_reply_err(req, -res);
+    }
+}
+
+static void sfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    TRACE_DEBUG("### sfs_ll_mkdir: %lu '%s'", parent, name);
+    char *path = child_path(parent, name);
+    if (path == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int result = sfs_mkdir(sfs, path);
+    free(path);
+    if (result == 0) {
+        reply_new_entry(req, parent, name, NULL);
+    } else {
+        fuse_reply_err(req, EACCES);
+    }
+}
+
+static void sfs_ll_create(req, parent, name, mode, fi)
+    fuse_req_t req;
+    fuse_ino_t parent;
+    const char *name;
+    mode_t mode;
+    struct fuse_file_info *fi;
+{
+    TRACE_DEBUG("### sfs_ll_create: %lu '%s'", parent, name);
+    char *path = child_path(parent, name);
+    if (path == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int result = sfs_create(sfs, path);
+    free(path);
+    if (result == 0) {
+        reply_new_entry(req, parent, name, fi);
+    } else {
+        fuse_reply_err(req, EACCES);
+    }
+}
+
+static void sfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    TRACE_DEBUG("### sfs_ll_rmdir: %lu '%s'", parent, name);
+    char *path = child_path(parent, name);
+    if (path == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int result = sfs_rmdir(sfs, path);
+    free(path);
+    fuse_reply_err(req, result == 0 ? 0 : EACCES);
+}
+
+static void sfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    TRACE_DEBUG("### sfs_ll_unlink: %lu '%s'", parent, name);
+    char *path = child_path(parent, name);
+    if (path == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int result = sfs_delete(sfs, path);
+    free(path);
+    fuse_reply_err(req, result == 0 ? 0 : EACCES);
+}
+
+static void sfs_ll_rename(req, parent, name, newparent, newname, flags)
+    fuse_req_t req;
+    fuse_ino_t parent;
+    const char *name;
+    fuse_ino_t newparent;
+    const char *newname;
+    unsigned int flags;
+{
+    TRACE_DEBUG("### sfs_ll_rename: %lu '%s' -> %lu '%s'", parent, name, newparent, newname);
+    if (flags & RENAME_EXCHANGE) {
+        fprintf(stderr, "rename exchange not implemented\n");
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    char *path = child_path(parent, name);
+    char *newpath = child_path(newparent, newname);
+    int result = -1;
+    if (path != NULL && newpath != NULL) {
+        int replace = ((flags & RENAME_NOREPLACE) == 0);
+        result = sfs_rename(sfs, path, newpath, replace);
+    }
+    free(path);
+    free(newpath);
+    fuse_reply_err(req, result == 0 ? 0 : EACCES);
+}
+
+static const struct fuse_lowlevel_ops sfs_ll_operations = {
+    .init = sfs_ll_init,
+    .lookup = sfs_ll_lookup,
+    .forget = sfs_ll_forget,
+    .forget_multi = sfs_ll_forget_multi,
+    .getattr = sfs_ll_getattr,
+    .setattr = sfs_ll_setattr,
+    .opendir = sfs_ll_opendir,
+    .readdir = sfs_ll_readdir,
+    .readdirplus = sfs_ll_readdirplus,
+    .releasedir = sfs_ll_releasedir,
+    .open = sfs_ll_open,
+    .release = sfs_ll_release,
+    .read = sfs_ll_read,
+    .write = sfs_ll_write,
+    .write_buf = sfs_ll_write_buf,
+    .mkdir = sfs_ll_mkdir,
+    .create = sfs_ll_create,
+    .rmdir = sfs_ll_rmdir,
+    .unlink = sfs_ll_unlink,
+    .rename = sfs_ll_rename
+};
+
+static void show_help(const char *progname)
+{
+    printf("usage: %s [options] <mountpoint>\n\n", progname);
+    printf("File-system specific options:\n"
+        "    --name=<s>          Name of the image file\n"
+        "    --trace=<n>         Trace level: 0 none, 1 error, 2 warn, 3 info,\n"
+        "                        4 debug (default: 0)\n"
+        "    --trace-echo        Also write trace messages to stderr\n"
+        "    --trace-dump=<s>    File where the trace buffer is dumped on\n"
+        "                        SIGUSR1 (default: stderr)\n"
+        "    --lazy-zero         Do not write the null bytes of the files\n"
+        "                        extended by truncate until needed\n"
+        "    --discard           Punch holes in the image for the freed\n"
+        "                        blocks\n"
+        "\n");
+}
+
+/* Sets the trace level and installs the SIGUSR1 handler dumping the trace
+ * buffer.  Returns 0 on success and -1 on error. */
+static int setup_trace(void)
+{
+    int fd = STDERR_FILENO;
+    sfs_trace_set_level(options.trace_level);
+    if (options.trace_echo) {
+        sfs_trace_set_echo(STDERR_FILENO);
+    }
+    if (options.trace_dump != NULL) {
+        fd = open(options.trace_dump, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "cannot open trace dump file %s\n", options.trace_dump);
+            return -1;
+        }
+    }
+    return sfs_trace_dump_on_signal(SIGUSR1, fd);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int ret = 1;
+    options.filename = NULL;
+
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (options.show_help || opts.show_help
+            || options.filename == NULL || opts.mountpoint == NULL) {
+        show_help(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto out;
+    }
+    if (access(options.filename, R_OK) != 0) {
+        fprintf(stderr, "%s is not readable\n", options.filename);
+        ret = 2;
+        goto out;
+    }
+    if (setup_trace() != 0) {
+        ret = 2;
+        goto out;
+    }
+    options.absolute_filename = realpath(options.filename, NULL);
+    sfs = sfs_init(options.absolute_filename);
+    if (sfs == NULL) {
+        ret = 2;
+        goto out;
+    }
+    sfs_set_lazy_zero(sfs, options.lazy_zero);
+
+    se = fuse_session_new(&args, &sfs_ll_operations, sizeof(sfs_ll_operations), NULL);
+    if (se == NULL)
+        goto out_sfs;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_session;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+    /* the discard thread would not survive the fork of fuse_daemonize */
+    if (options.discard && sfs_set_discard(sfs, 1) != 0) {
+        fprintf(stderr, "cannot enable discard\n");
+    }
+    /* the sfs library is not thread safe: always single threaded */
+    ret = fuse_session_loop(se);
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_sfs:
+    sfs_terminate(sfs);
+out:
+    free(opts.mountpoint);
+    free(options.absolute_filename);
+    fuse_opt_free_args(&args);
+    return ret;
+}
@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs.h"
+#include "sfs_util.h"
+
+/****h* sfs/sfs_gen
+ * NAME
+ *   sfs_gen -- generate an aged image from a seed
+ * DESCRIPTION
+ *   sfs_gen [-n files] [-d files] [-l min,max] [-z min,max] [-c ops]
+ *           [-x percent] [-u count,size] [-b size] [-s size] [-r seed]
+ *           <image>
+ *
+ *   Makes an image which looks like it has been used for a while, for the
+ *   benchmarks and the tests which need large volumes.  -n files (default
+ *   10000) are created in directories of -d files (default 100), with
+ *   names of -l min,max characters (default 4,100), so that entries have
+ *   from 0 to 2 continuations, and sizes of -z min,max bytes (default
+ *   0,1M), drawn so that small files are as frequent as large ones on a
+ *   log scale.
+ *
+ *   The volume is then aged by -c operations (default twice the files)
+ *   chosen at random: creating a file, growing a file, which has to move
+ *   it when the next blocks are used, shrinking a file or deleting one.
+ *   At the end, -x percent of the files (default 10) are deleted, so that
+ *   the Index Area has deleted entries.  With -u count,size, count ranges
+ *   of size bytes are marked unusable before the files are created, spread
+ *   over the first half of the volume where the files are.
+ *
+ *   The volume has blocks of -b bytes (default 512) and -s bytes (default:
+ *   twice the expected contents).  Every random choice comes from the seed
+ *   -r (default 1), so the same options always give the same layout; only
+ *   the time stamps differ.  The sizes can have a K, M or G suffix.  The
+ *   image is opened again at the end to check the files.
+ ******
+ */
+
+#define DEFAULT_FILES 10000
+#define DEFAULT_FILES_PER_DIR 100
+#define DEFAULT_NAME_MIN 4
+#define DEFAULT_NAME_MAX 100
+#define DEFAULT_SIZE_MAX (1 << 20)
+#define DEFAULT_DELETED 10
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_INDEX_SIZE 4096
+
+/* a file of the volume */
+struct gen_file {
+    char *path;
+    uint64_t size;
+};
+
+struct gen {
+    SFS *sfs;
+    uint64_t rng;
+    int name_min;
+    int name_max;
+    uint64_t size_min;
+    uint64_t size_max;
+    uint64_t dirs;
+    uint64_t next_id;
+    struct gen_file *files;     /* the live files, in no order */
+    uint64_t count;
+    uint64_t size;
+    uint64_t (*unusable)[2];    /* first and last block of the ranges */
+    int unusable_count;
+    uint64_t failures;
+};
+
+
+static uint64_t gen_rand(struct gen *gen)
+{
+    return sfs_util_rand(&gen->rng);
+}
+
+
+static uint64_t gen_range(struct gen *gen, uint64_t n)
+{
+    return n == 0 ? 0 : gen_rand(gen) % n;
+}
+
+
+/* A size between size_min and size_max, uniform on a log scale */
+static uint64_t gen_size(struct gen *gen)
+{
+    double u = (gen_rand(gen) >> 11) / 9007199254740992.0;
+    double lo = log(gen->size_min + 1.0);
+    double hi = log(gen->size_max + 1.0);
+    uint64_t size = exp(lo + u * (hi - lo)) - 1.0;
+    return size > gen->size_max ? gen->size_max : size;
+}
+
+
+/* A new name: the prefix, the unique id in base 36, then random letters
+ * up to a length between name_min and name_max */
+static void gen_name(struct gen *gen, char *buf, char prefix)
+{
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    int len = gen->name_min + gen_range(gen, gen->name_max - gen->name_min + 1);
+    char id[16];
+    int id_len = 0;
+    uint64_t n = gen->next_id++;
+    do {
+        id[id_len++] = digits[n % 36];
+        n /= 36;
+    } while (n > 0);
+    int i = 0;
+    buf[i++] = prefix;
+    while (id_len > 0) {
+        buf[i++] = id[--id_len];
+    }
+    if (i < len) {
+        buf[i++] = '_';
+    }
+    while (i < len) {
+        buf[i++] = digits[10 + gen_range(gen, 26)];
+    }
+    buf[i] = '\0';
+}
+
+
+/* A path for a new file in a random directory */
+static char *gen_path(struct gen *gen)
+{
+    char dir[gen->name_max + 16];
+    char name[gen->name_max + 16];
+    snprintf(dir, sizeof(dir), "d%lu", gen_range(gen, gen->dirs));
+    gen_name(gen, name, 'f');
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+
+static void remove_file(struct gen *gen, uint64_t i)
+{
+    gen->size -= gen->files[i].size;
+    free(gen->files[i].path);
+    gen->files[i] = gen->files[--gen->count];
+}
+
+
+/* Spreads the unusable ranges over the Data Area, one in each slice of
+ * the volume */
+static int mark_unusable(struct gen *gen, uint64_t total_blocks, uint64_t blocks)
+{
+    const uint64_t first = 1024 / sfs_get_block_size(gen->sfs) + 1;
+    const uint64_t slice = (total_blocks / 2 - first) / gen->unusable_count;
+    if (blocks == 0 || slice <= blocks) {
+        fprintf(stderr, "the unusable ranges do not fit in the volume\n");
+        return -1;
+    }
+    for (int i = 0; i < gen->unusable_count; ++i) {
+        uint64_t start = first + i * slice + gen_range(gen, slice - blocks);
+        gen->unusable[i][0] = start;
+        gen->unusable[i][1] = start + blocks - 1;
+        if (sfs_mark_unusable(gen->sfs, start, start + blocks - 1) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Creates the directories and the first files in one call */
+static int populate(struct gen *gen, uint64_t files)
+{
+    uint64_t count = gen->dirs + files;
+    struct sfs_new_entry *entries = malloc(count * sizeof(struct sfs_new_entry));
+    char (*dirs)[24] = malloc(gen->dirs * sizeof(*dirs));
+    for (uint64_t i = 0; i < gen->dirs; ++i) {
+        snprintf(dirs[i], sizeof(*dirs), "d%lu", i);
+        entries[i].path = dirs[i];
+        entries[i].type = SFS_TYPE_DIR;
+        entries[i].size = 0;
+    }
+    for (uint64_t i = 0; i < files; ++i) {
+        struct gen_file *file = &gen->files[gen->count++];
+        file->path = gen_path(gen);
+        file->size = gen_size(gen);
+        gen->size += file->size;
+        entries[gen->dirs + i].path = file->path;
+        entries[gen->dirs + i].type = SFS_TYPE_FILE;
+        entries[gen->dirs + i].size = file->size;
+    }
+    int result = sfs_create_many(gen->sfs, entries, count, SFS_CREATE_NOFILL);
+    free(entries);
+    free(dirs);
+    return result;
+}
+
+
+/* One random operation of the aging.  The volume running out of space is
+ * counted as a failure, as it happens with real use. */
+static void churn(struct gen *gen, uint64_t capacity)
+{
+    int choice = gen_range(gen, 100);
+    if (gen->count == 0 || (choice < 30 && gen->count < capacity)) {
+        struct sfs_new_entry entry;
+        entry.path = gen_path(gen);
+        entry.type = SFS_TYPE_FILE;
+        entry.size = gen_size(gen);
+        if (sfs_create_many(gen->sfs, &entry, 1, SFS_CREATE_NOFILL) != 0) {
+            free((char *)entry.path);
+            gen->failures++;
+            return;
+        }
+        gen->files[gen->count].path = (char *)entry.path;
+        gen->files[gen->count].size = entry.size;
+        gen->count++;
+        gen->size += entry.size;
+        return;
+    }
+
+    uint64_t i = gen_range(gen, gen->count);
+    struct gen_file *file = &gen->files[i];
+    if (choice < 60) {
+        uint64_t size = file->size + gen_size(gen);
+        if (sfs_resize(gen->sfs, file->path, size) != 0) {
+            gen->failures++;
+            return;
+        }
+        gen->size += size - file->size;
+        file->size = size;
+    } else if (choice < 70) {
+        uint64_t size = file->size / 2;
+        if (sfs_resize(gen->sfs, file->path, size) != 0) {
+            gen->failures++;
+            return;
+        }
+        gen->size -= file->size - size;
+        file->size = size;
+    } else if (sfs_delete(gen->sfs, file->path) != 0) {
+        gen->failures++;
+    } else {
+        remove_file(gen, i);
+    }
+}
+
+
+static int compare_range(const void *p1, const void *p2)
+{
+    const uint64_t *r1 = p1;
+    const uint64_t *r2 = p2;
+    return r1[0] < r2[0] ? -1 : r1[0] > r2[0];
+}
+
+
+/* Opens the image again and checks that the files are there with their
+ * sizes, and that no blocks are used twice */
+static int check(struct gen *gen, const char *image)
+{
+    SFS *sfs = sfs_init(image);
+    if (sfs == NULL) {
+        fprintf(stderr, "check: cannot open %s\n", image);
+        return -1;
+    }
+    int errors = 0;
+    for (uint64_t i = 0; i < gen->count; ++i) {
+        struct sfs_stat st;
+        if (sfs_stat(sfs, gen->files[i].path, &st) != 0 || st.size != gen->files[i].size) {
+            fprintf(stderr, "check: %s is missing or has the wrong size\n", gen->files[i].path);
+            errors++;
+        }
+    }
+
+    uint64_t (*ranges)[2] = malloc((gen->count + gen->unusable_count) * sizeof(*ranges));
+    uint64_t n = 0;
+    struct sfs_stat st;
+    for (const char *path = sfs_first_entry(sfs, &st); path != NULL; path = sfs_next_entry(sfs, &st)) {
+        if (st.type == SFS_TYPE_FILE && st.size > 0 && n < gen->count) {
+            ranges[n][0] = st.start_block;
+            ranges[n][1] = st.end_block;
+            n++;
+        }
+    }
+    memcpy(&ranges[n], gen->unusable, gen->unusable_count * sizeof(*ranges));
+    n += gen->unusable_count;
+    qsort(ranges, n, sizeof(*ranges), compare_range);
+    for (uint64_t i = 1; i < n; ++i) {
+        if (ranges[i][0] <= ranges[i - 1][1]) {
+            fprintf(stderr, "check: blocks 0x%lx-0x%lx are used twice\n",
+                    ranges[i][0], ranges[i - 1][1]);
+            errors++;
+        }
+    }
+    free(ranges);
+    sfs_terminate(sfs);
+    return errors == 0 ? 0 : -1;
+}
+
+
+/* Parses "a,b" into the two sizes, returns 0 on success */
+static int parse_pair(const char *s, uint64_t *a, uint64_t *b)
+{
+    const char *comma = strchr(s, ',');
+    if (comma == NULL || comma - s >= 32) {
+        return -1;
+    }
+    char first[32];
+    memcpy(first, s, comma - s);
+    first[comma - s] = '\0';
+    *a = strcmp(first, "0") == 0 ? 0 : sfs_util_parse_size(first);
+    *b = strcmp(comma + 1, "0") == 0 ? 0 : sfs_util_parse_size(comma + 1);
+    return (*a == 0 && strcmp(first, "0") != 0) || (*b == 0 && strcmp(comma + 1, "0") != 0);
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n files] [-d files] [-l min,max] [-z min,max] [-c ops] [-x percent] [-u count,size] [-b size] [-s size] [-r seed] <image>\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct gen gen;
+    memset(&gen, 0, sizeof(struct gen));
+    uint64_t files = DEFAULT_FILES;
+    uint64_t files_per_dir = DEFAULT_FILES_PER_DIR;
+    uint64_t name_min = DEFAULT_NAME_MIN;
+    uint64_t name_max = DEFAULT_NAME_MAX;
+    uint64_t ops = 0;
+    int deleted = DEFAULT_DELETED;
+    uint64_t unusable_count = 0;
+    uint64_t unusable_size = 0;
+    int block_size = DEFAULT_BLOCK_SIZE;
+    uint64_t volume_size = 0;
+    uint64_t seed = 1;
+    int bad = 0;
+    int opt;
+    gen.size_max = DEFAULT_SIZE_MAX;
+    while ((opt = getopt(argc, argv, "n:d:l:z:c:x:u:b:s:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            files_per_dir = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            bad |= parse_pair(optarg, &name_min, &name_max);
+            break;
+        case 'z':
+            bad |= parse_pair(optarg, &gen.size_min, &gen.size_max);
+            break;
+        case 'c':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            deleted = atoi(optarg);
+            break;
+        case 'u':
+            bad |= parse_pair(optarg, &unusable_count, &unusable_size);
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            break;
+        case 's':
+            volume_size = sfs_util_parse_size(optarg);
+            bad |= volume_size == 0;
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            bad = 1;
+        }
+    }
+    if (bad || argc - optind != 1 || files == 0 || files_per_dir == 0
+            || name_min < 1 || name_max < name_min || name_max > 1000
+            || gen.size_max < gen.size_min || deleted < 0 || deleted > 100
+            || unusable_count > 1000 || block_size < 128
+            || (block_size & (block_size - 1)) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *image = argv[optind];
+    if (ops == 0) {
+        ops = 2 * files;
+    }
+    gen.name_min = name_min;
+    gen.name_max = name_max;
+    gen.rng = seed * 0x9e3779b97f4a7c15ull + 1;
+    gen.dirs = (files + files_per_dir - 1) / files_per_dir;
+
+    /* twice the expected size of the files and of the entries */
+    const uint64_t bs = block_size;
+    double lo = gen.size_min + 1.0;
+    double hi = gen.size_max + 1.0;
+    double mean_size = hi > lo ? (hi - lo) / log(hi / lo) - 1.0 : lo - 1.0;
+    uint64_t unusable_blocks = unusable_count * ((unusable_size + bs - 1) / bs);
+    if (volume_size == 0) {
+        uint64_t entry_blocks = (gen.dirs + 2 * files) * 64 * (2 + name_max / 64) / bs;
+        volume_size = (2 * files * ((uint64_t)mean_size / bs + 1) + entry_blocks
+                       + 2 * unusable_blocks + 16) * bs;
+    }
+    uint64_t total_blocks = volume_size / bs;
+
+    double t0 = sfs_util_now();
+    if (sfs_mkfs(image, total_blocks, block_size, DEFAULT_INDEX_SIZE, "aged") != 0
+            || (gen.sfs = sfs_init(image)) == NULL) {
+        fprintf(stderr, "couldn't make the volume %s\n", image);
+        return 1;
+    }
+    gen.unusable_count = unusable_count;
+    gen.unusable = malloc((unusable_count + 1) * sizeof(*gen.unusable));
+    /* files created by the aging can take the place of deleted ones */
+    uint64_t capacity = files + files / 2 + 1;
+    gen.files = malloc(capacity * sizeof(struct gen_file));
+
+    int result = 0;
+    if (unusable_count > 0 && mark_unusable(&gen, total_blocks, unusable_blocks / unusable_count) != 0) {
+        fprintf(stderr, "couldn't mark the unusable ranges\n");
+        result = -1;
+    } else if (populate(&gen, files) != 0) {
+        fprintf(stderr, "couldn't create the files, the volume may be too small\n");
+        result = -1;
+    }
+    for (uint64_t i = 0; result == 0 && i < ops; ++i) {
+        churn(&gen, capacity);
+    }
+    uint64_t to_delete = gen.count * deleted / 100;
+    for (uint64_t n = 0; result == 0 && n < to_delete; ++n) {
+        uint64_t i = gen_range(&gen, gen.count);
+        if (sfs_delete(gen.sfs, gen.files[i].path) != 0) {
+            gen.failures++;
+        } else {
+            remove_file(&gen, i);
+        }
+    }
+
+    struct sfs_stats stats;
+    sfs_get_stats(gen.sfs, &stats);
+    sfs_terminate(gen.sfs);
+    if (result == 0) {
+        printf("%s: %lu blocks of %d bytes, %lu unusable in %lu ranges\n",
+               image, total_blocks, block_size, unusable_blocks, unusable_count);
+        printf("  %lu files of %lu bytes in %lu directories, %lu deleted at the end\n",
+               gen.count, gen.size, gen.dirs, to_delete);
+        printf("  %lu aging operations, %lu failed, %lu relocations of %lu blocks\n",
+               ops, gen.failures, stats.relocations, stats.blocks_relocated);
+        printf("  generated in %.1f s (seed %lu)\n", sfs_util_now() - t0, seed);
+        result = check(&gen, image);
+    }
+
+    while (gen.count > 0) {
+        remove_file(&gen, 0);
+    }
+    free(gen.files);
+    free(gen.unusable);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sfs_hist.h"
+
+/****h* sfs/sfs_hist
+ * NAME
+ *   sfs_hist -- log-linear latency histograms
+ * DESCRIPTION
+ *   A value v >= SFS_HIST_SUB with its highest bit at position e goes into
+ *   the bucket (e - SFS_HIST_SUB_BITS + 1) * SFS_HIST_SUB + the next
+ *   SFS_HIST_SUB_BITS bits of v.  Percentiles are given as the highest
+ *   value of their bucket, so they are never under the real value and at
+ *   most 12.5% above it.  The histograms can be formatted from a signal
+ *   handler.
+ ******
+ */
+
+
+static int bucket_of(uint64_t value)
+{
+    if (value < SFS_HIST_SUB) {
+        return value;
+    }
+    int e = 63 - __builtin_clzll(value);
+    int sub = (value >> (e - SFS_HIST_SUB_BITS)) & (SFS_HIST_SUB - 1);
+    return (e - SFS_HIST_SUB_BITS + 1) * SFS_HIST_SUB + sub;
+}
+
+
+/* The highest value going into the bucket */
+static uint64_t bucket_max(int bucket)
+{
+    if (bucket < SFS_HIST_SUB) {
+        return bucket;
+    }
+    int e = bucket / SFS_HIST_SUB + SFS_HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % SFS_HIST_SUB;
+    uint64_t width = 1ull << (e - SFS_HIST_SUB_BITS);
+    return ((SFS_HIST_SUB + sub) << (e - SFS_HIST_SUB_BITS)) + width - 1;
+}
+
+
+void sfs_hist_add(struct sfs_hist *hist, uint64_t value)
+{
+    __atomic_fetch_add(&hist->buckets[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, 1,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/****f* sfs_hist/sfs_hist_percentile
+ * NAME
+ *   sfs_hist_percentile -- get a percentile of a histogram
+ * DESCRIPTION
+ *   Gives the value under which percent % of the values are, rounded up to
+ *   the end of its bucket and limited to the largest value.  Values added
+ *   during the call may or may not be counted.
+ * PARAMETERS
+ *   hist - the histogram
+ *   percent - the percentile, from 0 to 100
+ * RETURN VALUE
+ *   Returns the percentile, 0 if the histogram is empty.
+ ******
+ */
+uint64_t sfs_hist_percentile(const struct sfs_hist *hist, double percent)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(count * percent / 100);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < SFS_HIST_BUCKETS; ++i) {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (seen > rank) {
+            uint64_t value = bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+
+/* Async-signal-safe formatting of an unsigned number, returns the number of
+ * characters written */
+static int format_number(char *buf, uint64_t n)
+{
+    char tmp[20];
+    int len = 0;
+    do {
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    for (int i = 0; i < len; ++i) {
+        buf[i] = tmp[len - i - 1];
+    }
+    return len;
+}
+
+
+/****f* sfs_hist/sfs_hist_format
+ * NAME
+ *   sfs_hist_format -- write a histogram as one line of text
+ * DESCRIPTION
+ *   Writes "name count avg p50 p90 p99 p99.9 max\n", the values being in
+ *   the unit of the histogram.  The name is truncated to 32 bytes.  Only
+ *   async-signal-safe functions are used.
+ * PARAMETERS
+ *   buf - the buffer, of at least SFS_HIST_LINE bytes
+ *   name - the name of the histogram
+ *   hist - the histogram
+ * RETURN VALUE
+ *   Returns the length of the line, without null byte.
+ ******
+ */
+int sfs_hist_format(char *buf, const char *name, const struct sfs_hist *hist)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+    uint64_t values[] = {
+        count,
+        count > 0 ? sum / count : 0,
+        sfs_hist_percentile(hist, 50),
+        sfs_hist_percentile(hist, 90),
+        sfs_hist_percentile(hist, 99),
+        sfs_hist_percentile(hist, 99.9),
+        __atomic_load_n(&hist->max, __ATOMIC_RELAXED)
+    };
+    int len = 0;
+    while (len < 32 && name[len] != '\0') {
+        buf[len] = name[len];
+        len++;
+    }
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        buf[len++] = ' ';
+        len += format_number(&buf[len], values[i]);
+    }
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+/* Log-linear histograms of durations in ns: values below SFS_HIST_SUB have
+ * their own bucket, larger ones are split into SFS_HIST_SUB buckets per
+ * power of two, so a bucket is at most 1/SFS_HIST_SUB of its values wide.
+ * Values are added with atomic operations and without locks. */
+#define SFS_HIST_SUB_BITS 3
+#define SFS_HIST_SUB (1 << SFS_HIST_SUB_BITS)
+#define SFS_HIST_BUCKETS ((64 - SFS_HIST_SUB_BITS + 1) * SFS_HIST_SUB)
+
+/* the longest line written by sfs_hist_format, with a name of 32 bytes */
+#define SFS_HIST_LINE 192
+
+struct sfs_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[SFS_HIST_BUCKETS];
+};
+
+void sfs_hist_add(struct sfs_hist *hist, uint64_t value);
+
+uint64_t sfs_hist_percentile(const struct sfs_hist *hist, double percent);
+
+int sfs_hist_format(char *buf, const char *name, const struct sfs_hist *hist);
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sfs_record.h"
+
+/****h* sfs/sfs_record
+ * NAME
+ *   sfs_record -- binary recording of the file system operations
+ * DESCRIPTION
+ *   Each operation is written as a fixed part of 45 bytes, little endian,
+ *   followed by its paths without null bytes:
+ *     time (8), duration (8), fh (8), offset (8), size (4), result (4),
+ *     op (1), length of path (2), length of path2 (2),
+ *     path, path2
+ *   The records are written through a stdio buffer under a mutex, so that
+ *   the threads of libfuse can record concurrently.
+ ******
+ */
+
+#define RECORD_FIXED_SIZE 45
+#define RECORD_PATH_MAX 0xffff
+
+static FILE *record_file = NULL;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t record_start = 0;
+
+static const char *op_names[SFS_OP_COUNT] = {
+    "getattr", "open", "create", "release", "read", "write", "readdir",
+    "mkdir", "rmdir", "unlink", "rename", "truncate", "utimens"
+};
+
+
+static void put_le(unsigned char *buf, uint64_t value, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        buf[i] = value >> (8 * i);
+    }
+}
+
+
+static uint64_t get_le(const unsigned char *buf, int len)
+{
+    uint64_t value = 0;
+    for (int i = len - 1; i >= 0; --i) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+
+/* Monotonic time in ns since the start of the recording */
+uint64_t sfs_record_time(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000000ull + spec.tv_nsec - record_start;
+}
+
+
+/****f* sfs_record/sfs_record_start
+ * NAME
+ *   sfs_record_start -- start recording the operations into a file
+ * DESCRIPTION
+ *   Creates or truncates the file and writes the magic string.  The times
+ *   of the records are counted from this call.
+ * PARAMETERS
+ *   filename - the file of the recording
+ * RETURN VALUE
+ *   Returns 0 on success and -1 on error.
+ ******
+ */
+int sfs_record_start(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        perror("sfs_record_start error");
+        return -1;
+    }
+    if (fwrite(SFS_RECORD_MAGIC, strlen(SFS_RECORD_MAGIC), 1, file) != 1) {
+        perror("sfs_record_start error");
+        fclose(file);
+        return -1;
+    }
+    record_start = 0;
+    record_start = sfs_record_time();
+    record_file = file;
+    return 0;
+}
+
+
+/* Writes the buffered records and closes the file */
+void sfs_record_stop(void)
+{
+    pthread_mutex_lock(&record_mutex);
+    if (record_file != NULL) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
+
+
+/****f* sfs_record/sfs_record
+ * NAME
+ *   sfs_record -- record an operation
+ * DESCRIPTION
+ *   Writes the record of an operation which started at start (from
+ *   sfs_record_time) and has just returned result.  Nothing is done if the
+ *   recording is not started.  Paths are truncated to 65535 bytes.
+ * PARAMETERS
+ *   op - the operation, an sfs_record_op
+ *   start - the time when the operation started
+ *   path - the path of the operation
+ *   path2 - the new path of rename, NULL otherwise
+ *   fh, offset, size, result - see struct sfs_record
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_record(op, start, path, path2, fh, offset, size, result)
+    int op;
+    uint64_t start;
+    const char *path;
+    const char *path2;
+    uint64_t fh;
+    uint64_t offset;
+    uint32_t size;
+    int32_t result;
+{
+    if (record_file == NULL) {
+        return;
+    }
+    unsigned char buf[RECORD_FIXED_SIZE];
+    size_t path_len = path == NULL ? 0 : strnlen(path, RECORD_PATH_MAX);
+    size_t path2_len = path2 == NULL ? 0 : strnlen(path2, RECORD_PATH_MAX);
+    put_le(buf, start, 8);
+    put_le(buf + 8, sfs_record_time() - start, 8);
+    put_le(buf + 16, fh, 8);
+    put_le(buf + 24, offset, 8);
+    put_le(buf + 32, size, 4);
+    put_le(buf + 36, (uint32_t)result, 4);
+    buf[40] = op;
+    put_le(buf + 41, path_len, 2);
+    put_le(buf + 43, path2_len, 2);
+
+    pthread_mutex_lock(&record_mutex);
+    if (record_file != NULL) {
+        fwrite(buf, RECORD_FIXED_SIZE, 1, record_file);
+        if (path_len > 0) {
+            fwrite(path, 1, path_len, record_file);
+        }
+        if (path2_len > 0) {
+            fwrite(path2, 1, path2_len, record_file);
+        }
+    }
+    pthread_mutex_unlock(&record_mutex);
+}
+
+
+const char *sfs_record_op_name(int op)
+{
+    if (op < 0 || op >= SFS_OP_COUNT) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+
+/* Reads and checks the magic string at the start of a recording.  Returns
+ * 0 on success and -1 if it is not a recording. */
+int sfs_record_read_header(FILE *file)
+{
+    char magic[sizeof(SFS_RECORD_MAGIC)];
+    if (fread(magic, strlen(SFS_RECORD_MAGIC), 1, file) != 1
+            || memcmp(magic, SFS_RECORD_MAGIC, strlen(SFS_RECORD_MAGIC)) != 0) {
+        fprintf(stderr, "sfs_record_read_header error: not a recording\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Reads the next path of length len into *path, growing it as needed */
+static int read_path(FILE *file, char **path, size_t len)
+{
+    char *p = realloc(*path, len + 1);
+    if (p == NULL) {
+        return -1;
+    }
+    *path = p;
+    if (len > 0 && fread(p, len, 1, file) != 1) {
+        return -1;
+    }
+    p[len] = '\0';
+    return 0;
+}
+
+
+/****f* sfs_record/sfs_record_read
+ * NAME
+ *   sfs_record_read -- read the next record of a recording
+ * DESCRIPTION
+ *   Reads the next record into *record.  The paths are kept in buffers of
+ *   the record which are reused by the next calls: record must be zeroed
+ *   before the first call and freed with sfs_record_free.
+ * PARAMETERS
+ *   file - the recording, after sfs_record_read_header
+ *   record - the record to fill
+ * RETURN VALUE
+ *   Returns 1 if a record was read, 0 at the end of the file and -1 on
+ *   error.
+ ******
+ */
+int sfs_record_read(file, record)
+    FILE *file;
+    struct sfs_record *record;
+{
+    unsigned char buf[RECORD_FIXED_SIZE];
+    size_t n = fread(buf, 1, RECORD_FIXED_SIZE, file);
+    if (n == 0 && feof(file)) {
+        return 0;
+    }
+    if (n != RECORD_FIXED_SIZE) {
+        fprintf(stderr, "sfs_record_read error: truncated record\n");
+        return -1;
+    }
+    record->time = get_le(buf, 8);
+    record->duration = get_le(buf + 8, 8);
+    record->fh = get_le(buf + 16, 8);
+    record->offset = get_le(buf + 24, 8);
+    record->size = get_le(buf + 32, 4);
+    record->result = (int32_t)get_le(buf + 36, 4);
+    record->op = buf[40];
+    if (read_path(file, &record->path, get_le(buf + 41, 2)) != 0
+            || read_path(file, &record->path2, get_le(buf + 43, 2)) != 0) {
+        fprintf(stderr, "sfs_record_read error: truncated record\n");
+        return -1;
+    }
+    return 1;
+}
+
+
+void sfs_record_free(struct sfs_record *record)
+{
+    free(record->path);
+    free(record->path2);
+    record->path = NULL;
+    record->path2 = NULL;
+}
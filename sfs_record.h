@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdio.h>
+
+/* Recording of the operations received by sfs_fuse into a binary file,
+ * replayed by sfs_replay.  The file starts with SFS_RECORD_MAGIC, then has
+ * one record per operation, in the order they completed. */
+#define SFS_RECORD_MAGIC "SFSREC01"
+
+enum sfs_record_op {
+    SFS_OP_GETATTR,
+    SFS_OP_OPEN,
+    SFS_OP_CREATE,
+    SFS_OP_RELEASE,
+    SFS_OP_READ,
+    SFS_OP_WRITE,
+    SFS_OP_READDIR,
+    SFS_OP_MKDIR,
+    SFS_OP_RMDIR,
+    SFS_OP_UNLINK,
+    SFS_OP_RENAME,
+    SFS_OP_TRUNCATE,
+    SFS_OP_UTIMENS,
+    SFS_OP_COUNT
+};
+
+/****s* sfs_record/sfs_record
+ * NAME
+ *   struct sfs_record -- one recorded operation
+ * FIELDS
+ *   time - start of the operation in ns since the start of the recording
+ *   duration - duration of the operation in ns
+ *   fh - file handle given by open or create, 0 if none
+ *   offset - offset of read and write, length of truncate, seconds of
+ *            utimens
+ *   size - size of read and write, flags of rename, nanoseconds of utimens
+ *   result - value returned by the operation
+ *   op - the operation, an sfs_record_op
+ *   path - the path of the operation
+ *   path2 - the new path of rename, empty otherwise
+ ******
+ */
+struct sfs_record {
+    uint64_t time;
+    uint64_t duration;
+    uint64_t fh;
+    uint64_t offset;
+    uint32_t size;
+    int32_t result;
+    int op;
+    char *path;
+    char *path2;
+};
+
+int sfs_record_start(const char *filename);
+
+void sfs_record_stop(void);
+
+uint64_t sfs_record_time(void);
+
+void sfs_record(int op, uint64_t start, const char *path, const char *path2,
+                uint64_t fh, uint64_t offset, uint32_t size, int32_t result);
+
+const char *sfs_record_op_name(int op);
+
+int sfs_record_read_header(FILE *file);
+
+int sfs_record_read(FILE *file, struct sfs_record *record);
+
+void sfs_record_free(struct sfs_record *record);
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sfs.h"
+#include "sfs_record.h"
+#include "sfs_util.h"
+
+/****h* sfs/sfs_replay
+ * NAME
+ *   sfs_replay -- replay a recording of sfs_fuse on an image
+ * DESCRIPTION
+ *   sfs_replay [-t] [-v] <recording> <image>
+ *
+ *   Runs the operations recorded with sfs_fuse --record on the image
+ *   through the functions of sfs.h, in the order of the recording.  The
+ *   image is modified: replay on a copy of the image that was mounted when
+ *   the recording started.  The operations are run as fast as possible, or
+ *   with -t at the times of the recording.  Written data is not recorded,
+ *   so writes are replayed with null bytes.
+ *
+ *   At the end, the count, the errors and the latencies of each operation
+ *   are printed next to the recorded latencies.  An operation which fails
+ *   when it succeeded in the recording, or the reverse, is counted as
+ *   diverging, and printed with -v.
+ ******
+ */
+
+/* latencies of one operation, in ns */
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t diverging;
+    uint64_t total;
+    uint64_t recorded_total;
+    uint64_t *times;
+    size_t times_size;
+};
+
+/* the file opened for a recorded file handle */
+struct handle {
+    uint64_t fh;
+    SFS_FILE *file;
+};
+
+static struct replay {
+    SFS *sfs;
+    struct handle *handles;
+    size_t handles_count;
+    size_t handles_size;
+    char *buf;
+    size_t buf_size;
+    struct op_stats stats[SFS_OP_COUNT];
+} replay;
+
+
+static struct handle *find_handle(uint64_t fh)
+{
+    for (size_t i = 0; i < replay.handles_count; ++i) {
+        if (replay.handles[i].fh == fh) {
+            return &replay.handles[i];
+        }
+    }
+    return NULL;
+}
+
+
+static SFS_FILE *get_file(uint64_t fh)
+{
+    struct handle *handle = fh == 0 ? NULL : find_handle(fh);
+    return handle == NULL ? NULL : handle->file;
+}
+
+
+static void add_handle(uint64_t fh, SFS_FILE *file)
+{
+    if (replay.handles_count == replay.handles_size) {
+        replay.handles_size = replay.handles_size == 0 ? 16 : replay.handles_size * 2;
+        replay.handles = realloc(replay.handles, replay.handles_size * sizeof(struct handle));
+    }
+    replay.handles[replay.handles_count].fh = fh;
+    replay.handles[replay.handles_count].file = file;
+    replay.handles_count++;
+}
+
+
+static int release_handle(uint64_t fh)
+{
+    struct handle *handle = find_handle(fh);
+    if (handle == NULL) {
+        return -1;
+    }
+    sfs_release(replay.sfs, handle->file);
+    *handle = replay.handles[--replay.handles_count];
+    return 0;
+}
+
+
+/* A buffer of at least size bytes */
+static char *get_buf(size_t size)
+{
+    if (size > replay.buf_size) {
+        free(replay.buf);
+        replay.buf = calloc(1, size);
+        replay.buf_size = replay.buf == NULL ? 0 : size;
+    }
+    return replay.buf;
+}
+
+
+/* Runs the operation of the record.  Returns a negative number on error. */
+static int run(struct sfs_record *record)
+{
+    SFS *sfs = replay.sfs;
+    const char *path = sfs_util_fix_path(record->path);
+    SFS_FILE *file = get_file(record->fh);
+    struct sfs_stat st;
+    char *buf;
+
+    switch (record->op) {
+    case SFS_OP_GETATTR:
+        return sfs_stat(sfs, path, &st);
+    case SFS_OP_OPEN:
+        file = sfs_open(sfs, path);
+        if (file == NULL) {
+            return -1;
+        }
+        add_handle(record->fh, file);
+        return 0;
+    case SFS_OP_CREATE:
+        if (sfs_create(sfs, path) != 0 || (file = sfs_open(sfs, path)) == NULL) {
+            return -1;
+        }
+        add_handle(record->fh, file);
+        return 0;
+    case SFS_OP_RELEASE:
+        return release_handle(record->fh);
+    case SFS_OP_READ:
+        if ((buf = get_buf(record->size)) == NULL) {
+            return -1;
+        }
+        if (file != NULL) {
+            return sfs_read_fh(sfs, file, buf, record->size, record->offset);
+        }
+        return sfs_read(sfs, path, buf, record->size, record->offset);
+    case SFS_OP_WRITE:
+        if ((buf = get_buf(record->size)) == NULL) {
+            return -1;
+        }
+        if (file != NULL) {
+            return sfs_write_extend_fh(sfs, file, buf, record->size, record->offset);
+        }
+        return sfs_write_extend(sfs, path, buf, record->size, record->offset);
+    case SFS_OP_READDIR:
+        if (sfs_stat(sfs, path, &st) != 0) {
+            return -1;
+        }
+        for (const char *name = sfs_first_stat(sfs, path, &st); name != NULL;
+                name = sfs_next_stat(sfs, path, &st)) {
+        }
+        return 0;
+    case SFS_OP_MKDIR:
+        return sfs_mkdir(sfs, path);
+    case SFS_OP_RMDIR:
+        return sfs_rmdir(sfs, path);
+    case SFS_OP_UNLINK:
+        return sfs_delete(sfs, path);
+    case SFS_OP_RENAME:
+        /* RENAME_NOREPLACE is 1, RENAME_EXCHANGE is not supported */
+        if (record->size & 2) {
+            return -1;
+        }
+        return sfs_rename(sfs, path, sfs_util_fix_path(record->path2), (record->size & 1) == 0);
+    case SFS_OP_TRUNCATE:
+        if (file != NULL) {
+            return sfs_resize_fh(sfs, file, record->offset);
+        }
+        return sfs_resize(sfs, path, record->offset);
+    case SFS_OP_UTIMENS: {
+        struct timespec timespec;
+        if (record->size == UTIME_OMIT) {
+            return 0;
+        } else if (record->size == UTIME_NOW) {
+            clock_gettime(CLOCK_REALTIME, &timespec);
+        } else {
+            timespec.tv_sec = record->offset;
+            timespec.tv_nsec = record->size;
+        }
+        return sfs_set_time(sfs, path, &timespec);
+    }
+    default:
+        return -1;
+    }
+}
+
+
+static void add_time(struct op_stats *stats, uint64_t time)
+{
+    if (stats->count == stats->times_size) {
+        stats->times_size = stats->times_size == 0 ? 1024 : stats->times_size * 2;
+        stats->times = realloc(stats->times, stats->times_size * sizeof(uint64_t));
+    }
+    stats->times[stats->count++] = time;
+    stats->total += time;
+}
+
+
+static int compare_u64(const void *p1, const void *p2)
+{
+    uint64_t n1 = *(const uint64_t *)p1;
+    uint64_t n2 = *(const uint64_t *)p2;
+    return n1 < n2 ? -1 : n1 > n2;
+}
+
+
+static void report(uint64_t count, uint64_t time)
+{
+    printf("%lu operations in %.2f s, %.0f ops/s\n", count, time / 1e9,
+           time > 0 ? count / (time / 1e9) : 0);
+    printf("  %-10s %10s %8s %10s %12s %12s %12s %14s\n", "operation", "ops",
+           "errors", "diverging", "avg (us)", "p50 (us)", "p99 (us)", "recorded (us)");
+    for (int op = 0; op < SFS_OP_COUNT; ++op) {
+        struct op_stats *stats = &replay.stats[op];
+        if (stats->count == 0) {
+            continue;
+        }
+        qsort(stats->times, stats->count, sizeof(uint64_t), compare_u64);
+        printf("  %-10s %10lu %8lu %10lu %12.1f %12.1f %12.1f %14.1f\n",
+               sfs_record_op_name(op), stats->count, stats->errors, stats->diverging,
+               stats->total / 1e3 / stats->count,
+               stats->times[stats->count / 2] / 1e3,
+               stats->times[(stats->count * 99) / 100] / 1e3,
+               stats->recorded_total / 1e3 / stats->count);
+    }
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t] [-v] <recording> <image>\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    int timed = 0;
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "tv")) != -1) {
+        switch (opt) {
+        case 't':
+            timed = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "r");
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (sfs_record_read_header(file) != 0) {
+        fclose(file);
+        return 1;
+    }
+    replay.sfs = sfs_init(argv[optind + 1]);
+    if (replay.sfs == NULL) {
+        fprintf(stderr, "couldn't open %s\n", argv[optind + 1]);
+        fclose(file);
+        return 1;
+    }
+
+    struct sfs_record record;
+    memset(&record, 0, sizeof(struct sfs_record));
+    uint64_t count = 0;
+    uint64_t start = sfs_util_now_ns();
+    int result;
+    while ((result = sfs_record_read(file, &record)) == 1) {
+        if (record.op < 0 || record.op >= SFS_OP_COUNT) {
+            fprintf(stderr, "unknown operation %d\n", record.op);
+            result = -1;
+            break;
+        }
+        if (timed) {
+            uint64_t elapsed = sfs_util_now_ns() - start;
+            if (record.time > elapsed) {
+                uint64_t wait = record.time - elapsed;
+                struct timespec delay = { wait / 1000000000, wait % 1000000000 };
+                nanosleep(&delay, NULL);
+            }
+        }
+        uint64_t t0 = sfs_util_now_ns();
+        int ret = run(&record);
+        uint64_t time = sfs_util_now_ns() - t0;
+
+        struct op_stats *stats = &replay.stats[record.op];
+        add_time(stats, time);
+        stats->recorded_total += record.duration;
+        if (ret < 0) {
+            stats->errors++;
+        }
+        if ((ret < 0) != (record.result < 0)) {
+            stats->diverging++;
+            if (verbose) {
+                fprintf(stderr, "diverging: %s '%s' returned %d, recorded %d\n",
+                        sfs_record_op_name(record.op), record.path, ret, record.result);
+            }
+        }
+        count++;
+    }
+    uint64_t time = sfs_util_now_ns() - start;
+    fclose(file);
+
+    while (replay.handles_count > 0) {
+        release_handle(replay.handles[0].fh);
+    }
+    sfs_terminate(replay.sfs);
+    report(count, time);
+
+    for (int op = 0; op < SFS_OP_COUNT; ++op) {
+        free(replay.stats[op].times);
+    }
+    free(replay.handles);
+    free(replay.buf);
+    sfs_record_free(&record);
+    return result == 0 ? 0 : 1;
+}
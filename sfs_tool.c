@@ -1,11 +1,718 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "sfs.h"
+#include "sfs_util.h"
+
+/****h* sfs/sfs_tool
+ * NAME
+ *   sfs_tool -- create and fill SFS images
+ * DESCRIPTION
+ *   sfs_tool mkfs [options] <image>
+ *     creates an empty filesystem
+ *   sfs_tool pack [options] [-j threads] <image> <dir>
+ *     creates a filesystem with the contents of the host directory dir
+ *   sfs_tool export <image> <dir>
+ *     copies the contents of the filesystem into the host directory dir
+ *   sfs_tool export -t <image>
+ *     writes the contents of the filesystem as a tar archive to stdout
+ *   sfs_tool <image>
+ *     checks that the image can be opened
+ *
+ *   Options:
+ *     -b size   block size in bytes (default 512)
+ *     -s size   size of the filesystem in bytes, with an optional K, M or G
+ *               suffix (required for mkfs, for pack the default is the size
+ *               needed for the contents)
+ *     -i size   space reserved in the Index Area in bytes (default 4K)
+ *     -n name   volume name
+ *     -j n      number of threads reading the files for pack (default 4)
+ ******
+ */
+
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_INDEX_SIZE (4 * 1024)
+#define DEFAULT_THREADS 4
+#define COPY_BUFFER_SIZE (4 * 1024 * 1024)
+#define EXPORT_BUFFER_SIZE (8 * 1024 * 1024)
+#define TAR_BLOCK 512
+
+struct options {
+    int block_size;
+    uint64_t size;
+    uint64_t index_size;
+    const char *name;
+    int threads;
+};
+
+
+/****s* sfs_tool/pack_list
+ * NAME
+ *   struct pack_list -- the entries found in the host directory
+ * FIELDS
+ *   entries - the entries for sfs_create_many, directories before contents
+ *   sources - the host path of each entry
+ *   count - the number of entries
+ *   capacity - the allocated number of entries
+ *   next - the next file to copy, taken by the copying threads
+ *   failed - set by a copying thread on error
+ ******
+ */
+struct pack_list {
+    struct sfs_new_entry *entries;
+    char **sources;
+    size_t count;
+    size_t capacity;
+    atomic_size_t next;
+    atomic_int failed;
+};
+
+
+struct pack_copy {
+    struct pack_list *list;
+    int fd;
+    int block_size;
+};
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s mkfs [-b block_size] -s size [-i index_size] [-n name] <image>\n", name);
+    fprintf(stderr, "       %s pack [-b block_size] [-s size] [-i index_size] [-n name] [-j threads] <image> <dir>\n", name);
+    fprintf(stderr, "       %s export <image> <dir>\n", name);
+    fprintf(stderr, "       %s export -t <image> > archive.tar\n", name);
+    fprintf(stderr, "       %s <image>\n", name);
+}
+
+
+/* Parses the options, returns the index of the first argument or -1 on
+ * error */
+static int parse_options(int argc, char **argv, struct options *options)
+{
+    int opt;
+    options->block_size = DEFAULT_BLOCK_SIZE;
+    options->size = 0;
+    options->index_size = DEFAULT_INDEX_SIZE;
+    options->name = "";
+    options->threads = DEFAULT_THREADS;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "b:s:i:n:j:")) != -1) {
+        switch (opt) {
+        case 'b': {
+            /* a power of two, as sfs_mkfs requires, and never 0 as the size is
+             * divided by it */
+            uint64_t block_size = sfs_util_parse_size(optarg);
+            if (block_size == 0 || (block_size & (block_size - 1)) != 0
+                    || block_size > 1u << 30) {
+                return -1;
+            }
+            options->block_size = block_size;
+            break;
+        }
+        case 's':
+            options->size = sfs_util_parse_size(optarg);
+            if (options->size == 0) {
+                return -1;
+            }
+            break;
+        case 'i':
+            options->index_size = sfs_util_parse_size(optarg);
+            break;
+        case 'n':
+            options->name = optarg;
+            break;
+        case 'j':
+            options->threads = atoi(optarg);
+            if (options->threads < 1) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return optind;
+}
+
+
+static int mkfs(int argc, char **argv)
+{
+    struct options options;
+    int arg = parse_options(argc, argv, &options);
+    if (arg == -1 || arg != argc - 1 || options.size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    uint64_t total_blocks = options.size / options.block_size;
+    if (sfs_mkfs(argv[arg], total_blocks, options.block_size,
+                 options.index_size, options.name) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static void pack_add(struct pack_list *list, char *path, char *source, int type, uint64_t size)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+        list->entries = realloc(list->entries, list->capacity * sizeof(struct sfs_new_entry));
+        list->sources = realloc(list->sources, list->capacity * sizeof(char *));
+    }
+    list->entries[list->count].path = path;
+    list->entries[list->count].type = type;
+    list->entries[list->count].size = size;
+    list->entries[list->count].start_block = 0;
+    list->sources[list->count] = source;
+    ++list->count;
+}
+
+
+/* Adds the contents of the host directory source, which is path in the
+ * image ("" for the root), files first and then each subdirectory with its
+ * contents, in name order.  Returns 0 on success and -1 on error. */
+static int pack_scan(struct pack_list *list, const char *source, const char *path)
+{
+    struct dirent **names;
+    int n = scandir(source, &names, NULL, alphasort);
+    if (n < 0) {
+        perror(source);
+        return -1;
+    }
+    int result = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            const char *name = names[i]->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+            char *host = malloc(strlen(source) + strlen(name) + 2);
+            char *sfs_path = malloc(strlen(path) + strlen(name) + 2);
+            sprintf(host, "%s/%s", source, name);
+            sprintf(sfs_path, "%s%s%s", path, *path != '\0' ? "/" : "", name);
+            struct stat st;
+            if (lstat(host, &st) != 0) {
+                if (pass == 0) {
+                    perror(host);
+                    result = -1;
+                }
+            } else if (pass == 0 && S_ISREG(st.st_mode)) {
+                pack_add(list, sfs_path, host, SFS_TYPE_FILE, st.st_size);
+                continue;
+            } else if (pass == 1 && S_ISDIR(st.st_mode)) {
+                pack_add(list, sfs_path, host, SFS_TYPE_DIR, 0);
+                if (pack_scan(list, host, sfs_path) != 0) {
+                    result = -1;
+                }
+                continue;
+            } else if (pass == 1 && !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "skipping \"%s\": not a regular file or directory\n", host);
+            }
+            free(host);
+            free(sfs_path);
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+
+/* Copies the files of the list into the image, a file at a time */
+static void *pack_copy(void *arg)
+{
+    struct pack_copy *copy = arg;
+    struct pack_list *list = copy->list;
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    size_t i;
+    while ((i = atomic_fetch_add(&list->next, 1)) < list->count) {
+        struct sfs_new_entry *entry = &list->entries[i];
+        if (entry->type != SFS_TYPE_FILE || entry->size == 0) {
+            continue;
+        }
+        int fd = open(list->sources[i], O_RDONLY);
+        if (fd == -1) {
+            perror(list->sources[i]);
+            atomic_store(&list->failed, 1);
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        off_t pos = entry->start_block * copy->block_size;
+        uint64_t done = 0;
+        while (done < entry->size) {
+            size_t size = entry->size - done < COPY_BUFFER_SIZE ? entry->size - done : COPY_BUFFER_SIZE;
+            ssize_t n = pread(fd, buf, size, done);
+            if (n <= 0) {
+                /* the file became shorter: the rest stays null bytes */
+                break;
+            }
+            if (pwrite(copy->fd, buf, n, pos + done) != n) {
+                perror("pack: write error");
+                atomic_store(&list->failed, 1);
+                break;
+            }
+            done += n;
+        }
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+
+/* Copies the files with the given number of threads, returns 0 on success
+ * and -1 on error */
+static int pack_files(struct pack_list *list, const char *image, int block_size, int threads)
+{
+    struct pack_copy copy;
+    copy.list = list;
+    copy.block_size = block_size;
+    copy.fd = open(image, O_WRONLY);
+    if (copy.fd == -1) {
+        perror(image);
+        return -1;
+    }
+    atomic_store(&list->next, 0);
+    atomic_store(&list->failed, 0);
+    pthread_t thread[threads];
+    int started = 0;
+    while (started < threads && pthread_create(&thread[started], NULL, pack_copy, &copy) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        pack_copy(&copy);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+    int result = atomic_load(&list->failed) ? -1 : fsync(copy.fd);
+    if (close(copy.fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+
+/****f* sfs_tool/pack
+ * NAME
+ *   pack -- create an image with the contents of a host directory
+ * DESCRIPTION
+ *   The host directory is scanned first.  Then the image is created and all
+ *   the entries are created at once with sfs_create_many, which lays out the
+ *   files one after the other and writes the Index Area in one write.  The
+ *   Data Area is not filled with null bytes: the threads copy the files
+ *   directly into their blocks with large reads and writes.
+ ******
+ */
+static int pack(int argc, char **argv)
+{
+    struct options options;
+    int arg = parse_options(argc, argv, &options);
+    if (arg == -1 || arg != argc - 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *image = argv[arg];
+    const char *dir = argv[arg + 1];
+    const uint64_t bs = options.block_size;
+
+    struct pack_list list;
+    memset(&list, 0, sizeof(struct pack_list));
+    if (pack_scan(&list, dir, "") != 0) {
+        return 1;
+    }
+
+    /* an entry takes at most 2 + length / 64 entries of 64 bytes */
+    uint64_t data_blocks = 0;
+    uint64_t index_size = 0;
+    for (size_t i = 0; i < list.count; ++i) {
+        data_blocks += (list.entries[i].size + bs - 1) / bs;
+        index_size += 64 * (2 + strlen(list.entries[i].path) / 64);
+    }
+    uint64_t total_blocks = options.size / bs;
+    if (options.size == 0) {
+        uint64_t rsvd_blocks = (512 + bs - 1) / bs;     /* the superblock */
+        total_blocks = rsvd_blocks + data_blocks + 2
+            + (index_size + options.index_size + 2 * 64 + bs - 1) / bs;
+    }
+    if (sfs_mkfs(image, total_blocks, bs, options.index_size, options.name) != 0) {
+        return 1;
+    }
+
+    SFS *sfs = sfs_init(image);
+    if (sfs == NULL) {
+        return 1;
+    }
+    int result = sfs_create_many(sfs, list.entries, list.count, SFS_CREATE_NOFILL);
+    sfs_terminate(sfs);
+    if (result != 0 || pack_files(&list, image, bs, options.threads) != 0) {
+        fprintf(stderr, "pack: couldn't pack \"%s\" into \"%s\"\n", dir, image);
+        result = -1;
+    }
+
+    for (size_t i = 0; i < list.count; ++i) {
+        free((char *)list.entries[i].path);
+        free(list.sources[i]);
+    }
+    free(list.entries);
+    free(list.sources);
+    return result == 0 ? 0 : 1;
+}
+
+
+/****s* sfs_tool/export_item
+ * NAME
+ *   struct export_item -- a directory or file of the image to export
+ ******
+ */
+struct export_item {
+    char *path;
+    int type;
+    uint64_t size;
+    uint64_t start_block;
+    struct timespec time;
+};
+
+
+/****s* sfs_tool/export_reader
+ * NAME
+ *   struct export_reader -- window of the image read sequentially
+ * FIELDS
+ *   fd - the image
+ *   buf - the bytes from start to end of the image
+ ******
+ */
+struct export_reader {
+    int fd;
+    char *buf;
+    uint64_t start;
+    uint64_t end;
+};
+
+
+/* Directories first, by path so that parents come first, then the files in
+ * the order of their blocks */
+static int export_compare(const void *p1, const void *p2)
+{
+    const struct export_item *item1 = p1;
+    const struct export_item *item2 = p2;
+    if (item1->type != item2->type) {
+        return item1->type == SFS_TYPE_DIR ? -1 : 1;
+    }
+    if (item1->type == SFS_TYPE_FILE && item1->start_block != item2->start_block) {
+        return item1->start_block < item2->start_block ? -1 : 1;
+    }
+    return strcmp(item1->path, item2->path);
+}
+
+
+/* Returns the bytes of the image at pos and sets *size to their number, at
+ * most the size asked for.  Reads EXPORT_BUFFER_SIZE bytes from pos if pos is
+ * not in the window.  Returns NULL on error. */
+static const char *export_read(struct export_reader *reader, uint64_t pos, size_t *size)
+{
+    if (pos < reader->start || pos >= reader->end) {
+        ssize_t n = pread(reader->fd, reader->buf, EXPORT_BUFFER_SIZE, pos);
+        if (n <= 0) {
+            return NULL;
+        }
+        reader->start = pos;
+        reader->end = pos + n;
+    }
+    if (*size > reader->end - pos) {
+        *size = reader->end - pos;
+    }
+    return &reader->buf[pos - reader->start];
+}
+
+
+static int write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+
+/* Writes the data of the file from the image to fd */
+static int export_data(struct export_reader *reader, struct export_item *item, int bs, int fd)
+{
+    uint64_t pos = item->start_block * bs;
+    uint64_t rest = item->size;
+    while (rest > 0) {
+        size_t size = rest < EXPORT_BUFFER_SIZE ? rest : EXPORT_BUFFER_SIZE;
+        const char *data = export_read(reader, pos, &size);
+        if (data == NULL || write_all(fd, data, size) != 0) {
+            return -1;
+        }
+        pos += size;
+        rest -= size;
+    }
+    return 0;
+}
+
+
+/* Puts value into a numeric field of a tar header, in octal or, if it is
+ * too large, in base 256 */
+static void tar_number(char *field, int len, uint64_t value)
+{
+    if (value < (uint64_t)1 << (3 * (len - 1))) {
+        snprintf(field, len, "%0*lo", len - 1, value);
+        return;
+    }
+    field[0] = (char)0x80;
+    for (int i = len - 1; i > 0; --i) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+
+/* Writes a tar header, with a GNU long name header before it if the name
+ * does not fit */
+static int tar_header(int fd, const char *name, char type, uint64_t size, time_t mtime)
+{
+    char header[TAR_BLOCK];
+    size_t len = strlen(name);
+    if (len > 100) {
+        if (tar_header(fd, "././@LongLink", 'L', len + 1, 0) != 0
+                || write_all(fd, name, len + 1) != 0) {
+            return -1;
+        }
+        memset(header, 0, TAR_BLOCK);
+        if (write_all(fd, header, (TAR_BLOCK - (len + 1) % TAR_BLOCK) % TAR_BLOCK) != 0) {
+            return -1;
+        }
+    }
+    memset(header, 0, TAR_BLOCK);
+    strncpy(header, name, 100);
+    tar_number(&header[100], 8, type == '5' ? 0755 : 0644);
+    tar_number(&header[108], 8, 0);
+    tar_number(&header[116], 8, 0);
+    tar_number(&header[124], 12, size);
+    tar_number(&header[136], 12, mtime);
+    header[156] = type;
+    memcpy(&header[257], "ustar  ", 8);
+    memset(&header[148], ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        sum += (unsigned char)header[i];
+    }
+    snprintf(&header[148], 8, "%06o", sum);
+    return write_all(fd, header, TAR_BLOCK);
+}
+
+
+static int export_tar(struct export_reader *reader, struct export_item *items, size_t count, int bs)
+{
+    char zeros[2 * TAR_BLOCK];
+    memset(zeros, 0, 2 * TAR_BLOCK);
+    for (size_t i = 0; i < count; ++i) {
+        struct export_item *item = &items[i];
+        if (item->type == SFS_TYPE_DIR) {
+            char name[strlen(item->path) + 2];
+            sprintf(name, "%s/", item->path);
+            if (tar_header(STDOUT_FILENO, name, '5', 0, item->time.tv_sec) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t pad = (TAR_BLOCK - item->size % TAR_BLOCK) % TAR_BLOCK;
+        if (tar_header(STDOUT_FILENO, item->path, '0', item->size, item->time.tv_sec) != 0
+                || export_data(reader, item, bs, STDOUT_FILENO) != 0
+                || write_all(STDOUT_FILENO, zeros, pad) != 0) {
+            return -1;
+        }
+    }
+    return write_all(STDOUT_FILENO, zeros, 2 * TAR_BLOCK);
+}
+
+
+/* Returns 1 if a path has a ".." component, which would lead out of the
+ * directory it is exported to */
+static int has_dotdot(const char *path)
+{
+    const char *p = path;
+    while (*p != '\0') {
+        const char *end = strchr(p, '/');
+        size_t len = end == NULL ? strlen(p) : (size_t)(end - p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return 1;
+        }
+        p += len;
+        while (*p == '/') {
+            ++p;
+        }
+    }
+    return 0;
+}
+
+
+static int export_dir(struct export_reader *reader, struct export_item *items, size_t count,
+                      int bs, const char *dir)
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (has_dotdot(items[i].path)) {
+            fprintf(stderr, "export error: \"%s\" leads out of %s\n", items[i].path, dir);
+            return -1;
+        }
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        struct export_item *item = &items[i];
+        char host[strlen(dir) + strlen(item->path) + 2];
+        sprintf(host, "%s/%s", dir, item->path);
+        if (item->type == SFS_TYPE_DIR) {
+            if (mkdir(host, 0755) != 0 && errno != EEXIST) {
+                perror(host);
+                return -1;
+            }
+            continue;
+        }
+        int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(host);
+            return -1;
+        }
+        struct timespec times[2] = { item->time, item->time };
+        if (export_data(reader, item, bs, fd) != 0 || futimens(fd, times) != 0) {
+            perror(host);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    /* the times of the directories last, as creating their contents changes
+     * them, and the subdirectories before their parents */
+    for (size_t i = count; i-- > 0;) {
+        if (items[i].type == SFS_TYPE_DIR) {
+            char host[strlen(dir) + strlen(items[i].path) + 2];
+            sprintf(host, "%s/%s", dir, items[i].path);
+            struct timespec times[2] = { items[i].time, items[i].time };
+            utimensat(AT_FDCWD, host, times, 0);
+        }
+    }
+    return 0;
+}
+
+
+/****f* sfs_tool/export
+ * NAME
+ *   export -- copy the contents of an image to a host directory or a tar
+ *             archive
+ * DESCRIPTION
+ *   The directories and files are listed from the Index Area in one pass.
+ *   The directories are created first.  Then the files are sorted by their
+ *   first block and copied in that order, so that the Data Area is read
+ *   from start to end in large sequential reads.
+ ******
+ */
+static int export(int argc, char **argv)
+{
+    int tar = 0;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt != 't') {
+            usage(argv[0]);
+            return 1;
+        }
+        tar = 1;
+    }
+    if (optind != argc - (tar ? 1 : 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *image = argv[optind];
+
+    SFS *sfs = sfs_init(image);
+    if (sfs == NULL) {
+        return 1;
+    }
+    const int bs = sfs_get_block_size(sfs);
+    size_t count = 0;
+    size_t capacity = 1024;
+    struct export_item *items = malloc(capacity * sizeof(struct export_item));
+    struct sfs_stat st;
+    for (const char *path = sfs_first_entry(sfs, &st); path != NULL; path = sfs_next_entry(sfs, &st)) {
+        if (count == capacity) {
+            capacity *= 2;
+            items = realloc(items, capacity * sizeof(struct export_item));
+        }
+        items[count].path = strdup(path);
+        items[count].type = st.type;
+        items[count].size = st.size;
+        items[count].start_block = st.start_block;
+        items[count].time = st.time;
+        ++count;
+    }
+    sfs_terminate(sfs);
+    qsort(items, count, sizeof(struct export_item), export_compare);
+
+    struct export_reader reader;
+    reader.fd = open(image, O_RDONLY);
+    reader.buf = malloc(EXPORT_BUFFER_SIZE);
+    reader.start = 0;
+    reader.end = 0;
+    int result = -1;
+    if (reader.fd == -1) {
+        perror(image);
+    } else {
+        posix_fadvise(reader.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (tar) {
+            result = export_tar(&reader, items, count, bs);
+        } else {
+            result = export_dir(&reader, items, count, bs, argv[optind + 1]);
+        }
+        if (result != 0) {
+            fprintf(stderr, "export: couldn't export \"%s\"\n", image);
+        }
+        close(reader.fd);
+    }
+
+    free(reader.buf);
+    for (size_t i = 0; i < count; ++i) {
+        free(items[i].path);
+    }
+    free(items);
+    return result == 0 ? 0 : 1;
+}
+
 
 int main(int argc, char **argv)
 {
+    if (argc >= 2 && strcmp(argv[1], "mkfs") == 0) {
+        return mkfs(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "pack") == 0) {
+        return pack(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "export") == 0) {
+        return export(argc, argv);
+    }
     if (argc != 2) {
-        fprintf(stderr, "usage %s <file>\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_trace.h"
+
+/****h* sfs/sfs_trace
+ * NAME
+ *   sfs_trace -- leveled tracing into an in-memory ring buffer
+ * DESCRIPTION
+ *   Trace messages are formatted into the slots of a ring buffer instead of
+ *   being written to stdout.  Nothing is formatted when the level of the
+ *   message is above the runtime level, and nothing is compiled when it is
+ *   above SFS_TRACE_MAX.  Writers claim a slot with an atomic increment and
+ *   publish it with its sequence number, so tracing never takes a lock.  The
+ *   buffer keeps the last SFS_TRACE_SLOTS messages and can be dumped at any
+ *   time, also from a signal handler.
+ ******
+ */
+
+#ifndef SFS_TRACE_SLOTS
+#define SFS_TRACE_SLOTS 4096    /* must be a power of two */
+#endif
+
+#define SFS_TRACE_MSG_LEN 112
+
+/****s* sfs_trace/trace_slot
+ * NAME
+ *   struct trace_slot -- one message of the ring buffer
+ * FIELDS
+ *   seq - 1 + the number of the message in the slot, 0 while it is written
+ *   time - CLOCK_REALTIME when the message was recorded
+ *   level - level of the message
+ *   msg - the formatted message, truncated if too long
+ ******
+ */
+struct trace_slot {
+    atomic_uint_fast64_t seq;
+    struct timespec time;
+    int level;
+    char msg[SFS_TRACE_MSG_LEN];
+};
+
+atomic_int sfs_trace_level = 0;
+
+static atomic_int echo_fd = -1;
+static atomic_int dump_fd = -1;
+static atomic_uint_fast64_t trace_head = 0;
+static struct trace_slot trace_ring[SFS_TRACE_SLOTS];
+
+static const char level_names[][6] = { "", "ERROR", "WARN", "INFO", "DEBUG" };
+
+
+void sfs_trace_set_level(int level)
+{
+    atomic_store(&sfs_trace_level, level);
+}
+
+
+/* Messages are also written to fd as they are recorded (-1 to stop) */
+void sfs_trace_set_echo(int fd)
+{
+    atomic_store(&echo_fd, fd);
+}
+
+
+/* Async-signal-safe formatting of an unsigned number with at least width
+ * digits, returns the number of characters written */
+static int format_number(char *buf, uint64_t n, int width)
+{
+    char tmp[20];
+    int len = 0;
+    do {
+        tmp[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (len < width) {
+        tmp[len++] = '0';
+    }
+    for (int i = 0; i < len; ++i) {
+        buf[i] = tmp[len - i - 1];
+    }
+    return len;
+}
+
+
+/* Writes "sec.usec LEVEL message\n" for the slot to fd */
+static void write_slot(int fd, struct trace_slot *slot)
+{
+    char line[SFS_TRACE_MSG_LEN + 48];
+    int len = format_number(line, slot->time.tv_sec, 1);
+    line[len++] = '.';
+    len += format_number(&line[len], slot->time.tv_nsec / 1000, 6);
+    line[len++] = ' ';
+    int level = slot->level >= 1 && slot->level <= SFS_TRACE_DEBUG ? slot->level : 0;
+    for (const char *p = level_names[level]; *p != '\0'; ++p) {
+        line[len++] = *p;
+    }
+    line[len++] = ' ';
+    for (int i = 0; i < SFS_TRACE_MSG_LEN && slot->msg[i] != '\0'; ++i) {
+        line[len++] = slot->msg[i];
+    }
+    line[len++] = '\n';
+    ssize_t written = write(fd, line, len);
+    (void)written;
+}
+
+
+void sfs_trace(int level, const char *format, ...)
+{
+    uint64_t n = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    struct trace_slot *slot = &trace_ring[n & (SFS_TRACE_SLOTS - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(slot->msg, SFS_TRACE_MSG_LEN, format, ap);
+    va_end(ap);
+    atomic_store_explicit(&slot->seq, n + 1, memory_order_release);
+
+    int fd = atomic_load_explicit(&echo_fd, memory_order_relaxed);
+    if (fd >= 0) {
+        write_slot(fd, slot);
+    }
+}
+
+
+/****f* sfs_trace/sfs_trace_dump
+ * NAME
+ *   sfs_trace_dump -- write the messages of the ring buffer to a file
+ * DESCRIPTION
+ *   Writes the recorded messages, oldest first, to the file descriptor fd.
+ *   Messages being overwritten while they are dumped are skipped.  Only
+ *   async-signal-safe functions are used.
+ * PARAMETERS
+ *   fd - the file descriptor
+ * RETURN VALUE
+ *   No return value (void function)
+ ******
+ */
+void sfs_trace_dump(int fd)
+{
+    uint64_t head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    uint64_t first = head > SFS_TRACE_SLOTS ? head - SFS_TRACE_SLOTS : 0;
+    for (uint64_t n = first; n < head; ++n) {
+        struct trace_slot *slot = &trace_ring[n & (SFS_TRACE_SLOTS - 1)];
+        struct trace_slot copy;
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != n + 1) {
+            continue;
+        }
+        copy.time = slot->time;
+        copy.level = slot->level;
+        memcpy(copy.msg, slot->msg, SFS_TRACE_MSG_LEN);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != n + 1) {
+            continue;
+        }
+        write_slot(fd, &copy);
+    }
+}
+
+
+static void dump_handler(int signum)
+{
+    int fd = atomic_load(&dump_fd);
+    if (fd >= 0) {
+        sfs_trace_dump(fd);
+    }
+}
+
+
+/* Installs a handler dumping the ring buffer to fd when signum is received.
+ * Returns 0 on success and -1 on error. */
+int sfs_trace_dump_on_signal(int signum, int fd)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = dump_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    atomic_store(&dump_fd, fd);
+    return sigaction(signum, &action, NULL);
+}
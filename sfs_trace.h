@@ -0,0 +1,38 @@
+#include <stdatomic.h>
+
+/* Trace levels: a message is recorded if its level is at most the runtime
+ * level sfs_trace_level (0 records nothing). */
+#define SFS_TRACE_ERROR 1
+#define SFS_TRACE_WARN 2
+#define SFS_TRACE_INFO 3
+#define SFS_TRACE_DEBUG 4
+
+/* Messages above SFS_TRACE_MAX are compiled out (make SFS_TRACE_MAX=0) */
+#ifndef SFS_TRACE_MAX
+#define SFS_TRACE_MAX SFS_TRACE_DEBUG
+#endif
+
+extern atomic_int sfs_trace_level;
+
+#define TRACE_ENABLED(level) \
+    ((level) <= SFS_TRACE_MAX \
+     && (level) <= atomic_load_explicit(&sfs_trace_level, memory_order_relaxed))
+
+#define TRACE(level, ...) \
+    do { if (TRACE_ENABLED(level)) sfs_trace(level, __VA_ARGS__); } while (0)
+
+#define TRACE_ERROR(...) TRACE(SFS_TRACE_ERROR, __VA_ARGS__)
+#define TRACE_WARN(...) TRACE(SFS_TRACE_WARN, __VA_ARGS__)
+#define TRACE_INFO(...) TRACE(SFS_TRACE_INFO, __VA_ARGS__)
+#define TRACE_DEBUG(...) TRACE(SFS_TRACE_DEBUG, __VA_ARGS__)
+
+void sfs_trace(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void sfs_trace_set_level(int level);
+
+void sfs_trace_set_echo(int fd);
+
+void sfs_trace_dump(int fd);
+
+int sfs_trace_dump_on_signal(int signum, int fd);
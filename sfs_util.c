@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sfs_util.h"
+
+/****h* sfs/sfs_util
+ * NAME
+ *   sfs_util -- helpers shared by the command line tools
+ * DESCRIPTION
+ *   The clock, the size parser, the comparison for sorting latencies, the
+ *   random generator and the path fixer of sfs_tool, sfs_bench, sfs_fuse,
+ *   sfs_fuse_bench, sfs_replay, sfs_gen and sfs_alloc_sim.
+ ******
+ */
+
+
+/* Returns the time of the monotonic clock in seconds */
+double sfs_util_now(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + spec.tv_nsec / 1e9;
+}
+
+
+/* Returns the time of the monotonic clock in ns */
+uint64_t sfs_util_now_ns(void)
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+
+/* Parses a number of bytes, with an optional K, M or G suffix (in any case)
+ * for KiB, MiB or GiB.  Returns 0 on error. */
+uint64_t sfs_util_parse_size(const char *s)
+{
+    char *end;
+    uint64_t size = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+
+/* qsort comparison of doubles */
+int sfs_util_compare_double(const void *p1, const void *p2)
+{
+    double d1 = *(const double *)p1;
+    double d2 = *(const double *)p2;
+    return d1 < d2 ? -1 : d1 > d2;
+}
+
+
+/* xorshift64*: the same sequence on every platform, unlike rand().  *state*
+ * must not be 0. */
+uint64_t sfs_util_rand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+
+/* Skips the leading slashes of a FUSE path: sfs.h takes paths relative to
+ * the root */
+const char *sfs_util_fix_path(const char *path)
+{
+    while (*path == '/')
+        path++;
+    return path;
+}
@@ -0,0 +1,15 @@
+#include <stdint.h>
+
+/* Helpers shared by the command line tools */
+
+double sfs_util_now(void);
+
+uint64_t sfs_util_now_ns(void);
+
+uint64_t sfs_util_parse_size(const char *s);
+
+int sfs_util_compare_double(const void *p1, const void *p2);
+
+uint64_t sfs_util_rand(uint64_t *state);
+
+const char *sfs_util_fix_path(const char *path);